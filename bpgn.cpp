@@ -0,0 +1,753 @@
+/*
+
+    Binary columnar companion format for .lpgn files (.bpgn), see bpgn.h
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+#include "util.h"
+#include "lpgnz.h"
+#include "movecode.h"
+#include "bpgn.h"
+
+#define BPGN_NAME_LEN 24
+#define BPGN_HEADER_LEN 24
+#define BPGN_DIR_ENTRY_LEN 48
+#define BPGN_NO_DICTIONARY 0xffffffff
+
+// Field by field, so the strings keep their capacity from game to game
+void BpgnGame::clear()
+{
+    line = 0;
+    tournament_date = 0;
+    date = 0;
+    event.clear();
+    site.clear();
+    round.clear();
+    white.clear();
+    black.clear();
+    result = bpgn_result_other;
+    white_elo = 0;
+    black_elo = 0;
+    white_fide_id = 0;
+    black_fide_id = 0;
+    white_fed.clear();
+    black_fed.clear();
+    eco = 0;
+    flags = 0;
+    fen.clear();
+    extra_tags.clear();
+    moves.clear();
+}
+
+uint32_t bpgn_date( const char *s, size_t len )
+{
+    if( len < 10 )
+        return 0;
+    uint32_t parts[3] = {0,0,0};
+    const int offsets[3] = {0,5,8};
+    const int widths[3]  = {4,2,2};
+    for( int i=0; i<3; i++ )
+    {
+        for( int j=0; j<widths[i]; j++ )
+        {
+            char c = s[offsets[i]+j];
+            if( !isascii(c) || !isdigit(c) )
+            {
+                parts[i] = 0;
+                break;
+            }
+            parts[i] = parts[i]*10 + (c-'0');
+        }
+    }
+    if( parts[1]>12 || parts[2]>31 )
+        return parts[0]*10000;
+    return parts[0]*10000 + parts[1]*100 + parts[2];
+}
+
+std::string bpgn_date_str( uint32_t yyyymmdd )
+{
+    std::string s;
+    uint32_t yyyy = yyyymmdd/10000;
+    uint32_t mm   = (yyyymmdd/100)%100;
+    uint32_t dd   = yyyymmdd%100;
+    s += yyyy ? util::sprintf("%04u",yyyy) : "????";
+    s += mm   ? util::sprintf(".%02u",mm)  : ".??";
+    s += dd   ? util::sprintf(".%02u",dd)  : ".??";
+    return s;
+}
+
+uint16_t bpgn_eco( const std::string &s )
+{
+    if( s.length()!=3 || s[0]<'A' || s[0]>'E' || !isdigit(s[1]) || !isdigit(s[2]) )
+        return 0;
+    return static_cast<uint16_t>( (s[0]-'A'+1)*100 + (s[1]-'0')*10 + (s[2]-'0') );
+}
+
+std::string bpgn_eco_str( uint16_t eco )
+{
+    if( eco<100 || eco>599 )
+        return "";
+    return util::sprintf( "%c%02d", 'A'+eco/100-1, eco%100 );
+}
+
+const char *bpgn_result_str( uint8_t result )
+{
+    switch( result )
+    {
+        case bpgn_result_white: return "1-0";
+        case bpgn_result_black: return "0-1";
+        case bpgn_result_draw:  return "1/2-1/2";
+    }
+    return "*";
+}
+
+std::string bpgn_value_str( const std::string &column, uint64_t value )
+{
+    if( column=="date" || column=="tournament_date" )
+        return bpgn_date_str( static_cast<uint32_t>(value) );
+    else if( column == "result" )
+        return bpgn_result_str( static_cast<uint8_t>(value) );
+    else if( column == "eco" )
+        return bpgn_eco_str( static_cast<uint16_t>(value) );
+    return util::sprintf( "%llu", static_cast<unsigned long long>(value) );
+}
+
+// Find the next "@H" or "@M" marker, '@' characters in the text are escaped as "@$"
+static const char *next_marker( const char *p, const char *end )
+{
+    while( NULL != (p = static_cast<const char *>(memchr(p,'@',end-p))) )
+    {
+        if( p+1<end && (p[1]=='H' || p[1]=='M') )
+            return p;
+        p++;
+    }
+    return end;
+}
+
+// Reverse the "@" -> "@$" escape
+static void unescape( const char *p, const char *end, std::string &s )
+{
+    s.clear();
+    while( p < end )
+    {
+        s += *p;
+        if( *p=='@' && p+1<end && p[1]=='$' )
+            p++;
+        p++;
+    }
+}
+
+static uint32_t to_uint( const std::string &s )
+{
+    uint32_t value = 0;
+    for( char c: s )
+    {
+        if( !isdigit(c) )
+            return 0;
+        value = value*10 + (c-'0');
+    }
+    return value;
+}
+
+void bpgn_parse_line( const char *line, size_t len, BpgnGame &game )
+{
+    uint64_t line_nbr = game.line;
+    game.clear();
+    game.line = line_nbr;
+    const char *end = line+len;
+    const char *p = next_marker( line, end );
+    if( p-line >= 10 )
+        game.tournament_date = bpgn_date( line, 10 );
+    std::string hdr;
+    std::string tag;
+    std::string value;
+    std::string movetext;
+    while( p < end )
+    {
+        char kind = p[1];
+        const char *segment = p+2;
+        p = next_marker( segment, end );
+        if( kind == 'M' )
+        {
+            if( movetext.length() > 0 )
+                movetext += '\n';
+            std::string s;
+            unescape( segment, p, s );
+            movetext += s;
+            continue;
+        }
+
+        // [Tag "Value"], with \" and \\ escapes in the value
+        unescape( segment, p, hdr );
+        size_t space = hdr.find(' ');
+        size_t quote1 = hdr.find('"');
+        size_t quote2 = hdr.rfind('"');
+        if( hdr.length()<2 || hdr[0]!='[' || space==std::string::npos || quote1==std::string::npos || quote2<=quote1 )
+            continue;
+        tag.assign( hdr, 1, space-1 );
+        value.clear();
+        for( size_t i=quote1+1; i<quote2; i++ )
+        {
+            if( hdr[i]=='\\' && i+1<quote2 )
+                i++;
+            value += hdr[i];
+        }
+        if( tag == "Event" )
+            game.event = value;
+        else if( tag == "Site" )
+            game.site = value;
+        else if( tag == "Date" )
+            game.date = bpgn_date( value.c_str(), value.length() );
+        else if( tag == "Round" )
+            game.round = value;
+        else if( tag == "White" )
+            game.white = value;
+        else if( tag == "Black" )
+            game.black = value;
+        else if( tag == "Result" )
+        {
+            if( value == "1-0" )
+                game.result = bpgn_result_white;
+            else if( value == "0-1" )
+                game.result = bpgn_result_black;
+            else if( value == "1/2-1/2" )
+                game.result = bpgn_result_draw;
+        }
+        else if( tag=="WhiteElo" && to_uint(value)<65536 )
+            game.white_elo = static_cast<uint16_t>( to_uint(value) );
+        else if( tag=="BlackElo" && to_uint(value)<65536 )
+            game.black_elo = static_cast<uint16_t>( to_uint(value) );
+        else if( tag == "WhiteFideId" )
+            game.white_fide_id = to_uint(value);
+        else if( tag == "BlackFideId" )
+            game.black_fide_id = to_uint(value);
+        else if( tag == "WhiteFed" )
+            game.white_fed = value;
+        else if( tag == "BlackFed" )
+            game.black_fed = value;
+        else if( tag=="ECO" && bpgn_eco(value)!=0 )
+            game.eco = bpgn_eco(value);
+        else
+        {
+            if( tag == "FEN" )
+                game.fen = value;
+            game.extra_tags += tag;
+            game.extra_tags += '\0';
+            game.extra_tags += value;
+            game.extra_tags += '\0';
+        }
+    }
+    if( game.fen != "" )
+        game.flags |= BPGN_FLAG_FEN;
+    if( std::string::npos != movetext.find_first_of("{;") )
+        game.flags |= BPGN_FLAG_COMMENTS;
+    if( std::string::npos != movetext.find('(') )
+        game.flags |= BPGN_FLAG_VARIATIONS;
+    if( !encode_movetext( game.fen, movetext.c_str(), movetext.length(), game.moves ) )
+        game.flags |= BPGN_FLAG_MOVES_INCOMPLETE;
+}
+
+uint32_t BpgnWriter::Dictionary::id( const std::string &s )
+{
+    auto it = ids.find(s);
+    if( it != ids.end() )
+        return it->second;
+    uint32_t new_id = static_cast<uint32_t>( strings.size() );
+    ids[s] = new_id;
+    strings.push_back(s);
+    return new_id;
+}
+
+BpgnWriter::~BpgnWriter()
+{
+    if( opened )
+        remove_temp_files();
+    for( TempColumn *col: columns )
+        delete col;
+}
+
+void BpgnWriter::add_column( const std::string &name, int type, int dictionary )
+{
+    TempColumn *col = new TempColumn;
+    col->name = name;
+    col->type = type;
+    col->dictionary = dictionary;
+    col->fname = fname + "-" + name + ".tmp";
+    col->out.open( col->fname, std::ios_base::out | std::ios_base::binary );
+    if( type == bpgn_var )
+    {
+        col->offsets_fname = fname + "-" + name + "-offsets.tmp";
+        col->out_offsets.open( col->offsets_fname, std::ios_base::out | std::ios_base::binary );
+        if( !col->out_offsets )
+            opened = false;
+        uint64_t zero = 0;
+        col->out_offsets.write( reinterpret_cast<const char *>(&zero), sizeof(zero) );
+    }
+    if( !col->out )
+        opened = false;
+    columns.push_back(col);
+}
+
+// The column order here is the order of the columns in the file
+enum
+{
+    col_line, col_tournament_date, col_date, col_event, col_site, col_round, col_white, col_black,
+    col_result, col_white_elo, col_black_elo, col_white_fide_id, col_black_fide_id, col_white_fed,
+    col_black_fed, col_eco, col_flags, col_extra_tags, col_moves
+};
+enum { dict_events, dict_sites, dict_rounds, dict_players, dict_federations, nbr_dicts };
+
+bool BpgnWriter::open( const std::string &fname_ )
+{
+    fname = fname_;
+    opened = true;
+    dicts.resize( nbr_dicts );
+    dicts[dict_events].name  = "events";
+    dicts[dict_sites].name   = "sites";
+    dicts[dict_rounds].name  = "rounds";
+    dicts[dict_players].name = "players";
+    dicts[dict_federations].name = "federations";
+    for( Dictionary &d: dicts )
+        d.id("");   // id 0
+    add_column( "line",            bpgn_u64 );
+    add_column( "tournament_date", bpgn_u32 );
+    add_column( "date",            bpgn_u32 );
+    add_column( "event",           bpgn_u32, dict_events );
+    add_column( "site",            bpgn_u32, dict_sites );
+    add_column( "round",           bpgn_u32, dict_rounds );
+    add_column( "white",           bpgn_u32, dict_players );
+    add_column( "black",           bpgn_u32, dict_players );
+    add_column( "result",          bpgn_u8 );
+    add_column( "white_elo",       bpgn_u16 );
+    add_column( "black_elo",       bpgn_u16 );
+    add_column( "white_fide_id",   bpgn_u32 );
+    add_column( "black_fide_id",   bpgn_u32 );
+    add_column( "white_fed",       bpgn_u32, dict_federations );
+    add_column( "black_fed",       bpgn_u32, dict_federations );
+    add_column( "eco",             bpgn_u16 );
+    add_column( "flags",           bpgn_u8 );
+    add_column( "extra_tags",      bpgn_var );
+    add_column( "moves",           bpgn_var );
+    if( !opened )
+    {
+        printf( "Error; Cannot open temporary files for writing %s\n", fname.c_str() );
+        remove_temp_files();
+    }
+    return opened;
+}
+
+void BpgnWriter::put( int column, const void *data, size_t len )
+{
+    columns[column]->out.write( static_cast<const char *>(data), len );
+}
+
+void BpgnWriter::put_var( int column, const std::string &value )
+{
+    TempColumn *col = columns[column];
+    col->out.write( value.c_str(), value.length() );
+    col->var_size += value.length();
+    col->out_offsets.write( reinterpret_cast<const char *>(&col->var_size), sizeof(col->var_size) );
+}
+
+void BpgnWriter::add_game( const BpgnGame &game )
+{
+    uint32_t id;
+    put( col_line, &game.line, sizeof(game.line) );
+    put( col_tournament_date, &game.tournament_date, sizeof(game.tournament_date) );
+    put( col_date, &game.date, sizeof(game.date) );
+    id = dicts[dict_events].id(game.event);
+    put( col_event, &id, sizeof(id) );
+    id = dicts[dict_sites].id(game.site);
+    put( col_site, &id, sizeof(id) );
+    id = dicts[dict_rounds].id(game.round);
+    put( col_round, &id, sizeof(id) );
+    id = dicts[dict_players].id(game.white);
+    put( col_white, &id, sizeof(id) );
+    id = dicts[dict_players].id(game.black);
+    put( col_black, &id, sizeof(id) );
+    put( col_result, &game.result, sizeof(game.result) );
+    put( col_white_elo, &game.white_elo, sizeof(game.white_elo) );
+    put( col_black_elo, &game.black_elo, sizeof(game.black_elo) );
+    put( col_white_fide_id, &game.white_fide_id, sizeof(game.white_fide_id) );
+    put( col_black_fide_id, &game.black_fide_id, sizeof(game.black_fide_id) );
+    id = dicts[dict_federations].id(game.white_fed);
+    put( col_white_fed, &id, sizeof(id) );
+    id = dicts[dict_federations].id(game.black_fed);
+    put( col_black_fed, &id, sizeof(id) );
+    put( col_eco, &game.eco, sizeof(game.eco) );
+    put( col_flags, &game.flags, sizeof(game.flags) );
+    put_var( col_extra_tags, game.extra_tags );
+    put_var( col_moves, game.moves );
+    nbr_games++;
+}
+
+static void put_u32( std::string &s, uint32_t value )
+{
+    s.append( reinterpret_cast<const char *>(&value), sizeof(value) );
+}
+
+static void put_u64( std::string &s, uint64_t value )
+{
+    s.append( reinterpret_cast<const char *>(&value), sizeof(value) );
+}
+
+static bool append_file( std::ofstream &out, const std::string &fname )
+{
+    std::ifstream in( fname, std::ios_base::in | std::ios_base::binary );
+    if( !in )
+        return false;
+    if( in.peek() != std::ifstream::traits_type::eof() )
+        out << in.rdbuf();     // (streaming an empty file sets failbit on out)
+    return true;
+}
+
+bool BpgnWriter::close()
+{
+    if( !opened )
+        return false;
+    for( TempColumn *col: columns )
+    {
+        col->out.close();
+        if( col->type == bpgn_var )
+            col->out_offsets.close();
+    }
+
+    // Column sizes, the dictionaries follow the per game columns
+    size_t nbr_columns = columns.size() + dicts.size();
+    std::vector<uint64_t> sizes;
+    for( TempColumn *col: columns )
+        sizes.push_back( col->type==bpgn_var ? 8 + 8*(nbr_games+1) + col->var_size : nbr_games*col->type );
+    for( Dictionary &d: dicts )
+    {
+        uint64_t data_size = 0;
+        for( const std::string &s: d.strings )
+            data_size += s.length();
+        sizes.push_back( 8 + 8*(d.strings.size()+1) + data_size );
+    }
+
+    // Header and directory
+    std::string hdr = "BPGN";
+    put_u32( hdr, BPGN_VERSION );
+    put_u64( hdr, nbr_games );
+    put_u32( hdr, static_cast<uint32_t>(nbr_columns) );
+    put_u32( hdr, 0 );
+    uint64_t offset = BPGN_HEADER_LEN + BPGN_DIR_ENTRY_LEN*nbr_columns;
+    for( size_t i=0; i<nbr_columns; i++ )
+    {
+        std::string name = i<columns.size() ? columns[i]->name : dicts[i-columns.size()].name;
+        int dictionary = i<columns.size() ? columns[i]->dictionary : -1;
+        name.resize( BPGN_NAME_LEN, '\0' );
+        hdr += name;
+        put_u32( hdr, i<columns.size() ? columns[i]->type : bpgn_var );
+        put_u32( hdr, dictionary<0 ? BPGN_NO_DICTIONARY : static_cast<uint32_t>(columns.size()+dictionary) );
+        put_u64( hdr, offset );
+        put_u64( hdr, sizes[i] );
+        offset += sizes[i];
+    }
+    std::ofstream out( fname, std::ios_base::out | std::ios_base::binary );
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fname.c_str() );
+        remove_temp_files();
+        opened = false;
+        return false;
+    }
+    out.write( hdr.c_str(), hdr.length() );
+
+    // Per game columns
+    bool ok = true;
+    for( TempColumn *col: columns )
+    {
+        if( col->type == bpgn_var )
+        {
+            std::string count;
+            put_u64( count, nbr_games );
+            out.write( count.c_str(), count.length() );
+            ok = ok && append_file( out, col->offsets_fname );
+        }
+        ok = ok && append_file( out, col->fname );
+    }
+
+    // Dictionaries
+    for( Dictionary &d: dicts )
+    {
+        std::string s;
+        put_u64( s, d.strings.size() );
+        uint64_t data_offset = 0;
+        put_u64( s, data_offset );
+        for( const std::string &str: d.strings )
+        {
+            data_offset += str.length();
+            put_u64( s, data_offset );
+        }
+        out.write( s.c_str(), s.length() );
+        for( const std::string &str: d.strings )
+            out.write( str.c_str(), str.length() );
+    }
+    remove_temp_files();
+    opened = false;
+    if( !ok || !out )
+    {
+        printf( "Error; Cannot write file %s\n", fname.c_str() );
+        return false;
+    }
+    return true;
+}
+
+void BpgnWriter::remove_temp_files()
+{
+    for( TempColumn *col: columns )
+    {
+        if( col->out.is_open() )
+            col->out.close();
+        if( col->out_offsets.is_open() )
+            col->out_offsets.close();
+        remove( col->fname.c_str() );
+        if( col->type == bpgn_var )
+            remove( col->offsets_fname.c_str() );
+    }
+}
+
+static uint32_t get_u32( const char *p )
+{
+    uint32_t value;
+    memcpy( &value, p, sizeof(value) );
+    return value;
+}
+
+static uint64_t get_u64( const char *p )
+{
+    uint64_t value;
+    memcpy( &value, p, sizeof(value) );
+    return value;
+}
+
+bool BpgnReader::open( const std::string &fname_ )
+{
+    fname = fname_;
+    dir.clear();
+    games = 0;
+    in.open( fname, std::ios_base::in | std::ios_base::binary );
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fname.c_str() );
+        return false;
+    }
+    char hdr[BPGN_HEADER_LEN];
+    if( !in.read(hdr,sizeof(hdr)) || 0!=memcmp(hdr,"BPGN",4) || get_u32(hdr+4)!=BPGN_VERSION )
+    {
+        printf( "Error; File %s is not a version %d .bpgn file\n", fname.c_str(), BPGN_VERSION );
+        return false;
+    }
+    games = get_u64( hdr+8 );
+    uint32_t nbr_columns = get_u32( hdr+16 );
+    std::vector<char> buf( BPGN_DIR_ENTRY_LEN*nbr_columns );
+    if( !in.read(buf.data(),buf.size()) )
+    {
+        printf( "Error; File %s is truncated\n", fname.c_str() );
+        return false;
+    }
+    for( uint32_t i=0; i<nbr_columns; i++ )
+    {
+        const char *p = buf.data() + BPGN_DIR_ENTRY_LEN*i;
+        DirEntry e;
+        e.name.assign( p, strnlen(p,BPGN_NAME_LEN) );
+        e.type       = get_u32( p+BPGN_NAME_LEN );
+        e.dictionary = get_u32( p+BPGN_NAME_LEN+4 );
+        e.offset     = get_u64( p+BPGN_NAME_LEN+8 );
+        e.size       = get_u64( p+BPGN_NAME_LEN+16 );
+        dir.push_back(e);
+    }
+    return true;
+}
+
+std::vector<std::string> BpgnReader::column_names() const
+{
+    std::vector<std::string> names;
+    for( const DirEntry &e: dir )
+        names.push_back(e.name);
+    return names;
+}
+
+int BpgnReader::find( const std::string &name ) const
+{
+    for( size_t i=0; i<dir.size(); i++ )
+    {
+        if( dir[i].name == name )
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+int BpgnReader::column_type( const std::string &name ) const
+{
+    int idx = find(name);
+    return idx<0 ? 0 : static_cast<int>(dir[idx].type);
+}
+
+uint64_t BpgnReader::column_size( const std::string &name ) const
+{
+    int idx = find(name);
+    return idx<0 ? 0 : dir[idx].size;
+}
+
+bool BpgnReader::has_dictionary( const std::string &name ) const
+{
+    int idx = find(name);
+    return idx>=0 && dir[idx].type!=bpgn_var && dir[idx].dictionary!=BPGN_NO_DICTIONARY;
+}
+
+bool BpgnReader::read_bytes( uint64_t offset, void *buf, uint64_t len )
+{
+    in.clear();
+    in.seekg( offset );
+    if( len>0 && !in.read( static_cast<char *>(buf), len ) )
+    {
+        printf( "Error; File %s is truncated\n", fname.c_str() );
+        return false;
+    }
+    return true;
+}
+
+bool BpgnReader::read_block( const std::string &name, uint64_t first, size_t count, std::vector<uint64_t> &values )
+{
+    int idx = find(name);
+    if( idx<0 || dir[idx].type==bpgn_var || first+count>games )
+    {
+        printf( "Error; File %s has no fixed width column %s (or not enough games)\n", fname.c_str(), name.c_str() );
+        return false;
+    }
+    uint32_t width = dir[idx].type;
+    values.resize( count );
+    if( width == bpgn_u64 )
+        return read_bytes( dir[idx].offset+first*width, values.data(), count*width );
+
+    // Narrower values are read into the end of the buffer and widened in place,
+    //  working forwards is safe because each value is written no later than it is read
+    unsigned char *buf = reinterpret_cast<unsigned char *>(values.data()) + count*(sizeof(uint64_t)-width);
+    if( !read_bytes( dir[idx].offset+first*width, buf, count*width ) )
+        return false;
+    switch( width )
+    {
+        case bpgn_u8:
+            for( size_t i=0; i<count; i++ )
+                values[i] = buf[i];
+            break;
+        case bpgn_u16:
+            for( size_t i=0; i<count; i++ )
+            {
+                uint16_t value;
+                memcpy( &value, buf+2*i, sizeof(value) );
+                values[i] = value;
+            }
+            break;
+        case bpgn_u32:
+            for( size_t i=0; i<count; i++ )
+                values[i] = get_u32( reinterpret_cast<const char *>(buf+4*i) );
+            break;
+    }
+    return true;
+}
+
+bool BpgnReader::read_lengths( const std::string &name, uint64_t first, size_t count, std::vector<uint64_t> &lengths )
+{
+    int idx = find(name);
+    if( idx<0 || dir[idx].type!=bpgn_var || first+count>games )
+    {
+        printf( "Error; File %s has no variable length column %s (or not enough games)\n", fname.c_str(), name.c_str() );
+        return false;
+    }
+    std::vector<uint64_t> offsets( count+1 );
+    if( !read_bytes( dir[idx].offset+8+8*first, offsets.data(), 8*(count+1) ) )
+        return false;
+    lengths.resize( count );
+    for( size_t i=0; i<count; i++ )
+        lengths[i] = offsets[i+1] - offsets[i];
+    return true;
+}
+
+bool BpgnReader::read_var_idx( int idx, std::vector<uint64_t> &offsets, std::string &data )
+{
+    uint64_t count;
+    if( !read_bytes( dir[idx].offset, &count, sizeof(count) ) )
+        return false;
+    offsets.resize( static_cast<size_t>(count+1) );
+    if( !read_bytes( dir[idx].offset+8, offsets.data(), 8*(count+1) ) )
+        return false;
+    data.resize( static_cast<size_t>(offsets[count]) );
+    return read_bytes( dir[idx].offset+8+8*(count+1), &data[0], offsets[count] );
+}
+
+bool BpgnReader::read_var( const std::string &name, std::vector<uint64_t> &offsets, std::string &data )
+{
+    int idx = find(name);
+    if( idx<0 || dir[idx].type!=bpgn_var )
+    {
+        printf( "Error; File %s has no variable length column %s\n", fname.c_str(), name.c_str() );
+        return false;
+    }
+    return read_var_idx( idx, offsets, data );
+}
+
+bool BpgnReader::read_dictionary( const std::string &name, std::vector<std::string> &strings )
+{
+    int idx = find(name);
+    if( idx>=0 && dir[idx].dictionary!=BPGN_NO_DICTIONARY && dir[idx].dictionary<dir.size() )
+        idx = static_cast<int>( dir[idx].dictionary );
+    if( idx<0 || dir[idx].type!=bpgn_var )
+    {
+        printf( "Error; File %s has no dictionary for %s\n", fname.c_str(), name.c_str() );
+        return false;
+    }
+    std::vector<uint64_t> offsets;
+    std::string data;
+    if( !read_var_idx( idx, offsets, data ) )
+        return false;
+    strings.resize( offsets.size()-1 );
+    for( size_t i=0; i+1<offsets.size(); i++ )
+        strings[i].assign( data, static_cast<size_t>(offsets[i]), static_cast<size_t>(offsets[i+1]-offsets[i]) );
+    return true;
+}
+
+bool lpgn_to_bpgn( const std::string &fin, const std::string &fout )
+{
+    LineReader in(fin);
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return false;
+    }
+    BpgnWriter out;
+    if( !out.open(fout) )
+        return false;
+    BpgnGame game;
+    uint64_t line_nbr = 0;
+    uint64_t nbr_incomplete = 0;
+    const char *line;
+    size_t len;
+    while( in.next_line(line,len) )
+    {
+        // Strip out UTF8 BOM mark (hex value: EF BB BF)
+        if( line_nbr==0 && len>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65 )
+        {
+            line += 3;
+            len  -= 3;
+        }
+        game.line = line_nbr++;
+        bpgn_parse_line( line, len, game );
+        if( game.flags & BPGN_FLAG_MOVES_INCOMPLETE )
+            nbr_incomplete++;
+        out.add_game( game );
+    }
+    if( nbr_incomplete > 0 )
+        printf( "Warning; The moves of %llu game%s in %s could not all be encoded (see the line column, and the .lpgn file)\n",
+                static_cast<unsigned long long>(nbr_incomplete), nbr_incomplete==1?"":"s", fin.c_str() );
+    return out.close();
+}
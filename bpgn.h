@@ -0,0 +1,216 @@
+/*
+
+    Binary columnar companion format for .lpgn files (.bpgn)
+
+    Game by game the .lpgn format is text, so every program that wants (say) the
+    players and results of each game has to scan each line for the right headers,
+    and anything that wants the moves has to parse SAN again. A .bpgn file holds the
+    same games, pre-parsed, column by column, so a program reads just the columns it
+    needs. The .lpgn file is still the full record (comments, variations and the
+    exact text of everything), column "line" gives each game's line number in it.
+
+    File layout (all integers little endian);
+
+        Header     "BPGN", uint32 version, uint64 nbr_games, uint32 nbr_columns,
+                   uint32 reserved
+        Directory  nbr_columns entries of; char name[24] (nul padded), uint32 type,
+                   uint32 dictionary (column index, or 0xffffffff), uint64 offset,
+                   uint64 size
+        Columns    contiguous, at the offsets given in the directory
+
+    Column types are fixed width integers (one value per game), or variable length
+    byte strings stored as uint64 count, (count+1) uint64 offsets into the data
+    that follows. Per game integer columns can be ids in a dictionary column (a
+    variable length column of strings, id 0 is always the empty string).
+
+    Columns;
+
+        line             u64   line number in the .lpgn file (first line is 0)
+        tournament_date  u32   yyyymmdd from the .lpgn prefix, 0 for unknown parts
+        date             u32   yyyymmdd from the Date tag
+        event, site      u32   ids in dictionaries events, sites
+        round            u32   id in dictionary rounds
+        white, black     u32   ids in dictionary players
+        result           u8    see BpgnResult
+        white_elo        u16   0 if not known
+        black_elo        u16
+        white_fide_id    u32   0 if not known
+        black_fide_id    u32
+        white_fed        u32   ids in dictionary federations (WhiteFed, BlackFed tags)
+        black_fed        u32
+        eco              u16   A00 is 100 ... E99 is 599, 0 if not known
+        flags            u8    see BPGN_FLAG_xxx
+        extra_tags       var   all other tags as Tag\0Value\0 pairs
+        moves            var   main line, one byte per move, see movecode.h
+
+*/
+
+#ifndef BPGN_H_INCLUDED
+#define BPGN_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+
+#define BPGN_VERSION 1
+
+enum BpgnType
+{
+    bpgn_u8  = 1,
+    bpgn_u16 = 2,
+    bpgn_u32 = 4,
+    bpgn_u64 = 8,
+    bpgn_var = 16
+};
+
+enum BpgnResult
+{
+    bpgn_result_other = 0,      // "*" or anything else
+    bpgn_result_white = 1,      // "1-0"
+    bpgn_result_black = 2,      // "0-1"
+    bpgn_result_draw  = 3       // "1/2-1/2"
+};
+
+#define BPGN_FLAG_MOVES_INCOMPLETE  1   // moves column stops at a move that couldn't be encoded
+#define BPGN_FLAG_COMMENTS          2   // the movetext has comments
+#define BPGN_FLAG_VARIATIONS        4   // the movetext has variations
+#define BPGN_FLAG_FEN               8   // moves start from the FEN tag's position
+
+// One game, parsed from a .lpgn line
+struct BpgnGame
+{
+    uint64_t line=0;
+    uint32_t tournament_date=0;
+    uint32_t date=0;
+    std::string event;
+    std::string site;
+    std::string round;
+    std::string white;
+    std::string black;
+    uint8_t result=bpgn_result_other;
+    uint16_t white_elo=0;
+    uint16_t black_elo=0;
+    uint32_t white_fide_id=0;
+    uint32_t black_fide_id=0;
+    std::string white_fed;
+    std::string black_fed;
+    uint16_t eco=0;
+    uint8_t flags=0;
+    std::string fen;
+    std::string extra_tags;     // Tag\0Value\0 pairs
+    std::string moves;          // encoded
+    void clear();
+};
+
+// Parse a .lpgn line (without any UTF8 BOM), including encoding the moves
+void bpgn_parse_line( const char *line, size_t len, BpgnGame &game );
+
+// Helpers for the column values
+uint32_t bpgn_date( const char *s, size_t len );       // "yyyy.mm.dd" or "yyyy-mm-dd"
+std::string bpgn_date_str( uint32_t yyyymmdd );         // "yyyy.mm.dd", with "??" for 0 parts
+uint16_t bpgn_eco( const std::string &s );
+std::string bpgn_eco_str( uint16_t eco );
+const char *bpgn_result_str( uint8_t result );
+
+// A fixed width column's value as text, dates as "yyyy.mm.dd", results as "1-0" etc,
+//  ECO codes as "B90" and anything else as a number (not for dictionary ids)
+std::string bpgn_value_str( const std::string &column, uint64_t value );
+
+class BpgnWriter
+{
+public:
+    ~BpgnWriter();
+    bool open( const std::string &fname );
+    void add_game( const BpgnGame &game );
+    bool close();
+private:
+    struct TempColumn
+    {
+        std::string name;
+        int type;
+        int dictionary;     // index into dicts, or -1
+        std::string fname;
+        std::ofstream out;
+        std::string offsets_fname;  // bpgn_var only
+        std::ofstream out_offsets;
+        uint64_t var_size=0;
+    };
+    struct Dictionary
+    {
+        std::string name;
+        std::unordered_map<std::string,uint32_t> ids;
+        std::vector<std::string> strings;
+        uint32_t id( const std::string &s );
+    };
+    void add_column( const std::string &name, int type, int dictionary=-1 );
+    void put( int column, const void *data, size_t len );
+    void put_var( int column, const std::string &value );
+    void remove_temp_files();
+    std::string fname;
+    bool opened=false;
+    uint64_t nbr_games=0;
+    std::vector<TempColumn *> columns;
+    std::vector<Dictionary> dicts;
+};
+
+class BpgnReader
+{
+public:
+    bool open( const std::string &fname );
+    uint64_t nbr_games() const { return games; }
+    std::vector<std::string> column_names() const;
+    bool has_column( const std::string &name ) const { return find(name) >= 0; }
+    int column_type( const std::string &name ) const;
+    uint64_t column_size( const std::string &name ) const;
+    bool has_dictionary( const std::string &name ) const;     // ie an id column
+
+    // Read a whole fixed width column, T must have the column's width
+    template <typename T> bool read_column( const std::string &name, std::vector<T> &values )
+    {
+        int idx = find(name);
+        if( idx<0 || dir[idx].type!=sizeof(T) )
+        {
+            printf( "Error; File %s has no %d bit column %s\n", fname.c_str(), static_cast<int>(8*sizeof(T)), name.c_str() );
+            return false;
+        }
+        values.resize( static_cast<size_t>(games) );
+        return read_bytes( dir[idx].offset, values.data(), games*sizeof(T) );
+    }
+
+    // Read values first to first+count-1 of any fixed width column, widened to 64 bits
+    bool read_block( const std::string &name, uint64_t first, size_t count, std::vector<uint64_t> &values );
+
+    // Read the lengths of values first to first+count-1 of a variable length column
+    bool read_lengths( const std::string &name, uint64_t first, size_t count, std::vector<uint64_t> &lengths );
+
+    // Read a whole variable length column, value i is data[offsets[i]] to data[offsets[i+1]]
+    bool read_var( const std::string &name, std::vector<uint64_t> &offsets, std::string &data );
+
+    // Read the dictionary for an id column, or a dictionary column by name
+    bool read_dictionary( const std::string &name, std::vector<std::string> &strings );
+
+private:
+    struct DirEntry
+    {
+        std::string name;
+        uint32_t type;
+        uint32_t dictionary;
+        uint64_t offset;
+        uint64_t size;
+    };
+    int find( const std::string &name ) const;
+    bool read_bytes( uint64_t offset, void *buf, uint64_t len );
+    bool read_var_idx( int idx, std::vector<uint64_t> &offsets, std::string &data );
+    std::string fname;
+    std::ifstream in;
+    uint64_t games=0;
+    std::vector<DirEntry> dir;
+};
+
+// Convert a .lpgn file (plain or compressed) to .bpgn
+bool lpgn_to_bpgn( const std::string &fin, const std::string &fout );
+
+#endif // BPGN_H_INCLUDED
@@ -0,0 +1,568 @@
+/*
+
+    Analytic queries over the columns of a .bpgn file, see bquery.h
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <unordered_map>
+#include <ostream>
+#include "util.h"
+#include "bpgn.h"
+#include "bquery.h"
+
+#define QUERY_BLOCK_SIZE 65536
+#define QUERY_MAX_KEYS   4
+
+// A column the query uses, stored in the file or derived from stored columns, one
+//  block of values at a time
+struct QueryColumn
+{
+    std::string name;
+    bool text=false;
+    std::vector<std::string> dictionary;    // text columns only
+    std::vector<uint64_t> values;
+};
+
+struct Condition
+{
+    int column;
+    std::string op;
+    uint64_t value=0;
+    std::vector<uint8_t> match;             // text columns, indexed by id
+};
+
+struct Aggregate
+{
+    std::string function;                   // count, sum, avg, min or max
+    int column=-1;
+};
+
+typedef std::array<uint64_t,QUERY_MAX_KEYS> GroupKey;
+
+struct GroupKeyHash
+{
+    size_t operator()( const GroupKey &key ) const
+    {
+        uint64_t hash = 0;
+        for( uint64_t k: key )
+            hash = (hash ^ k) * 0x100000001b3ULL;
+        return static_cast<size_t>( hash ^ (hash>>32) );
+    }
+};
+
+struct Group
+{
+    GroupKey key;
+    uint64_t count=0;
+    std::vector<double>   sum;
+    std::vector<uint64_t> n;                // nonzero values, for avg, min and max
+    std::vector<uint64_t> min;
+    std::vector<uint64_t> max;
+};
+
+static bool is_derived( const std::string &name )
+{
+    return name=="year" || name=="month" || name=="tournament_year" || name=="plies";
+}
+
+// Index of a column in columns, adding it if need be
+static int find_column( BpgnReader &in, const std::string &name, std::vector<QueryColumn> &columns )
+{
+    for( size_t i=0; i<columns.size(); i++ )
+    {
+        if( columns[i].name == name )
+            return static_cast<int>(i);
+    }
+    QueryColumn col;
+    col.name = name;
+    if( !is_derived(name) )
+    {
+        if( !in.has_column(name) || in.column_type(name)==bpgn_var )
+        {
+            printf( "Error; No column %s to query (bpgn -i lists the columns)\n", name.c_str() );
+            return -1;
+        }
+        if( in.has_dictionary(name) )
+        {
+            col.text = true;
+            if( !in.read_dictionary(name,col.dictionary) )
+                return -1;
+        }
+    }
+    columns.push_back(col);
+    return static_cast<int>( columns.size()-1 );
+}
+
+// Split on spaces (and commas between aggregates or group columns), except in quotes
+static void tokenize( const std::string &query, std::vector<std::string> &tokens )
+{
+    std::string token;
+    bool quoted = false;
+    for( char c: query )
+    {
+        if( c == '"' )
+            quoted = !quoted;
+        if( !quoted && (c==' ' || c=='\t' || c==',') )
+        {
+            if( token != "" )
+                tokens.push_back(token);
+            token.clear();
+        }
+        else
+            token += c;
+    }
+    if( token != "" )
+        tokens.push_back(token);
+}
+
+static std::string lower( const std::string &s )
+{
+    std::string t = s;
+    for( char &c: t )
+    {
+        if( isascii(c) )
+            c = static_cast<char>( tolower(c) );
+    }
+    return t;
+}
+
+// "yyyy", "yyyy.mm" or "yyyy.mm.dd" (or with '-' separators) to yyyymmdd
+static bool parse_date( const std::string &s, uint64_t &value )
+{
+    uint64_t parts[3] = {0,0,0};
+    int idx = 0;
+    for( char c: s )
+    {
+        if( c=='.' || c=='-' )
+        {
+            if( ++idx > 2 )
+                return false;
+        }
+        else if( isdigit(c) )
+            parts[idx] = parts[idx]*10 + (c-'0');
+        else
+            return false;
+    }
+    value = parts[0]*10000 + parts[1]*100 + parts[2];
+    return s.length() > 0;
+}
+
+static bool parse_condition( BpgnReader &in, const std::string &token, std::vector<QueryColumn> &columns, Condition &cond )
+{
+    size_t pos = token.find_first_of( "=!<>~" );
+    if( pos==std::string::npos || pos==0 )
+    {
+        printf( "Error; Bad condition %s (expected column op value)\n", token.c_str() );
+        return false;
+    }
+    std::string name = token.substr(0,pos);
+    size_t op_len = (pos+1<token.length() && token[pos+1]=='=') ? 2 : 1;
+    cond.op = token.substr(pos,op_len);
+    std::string value = token.substr(pos+op_len);
+    if( value.length()>=2 && value[0]=='"' && value[value.length()-1]=='"' )
+        value = value.substr( 1, value.length()-2 );
+    if( cond.op=="!" || cond.op=="~=" )
+    {
+        printf( "Error; Bad condition %s (op is one of = != < <= > >= ~)\n", token.c_str() );
+        return false;
+    }
+    cond.column = find_column( in, name, columns );
+    if( cond.column < 0 )
+        return false;
+    const QueryColumn &col = columns[cond.column];
+    if( col.text )
+    {
+        if( cond.op!="=" && cond.op!="!=" && cond.op!="~" )
+        {
+            printf( "Error; Text column %s can only be compared with = != or ~\n", name.c_str() );
+            return false;
+        }
+        std::string value_lower = lower(value);
+        cond.match.resize( col.dictionary.size() );
+        for( size_t id=0; id<col.dictionary.size(); id++ )
+        {
+            const std::string &s = col.dictionary[id];
+            bool match;
+            if( cond.op == "~" )
+                match = (std::string::npos != lower(s).find(value_lower));
+            else
+                match = (s==value) == (cond.op=="=");
+            cond.match[id] = match ? 1 : 0;
+        }
+        return true;
+    }
+    if( cond.op == "~" )
+    {
+        printf( "Error; Only text columns can be compared with ~, not %s\n", name.c_str() );
+        return false;
+    }
+    bool ok = true;
+    if( name == "result" )
+    {
+        if( value == "1-0" )
+            cond.value = bpgn_result_white;
+        else if( value == "0-1" )
+            cond.value = bpgn_result_black;
+        else if( value == "1/2-1/2" )
+            cond.value = bpgn_result_draw;
+        else if( value == "*" )
+            cond.value = bpgn_result_other;
+        else
+            ok = false;
+    }
+    else if( name=="date" || name=="tournament_date" )
+        ok = parse_date( value, cond.value );
+    else if( name == "eco" )
+    {
+        cond.value = bpgn_eco(value);
+        ok = (cond.value != 0);
+    }
+    else
+    {
+        ok = (value.length() > 0);
+        for( char c: value )
+        {
+            if( !isdigit(c) )
+                ok = false;
+        }
+        if( ok )
+            cond.value = strtoull( value.c_str(), NULL, 10 );
+    }
+    if( !ok )
+        printf( "Error; Bad value %s for column %s\n", value.c_str(), name.c_str() );
+    return ok;
+}
+
+static bool parse_aggregate( BpgnReader &in, const std::string &token, std::vector<QueryColumn> &columns, Aggregate &agg )
+{
+    if( token == "count" )
+    {
+        agg.function = "count";
+        return true;
+    }
+    size_t open = token.find('(');
+    if( open==std::string::npos || token[token.length()-1]!=')' )
+    {
+        printf( "Error; Bad aggregate %s (expected count, sum(column), avg(column), min(column) or max(column))\n", token.c_str() );
+        return false;
+    }
+    agg.function = token.substr(0,open);
+    std::string name = token.substr( open+1, token.length()-open-2 );
+    if( agg.function!="sum" && agg.function!="avg" && agg.function!="min" && agg.function!="max" )
+    {
+        printf( "Error; Bad aggregate %s (expected count, sum(column), avg(column), min(column) or max(column))\n", token.c_str() );
+        return false;
+    }
+    agg.column = find_column( in, name, columns );
+    if( agg.column < 0 )
+        return false;
+    if( columns[agg.column].text )
+    {
+        printf( "Error; Cannot %s text column %s\n", agg.function.c_str(), name.c_str() );
+        return false;
+    }
+    return true;
+}
+
+// Read (or calculate) the values of games first to first+count-1 for each column
+static bool read_block( BpgnReader &in, uint64_t first, size_t count, std::vector<QueryColumn> &columns )
+{
+    std::vector<uint64_t> other;
+    for( QueryColumn &col: columns )
+    {
+        std::vector<uint64_t> &v = col.values;
+        bool ok;
+        if( col.name == "year" )
+        {
+            ok = in.read_block( "date", first, count, v ) &&
+                 in.read_block( "tournament_date", first, count, other );
+            if( ok )
+            {
+                for( size_t i=0; i<count; i++ )
+                    v[i] = (v[i]>=10000 ? v[i] : other[i]) / 10000;
+            }
+        }
+        else if( col.name == "month" )
+        {
+            ok = in.read_block( "date", first, count, v );
+            if( ok )
+            {
+                for( size_t i=0; i<count; i++ )
+                    v[i] = (v[i]/100) % 100;
+            }
+        }
+        else if( col.name == "tournament_year" )
+        {
+            ok = in.read_block( "tournament_date", first, count, v );
+            if( ok )
+            {
+                for( size_t i=0; i<count; i++ )
+                    v[i] /= 10000;
+            }
+        }
+        else if( col.name == "plies" )
+            ok = in.read_lengths( "moves", first, count, v );
+        else
+            ok = in.read_block( col.name, first, count, v );
+        if( !ok )
+            return false;
+    }
+    return true;
+}
+
+// Clear selected[i] for games that don't meet the condition
+static void apply_condition( const Condition &cond, const std::vector<uint64_t> &values, size_t count, std::vector<uint8_t> &selected )
+{
+    const uint64_t *v = values.data();
+    uint8_t *sel = selected.data();
+    uint64_t x = cond.value;
+    if( cond.match.size() > 0 )
+    {
+        const uint8_t *match = cond.match.data();
+        uint64_t nbr_ids = cond.match.size();
+        for( size_t i=0; i<count; i++ )
+            sel[i] &= (v[i]<nbr_ids ? match[v[i]] : 0);
+    }
+    else if( cond.op == "=" )
+    {
+        for( size_t i=0; i<count; i++ )
+            sel[i] &= (v[i] == x);
+    }
+    else if( cond.op == "!=" )
+    {
+        for( size_t i=0; i<count; i++ )
+            sel[i] &= (v[i] != x);
+    }
+    else if( cond.op == "<" )
+    {
+        for( size_t i=0; i<count; i++ )
+            sel[i] &= (v[i] < x);
+    }
+    else if( cond.op == "<=" )
+    {
+        for( size_t i=0; i<count; i++ )
+            sel[i] &= (v[i] <= x);
+    }
+    else if( cond.op == ">" )
+    {
+        for( size_t i=0; i<count; i++ )
+            sel[i] &= (v[i] > x);
+    }
+    else if( cond.op == ">=" )
+    {
+        for( size_t i=0; i<count; i++ )
+            sel[i] &= (v[i] >= x);
+    }
+}
+
+static std::string value_str( const QueryColumn &col, uint64_t value )
+{
+    if( col.text )
+        return value<col.dictionary.size() ? col.dictionary[static_cast<size_t>(value)] : "";
+    if( is_derived(col.name) )
+        return util::sprintf( "%llu", static_cast<unsigned long long>(value) );
+    return bpgn_value_str( col.name, value );
+}
+
+bool bpgn_query( const std::string &fin, const std::string &query, std::ostream &out )
+{
+    BpgnReader in;
+    if( !in.open(fin) )
+        return false;
+
+    // Parse; aggregates [by columns] [where conditions]
+    std::vector<std::string> tokens;
+    tokenize( query, tokens );
+    std::vector<QueryColumn> columns;
+    std::vector<Aggregate> aggregates;
+    std::vector<int> keys;
+    std::vector<Condition> conditions;
+    enum { in_aggregates, in_by, in_where } state = in_aggregates;
+    for( const std::string &token: tokens )
+    {
+        if( token=="by" && state==in_aggregates )
+            state = in_by;
+        else if( token=="where" && state!=in_where )
+            state = in_where;
+        else if( state == in_aggregates )
+        {
+            Aggregate agg;
+            if( !parse_aggregate( in, token, columns, agg ) )
+                return false;
+            aggregates.push_back(agg);
+        }
+        else if( state == in_by )
+        {
+            int column = find_column( in, token, columns );
+            if( column < 0 )
+                return false;
+            keys.push_back(column);
+        }
+        else
+        {
+            Condition cond;
+            if( !parse_condition( in, token, columns, cond ) )
+                return false;
+            conditions.push_back(cond);
+        }
+    }
+    if( aggregates.size() == 0 )
+    {
+        printf( "Error; Query has no aggregates, eg \"count by year\"\n" );
+        return false;
+    }
+    if( keys.size() > QUERY_MAX_KEYS )
+    {
+        printf( "Error; Query can group by at most %d columns\n", QUERY_MAX_KEYS );
+        return false;
+    }
+
+    // Scan, a block of games at a time
+    std::vector<Group> groups;
+    std::unordered_map<GroupKey,size_t,GroupKeyHash> group_idx;
+    std::vector<uint8_t> selected;
+    size_t nbr_aggregates = aggregates.size();
+    GroupKey key, last_key;
+    key.fill(0);
+    size_t last_group = 0;
+    bool have_last = false;
+    if( keys.size() == 0 )
+    {
+        // No grouping, one group for all games even if none are selected
+        Group g;
+        g.key = key;
+        groups.push_back(g);
+        group_idx[key] = 0;
+    }
+    for( uint64_t first=0; first<in.nbr_games(); first+=QUERY_BLOCK_SIZE )
+    {
+        size_t count = static_cast<size_t>( std::min<uint64_t>( QUERY_BLOCK_SIZE, in.nbr_games()-first ) );
+        if( !read_block( in, first, count, columns ) )
+            return false;
+        selected.assign( count, 1 );
+        for( const Condition &cond: conditions )
+            apply_condition( cond, columns[cond.column].values, count, selected );
+        for( size_t i=0; i<count; i++ )
+        {
+            if( !selected[i] )
+                continue;
+            for( size_t k=0; k<keys.size(); k++ )
+                key[k] = columns[keys[k]].values[i];
+
+            // Games are sorted by tournament, so often in the same group as the last game
+            if( !have_last || key!=last_key )
+            {
+                auto it = group_idx.find(key);
+                if( it != group_idx.end() )
+                    last_group = it->second;
+                else
+                {
+                    Group g;
+                    g.key = key;
+                    last_group = groups.size();
+                    group_idx[key] = last_group;
+                    groups.push_back(g);
+                }
+                last_key = key;
+                have_last = true;
+            }
+            Group &g = groups[last_group];
+            if( g.sum.size() == 0 )
+            {
+                g.sum.resize( nbr_aggregates, 0.0 );
+                g.n.resize( nbr_aggregates, 0 );
+                g.min.resize( nbr_aggregates, UINT64_MAX );
+                g.max.resize( nbr_aggregates, 0 );
+            }
+            g.count++;
+            for( size_t a=0; a<nbr_aggregates; a++ )
+            {
+                if( aggregates[a].column < 0 )
+                    continue;
+                uint64_t value = columns[aggregates[a].column].values[i];
+                g.sum[a] += static_cast<double>(value);
+                if( value != 0 )
+                {
+                    g.n[a]++;
+                    if( value < g.min[a] )
+                        g.min[a] = value;
+                    if( value > g.max[a] )
+                        g.max[a] = value;
+                }
+            }
+        }
+    }
+
+    // Groups in order, text columns alphabetically
+    std::vector<size_t> order;
+    for( size_t i=0; i<groups.size(); i++ )
+        order.push_back(i);
+    std::sort( order.begin(), order.end(), [&]( size_t lhs, size_t rhs )
+    {
+        for( size_t k=0; k<keys.size(); k++ )
+        {
+            const QueryColumn &col = columns[keys[k]];
+            uint64_t l = groups[lhs].key[k];
+            uint64_t r = groups[rhs].key[k];
+            if( l == r )
+                continue;
+            if( col.text && l<col.dictionary.size() && r<col.dictionary.size() )
+                return col.dictionary[static_cast<size_t>(l)] < col.dictionary[static_cast<size_t>(r)];
+            return l < r;
+        }
+        return false;
+    } );
+
+    // Heading, then one line per group
+    std::string line;
+    for( int k: keys )
+    {
+        line += columns[k].name;
+        line += '\t';
+    }
+    for( size_t a=0; a<nbr_aggregates; a++ )
+    {
+        if( a > 0 )
+            line += '\t';
+        line += aggregates[a].function;
+        if( aggregates[a].column >= 0 )
+            line += "(" + columns[aggregates[a].column].name + ")";
+    }
+    util::putline( out, line );
+    for( size_t idx: order )
+    {
+        const Group &g = groups[idx];
+        line.clear();
+        for( size_t k=0; k<keys.size(); k++ )
+        {
+            line += value_str( columns[keys[k]], g.key[k] );
+            line += '\t';
+        }
+        for( size_t a=0; a<nbr_aggregates; a++ )
+        {
+            if( a > 0 )
+                line += '\t';
+            const Aggregate &agg = aggregates[a];
+            if( agg.function == "count" )
+                line += util::sprintf( "%llu", static_cast<unsigned long long>(g.count) );
+            else if( g.sum.size()==0 || (agg.function!="sum" && g.n[a]==0) )
+                line += agg.function=="sum" ? "0" : "";
+            else if( agg.function == "sum" )
+                line += util::sprintf( "%.0f", g.sum[a] );
+            else if( agg.function == "avg" )
+                line += util::sprintf( "%.1f", g.sum[a]/g.n[a] );
+            else
+                line += value_str( columns[agg.column], agg.function=="min" ? g.min[a] : g.max[a] );
+        }
+        util::putline( out, line );
+    }
+    return true;
+}
@@ -0,0 +1,51 @@
+/*
+
+    Analytic queries over the columns of a .bpgn file
+
+    A query counts games, or sums, averages or finds the minimum or maximum of
+    columns, over the games that meet some conditions, optionally grouped by one
+    or more columns. For example;
+
+        count by year,white_fed where year>=2000
+        count,avg(white_elo),avg(black_elo) by event where event~olympiad
+        count by year,result
+        avg(plies) by eco where white_elo>=2600 black_elo>=2600
+
+    Syntax;
+
+        aggregate[,aggregate...] [by column[,column...]] [where condition...]
+
+    An aggregate is count, or one of sum, avg, min or max of a column, eg avg(white_elo).
+    Averages, minimums and maximums skip zero (ie unknown) values. A condition is
+    column op value with op one of = != < <= > >= or ~ (contains, ignoring case, text
+    columns only). Games must meet all the conditions. Quote values with spaces, eg
+    event="Tata Steel Masters".
+
+    Columns are the fixed width columns of the .bpgn file (see bpgn.h) plus;
+
+        year             year of the date, or of the tournament date if not known
+        month            month of the date, 0 if not known
+        tournament_year  year of the tournament date
+        plies            length of the main line
+
+    Text columns (event, site, round, white, black, white_fed, black_fed) compare and
+    group by their text, result compares with 1-0, 0-1, 1/2-1/2 or *, dates with
+    yyyy, yyyy.mm or yyyy.mm.dd and eco with codes like B90.
+
+    Only the columns the query uses are read, a block of games at a time. Each
+    condition is applied to the whole block by a simple loop over one column (which
+    the compiler can vectorise), then the games still selected are grouped.
+
+*/
+
+#ifndef BQUERY_H_INCLUDED
+#define BQUERY_H_INCLUDED
+
+#include <string>
+#include <ostream>
+
+// Run a query over .bpgn file fin, the results are written to out as tab separated
+//  text after a heading line. Returns false if the query is bad (or fin can't be read)
+bool bpgn_query( const std::string &fin, const std::string &query, std::ostream &out );
+
+#endif // BQUERY_H_INCLUDED
@@ -0,0 +1,178 @@
+/*
+
+    Per file conversion cache for pgn2line -l
+
+    With a list of tens of thousands of pgn files, almost all of which haven't
+    changed since the last run, most of pgn2line's time goes into converting
+    the same files again. With a cache directory each file's converted games
+    (plain .lpgn lines, without sort keys, unsorted) are kept in an entry file;
+
+        <content hash>-<config hash>.lpgn
+
+    The content hash is of the pgn file's bytes (as stored, so a compressed file
+    is not decompressed), the config hash covers the conversion options and the
+    whitelist, blacklist and fixup lists. So an edited file, or a change of
+    options, naturally gets a new entry, and a file that is moved or copied
+    still finds its entry. Old entries are never deleted, empty the directory
+    to reclaim the space.
+
+    Index file "index.txt" in the cache directory, one line per pgn file;
+
+        <content hash> <size> <modification time> <path>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include "util.h"
+#include "convcache.h"
+
+uint64_t cache_hash( const void *data, size_t len, uint64_t hash )
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    uint64_t h = hash ? hash : 14695981039346656037ULL;
+    for( size_t i=0; i<len; i++ )
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static std::string hex64( uint64_t value )
+{
+    return util::sprintf( "%016llx", static_cast<unsigned long long>(value) );
+}
+
+static bool file_exists( const std::string &fname )
+{
+    struct stat st;
+    return 0 == stat(fname.c_str(),&st);
+}
+
+static bool hash_file_contents( const std::string &fname, uint64_t &hash )
+{
+    std::ifstream in( fname, std::ios_base::in | std::ios_base::binary );
+    if( !in )
+        return false;
+    std::vector<char> buf(1024*1024);
+    hash = 0;
+    while( in )
+    {
+        in.read( buf.data(), buf.size() );
+        size_t len = static_cast<size_t>(in.gcount());
+        if( len == 0 )
+            break;
+        hash = cache_hash( buf.data(), len, hash );
+    }
+    return true;
+}
+
+bool ConversionCache::open( const std::string &dir_, uint64_t config_hash_ )
+{
+    dir = dir_;
+    if( dir.length()>0 && (dir[dir.length()-1]=='/' || dir[dir.length()-1]=='\\') )
+        dir.erase( dir.length()-1 );
+    config_hash = config_hash_;
+    index.clear();
+    index_changed = false;
+
+    // Check the directory is usable
+    std::string probe = dir + "/index.tmp";
+    std::ofstream out(probe);
+    if( !out )
+    {
+        printf( "Error; Cannot write to cache directory %s (it must already exist)\n", dir.c_str() );
+        return false;
+    }
+    out.close();
+    remove( probe.c_str() );
+
+    // Read the index, if present
+    std::ifstream in( dir + "/index.txt" );
+    std::string line;
+    while( std::getline(in,line) )
+    {
+        IndexEntry e;
+        unsigned long long hash, size;
+        long long mtime;
+        int offset=0;
+        if( 3 == sscanf(line.c_str(),"%llx %llu %lld %n",&hash,&size,&mtime,&offset) && offset>0 )
+        {
+            e.content_hash = hash;
+            e.size = size;
+            e.mtime = mtime;
+            index[line.substr(offset)] = e;
+        }
+    }
+    return true;
+}
+
+bool ConversionCache::save()
+{
+    if( !index_changed )
+        return true;
+    std::string fname = dir + "/index.txt";
+    std::string temp  = dir + "/index.tmp";
+    std::ofstream out(temp);
+    if( !out )
+    {
+        printf( "Error; Cannot write cache index %s\n", temp.c_str() );
+        return false;
+    }
+    for( auto it=index.begin(); it!=index.end(); it++ )
+    {
+        std::string s = util::sprintf( "%s %llu %lld %s", hex64(it->second.content_hash).c_str(),
+                                       static_cast<unsigned long long>(it->second.size),
+                                       static_cast<long long>(it->second.mtime), it->first.c_str() );
+        util::putline(out,s);
+    }
+    out.close();
+    remove( fname.c_str() );
+    if( rename( temp.c_str(), fname.c_str() ) )
+    {
+        printf( "Error; Cannot create file %s by renaming temporary file %s\n", fname.c_str(), temp.c_str() );
+        return false;
+    }
+    index_changed = false;
+    return true;
+}
+
+bool ConversionCache::find( const std::string &pgn_file, std::string &entry )
+{
+    entry.clear();
+    struct stat st;
+    if( stat(pgn_file.c_str(),&st) )
+        return false;
+
+    // Only read the file to hash it if it's new or has changed size or time
+    IndexEntry e;
+    e.size  = static_cast<uint64_t>(st.st_size);
+    e.mtime = static_cast<int64_t>(st.st_mtime);
+    auto it = index.find(pgn_file);
+    if( it!=index.end() && it->second.size==e.size && it->second.mtime==e.mtime )
+        e.content_hash = it->second.content_hash;
+    else
+    {
+        if( !hash_file_contents(pgn_file,e.content_hash) )
+            return false;
+        index[pgn_file] = e;
+        index_changed = true;
+    }
+    entry = dir + "/" + hex64(e.content_hash) + "-" + hex64(config_hash) + ".lpgn";
+    return file_exists(entry);
+}
+
+bool ConversionCache::commit( const std::string &entry )
+{
+    std::string temp = temp_name(entry);
+    if( rename( temp.c_str(), entry.c_str() ) )
+    {
+        printf( "Error; Cannot create cache entry %s by renaming temporary file %s\n", entry.c_str(), temp.c_str() );
+        return false;
+    }
+    return true;
+}
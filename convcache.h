@@ -0,0 +1,48 @@
+/*
+
+    Per file conversion cache for pgn2line -l
+
+*/
+
+#ifndef CONVCACHE_H_INCLUDED
+#define CONVCACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <map>
+
+// 64 bit FNV-1a, start with hash=0 then continue with the previous hash to hash in pieces
+uint64_t cache_hash( const void *data, size_t len, uint64_t hash=0 );
+
+// Each pgn file's converted games are kept in a cache entry named for a hash of the
+//  file's contents and a hash of the conversion options (config_hash). An index in
+//  the cache directory remembers the content hash of each pgn file along with its
+//  size and modification time, so unchanged files needn't be read to be found
+class ConversionCache
+{
+public:
+    bool open( const std::string &dir, uint64_t config_hash );
+    bool save();
+
+    // Sets the name of the pgn file's cache entry, returns true if the entry exists
+    bool find( const std::string &pgn_file, std::string &entry );
+
+    // New entries are written to a temporary file, then committed. If the commit
+    //  fails the temporary file is left for the caller to use and remove
+    static std::string temp_name( const std::string &entry ) { return entry + ".tmp"; }
+    bool commit( const std::string &entry );
+
+private:
+    struct IndexEntry
+    {
+        uint64_t size=0;
+        int64_t  mtime=0;
+        uint64_t content_hash=0;
+    };
+    std::string dir;
+    uint64_t config_hash=0;
+    std::map<std::string,IndexEntry> index;
+    bool index_changed=false;
+};
+
+#endif // CONVCACHE_H_INCLUDED
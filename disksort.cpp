@@ -10,6 +10,11 @@
     We use default std::sort() as an underlying primitive, that means this is a case
     sensitive unlike system sort on (most?) systems, but that's neither here nor there
     for this application at least.
+
+    Input can be a plain text file or a compressed .lpgn container (see lpgnz.h),
+    with compress set the temporary files and output are compressed containers.
+    An optional transform is applied to every input line as it is read (pgn2line
+    uses this to rank the event and site ids in its sort keys, see sortkey.h).
     
 */
 
@@ -21,12 +26,16 @@
 #include <string>
 #include <algorithm>
 #include <vector>
+#include <functional>
 #include "util.h"
+#include "lpgnz.h"
+#include "metrics.h"
 #include "disksort.h"
 
-bool disksort( std::string fin, std::string fout, bool reverse )
+bool disksort( std::string fin, std::string fout, bool reverse, bool compress,
+               const std::function<void(std::string &line)> &transform )
 {
-    std::ifstream in(fin.c_str());
+    LineReader in(fin);
     if( !in )
     {
         printf( "Error, cannot open file %s for reading\n", fin.c_str() );
@@ -48,7 +57,7 @@ bool disksort( std::string fin, std::string fout, bool reverse )
     std::string fname_temp_out = flip_flop_temp_filenames ? fname_temp2 : fname_temp1;
 
     // Start with empty output file
-    std::ofstream empty_out(fname_temp_out);
+    LineWriter empty_out(fname_temp_out,compress);
     if( !empty_out )
     {
         printf( "Error; Cannot open file %s for writing\n", fname_temp_out.c_str() );
@@ -75,8 +84,10 @@ bool disksort( std::string fin, std::string fout, bool reverse )
         while( total_read_to_date < chunk_size )
         {
             std::string line;
-            if( !std::getline(in,line) )
+            if( !in.getline(line) )
                 break;
+            if( transform )
+                transform(line);
             chunk.push_back(line);
             total_read_to_date += line.length();
         }
@@ -89,15 +100,15 @@ bool disksort( std::string fin, std::string fout, bool reverse )
 
         // Read line by line from the input temporary file, merge sorting with this chunk and
         //  writing line by line to a new temporary file
-        std::ifstream temp_in(fname_temp_in);
-        std::ofstream temp_out(fname_temp_out);
+        LineReader temp_in(fname_temp_in);
+        LineWriter temp_out(fname_temp_out,compress);
         unsigned int get = 0;
         bool memory_line_available = get<chunk.size();
         std::string memory_line;
         if( memory_line_available )
             memory_line = chunk[get];
         std::string file_line;
-        bool file_line_available = static_cast<bool>(std::getline(temp_in,file_line));
+        bool file_line_available = temp_in.getline(file_line);
         while( file_line_available || memory_line_available )
         {
             bool use_memory = memory_line_available;
@@ -123,10 +134,12 @@ bool disksort( std::string fin, std::string fout, bool reverse )
             else
             {
                 output_line = file_line;
-                file_line_available = static_cast<bool>(std::getline(temp_in,file_line));
+                file_line_available = temp_in.getline(file_line);
             }
-            util::putline(temp_out,output_line);
+            temp_out.putline(output_line);
         }
+        temp_out.close();
+        temp_disk_usage.sample( file_size(fname_temp_in) + file_size(fname_temp_out) );
     }
 
     // Discard temporary input file and rename temporary output file as it's now the final sorted output
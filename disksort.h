@@ -9,8 +9,11 @@
 
 #include <string>
 #include <vector>
+#include <functional>
 
-bool disksort( std::string fin, std::string fout, bool reverse=false );
+// If provided, transform is applied to each input line before sorting
+bool disksort( std::string fin, std::string fout, bool reverse=false, bool compress=false,
+               const std::function<void(std::string &line)> &transform=nullptr );
 
 #endif // DISKSORT_H_INCLUDED
 
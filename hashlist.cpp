@@ -0,0 +1,369 @@
+/*
+
+    Hashed lists of tournaments and player names
+
+    Whitelists, blacklists and fixup lists are looked up for every game, and a
+    fixup list can have hundreds of thousands of player names. So rather than
+    std::set and std::map, lists are held as perfect hash tables (the "hash and
+    displace" method); keys are divided among buckets by hash, and each bucket
+    gets a seed chosen so that its keys land in otherwise unused slots. A lookup
+    is one hash calculation, one seed, one slot and one key comparison. Keys can
+    be presented in pieces, so a "yyyy Event@Site" key need not be built.
+
+    Each table is a single block of memory with no pointers, so the same block
+    is written to, and read from, compiled list files (see program fixupc).
+
+    Block layout (all integers little endian);
+
+        u32 nbr keys, u32 nbr buckets, u32 nbr slots (a power of 2),
+        u32 flags (bit 0 set means values present), u32 salt, u32 reserved
+        u32 seed for each bucket
+        for each slot; u32 key offset, u32 key length (0xffffffff if slot unused),
+                       u32 value offset, u32 value length
+        string data, offsets above are relative to the start of this
+
+    Compiled list file;
+
+        "LPGNFIX\x01", u32 nbr tables (2), u32 reserved
+        for each table (tournaments, then player names); u64 length, block
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "hashlist.h"
+
+static const char file_magic[8] = { 'L','P','G','N','F','I','X','\x01' };
+static const size_t block_header_size = 24;
+static const size_t slot_size = 16;
+static const uint32_t empty_slot = 0xffffffff;
+static const uint32_t max_seed_tries = 100000;
+
+static void put32( std::string &s, uint32_t v )
+{
+    for( int i=0; i<4; i++ )
+        s += static_cast<char>( (v>>(8*i)) & 0xff );
+}
+
+static void put64( std::string &s, uint64_t v )
+{
+    for( int i=0; i<8; i++ )
+        s += static_cast<char>( (v>>(8*i)) & 0xff );
+}
+
+static uint32_t get32( const unsigned char *q )
+{
+    return q[0] | (q[1]<<8) | (q[2]<<16) | (static_cast<uint32_t>(q[3])<<24);
+}
+
+static uint64_t get64( const unsigned char *q )
+{
+    return get32(q) | (static_cast<uint64_t>(get32(q+4))<<32);
+}
+
+// FNV-1a, presented with the key in pieces
+static uint64_t hash_pieces( uint32_t salt, const char *const *pieces, const size_t *lens, int nbr_pieces )
+{
+    uint64_t h = 14695981039346656037ULL ^ (salt * 0x9e3779b97f4a7c15ULL);
+    for( int i=0; i<nbr_pieces; i++ )
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(pieces[i]);
+        for( size_t j=0; j<lens[i]; j++ )
+            h = (h ^ p[j]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint32_t bucket_for( uint64_t h, uint32_t nbr_buckets )
+{
+    return static_cast<uint32_t>(h>>32) % nbr_buckets;
+}
+
+static uint32_t slot_for( uint64_t h, uint32_t seed, uint32_t nbr_slots )
+{
+    uint64_t x = h ^ (seed * 0x9e3779b97f4a7c15ULL);
+    x ^= x>>33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x>>33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x>>33;
+    return static_cast<uint32_t>(x) & (nbr_slots-1);
+}
+
+//
+//  HashedList
+//
+
+void HashedList::build( const std::vector<std::string> &keys, const std::vector<std::string> *values )
+{
+    // First occurrence of a key wins (as with std::map::insert())
+    std::vector<size_t> unique;
+    std::unordered_map<std::string,size_t> seen;
+    for( size_t i=0; i<keys.size(); i++ )
+    {
+        if( seen.insert( std::pair<std::string,size_t>(keys[i],i) ).second )
+            unique.push_back(i);
+    }
+    uint32_t n = static_cast<uint32_t>( unique.size() );
+    uint32_t buckets = n/4 + 1;
+    uint32_t m = 1;
+    while( m < n+n/2+1 )
+        m <<= 1;
+
+    // Find a salt and per bucket seeds that give every key its own slot
+    uint32_t salt = 0;
+    std::vector<uint64_t> hashes(n);
+    std::vector<uint32_t> seed_table(buckets);
+    std::vector<uint32_t> owner(m);
+    for(;;)
+    {
+        for( uint32_t i=0; i<n; i++ )
+        {
+            const std::string &key = keys[unique[i]];
+            const char *piece = key.c_str();
+            size_t len = key.length();
+            hashes[i] = hash_pieces( salt, &piece, &len, 1 );
+        }
+        std::vector< std::vector<uint32_t> > bucket_keys(buckets);
+        for( uint32_t i=0; i<n; i++ )
+            bucket_keys[ bucket_for(hashes[i],buckets) ].push_back(i);
+        std::vector<uint32_t> order(buckets);
+        for( uint32_t b=0; b<buckets; b++ )
+            order[b] = b;
+        std::stable_sort( order.begin(), order.end(), [&bucket_keys](uint32_t lhs, uint32_t rhs)
+                { return bucket_keys[lhs].size() > bucket_keys[rhs].size(); } );
+        std::fill( owner.begin(), owner.end(), empty_slot );
+        std::fill( seed_table.begin(), seed_table.end(), 0 );
+        bool ok = true;
+        std::vector<uint32_t> trial;
+        for( uint32_t k=0; ok && k<buckets; k++ )
+        {
+            const std::vector<uint32_t> &members = bucket_keys[order[k]];
+            if( members.size() == 0 )
+                break;  // sorted, so all remaining buckets are empty too
+            bool found = false;
+            for( uint32_t seed=0; !found && seed<max_seed_tries; seed++ )
+            {
+                trial.clear();
+                found = true;
+                for( size_t j=0; found && j<members.size(); j++ )
+                {
+                    uint32_t slot = slot_for( hashes[members[j]], seed, m );
+                    if( owner[slot]!=empty_slot || std::find(trial.begin(),trial.end(),slot)!=trial.end() )
+                        found = false;
+                    else
+                        trial.push_back(slot);
+                }
+                if( found )
+                {
+                    seed_table[order[k]] = seed;
+                    for( size_t j=0; j<members.size(); j++ )
+                        owner[trial[j]] = members[j];
+                }
+            }
+            ok = found;
+        }
+        if( ok )
+            break;
+        salt++;     // unlucky (eg two keys with the same 64 bit hash), try again
+        if( salt%4 == 0 )
+        {
+            m <<= 1;
+            owner.resize(m);
+        }
+    }
+
+    // Serialise
+    std::string strs;
+    std::string slot_data;
+    for( uint32_t s=0; s<m; s++ )
+    {
+        if( owner[s] == empty_slot )
+        {
+            put32( slot_data, 0 );
+            put32( slot_data, empty_slot );
+            put32( slot_data, 0 );
+            put32( slot_data, 0 );
+            continue;
+        }
+        size_t idx = unique[owner[s]];
+        put32( slot_data, static_cast<uint32_t>(strs.length()) );
+        put32( slot_data, static_cast<uint32_t>(keys[idx].length()) );
+        strs += keys[idx];
+        if( values )
+        {
+            const std::string &value = (*values)[idx];
+            put32( slot_data, static_cast<uint32_t>(strs.length()) );
+            put32( slot_data, static_cast<uint32_t>(value.length()) );
+            strs += value;
+        }
+        else
+        {
+            put32( slot_data, 0 );
+            put32( slot_data, 0 );
+        }
+    }
+    std::string blob;
+    put32( blob, n );
+    put32( blob, buckets );
+    put32( blob, m );
+    put32( blob, values?1:0 );
+    put32( blob, salt );
+    put32( blob, 0 );
+    for( uint32_t b=0; b<buckets; b++ )
+        put32( blob, seed_table[b] );
+    blob += slot_data;
+    blob += strs;
+    set_data( blob );
+}
+
+bool HashedList::set_data( std::string &blob )
+{
+    data.swap( blob );
+    nbr_keys = nbr_buckets = nbr_slots = 0;
+    values_present = false;
+    if( data.length() == 0 )
+        return true;    // never built, so empty
+    if( data.length() < block_header_size )
+        return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>( data.c_str() );
+    uint32_t keys    = get32(p);
+    uint32_t buckets = get32(p+4);
+    uint32_t slots   = get32(p+8);
+    uint32_t flags   = get32(p+12);
+    salt             = get32(p+16);
+    strings_offset = block_header_size + static_cast<uint64_t>(buckets)*4 + static_cast<uint64_t>(slots)*slot_size;
+    if( buckets==0 || slots==0 || (slots&(slots-1))!=0 || strings_offset>data.length() )
+        return false;
+    for( uint32_t s=0; s<slots; s++ )
+    {
+        const unsigned char *q = p + block_header_size + buckets*4 + s*slot_size;
+        uint64_t key_end   = static_cast<uint64_t>(get32(q)) + get32(q+4);
+        uint64_t value_end = static_cast<uint64_t>(get32(q+8)) + get32(q+12);
+        if( get32(q+4)!=empty_slot && (key_end>data.length()-strings_offset || value_end>data.length()-strings_offset) )
+            return false;
+    }
+    nbr_keys = keys;
+    nbr_buckets = buckets;
+    nbr_slots = slots;
+    values_present = ((flags&1) != 0);
+    return true;
+}
+
+bool HashedList::find( const char *const *pieces, const size_t *lens, int nbr_pieces,
+                       const char **value, size_t *value_len ) const
+{
+    if( nbr_keys == 0 )
+        return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>( data.c_str() );
+    uint64_t h = hash_pieces( salt, pieces, lens, nbr_pieces );
+    uint32_t seed = get32( p + block_header_size + 4*bucket_for(h,nbr_buckets) );
+    const unsigned char *q = p + block_header_size + 4*nbr_buckets + slot_size*slot_for(h,seed,nbr_slots);
+    uint32_t key_len = get32(q+4);
+    if( key_len == empty_slot )
+        return false;
+    size_t total_len = 0;
+    for( int i=0; i<nbr_pieces; i++ )
+        total_len += lens[i];
+    if( total_len != key_len )
+        return false;
+    const char *strs = data.c_str() + strings_offset;
+    const char *key = strs + get32(q);
+    for( int i=0; i<nbr_pieces; i++ )
+    {
+        if( 0 != memcmp(key,pieces[i],lens[i]) )
+            return false;
+        key += lens[i];
+    }
+    if( value )
+        *value = strs + get32(q+8);
+    if( value_len )
+        *value_len = get32(q+12);
+    return true;
+}
+
+bool HashedList::find( const std::string &key, std::string *value ) const
+{
+    const char *piece = key.c_str();
+    size_t len = key.length();
+    const char *v;
+    size_t vlen;
+    if( !find( &piece, &len, 1, &v, &vlen ) )
+        return false;
+    if( value )
+        value->assign( v, vlen );
+    return true;
+}
+
+//
+//  Compiled list files
+//
+
+bool hashlist_detect( const std::string &fname )
+{
+    std::ifstream in( fname.c_str(), std::ios_base::binary );
+    char buf[sizeof(file_magic)];
+    if( !in || !in.read(buf,sizeof(buf)) )
+        return false;
+    return 0 == memcmp(buf,file_magic,sizeof(buf));
+}
+
+bool hashlist_save( const std::string &fname, const HashedList &tournaments, const HashedList &names )
+{
+    std::ofstream out( fname.c_str(), std::ios_base::binary );
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fname.c_str() );
+        return false;
+    }
+    std::string hdr( file_magic, sizeof(file_magic) );
+    put32( hdr, 2 );
+    put32( hdr, 0 );
+    out.write( hdr.c_str(), hdr.length() );
+    const HashedList *tables[2] = { &tournaments, &names };
+    for( int i=0; i<2; i++ )
+    {
+        std::string len;
+        put64( len, tables[i]->get_data().length() );
+        out.write( len.c_str(), len.length() );
+        out.write( tables[i]->get_data().c_str(), tables[i]->get_data().length() );
+    }
+    return static_cast<bool>(out);
+}
+
+// The whole file is read into memory and used in place, there's no parsing step
+bool hashlist_load( const std::string &fname, HashedList &tournaments, HashedList &names )
+{
+    std::ifstream in( fname.c_str(), std::ios_base::binary );
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s\n", fname.c_str() );
+        return false;
+    }
+    bool ok = true;
+    unsigned char hdr[16];
+    if( !in.read( reinterpret_cast<char *>(hdr), sizeof(hdr) ) || 0!=memcmp(hdr,file_magic,sizeof(file_magic)) || get32(hdr+8)!=2 )
+        ok = false;
+    HashedList *tables[2] = { &tournaments, &names };
+    for( int i=0; ok && i<2; i++ )
+    {
+        unsigned char len_buf[8];
+        ok = static_cast<bool>( in.read( reinterpret_cast<char *>(len_buf), sizeof(len_buf) ) );
+        uint64_t len = ok ? get64(len_buf) : 0;
+        if( ok && len > (1ULL<<32) )
+            ok = false;
+        std::string blob( static_cast<size_t>(len), '\0' );
+        if( ok && len>0 )
+            ok = static_cast<bool>( in.read( &blob[0], blob.length() ) );
+        if( ok )
+            ok = tables[i]->set_data( blob );
+    }
+    if( !ok )
+        printf( "Error; File %s is not a valid compiled list file\n", fname.c_str() );
+    return ok;
+}
@@ -0,0 +1,52 @@
+/*
+
+    Hashed lists of tournaments and player names, for whitelists, blacklists
+    and fixup lists, plus a compiled binary form of such lists
+
+*/
+
+#ifndef HASHLIST_H_INCLUDED
+#define HASHLIST_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A read only set of strings (or map of strings to strings if values are present),
+//  stored as a perfect hash table in a single block of memory. The memory block is
+//  exactly what is written to (and read from) a compiled list file
+class HashedList
+{
+public:
+    HashedList() {}
+    void build( const std::vector<std::string> &keys, const std::vector<std::string> *values=NULL );
+    bool empty() const { return nbr_keys == 0; }
+    size_t size() const { return nbr_keys; }
+    bool has_values() const { return values_present; }
+
+    // Look up a key that is the concatenation of nbr_pieces pieces, so the caller
+    //  need not build the key. If found and values are present, value is set
+    bool find( const char *const *pieces, const size_t *lens, int nbr_pieces,
+               const char **value=NULL, size_t *value_len=NULL ) const;
+    bool find( const std::string &key, std::string *value=NULL ) const;
+
+    // Serialised form
+    const std::string &get_data() const { return data; }
+    bool set_data( std::string &blob );     // takes the blob, returns false if corrupt
+
+private:
+    std::string data;
+    uint32_t nbr_keys=0;
+    uint32_t nbr_buckets=0;
+    uint32_t nbr_slots=0;
+    uint32_t salt=0;
+    bool values_present=false;
+    size_t strings_offset=0;
+};
+
+// Compiled list files hold a tournament list and a player name list
+bool hashlist_detect( const std::string &fname );
+bool hashlist_save( const std::string &fname, const HashedList &tournaments, const HashedList &names );
+bool hashlist_load( const std::string &fname, HashedList &tournaments, HashedList &names );
+
+#endif // HASHLIST_H_INCLUDED
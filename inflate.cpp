@@ -0,0 +1,1665 @@
+/*
+
+    Transparent decoding of compressed input files
+
+    Lichess and TWIC archives arrive compressed. Rather than decompressing them
+    to disk before pgn2line can read them, class InputFile recognises gzip, zip
+    and zstd files by their magic bytes and decodes them on a separate thread.
+    The decoder thread hands over decoded data in 1M chunks through a small
+    queue, so decompression and parsing overlap.
+
+    The DEFLATE decoder (RFC 1951) is self contained, in the spirit of Mark
+    Adler's puff.c, with a table driven fast path for short Huffman codes.
+    gzip (RFC 1952) members, including concatenated members, are verified with
+    their CRC-32. For zip archives all .pgn entries are decoded in turn.
+
+    zstd (RFC 8878) frames are decoded by a second self contained decoder,
+    following the RFC's structure; FSE and Huffman coded literals and
+    sequences, repeat offsets, and the optional XXH64 content checksum. zstd
+    windows can be large (zstd --long), so the window is sized per frame.
+    Dictionaries are not supported.
+
+    bzip2 and xz files are recognised too, but only so that a helpful error
+    message can be given.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "util.h"
+#include "inflate.h"
+
+#define CHUNK_SIZE      (1024*1024)     // decoded data is handed over in chunks of this size
+#define MAX_CHUNKS      8               // decoder thread waits if the reader falls this far behind
+#define WINDOW_SIZE     32768           // DEFLATE back references reach this far
+#define MAX_MATCH       258
+#define FAST_BITS       10              // Huffman codes this long or shorter decode with one lookup
+
+InputFormat detect_input_format( const std::string &fname )
+{
+    std::ifstream in( fname.c_str(), std::ios_base::binary );
+    unsigned char buf[6];
+    memset( buf, 0, sizeof(buf) );
+    in.read( reinterpret_cast<char *>(buf), sizeof(buf) );
+    if( buf[0]==0x1f && buf[1]==0x8b )
+        return input_gzip;
+    if( buf[0]=='P' && buf[1]=='K' && buf[2]==3 && buf[3]==4 )
+        return input_zip;
+    if( buf[0]==0x28 && buf[1]==0xb5 && buf[2]==0x2f && buf[3]==0xfd )
+        return input_zstd;
+    if( buf[0]=='B' && buf[1]=='Z' && buf[2]=='h' )
+        return input_bzip2;
+    if( buf[0]==0xfd && buf[1]=='7' && buf[2]=='z' && buf[3]=='X' && buf[4]=='Z' && buf[5]==0 )
+        return input_xz;
+    return input_plain;
+}
+
+const char *input_format_name( InputFormat fmt )
+{
+    switch( fmt )
+    {
+        case input_gzip:    return "gzip";
+        case input_zip:     return "zip";
+        case input_zstd:    return "zstd";
+        case input_bzip2:   return "bzip2";
+        case input_xz:      return "xz";
+        default:
+        case input_plain:   return "plain";
+    }
+}
+
+static uint32_t crc32_update( uint32_t crc, const unsigned char *p, size_t len )
+{
+    static uint32_t table[256];
+    static bool init;
+    if( !init )
+    {
+        for( uint32_t i=0; i<256; i++ )
+        {
+            uint32_t c = i;
+            for( int k=0; k<8; k++ )
+                c = (c&1) ? (0xedb88320 ^ (c>>1)) : (c>>1);
+            table[i] = c;
+        }
+        init = true;
+    }
+    crc = ~crc;
+    while( len-- )
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc>>8);
+    return ~crc;
+}
+
+//
+//  DecodingBuf, a std::streambuf fed by the decoder thread
+//
+
+class DecodingBuf : public std::streambuf
+{
+public:
+    DecodingBuf( const std::string &fname, InputFormat fmt );
+    ~DecodingBuf();
+    bool push( std::string &chunk );
+    void finish( const std::string &err );
+protected:
+    int_type underflow();
+private:
+    std::string fname;
+    std::mutex mtx;
+    std::condition_variable cv_data;
+    std::condition_variable cv_space;
+    std::deque<std::string> chunks;
+    std::string current;
+    bool finished=false;
+    bool abandon=false;
+    std::string error;
+    std::thread worker;
+};
+
+//
+//  Decoder, runs on the worker thread
+//
+
+struct Huffman
+{
+    uint16_t count[16];
+    uint16_t symbol[320];
+    int16_t  fast[1<<FAST_BITS];    // (length<<9)|symbol, or -1 if code is longer than FAST_BITS
+    bool build( const uint8_t *lengths, int n );
+};
+
+bool Huffman::build( const uint8_t *lengths, int n )
+{
+    memset( count, 0, sizeof(count) );
+    for( int i=0; i<n; i++ )
+        count[lengths[i]]++;
+    count[0] = 0;
+    int left = 1;
+    for( int len=1; len<16; len++ )
+    {
+        left <<= 1;
+        left -= count[len];
+        if( left < 0 )
+            return false;   // over-subscribed
+    }
+    uint16_t offs[16];
+    offs[1] = 0;
+    for( int len=1; len<15; len++ )
+        offs[len+1] = offs[len] + count[len];
+    for( int i=0; i<n; i++ )
+    {
+        if( lengths[i] )
+            symbol[offs[lengths[i]]++] = static_cast<uint16_t>(i);
+    }
+    for( int i=0; i<(1<<FAST_BITS); i++ )
+        fast[i] = -1;
+    int code=0, k=0;
+    for( int len=1; len<=FAST_BITS; len++ )
+    {
+        for( int j=0; j<count[len]; j++ )
+        {
+            int rev = 0;    // codes are packed starting with the most significant bit
+            for( int b=0; b<len; b++ )
+                rev |= ((code>>b)&1) << (len-1-b);
+            for( int fill=rev; fill<(1<<FAST_BITS); fill+=(1<<len) )
+                fast[fill] = static_cast<int16_t>( (len<<9) | symbol[k] );
+            code++;
+            k++;
+        }
+        code <<= 1;
+    }
+    return true;
+}
+
+static const uint16_t length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const uint8_t  length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const uint16_t dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const uint8_t  dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+class Decoder
+{
+public:
+    Decoder( std::ifstream &in, DecodingBuf *sink ) : in(in), sink(sink), window(CHUNK_SIZE+WINDOW_SIZE+MAX_MATCH) {}
+    bool decode_gzip();
+    bool decode_zip();
+    std::string error;
+
+private:
+    bool inflate( bool emit, uint32_t &crc, uint64_t &size );
+    bool inflate_block( const Huffman &lencode, const Huffman &distcode );
+    bool dynamic_tables( Huffman &lencode, Huffman &distcode );
+    int  decode( const Huffman &h );
+    void flush( size_t keep );
+
+    // Bit and byte level input
+    int  getc_raw()
+    {
+        if( pos == len )
+        {
+            in.read( reinterpret_cast<char *>(buf), sizeof(buf) );
+            len = static_cast<size_t>( in.gcount() );
+            pos = 0;
+            if( len == 0 )
+                return -1;
+        }
+        return buf[pos++];
+    }
+    void need( int n )
+    {
+        while( bitcnt < n )
+        {
+            int c = getc_raw();
+            if( c < 0 )
+                break;
+            bitbuf |= static_cast<uint64_t>(c) << bitcnt;
+            bitcnt += 8;
+        }
+    }
+    uint32_t bits( int n )
+    {
+        need(n);
+        if( bitcnt < n )
+        {
+            fail( "unexpected end of compressed data" );
+            return 0;
+        }
+        uint32_t v = static_cast<uint32_t>( bitbuf & ((1u<<n)-1) );
+        bitbuf >>= n;
+        bitcnt -= n;
+        return v;
+    }
+    void align()
+    {
+        bitbuf >>= (bitcnt&7);
+        bitcnt -= (bitcnt&7);
+    }
+    int byte()      // byte aligned, returns -1 at end of input
+    {
+        if( bitcnt >= 8 )
+            return static_cast<int>( bits(8) );
+        return getc_raw();
+    }
+    uint32_t u16() { uint32_t lo=bits(8); return lo | (bits(8)<<8); }
+    uint32_t u32() { uint32_t lo=u16(); return lo | (u16()<<16); }
+    void skip( uint64_t n ) { while( n-- && !failed ) bits(8); }
+    void fail( const char *msg ) { if( !failed ) error = msg; failed = true; }
+
+    std::ifstream &in;
+    DecodingBuf *sink;
+    unsigned char buf[65536];
+    size_t pos=0, len=0;
+    uint64_t bitbuf=0;
+    int bitcnt=0;
+    bool failed=false;
+
+    // Output, with the most recent WINDOW_SIZE bytes retained for back references
+    std::vector<unsigned char> window;
+    size_t wpos=0;
+    uint64_t total=0;
+    bool emit=true;
+    uint32_t crc=0;
+};
+
+// Hand over all but the most recent keep bytes of output
+void Decoder::flush( size_t keep )
+{
+    if( wpos <= keep )
+        return;
+    size_t n = wpos-keep;
+    crc = crc32_update( crc, &window[0], n );
+    if( emit && !failed )
+    {
+        std::string chunk( reinterpret_cast<const char *>(&window[0]), n );
+        if( !sink->push(chunk) )
+            fail( "abandoned" );
+    }
+    memmove( &window[0], &window[n], keep );
+    wpos = keep;
+}
+
+int Decoder::decode( const Huffman &h )
+{
+    need( 15 );
+    int e = h.fast[bitbuf & ((1<<FAST_BITS)-1)];
+    if( e>=0 && (e>>9)<=bitcnt )
+    {
+        bitbuf >>= (e>>9);
+        bitcnt -= (e>>9);
+        return e & 511;
+    }
+    int code=0, first=0, index=0;
+    for( int len=1; len<16; len++ )
+    {
+        code |= bits(1);
+        int count = h.count[len];
+        if( code-count < first )
+            return h.symbol[index+(code-first)];
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    fail( "invalid Huffman code" );
+    return -1;
+}
+
+bool Decoder::inflate_block( const Huffman &lencode, const Huffman &distcode )
+{
+    while( !failed )
+    {
+        if( wpos >= CHUNK_SIZE+WINDOW_SIZE )
+            flush( WINDOW_SIZE );
+        int sym = decode(lencode);
+        if( sym < 0 )
+            return false;
+        if( sym < 256 )
+        {
+            window[wpos++] = static_cast<unsigned char>(sym);
+            total++;
+        }
+        else if( sym == 256 )
+            return true;
+        else
+        {
+            sym -= 257;
+            if( sym >= 29 )
+            {
+                fail( "invalid length code" );
+                return false;
+            }
+            int length = length_base[sym] + bits(length_extra[sym]);
+            int dsym = decode(distcode);
+            if( dsym<0 || dsym>=30 )
+            {
+                fail( "invalid distance code" );
+                return false;
+            }
+            size_t dist = dist_base[dsym] + bits(dist_extra[dsym]);
+            if( dist > total || dist > wpos )
+            {
+                fail( "distance too far back" );
+                return false;
+            }
+            unsigned char *dst = &window[wpos];
+            const unsigned char *src = dst-dist;
+            for( int i=0; i<length; i++ )   // byte by byte, source and destination can overlap
+                dst[i] = src[i];
+            wpos += length;
+            total += length;
+        }
+    }
+    return false;
+}
+
+bool Decoder::dynamic_tables( Huffman &lencode, Huffman &distcode )
+{
+    static const uint8_t order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+    uint8_t lengths[320];
+    int nlen  = bits(5) + 257;
+    int ndist = bits(5) + 1;
+    int ncode = bits(4) + 4;
+    if( nlen>286 || ndist>30 )
+    {
+        fail( "bad dynamic block counts" );
+        return false;
+    }
+    memset( lengths, 0, sizeof(lengths) );
+    for( int i=0; i<ncode; i++ )
+        lengths[order[i]] = static_cast<uint8_t>( bits(3) );
+    Huffman lencode_lengths;
+    if( !lencode_lengths.build(lengths,19) )
+    {
+        fail( "bad code length code" );
+        return false;
+    }
+    int idx=0;
+    while( idx<nlen+ndist && !failed )
+    {
+        int sym = decode(lencode_lengths);
+        if( sym < 0 )
+            return false;
+        if( sym < 16 )
+            lengths[idx++] = static_cast<uint8_t>(sym);
+        else
+        {
+            uint8_t len=0;
+            int repeat;
+            if( sym == 16 )
+            {
+                if( idx == 0 )
+                {
+                    fail( "repeat with no previous length" );
+                    return false;
+                }
+                len = lengths[idx-1];
+                repeat = 3 + bits(2);
+            }
+            else if( sym == 17 )
+                repeat = 3 + bits(3);
+            else
+                repeat = 11 + bits(7);
+            if( idx+repeat > nlen+ndist )
+            {
+                fail( "too many code lengths" );
+                return false;
+            }
+            while( repeat-- )
+                lengths[idx++] = len;
+        }
+    }
+    if( failed )
+        return false;
+    if( lengths[256] == 0 )
+    {
+        fail( "no end of block code" );
+        return false;
+    }
+    if( !lencode.build(lengths,nlen) || !distcode.build(lengths+nlen,ndist) )
+    {
+        fail( "bad literal/length or distance code" );
+        return false;
+    }
+    return true;
+}
+
+// Decode one complete DEFLATE stream
+bool Decoder::inflate( bool emit_, uint32_t &crc_, uint64_t &size )
+{
+    emit = emit_;
+    crc = 0;
+    total = 0;
+    wpos = 0;
+    static Huffman fixed_lencode, fixed_distcode;
+    static bool fixed_init;
+    if( !fixed_init )
+    {
+        uint8_t lengths[320];
+        int i=0;
+        for( ; i<144; i++ ) lengths[i] = 8;
+        for( ; i<256; i++ ) lengths[i] = 9;
+        for( ; i<280; i++ ) lengths[i] = 7;
+        for( ; i<288; i++ ) lengths[i] = 8;
+        fixed_lencode.build( lengths, 288 );
+        for( i=0; i<30; i++ ) lengths[i] = 5;
+        fixed_distcode.build( lengths, 30 );
+        fixed_init = true;
+    }
+    Huffman lencode, distcode;
+    bool last=false;
+    while( !last && !failed )
+    {
+        last = (bits(1) != 0);
+        int type = bits(2);
+        switch( type )
+        {
+            case 0:
+            {
+                align();
+                uint32_t n  = u16();
+                uint32_t nc = u16();
+                if( n != (~nc & 0xffff) )
+                    fail( "stored block length mismatch" );
+                while( n-- && !failed )
+                {
+                    if( wpos >= CHUNK_SIZE+WINDOW_SIZE )
+                        flush( WINDOW_SIZE );
+                    window[wpos++] = static_cast<unsigned char>( bits(8) );
+                    total++;
+                }
+                break;
+            }
+            case 1:
+                inflate_block( fixed_lencode, fixed_distcode );
+                break;
+            case 2:
+                if( dynamic_tables(lencode,distcode) )
+                    inflate_block( lencode, distcode );
+                break;
+            default:
+                fail( "invalid block type" );
+                break;
+        }
+    }
+    flush( 0 );
+    align();
+    crc_ = crc;
+    size = total;
+    return !failed;
+}
+
+bool Decoder::decode_gzip()
+{
+    bool first = true;
+    while( !failed )
+    {
+        int id1 = byte();
+        if( id1 < 0 && !first )
+            break;  // normal end, after one or more members
+        int id2 = byte();
+        if( id1!=0x1f || id2!=0x8b )
+        {
+            if( first )
+                fail( "not a gzip file" );
+            break;  // tolerate trailing garbage (eg zero padding) after a member
+        }
+        int method = bits(8);
+        int flags  = bits(8);
+        skip( 6 );  // mtime, extra flags, os
+        if( method != 8 )
+        {
+            fail( "unknown gzip compression method" );
+            break;
+        }
+        if( flags & 4 )
+            skip( u16() );
+        if( flags & 8 )
+            while( !failed && bits(8)!=0 ) ;
+        if( flags & 16 )
+            while( !failed && bits(8)!=0 ) ;
+        if( flags & 2 )
+            skip( 2 );
+        uint32_t crc_calc;
+        uint64_t size;
+        if( !inflate(true,crc_calc,size) )
+            break;
+        uint32_t crc_stored = u32();
+        uint32_t isize = u32();
+        if( !failed && (crc_calc!=crc_stored || isize!=static_cast<uint32_t>(size)) )
+            fail( "gzip CRC or length check failed, file is corrupt" );
+        first = false;
+    }
+    return !failed;
+}
+
+bool Decoder::decode_zip()
+{
+    while( !failed )
+    {
+        uint32_t sig = u32();
+        if( failed || sig==0x02014b50 || sig==0x06054b50 )
+            break;  // central directory, no more entries
+        if( sig != 0x04034b50 )
+        {
+            fail( "unexpected zip record" );
+            break;
+        }
+        skip( 2 );  // version
+        uint32_t flags  = u16();
+        uint32_t method = u16();
+        skip( 4 );  // time, date
+        uint32_t crc_stored = u32();
+        uint32_t csize = u32();
+        skip( 4 );  // uncompressed size
+        uint32_t name_len  = u16();
+        uint32_t extra_len = u16();
+        std::string name;
+        for( uint32_t i=0; i<name_len && !failed; i++ )
+            name += static_cast<char>( bits(8) );
+        skip( extra_len );
+        bool wanted = util::suffix( util::tolower(name), ".pgn" );
+        uint32_t crc_calc = 0;
+        uint64_t size;
+        if( method == 8 )
+        {
+            if( !inflate(wanted,crc_calc,size) )
+                break;
+        }
+        else if( method==0 && !(flags&8) )
+        {
+            emit = wanted;
+            crc = 0;
+            wpos = 0;
+            for( uint32_t i=0; i<csize && !failed; i++ )
+            {
+                if( wpos >= CHUNK_SIZE )
+                    flush( 0 );
+                window[wpos++] = static_cast<unsigned char>( bits(8) );
+            }
+            flush( 0 );
+            crc_calc = crc;
+        }
+        else
+        {
+            fail( "unsupported zip compression method" );
+            break;
+        }
+        if( flags & 8 )     // data descriptor, signature is optional
+        {
+            crc_stored = u32();
+            if( crc_stored == 0x08074b50 )
+                crc_stored = u32();
+            skip( 8 );
+        }
+        if( !failed && crc_calc!=crc_stored )
+            fail( "zip CRC check failed, file is corrupt" );
+    }
+    return !failed;
+}
+
+//
+//  ZstdDecoder, a zstd (RFC 8878) decoder, also runs on the worker thread
+//
+
+#define ZSTD_BLOCK_MAX  (128*1024)      // a block never decodes to more than this
+#define ZSTD_WINDOW_MAX (1ull<<31)      // bigger windows (zstd --long=32 or more) are refused
+
+static int highbit( uint64_t v )   // index of the most significant set bit, -1 if none
+{
+    int n = -1;
+    while( v )
+    {
+        v >>= 1;
+        n++;
+    }
+    return n;
+}
+
+// Streaming XXH64, zstd's optional content checksum is its low 32 bits
+class Xxh64
+{
+public:
+    void reset()
+    {
+        v[0] = P1+P2;
+        v[1] = P2;
+        v[2] = 0;
+        v[3] = 0-P1;
+        total = 0;
+        memlen = 0;
+    }
+    void update( const unsigned char *p, size_t n )
+    {
+        total += n;
+        if( memlen > 0 )
+        {
+            size_t k = 32-memlen < n ? 32-memlen : n;
+            memcpy( mem+memlen, p, k );
+            memlen += k;
+            p += k;
+            n -= k;
+            if( memlen < 32 )
+                return;
+            stripe( mem );
+            memlen = 0;
+        }
+        for( ; n>=32; p+=32, n-=32 )
+            stripe( p );
+        memcpy( mem, p, n );
+        memlen = n;
+    }
+    uint64_t digest() const
+    {
+        uint64_t h;
+        if( total >= 32 )
+        {
+            h = rotl(v[0],1) + rotl(v[1],7) + rotl(v[2],12) + rotl(v[3],18);
+            for( int i=0; i<4; i++ )
+                h = (h ^ round(0,v[i]))*P1 + P4;
+        }
+        else
+            h = P5;
+        h += total;
+        const unsigned char *p = mem;
+        size_t n = memlen;
+        for( ; n>=8; p+=8, n-=8 )
+            h = rotl( h^round(0,le(p,8)), 27 )*P1 + P4;
+        if( n >= 4 )
+        {
+            h = rotl( h ^ (le(p,4)*P1), 23 )*P2 + P3;
+            p += 4;
+            n -= 4;
+        }
+        for( ; n>0; p++, n-- )
+            h = rotl( h ^ (*p*P5), 11 )*P1;
+        h ^= h>>33;
+        h *= P2;
+        h ^= h>>29;
+        h *= P3;
+        h ^= h>>32;
+        return h;
+    }
+private:
+    static const uint64_t P1=11400714785074694791ull, P2=14029467366897019727ull, P3=1609587929392839161ull,
+                          P4=9650029242287828579ull, P5=2870177450012600261ull;
+    static uint64_t rotl( uint64_t x, int r ) { return (x<<r) | (x>>(64-r)); }
+    static uint64_t round( uint64_t acc, uint64_t x ) { return rotl(acc+x*P2,31) * P1; }
+    static uint64_t le( const unsigned char *p, int n )
+    {
+        uint64_t x = 0;
+        for( int i=n-1; i>=0; i-- )
+            x = (x<<8) | p[i];
+        return x;
+    }
+    void stripe( const unsigned char *p )
+    {
+        for( int i=0; i<4; i++ )
+            v[i] = round( v[i], le(p+8*i,8) );
+    }
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t memlen;
+};
+
+// zstd's FSE and Huffman coded streams are read backwards, from the end. The last
+//  byte's most significant set bit marks where the stream starts. offset is the
+//  number of bits not yet read, reading past the beginning gives zero bits and makes
+//  it negative, which is how the end of some streams is detected
+struct BackwardBits
+{
+    const unsigned char *src;
+    size_t len;
+    int64_t offset;
+    bool init( const unsigned char *p, size_t n )
+    {
+        src = p;
+        len = n;
+        if( n==0 || p[n-1]==0 )
+            return false;
+        offset = 8*static_cast<int64_t>(n) - 8 + highbit(p[n-1]);
+        return true;
+    }
+    uint32_t read( int n )     // n <= 32
+    {
+        if( n == 0 )
+            return 0;
+        offset -= n;
+        int64_t start = offset;
+        int cnt = n;
+        if( start < 0 )
+        {
+            cnt += static_cast<int>(start);
+            start = 0;
+            if( cnt <= 0 )
+                return 0;
+        }
+        size_t i = static_cast<size_t>(start>>3);
+        uint64_t v = 0;
+        size_t k = (len-i < 8 ? len-i : 8);
+        while( k-- )
+            v = (v<<8) | src[i+k];
+        v = (v >> (start&7)) & ((1ull<<cnt)-1);
+        if( offset < 0 )
+            v <<= -offset;
+        return static_cast<uint32_t>(v);
+    }
+};
+
+// An FSE decoding table
+struct Fse
+{
+    int log=-1;                 // accuracy log, -1 until a table is defined
+    uint8_t  symbol[512];
+    uint8_t  nbits[512];
+    uint16_t base[512];
+    bool build( const int16_t *norm, int max_symbol, int log );
+    bool read( const unsigned char *p, size_t n, size_t &used, int max_log, int max_symbol );
+    void rle( uint8_t sym ) { log=0; symbol[0]=sym; nbits[0]=0; base[0]=0; }
+    uint32_t init( BackwardBits &in ) const { return in.read(log); }
+    uint8_t  decode( uint32_t &state, BackwardBits &in ) const
+    {
+        uint8_t sym = symbol[state];
+        state = base[state] + in.read(nbits[state]);
+        return sym;
+    }
+};
+
+// Spread the symbols over the table, as described by normalised counts (-1 for a
+//  "less than one" probability)
+bool Fse::build( const int16_t *norm, int max_symbol, int log_ )
+{
+    log = log_;
+    int size = 1<<log;
+    int high = size-1;
+    uint16_t next[256];
+    for( int s=0; s<=max_symbol; s++ )
+    {
+        if( norm[s] == -1 )
+        {
+            symbol[high--] = static_cast<uint8_t>(s);
+            next[s] = 1;
+        }
+        else
+            next[s] = static_cast<uint16_t>( norm[s] );
+    }
+    int step = (size>>1) + (size>>3) + 3;
+    int pos = 0;
+    for( int s=0; s<=max_symbol; s++ )
+    {
+        for( int i=0; i<norm[s]; i++ )
+        {
+            symbol[pos] = static_cast<uint8_t>(s);
+            do
+                pos = (pos+step) & (size-1);
+            while( pos > high );
+        }
+    }
+    if( pos != 0 )
+        return false;
+    for( int u=0; u<size; u++ )
+    {
+        uint16_t n = next[symbol[u]]++;
+        int nb = log - highbit(n);
+        nbits[u] = static_cast<uint8_t>(nb);
+        base[u] = static_cast<uint16_t>( (n<<nb) - size );
+    }
+    return true;
+}
+
+// Read a table description (a forward bit stream) and build the table, used is set
+//  to the number of bytes the description occupies
+bool Fse::read( const unsigned char *p, size_t n, size_t &used, int max_log, int max_symbol )
+{
+    uint64_t bitpos = 0;
+    auto peek = [&]( int nb ) -> uint32_t
+    {
+        uint32_t v = 0;
+        for( int b=nb-1; b>=0; b-- )
+        {
+            uint64_t at = bitpos+b;
+            int bit = (at>>3) < n ? (p[at>>3]>>(at&7)) & 1 : 0;
+            v = (v<<1) | bit;
+        }
+        return v;
+    };
+    if( n == 0 )
+        return false;
+    int log_ = (p[0]&15) + 5;
+    bitpos = 4;
+    if( log_ > max_log )
+        return false;
+    int16_t norm[256];
+    memset( norm, 0, sizeof(norm) );
+    int remaining = (1<<log_) + 1;
+    int threshold = 1<<log_;
+    int nb = log_+1;
+    int s = 0;
+    bool prev0 = false;
+    while( remaining>1 && s<=max_symbol )
+    {
+        if( prev0 )     // a zero count is followed by 2 bit repeat counts of further zeroes
+        {
+            uint32_t r;
+            do
+            {
+                r = peek(2);
+                bitpos += 2;
+                s += r;
+            } while( r == 3 );
+            prev0 = false;
+            continue;
+        }
+        int max = (2*threshold-1) - remaining;
+        int v = static_cast<int>( peek(nb) );
+        int count;
+        if( (v & (threshold-1)) < max )
+        {
+            count = v & (threshold-1);
+            bitpos += nb-1;
+        }
+        else
+        {
+            count = v & (2*threshold-1);
+            if( count >= threshold )
+                count -= max;
+            bitpos += nb;
+        }
+        count--;
+        remaining -= (count<0 ? -count : count);
+        norm[s++] = static_cast<int16_t>(count);
+        prev0 = (count == 0);
+        while( remaining < threshold )
+        {
+            nb--;
+            threshold >>= 1;
+        }
+    }
+    used = static_cast<size_t>( (bitpos+7)>>3 );
+    if( remaining!=1 || s>max_symbol+1 || used>n )
+        return false;
+    return build( norm, s-1, log_ );
+}
+
+// The Huffman table for literals, indexed by the next max_bits bits of the stream
+struct ZstdHuffman
+{
+    int max_bits=0;             // 0 until a table is defined
+    uint8_t symbol[1<<11];
+    uint8_t nbits[1<<11];
+    bool read( const unsigned char *p, size_t n, size_t &used );
+    bool stream( const unsigned char *p, size_t n, unsigned char *out, size_t count ) const;
+};
+
+// Read a Huffman tree description, the weights of all but the last symbol, either
+//  FSE compressed or 4 bits each
+bool ZstdHuffman::read( const unsigned char *p, size_t n, size_t &used )
+{
+    uint8_t weights[256];
+    int nbr = 0;
+    if( n == 0 )
+        return false;
+    int header = p[0];
+    if( header < 128 )
+    {
+        used = 1+header;
+        if( used > n )
+            return false;
+        Fse fse;
+        size_t desc;
+        if( !fse.read(p+1,header,desc,6,255) )
+            return false;
+        BackwardBits in;
+        if( !in.init(p+1+desc,header-desc) )
+            return false;
+        uint32_t state1 = fse.init(in);     // two interleaved states, decoding until the stream is used up
+        uint32_t state2 = fse.init(in);
+        for(;;)
+        {
+            if( nbr >= 254 )
+                return false;
+            weights[nbr++] = fse.decode(state1,in);
+            if( in.offset < 0 )
+            {
+                weights[nbr++] = fse.symbol[state2];
+                break;
+            }
+            weights[nbr++] = fse.decode(state2,in);
+            if( in.offset < 0 )
+            {
+                weights[nbr++] = fse.symbol[state1];
+                break;
+            }
+        }
+    }
+    else
+    {
+        nbr = header-127;
+        used = 1 + (nbr+1)/2;
+        if( used > n )
+            return false;
+        for( int i=0; i<nbr; i++ )
+            weights[i] = (i&1) ? (p[1+i/2]&15) : (p[1+i/2]>>4);
+    }
+
+    // The last weight is implied, it completes a power of 2
+    uint64_t sum = 0;
+    for( int i=0; i<nbr; i++ )
+    {
+        if( weights[i] > 11 )
+            return false;
+        if( weights[i] > 0 )
+            sum += 1ull << (weights[i]-1);
+    }
+    if( sum == 0 )
+        return false;
+    max_bits = highbit(sum) + 1;
+    uint64_t rest = (1ull<<max_bits) - sum;
+    if( max_bits>11 || (rest & (rest-1)) )
+        return false;
+    weights[nbr++] = static_cast<uint8_t>( highbit(rest) + 1 );
+
+    // Lowest weights (longest codes) first, then in symbol order within each weight
+    int k = 0;
+    for( int w=1; w<=max_bits; w++ )
+    {
+        for( int s=0; s<nbr; s++ )
+        {
+            if( weights[s] != w )
+                continue;
+            for( int i=0; i<(1<<(w-1)); i++ )
+            {
+                symbol[k] = static_cast<uint8_t>(s);
+                nbits[k++] = static_cast<uint8_t>( max_bits+1-w );
+            }
+        }
+    }
+    return k == (1<<max_bits);
+}
+
+// Decode one Huffman coded literals stream of count symbols
+bool ZstdHuffman::stream( const unsigned char *p, size_t n, unsigned char *out, size_t count ) const
+{
+    BackwardBits in;
+    if( !in.init(p,n) )
+        return false;
+    uint32_t mask = (1u<<max_bits) - 1;
+    uint32_t state = in.read(max_bits);
+    for( size_t i=0; i<count; i++ )
+    {
+        out[i] = symbol[state];
+        int nb = nbits[state];
+        state = ((state<<nb) | in.read(nb)) & mask;
+    }
+    return in.offset == -max_bits;
+}
+
+// Sequence code tables, baselines and extra bits
+static const uint32_t ll_base[36] = { 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,18,20,22,24,28,32,40,48,64,128,256,512,
+                                      1024,2048,4096,8192,16384,32768,65536 };
+static const uint8_t  ll_extra[36] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,2,2,3,3,4,6,7,8,9,10,11,12,13,14,15,16 };
+static const uint32_t ml_base[53] = { 3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,
+                                      35,37,39,41,43,47,51,59,67,83,99,131,259,515,1027,2051,4099,8195,16387,32771,65539 };
+static const uint8_t  ml_extra[53] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+                                       1,1,1,1,2,2,3,3,4,4,5,7,8,9,10,11,12,13,14,15,16 };
+
+// Predefined distributions
+static const int16_t ll_default[36] = { 4,3,2,2,2,2,2,2,2,2,2,2,2,1,1,1,2,2,2,2,2,2,2,2,2,3,2,1,1,1,1,1,-1,-1,-1,-1 };
+static const int16_t ml_default[53] = { 1,4,3,2,2,2,2,2,2,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+                                        1,1,1,1,1,1,1,1,1,1,1,1,1,1,-1,-1,-1,-1,-1,-1,-1 };
+static const int16_t of_default[29] = { 1,1,1,1,1,1,2,2,2,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,-1,-1,-1,-1,-1 };
+
+class ZstdDecoder
+{
+public:
+    ZstdDecoder( std::ifstream &in, DecodingBuf *sink ) : in(in), sink(sink) {}
+    bool decode();
+    std::string error;
+
+private:
+    bool frame();
+    bool compressed_block( const unsigned char *p, size_t n );
+    bool literals( const unsigned char *&p, const unsigned char *end );
+    bool sequence_table( int mode, const unsigned char *&p, const unsigned char *end, Fse &table,
+                         const Fse &predefined, int max_log, int max_symbol );
+    void flush( size_t keep );
+    void room();
+
+    // Byte level input
+    bool read( unsigned char *dst, size_t n )
+    {
+        while( n > 0 )
+        {
+            if( pos == len )
+            {
+                in.read( reinterpret_cast<char *>(buf), sizeof(buf) );
+                len = static_cast<size_t>( in.gcount() );
+                pos = 0;
+                if( len == 0 )
+                    return false;
+            }
+            size_t k = (len-pos < n ? len-pos : n);
+            memcpy( dst, buf+pos, k );
+            dst += k;
+            pos += k;
+            n -= k;
+        }
+        return true;
+    }
+    uint64_t le( int n )   // little endian, n bytes
+    {
+        unsigned char b[8];
+        if( !read(b,n) )
+        {
+            fail( "unexpected end of compressed data" );
+            return 0;
+        }
+        uint64_t v = 0;
+        for( int i=n-1; i>=0; i-- )
+            v = (v<<8) | b[i];
+        return v;
+    }
+    void fail( const char *msg ) { if( !failed ) error = msg; failed = true; }
+
+    std::ifstream &in;
+    DecodingBuf *sink;
+    unsigned char buf[65536];
+    size_t pos=0, len=0;
+    bool failed=false;
+
+    // Per frame state, the tables and repeat offsets carry over from block to block
+    ZstdHuffman huffman;
+    Fse ll_table, of_table, ml_table;
+    Fse ll_predefined, of_predefined, ml_predefined;
+    uint64_t rep[3];
+    std::vector<unsigned char> block;
+    std::vector<unsigned char> lits;
+    size_t nbr_lits=0;
+
+    // Output, with the most recent window_size bytes retained for back references
+    std::vector<unsigned char> window;
+    size_t window_size=0;
+    size_t wpos=0;
+    uint64_t total=0;
+    Xxh64 xxh;
+};
+
+// Hand over all but the most recent keep bytes of output
+void ZstdDecoder::flush( size_t keep )
+{
+    if( wpos <= keep )
+        return;
+    size_t n = wpos-keep;
+    xxh.update( &window[0], n );
+    for( size_t i=0; i<n && !failed; i+=CHUNK_SIZE )
+    {
+        std::string chunk( reinterpret_cast<const char *>(&window[i]), n-i < CHUNK_SIZE ? n-i : CHUNK_SIZE );
+        if( !sink->push(chunk) )
+            fail( "abandoned" );
+    }
+    memmove( &window[0], &window[n], keep );
+    wpos = keep;
+}
+
+// Make room for the next block. The window is at least as big again as the history
+//  that's kept, so each byte is moved only about once
+void ZstdDecoder::room()
+{
+    if( wpos+ZSTD_BLOCK_MAX > window.size() )
+        flush( window_size );
+}
+
+bool ZstdDecoder::decode()
+{
+    ll_predefined.build( ll_default, 35, 6 );
+    ml_predefined.build( ml_default, 52, 6 );
+    of_predefined.build( of_default, 28, 5 );
+    bool first = true;
+    while( !failed )
+    {
+        unsigned char b[4];
+        if( !read(b,4) )
+        {
+            if( first )
+                fail( "not a zstd file" );
+            break;  // normal end, after one or more frames
+        }
+        uint32_t magic = b[0] | (b[1]<<8) | (b[2]<<16) | (static_cast<uint32_t>(b[3])<<24);
+        if( (magic&0xfffffff0) == 0x184d2a50 )  // skippable frame
+        {
+            uint64_t n = le(4);
+            while( n>0 && !failed )
+            {
+                unsigned char skip[4096];
+                size_t k = (n < sizeof(skip) ? static_cast<size_t>(n) : sizeof(skip));
+                if( !read(skip,k) )
+                    fail( "unexpected end of compressed data" );
+                n -= k;
+            }
+        }
+        else if( magic == 0xfd2fb528 )
+            frame();
+        else
+        {
+            if( first )
+                fail( "not a zstd file" );
+            break;  // tolerate trailing garbage after a frame, as for gzip
+        }
+        first = false;
+    }
+    return !failed;
+}
+
+bool ZstdDecoder::frame()
+{
+    int descriptor = static_cast<int>( le(1) );
+    int fcs_flag = descriptor>>6;
+    bool single_segment = (descriptor&0x20) != 0;
+    bool checksum = (descriptor&4) != 0;
+    if( descriptor & 8 )
+    {
+        fail( "reserved bit set in zstd frame header" );
+        return false;
+    }
+    uint64_t window_needed = 0;
+    if( !single_segment )
+    {
+        int wd = static_cast<int>( le(1) );
+        uint64_t base = 1ull << (10+(wd>>3));
+        window_needed = base + (base/8)*(wd&7);
+    }
+    static const int dict_id_len[4] = { 0, 1, 2, 4 };
+    if( le(dict_id_len[descriptor&3]) != 0 )
+    {
+        fail( "zstd dictionaries are not supported" );
+        return false;
+    }
+    static const int fcs_len[4] = { 0, 2, 4, 8 };
+    int n = (fcs_flag==0 && single_segment) ? 1 : fcs_len[fcs_flag];
+    uint64_t content_size = le(n);
+    if( n == 2 )
+        content_size += 256;
+    if( single_segment )
+        window_needed = content_size;
+    if( failed )
+        return false;
+    if( window_needed > ZSTD_WINDOW_MAX )
+    {
+        fail( "zstd window size is too large" );
+        return false;
+    }
+
+    // Initialise the per frame state
+    window_size = static_cast<size_t>( window_needed );
+    size_t chunk = (window_size > CHUNK_SIZE ? window_size : CHUNK_SIZE);
+    window.resize( window_size+chunk+ZSTD_BLOCK_MAX );
+    wpos = 0;
+    total = 0;
+    xxh.reset();
+    huffman.max_bits = 0;
+    ll_table.log = of_table.log = ml_table.log = -1;
+    rep[0] = 1;
+    rep[1] = 4;
+    rep[2] = 8;
+
+    bool last = false;
+    while( !last && !failed )
+    {
+        uint32_t header = static_cast<uint32_t>( le(3) );
+        last = (header&1) != 0;
+        int type = (header>>1) & 3;
+        size_t size = header>>3;
+        if( failed )
+            break;
+        if( size > ZSTD_BLOCK_MAX )
+        {
+            fail( "zstd block is too big" );
+            break;
+        }
+        room();
+        switch( type )
+        {
+            case 0:     // raw
+                if( !read(&window[wpos],size) )
+                    fail( "unexpected end of compressed data" );
+                wpos += size;
+                total += size;
+                break;
+            case 1:     // RLE
+            {
+                int c = static_cast<int>( le(1) );
+                memset( &window[wpos], c, size );
+                wpos += size;
+                total += size;
+                break;
+            }
+            case 2:
+                block.resize( size );
+                if( !read(&block[0],size) )
+                    fail( "unexpected end of compressed data" );
+                else
+                    compressed_block( &block[0], size );
+                break;
+            default:
+                fail( "invalid zstd block type" );
+                break;
+        }
+    }
+    flush( 0 );
+    if( checksum )
+    {
+        uint32_t stored = static_cast<uint32_t>( le(4) );
+        if( !failed && stored!=static_cast<uint32_t>(xxh.digest()) )
+            fail( "zstd checksum failed, file is corrupt" );
+    }
+    if( !failed && (fcs_flag!=0 || single_segment) && total!=content_size )
+        fail( "zstd content size check failed, file is corrupt" );
+    return !failed;
+}
+
+// Decode the literals section into lits
+bool ZstdDecoder::literals( const unsigned char *&p, const unsigned char *end )
+{
+    size_t avail = end-p;
+    if( avail < 1 )
+        return false;
+    int type = p[0]&3;
+    int size_format = (p[0]>>2)&3;
+    size_t regenerated, compressed=0, header;
+    int nbr_streams = 1;
+    if( type < 2 )  // raw or RLE
+    {
+        if( size_format==0 || size_format==2 )
+        {
+            header = 1;
+            regenerated = p[0]>>3;
+        }
+        else
+        {
+            header = size_format==1 ? 2 : 3;
+            if( avail < header )
+                return false;
+            regenerated = (p[0]>>4) + (p[1]<<4);
+            if( header == 3 )
+                regenerated += p[2]<<12;
+        }
+    }
+    else            // Huffman compressed, with a new table or the previous one
+    {
+        header = size_format<2 ? 3 : size_format+2;
+        if( avail < header )
+            return false;
+        uint64_t v = 0;
+        for( int i=static_cast<int>(header)-1; i>=0; i-- )
+            v = (v<<8) | p[i];
+        int field = size_format<2 ? 10 : (size_format==2 ? 14 : 18);
+        regenerated = static_cast<size_t>( (v>>4) & ((1u<<field)-1) );
+        compressed  = static_cast<size_t>( (v>>(4+field)) & ((1u<<field)-1) );
+        nbr_streams = size_format==0 ? 1 : 4;
+    }
+    if( regenerated > ZSTD_BLOCK_MAX )
+        return false;
+    p += header;
+    avail -= header;
+    nbr_lits = regenerated;
+    if( type == 0 )
+    {
+        if( avail < regenerated )
+            return false;
+        if( regenerated > 0 )
+            memcpy( &lits[0], p, regenerated );
+        p += regenerated;
+        return true;
+    }
+    if( type == 1 )
+    {
+        if( avail < 1 )
+            return false;
+        memset( &lits[0], *p++, regenerated );
+        return true;
+    }
+    if( avail < compressed )
+        return false;
+    const unsigned char *q = p;
+    size_t n = compressed;
+    p += compressed;
+    if( type == 2 )
+    {
+        size_t used;
+        if( !huffman.read(q,n,used) )
+            return false;
+        q += used;
+        n -= used;
+    }
+    else if( huffman.max_bits == 0 )
+        return false;
+    if( nbr_streams == 1 )
+        return huffman.stream( q, n, &lits[0], regenerated );
+    if( n < 6 )
+        return false;
+    size_t sizes[4];
+    sizes[0] = q[0] | (q[1]<<8);
+    sizes[1] = q[2] | (q[3]<<8);
+    sizes[2] = q[4] | (q[5]<<8);
+    q += 6;
+    n -= 6;
+    if( sizes[0]+sizes[1]+sizes[2] > n )
+        return false;
+    sizes[3] = n - sizes[0]-sizes[1]-sizes[2];
+    size_t segment = (regenerated+3)/4;
+    if( 3*segment > regenerated )
+        return false;
+    for( int i=0; i<4; i++ )
+    {
+        size_t count = (i<3 ? segment : regenerated-3*segment);
+        if( !huffman.stream(q,sizes[i],&lits[i*segment],count) )
+            return false;
+        q += sizes[i];
+    }
+    return true;
+}
+
+bool ZstdDecoder::sequence_table( int mode, const unsigned char *&p, const unsigned char *end, Fse &table,
+                                  const Fse &predefined, int max_log, int max_symbol )
+{
+    switch( mode )
+    {
+        case 0:
+            table = predefined;
+            return true;
+        case 1:
+            if( p>=end || *p>max_symbol )
+                return false;
+            table.rle( *p++ );
+            return true;
+        case 2:
+        {
+            size_t used;
+            if( !table.read(p,end-p,used,max_log,max_symbol) )
+                return false;
+            p += used;
+            return true;
+        }
+        default:    // repeat the previous block's table
+            return table.log >= 0;
+    }
+}
+
+bool ZstdDecoder::compressed_block( const unsigned char *p, size_t n )
+{
+    const unsigned char *end = p+n;
+    lits.resize( ZSTD_BLOCK_MAX );
+    if( !literals(p,end) || p>=end )
+    {
+        fail( "invalid zstd literals section" );
+        return false;
+    }
+
+    // Sequences section header
+    size_t nbr_seq = *p++;
+    if( nbr_seq >= 128 )
+    {
+        if( nbr_seq < 255 )
+        {
+            if( p >= end )
+                nbr_seq = 0;
+            else
+                nbr_seq = ((nbr_seq-128)<<8) + *p++;
+        }
+        else
+        {
+            if( end-p < 2 )
+                nbr_seq = 0;
+            else
+                nbr_seq = p[0] + (p[1]<<8) + 0x7f00;
+            p += 2;
+        }
+    }
+    const unsigned char *lit = &lits[0];
+    const unsigned char *lit_end = lit+nbr_lits;
+    unsigned char *out = &window[wpos];
+    if( nbr_seq > 0 )
+    {
+        if( p >= end )
+        {
+            fail( "invalid zstd sequences section" );
+            return false;
+        }
+        int modes = *p++;
+        if( (modes&3)
+         || !sequence_table( modes>>6, p, end, ll_table, ll_predefined, 9, 35 )
+         || !sequence_table( (modes>>4)&3, p, end, of_table, of_predefined, 8, 31 )
+         || !sequence_table( (modes>>2)&3, p, end, ml_table, ml_predefined, 9, 52 ) )
+        {
+            fail( "invalid zstd sequence tables" );
+            return false;
+        }
+        BackwardBits in;
+        if( !in.init(p,end-p) )
+        {
+            fail( "invalid zstd sequences bitstream" );
+            return false;
+        }
+        uint32_t ll_state = ll_table.init(in);
+        uint32_t of_state = of_table.init(in);
+        uint32_t ml_state = ml_table.init(in);
+        for( size_t i=0; i<nbr_seq; i++ )
+        {
+            int of = of_table.symbol[of_state];
+            int ll = ll_table.symbol[ll_state];
+            int ml = ml_table.symbol[ml_state];
+            if( of>31 || ll>35 || ml>52 )
+            {
+                fail( "invalid zstd sequence code" );
+                return false;
+            }
+            uint64_t offset_value = (1ull<<of) + in.read(of);
+            size_t match_len = ml_base[ml] + in.read(ml_extra[ml]);
+            size_t lit_len   = ll_base[ll] + in.read(ll_extra[ll]);
+            if( i+1 < nbr_seq )
+            {
+                ll_table.decode( ll_state, in );
+                ml_table.decode( ml_state, in );
+                of_table.decode( of_state, in );
+            }
+
+            // Offset values 1 to 3 select a recent offset
+            uint64_t offset;
+            if( offset_value > 3 )
+            {
+                offset = offset_value-3;
+                rep[2] = rep[1];
+                rep[1] = rep[0];
+                rep[0] = offset;
+            }
+            else
+            {
+                int idx = static_cast<int>(offset_value) - 1 + (lit_len==0 ? 1 : 0);
+                if( idx == 0 )
+                    offset = rep[0];
+                else
+                {
+                    offset = (idx<3 ? rep[idx] : rep[0]-1);
+                    if( idx > 1 )
+                        rep[2] = rep[1];
+                    rep[1] = rep[0];
+                    rep[0] = offset;
+                }
+            }
+
+            // Copy the literals, then the match
+            size_t done = out - &window[wpos];
+            if( lit_len>static_cast<size_t>(lit_end-lit) || done+lit_len+match_len>ZSTD_BLOCK_MAX )
+            {
+                fail( "invalid zstd sequence" );
+                return false;
+            }
+            memcpy( out, lit, lit_len );
+            out += lit_len;
+            lit += lit_len;
+            size_t history = out - &window[0];
+            if( offset==0 || offset>history || offset>total+done+lit_len )
+            {
+                fail( "zstd offset too far back" );
+                return false;
+            }
+            const unsigned char *src = out-offset;
+            if( offset >= match_len )
+                memcpy( out, src, match_len );
+            else
+            {
+                for( size_t j=0; j<match_len; j++ )   // byte by byte, source and destination overlap
+                    out[j] = src[j];
+            }
+            out += match_len;
+        }
+        if( in.offset != 0 )
+        {
+            fail( "invalid zstd sequences bitstream" );
+            return false;
+        }
+    }
+    else if( p != end )
+    {
+        fail( "invalid zstd sequences section" );
+        return false;
+    }
+
+    // The remaining literals come last
+    size_t rest = lit_end-lit;
+    if( static_cast<size_t>(out-&window[wpos])+rest > ZSTD_BLOCK_MAX )
+    {
+        fail( "invalid zstd sequence" );
+        return false;
+    }
+    memcpy( out, lit, rest );
+    out += rest;
+    size_t produced = out - &window[wpos];
+    wpos += produced;
+    total += produced;
+    return true;
+}
+
+//
+//  DecodingBuf implementation
+//
+
+DecodingBuf::DecodingBuf( const std::string &fname_, InputFormat fmt ) : fname(fname_)
+{
+    worker = std::thread( [this,fmt]()
+    {
+        std::ifstream in( fname.c_str(), std::ios_base::binary );
+        std::string err;
+        if( !in )
+            err = "cannot open file";
+        else
+        {
+            if( fmt == input_zstd )
+            {
+                ZstdDecoder *decoder = new ZstdDecoder(in,this);
+                if( !decoder->decode() )
+                    err = decoder->error;
+                delete decoder;
+            }
+            else
+            {
+                Decoder *decoder = new Decoder(in,this);   // big, so keep it off the thread's stack
+                bool ok = (fmt==input_zip ? decoder->decode_zip() : decoder->decode_gzip());
+                if( !ok )
+                    err = decoder->error;
+                delete decoder;
+            }
+        }
+        finish( err );
+    } );
+}
+
+DecodingBuf::~DecodingBuf()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        abandon = true;
+    }
+    cv_space.notify_all();
+    worker.join();
+}
+
+// Called by the decoder thread, returns false if the reader has gone away
+bool DecodingBuf::push( std::string &chunk )
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_space.wait( lock, [this]{ return chunks.size()<MAX_CHUNKS || abandon; } );
+    if( abandon )
+        return false;
+    chunks.push_back( std::string() );
+    chunks.back().swap( chunk );
+    cv_data.notify_one();
+    return true;
+}
+
+void DecodingBuf::finish( const std::string &err )
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    finished = true;
+    error = err;
+    cv_data.notify_one();
+}
+
+DecodingBuf::int_type DecodingBuf::underflow()
+{
+    if( gptr() < egptr() )
+        return traits_type::to_int_type(*gptr());
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_data.wait( lock, [this]{ return !chunks.empty() || finished; } );
+    if( chunks.empty() )
+    {
+        if( error!="" && error!="abandoned" )
+        {
+            printf( "Error; File: %s, %s\n", fname.c_str(), error.c_str() );
+            error = "";
+        }
+        return traits_type::eof();
+    }
+    current.swap( chunks.front() );
+    chunks.pop_front();
+    cv_space.notify_one();
+    char *p = &current[0];
+    setg( p, p, p+current.length() );
+    return traits_type::to_int_type(*p);
+}
+
+//
+//  InputFile
+//
+
+InputFile::InputFile( const std::string &fname ) : std::istream(NULL), decoder(NULL)
+{
+    fmt = detect_input_format(fname);
+    if( fmt == input_plain )
+    {
+        plain.open( fname.c_str() );
+        rdbuf( plain.rdbuf() );
+        if( !plain )
+            setstate( std::ios_base::failbit );
+    }
+    else if( fmt==input_gzip || fmt==input_zip || fmt==input_zstd )
+    {
+        decoder = new DecodingBuf( fname, fmt );
+        rdbuf( decoder );
+    }
+    else
+        setstate( std::ios_base::failbit );
+}
+
+InputFile::~InputFile()
+{
+    rdbuf( NULL );
+    delete decoder;
+}
@@ -0,0 +1,45 @@
+/*
+
+    Transparent decoding of compressed input files
+
+*/
+
+#ifndef INFLATE_H_INCLUDED
+#define INFLATE_H_INCLUDED
+
+#include <iostream>
+#include <fstream>
+#include <string>
+
+// Input file formats, recognised by magic bytes rather than file extension
+enum InputFormat
+{
+    input_plain,
+    input_gzip,
+    input_zip,
+    input_zstd,
+    input_bzip2,    // recognised but not supported, user must decompress first
+    input_xz        // ditto
+};
+
+InputFormat detect_input_format( const std::string &fname );
+const char *input_format_name( InputFormat fmt );
+
+class DecodingBuf;
+
+// An input stream for a plain, gzip, zip or zstd text file. Compressed files are decoded
+//  on a separate thread, so decompression overlaps with whatever the reader of the
+//  stream is doing and no intermediate decompressed file is needed
+class InputFile : public std::istream
+{
+public:
+    InputFile( const std::string &fname );
+    ~InputFile();
+    InputFormat format() const { return fmt; }
+private:
+    InputFormat fmt;
+    std::ifstream plain;
+    DecodingBuf *decoder;
+};
+
+#endif // INFLATE_H_INCLUDED
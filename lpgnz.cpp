@@ -0,0 +1,545 @@
+/*
+
+    Compressed LPGN container
+
+    A plain .lpgn file is a text file with one game per line. The compressed
+    container stores the same lines in independently compressed blocks of
+    (by default) 1000 lines, followed by a block index. So any line can be
+    reached by decompressing just one block, and every program in the suite
+    that reads .lpgn files can read the container transparently via class
+    LineReader.
+
+    Layout (all integers little endian);
+
+        Header   "LPGNZ\x01\0\0", u32 lines per block, u32 reserved
+        Block    u32 raw length, u32 stored length, u32 nbr lines, u32 flags,
+                 then stored length bytes of data (flags bit 0 set means
+                 stored uncompressed because compression didn't help)
+        ...
+        Index    for each block; u64 file offset, u64 line number of first line
+        Trailer  u64 nbr blocks, u64 total lines, u64 index offset, "LPGNZEND"
+
+    The codec is a small LZ77 implementation using the well known LZ4 block
+    format, so no external compression library is needed.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "util.h"
+#include "metrics.h"
+#include "lpgnz.h"
+
+static const char header_magic[8]  = { 'L','P','G','N','Z','\x01','\0','\0' };
+static const char trailer_magic[8] = { 'L','P','G','N','Z','E','N','D' };
+static const size_t header_size  = 16;
+static const size_t block_header_size = 16;
+static const size_t trailer_size = 32;
+static const size_t max_block_raw_size = 64*1024*1024;  // flush early for monster lines
+static const size_t plain_chunk_size = 1024*1024;
+
+static void put32( std::string &s, uint32_t v )
+{
+    for( int i=0; i<4; i++ )
+        s += static_cast<char>( (v>>(8*i)) & 0xff );
+}
+
+static void put64( std::string &s, uint64_t v )
+{
+    for( int i=0; i<8; i++ )
+        s += static_cast<char>( (v>>(8*i)) & 0xff );
+}
+
+static uint32_t get32( const char *p )
+{
+    const unsigned char *q = reinterpret_cast<const unsigned char *>(p);
+    return q[0] | (q[1]<<8) | (q[2]<<16) | (static_cast<uint32_t>(q[3])<<24);
+}
+
+static uint64_t get64( const char *p )
+{
+    return get32(p) | (static_cast<uint64_t>(get32(p+4)) << 32);
+}
+
+//
+//  LZ codec
+//
+
+#define LZ_HASH_BITS    16
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+#define LZ_END_LITERALS 5   // final bytes are always literals, simplifies the decoder
+
+static uint32_t lz_read32( const unsigned char *p )
+{
+    uint32_t v;
+    memcpy( &v, p, 4 );
+    return v;
+}
+
+static uint32_t lz_hash( uint32_t v )
+{
+    return (v*2654435761u) >> (32-LZ_HASH_BITS);
+}
+
+static void lz_put_length( std::string &dst, size_t len )
+{
+    while( len >= 255 )
+    {
+        dst += '\xff';
+        len -= 255;
+    }
+    dst += static_cast<char>(len);
+}
+
+static void lz_emit( std::string &dst, const unsigned char *literals, size_t nbr_literals, size_t offset, size_t match_len )
+{
+    size_t ml = match_len ? match_len-LZ_MIN_MATCH : 0;
+    unsigned char token = static_cast<unsigned char>( ((nbr_literals<15?nbr_literals:15)<<4) | (ml<15?ml:15) );
+    dst += static_cast<char>(token);
+    if( nbr_literals >= 15 )
+        lz_put_length( dst, nbr_literals-15 );
+    dst.append( reinterpret_cast<const char *>(literals), nbr_literals );
+    if( match_len )
+    {
+        dst += static_cast<char>( offset & 0xff );
+        dst += static_cast<char>( (offset>>8) & 0xff );
+        if( ml >= 15 )
+            lz_put_length( dst, ml-15 );
+    }
+}
+
+void lz_compress( const char *src, size_t len, std::string &dst )
+{
+    std::vector<uint32_t> table( 1<<LZ_HASH_BITS, 0 );     // local, so callers on different threads don't collide
+    dst.clear();
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(src);
+    size_t anchor=0, pos=0;
+    if( len > LZ_END_LITERALS+LZ_MIN_MATCH+8 )
+    {
+        size_t limit = len - (LZ_END_LITERALS+LZ_MIN_MATCH);
+        while( pos < limit )
+        {
+            uint32_t seq = lz_read32(in+pos);
+            uint32_t h = lz_hash(seq);
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(pos);
+            if( candidate<pos && pos-candidate<=LZ_MAX_OFFSET && lz_read32(in+candidate)==seq )
+            {
+                size_t match_len = LZ_MIN_MATCH;
+                size_t max = len - LZ_END_LITERALS - pos;
+                while( match_len<max && in[candidate+match_len]==in[pos+match_len] )
+                    match_len++;
+                lz_emit( dst, in+anchor, pos-anchor, pos-candidate, match_len );
+                pos += match_len;
+                anchor = pos;
+            }
+            else
+                pos++;
+        }
+    }
+    lz_emit( dst, in+anchor, len-anchor, 0, 0 );
+}
+
+bool lz_decompress( const char *src, size_t len, std::string &dst, size_t expected_len )
+{
+    dst.resize(expected_len);
+    char *out = &dst[0];
+    size_t op=0, ip=0;
+    while( ip < len )
+    {
+        unsigned char token = static_cast<unsigned char>(src[ip++]);
+        size_t nbr_literals = token>>4;
+        if( nbr_literals == 15 )
+        {
+            unsigned char c;
+            do
+            {
+                if( ip >= len )
+                    return false;
+                c = static_cast<unsigned char>(src[ip++]);
+                nbr_literals += c;
+            } while( c == 255 );
+        }
+        if( ip+nbr_literals>len || op+nbr_literals>expected_len )
+            return false;
+        memcpy( out+op, src+ip, nbr_literals );
+        ip += nbr_literals;
+        op += nbr_literals;
+        if( ip == len )
+            break;  // final sequence is literals only
+        if( ip+2 > len )
+            return false;
+        size_t offset = static_cast<unsigned char>(src[ip]) | (static_cast<unsigned char>(src[ip+1])<<8);
+        ip += 2;
+        size_t match_len = token & 0x0f;
+        if( match_len == 15 )
+        {
+            unsigned char c;
+            do
+            {
+                if( ip >= len )
+                    return false;
+                c = static_cast<unsigned char>(src[ip++]);
+                match_len += c;
+            } while( c == 255 );
+        }
+        match_len += LZ_MIN_MATCH;
+        if( offset==0 || offset>op || op+match_len>expected_len )
+            return false;
+        const char *from = out+op-offset;
+        for( size_t i=0; i<match_len; i++ )     // byte by byte, source and destination can overlap
+            out[op+i] = from[i];
+        op += match_len;
+    }
+    return op == expected_len;
+}
+
+bool lpgnz_detect( const std::string &fname )
+{
+    std::ifstream in( fname.c_str(), std::ios_base::binary );
+    char buf[sizeof(header_magic)];
+    if( !in || !in.read(buf,sizeof(buf)) )
+        return false;
+    return 0 == memcmp(buf,header_magic,sizeof(buf));
+}
+
+//
+//  LineReader
+//
+
+bool LineReader::open( const std::string &fname )
+{
+    opened = compressed = eof = have_index = false;
+    total_lines = 0;
+    block.clear();
+    block_offset = 0;
+    index_offsets.clear();
+    index_first_lines.clear();
+    if( in.is_open() )
+        in.close();
+    in.clear();
+    compressed = lpgnz_detect(fname);
+    in.open( fname.c_str(), std::ios_base::binary );
+    if( !in )
+        return false;
+    opened = true;
+    if( compressed )
+    {
+        if( !read_index() )
+        {
+            printf( "Error; File %s is not a complete compressed lpgn file\n", fname.c_str() );
+            opened = false;
+            return false;
+        }
+        in.clear();
+        in.seekg( header_size );
+    }
+    return true;
+}
+
+bool LineReader::read_index()
+{
+    char trailer[trailer_size];
+    in.seekg( 0, std::ios_base::end );
+    uint64_t file_len = static_cast<uint64_t>( in.tellg() );
+    if( file_len < header_size+trailer_size )
+        return false;
+    in.seekg( file_len-trailer_size );
+    if( !in.read(trailer,trailer_size) || 0!=memcmp(trailer+24,trailer_magic,sizeof(trailer_magic)) )
+        return false;
+    uint64_t nbr_blocks   = get64(trailer);
+    total_lines           = get64(trailer+8);
+    uint64_t index_offset = get64(trailer+16);
+    if( index_offset + nbr_blocks*16 + trailer_size != file_len )
+        return false;
+    std::string buf( static_cast<size_t>(nbr_blocks*16), '\0' );
+    in.seekg( index_offset );
+    if( nbr_blocks>0 && !in.read(&buf[0],buf.length()) )
+        return false;
+    for( uint64_t i=0; i<nbr_blocks; i++ )
+    {
+        index_offsets.push_back( get64(buf.c_str()+16*i) );
+        index_first_lines.push_back( get64(buf.c_str()+16*i+8) );
+    }
+    index_offsets.push_back( index_offset );    // sentinel, so we know where blocks end
+    index_first_lines.push_back( total_lines );
+    have_index = true;
+    return true;
+}
+
+// Read and decompress the next block
+bool LineReader::read_block()
+{
+    block.clear();
+    block_offset = 0;
+    uint64_t pos = static_cast<uint64_t>( in.tellg() );
+    if( pos >= index_offsets.back() )
+        return false;
+    char hdr[block_header_size];
+    if( !in.read(hdr,block_header_size) )
+        return false;
+    uint32_t raw_len    = get32(hdr);
+    uint32_t stored_len = get32(hdr+4);
+    uint32_t flags      = get32(hdr+12);
+    std::string stored( stored_len, '\0' );
+    if( stored_len>0 && !in.read(&stored[0],stored_len) )
+        return false;
+    if( flags & 1 )
+        block.swap(stored);
+    else if( !lz_decompress( stored.c_str(), stored.length(), block, raw_len ) )
+    {
+        printf( "Error; Corrupt block in compressed lpgn file\n" );
+        block.clear();
+        return false;
+    }
+    return true;
+}
+
+// Returns the next line as a pointer into the reader's buffer, valid until the next
+//  call. Plain files are read in large binary chunks rather than with std::getline(),
+//  so a caller that only needs part of each line can avoid copying the rest
+bool LineReader::next_line( const char *&line, size_t &len )
+{
+    if( !opened || eof )
+        return false;
+    for(;;)
+    {
+        const char *base = block.c_str();
+        size_t avail = block.length() - block_offset;
+        const char *p = avail>0 ? static_cast<const char *>( memchr(base+block_offset,'\n',avail) ) : NULL;
+        if( p )
+        {
+            line = base+block_offset;
+            len  = p-line;
+            block_offset += len+1;
+            io_counters.lines_read++;
+            io_counters.bytes_read += len+1;
+            if( !compressed && len>0 && line[len-1]=='\r' )
+                len--;  // as if read in text mode
+            return true;
+        }
+        bool more;
+        if( compressed )
+            more = (avail==0 && read_block());
+        else
+        {
+            block.erase( 0, block_offset );
+            block_offset = 0;
+            size_t old_len = block.length();
+            block.resize( old_len + plain_chunk_size );
+            in.read( &block[old_len], plain_chunk_size );
+            block.resize( old_len + static_cast<size_t>(in.gcount()) );
+            more = (block.length() > old_len);
+            avail = old_len;
+        }
+        if( !more )
+        {
+            if( avail == 0 )
+            {
+                eof = true;
+                return false;
+            }
+            line = block.c_str()+block_offset;  // last line, without a newline
+            len  = avail;
+            block_offset = block.length();
+            io_counters.lines_read++;
+            io_counters.bytes_read += len;
+            if( !compressed && len>0 && line[len-1]=='\r' )
+                len--;
+            return true;
+        }
+    }
+}
+
+bool LineReader::getline( std::string &line )
+{
+    const char *p;
+    size_t len;
+    if( !next_line(p,len) )
+        return false;
+    line.assign( p, len );
+    return true;
+}
+
+uint64_t LineReader::nbr_lines()
+{
+    return total_lines;
+}
+
+// Position so that the next getline() returns line line_nbr (first line is line 0)
+bool LineReader::seek_line( uint64_t line_nbr )
+{
+    if( !opened || !compressed || line_nbr>=total_lines )
+        return false;
+    size_t nbr_blocks = index_offsets.size()-1;
+    size_t lo=0, hi=nbr_blocks;   // find last block with first line <= line_nbr
+    while( hi-lo > 1 )
+    {
+        size_t mid = (lo+hi)/2;
+        if( index_first_lines[mid] <= line_nbr )
+            lo = mid;
+        else
+            hi = mid;
+    }
+    in.clear();
+    in.seekg( index_offsets[lo] );
+    eof = false;
+    if( !read_block() )
+        return false;
+    for( uint64_t skip = line_nbr-index_first_lines[lo]; skip>0; skip-- )
+    {
+        size_t end = block.find( '\n', block_offset );
+        if( end == std::string::npos )
+            return false;
+        block_offset = end+1;
+    }
+    return true;
+}
+
+//
+//  LineWriter
+//
+
+bool LineWriter::open( const std::string &fname, bool compress, bool append )
+{
+    close();
+    opened = false;
+    compressed = compress;
+    total_lines = 0;
+    index_offsets.clear();
+    index_first_lines.clear();
+    raw.clear();
+    nbr_lines_in_block = 0;
+
+    // Appending continues in the format of the existing file
+    if( append )
+    {
+        std::ifstream test( fname.c_str() );
+        if( test )
+            compressed = lpgnz_detect(fname);
+    }
+    if( !compressed )
+    {
+        out_plain.open( fname.c_str(), append ? std::ios_base::app : std::ios_base::out );
+        opened = static_cast<bool>(out_plain);
+        return opened;
+    }
+
+    // Append to an existing container by overwriting its index and trailer
+    if( append )
+    {
+        std::ifstream in( fname.c_str(), std::ios_base::binary );
+        in.seekg( 0, std::ios_base::end );
+        uint64_t file_len = static_cast<uint64_t>( in.tellg() );
+        char trailer[trailer_size];
+        in.seekg( file_len>=trailer_size ? file_len-trailer_size : 0 );
+        if( file_len>=header_size+trailer_size && in.read(trailer,trailer_size) &&
+            0==memcmp(trailer+24,trailer_magic,sizeof(trailer_magic)) )
+        {
+            uint64_t nbr_blocks = get64(trailer);
+            total_lines = get64(trailer+8);
+            offset = get64(trailer+16);
+            std::string buf( static_cast<size_t>(nbr_blocks*16), '\0' );
+            in.seekg( offset );
+            if( nbr_blocks>0 )
+                in.read( &buf[0], buf.length() );
+            for( uint64_t i=0; i<nbr_blocks; i++ )
+            {
+                index_offsets.push_back( get64(buf.c_str()+16*i) );
+                index_first_lines.push_back( get64(buf.c_str()+16*i+8) );
+            }
+            in.close();
+            out.open( fname.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::binary );
+            out.seekp( offset );
+            opened = static_cast<bool>(out);
+            return opened;
+        }
+        total_lines = 0;
+    }
+    out.open( fname.c_str(), std::ios_base::out | std::ios_base::trunc | std::ios_base::binary );
+    if( !out )
+        return false;
+    std::string hdr( header_magic, sizeof(header_magic) );
+    put32( hdr, LPGNZ_LINES_PER_BLOCK );
+    put32( hdr, 0 );
+    out.write( hdr.c_str(), hdr.length() );
+    offset = hdr.length();
+    opened = true;
+    return true;
+}
+
+void LineWriter::putline( const std::string &line )
+{
+    io_counters.lines_written++;
+    io_counters.bytes_written += line.length()+1;
+    if( !compressed )
+    {
+        util::putline( out_plain, line );
+        return;
+    }
+    raw += line;
+    raw += '\n';
+    nbr_lines_in_block++;
+    if( nbr_lines_in_block>=LPGNZ_LINES_PER_BLOCK || raw.length()>=max_block_raw_size )
+        flush_block();
+}
+
+void LineWriter::put_utf8_bom()
+{
+    if( !compressed )
+        out_plain.write( "\xef\xbb\xbf", 3 );
+    else
+        raw += "\xef\xbb\xbf";  // becomes part of the first line, just like a plain file
+}
+
+void LineWriter::flush_block()
+{
+    if( nbr_lines_in_block == 0 )
+        return;
+    lz_compress( raw.c_str(), raw.length(), packed );
+    bool stored = (packed.length() >= raw.length());
+    const std::string &data = stored ? raw : packed;
+    std::string hdr;
+    put32( hdr, static_cast<uint32_t>(raw.length()) );
+    put32( hdr, static_cast<uint32_t>(data.length()) );
+    put32( hdr, nbr_lines_in_block );
+    put32( hdr, stored ? 1 : 0 );
+    out.write( hdr.c_str(), hdr.length() );
+    out.write( data.c_str(), data.length() );
+    index_offsets.push_back( offset );
+    index_first_lines.push_back( total_lines );
+    offset += hdr.length() + data.length();
+    total_lines += nbr_lines_in_block;
+    nbr_lines_in_block = 0;
+    raw.clear();
+}
+
+void LineWriter::close()
+{
+    if( !opened )
+        return;
+    opened = false;
+    if( !compressed )
+    {
+        out_plain.close();
+        return;
+    }
+    flush_block();
+    std::string s;
+    for( size_t i=0; i<index_offsets.size(); i++ )
+    {
+        put64( s, index_offsets[i] );
+        put64( s, index_first_lines[i] );
+    }
+    put64( s, index_offsets.size() );
+    put64( s, total_lines );
+    put64( s, offset );
+    s.append( trailer_magic, sizeof(trailer_magic) );
+    out.write( s.c_str(), s.length() );
+    out.close();
+}
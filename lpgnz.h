@@ -0,0 +1,88 @@
+/*
+
+    Compressed LPGN container, plus line reader/writer classes that
+    handle either plain .lpgn or the compressed container transparently
+
+*/
+
+#ifndef LPGNZ_H_INCLUDED
+#define LPGNZ_H_INCLUDED
+
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Default number of lines (games) compressed together as one independent block
+#define LPGNZ_LINES_PER_BLOCK 1000
+
+// Bundled LZ codec (LZ4 style byte oriented format, no external dependencies)
+void lz_compress( const char *src, size_t len, std::string &dst );
+bool lz_decompress( const char *src, size_t len, std::string &dst, size_t expected_len );
+
+// Returns true if file is in the compressed container format
+bool lpgnz_detect( const std::string &fname );
+
+// Read lines from either a plain text file or a compressed container
+class LineReader
+{
+public:
+    LineReader() {}
+    LineReader( const std::string &fname ) { open(fname); }
+    bool open( const std::string &fname );
+    bool getline( std::string &line );
+    bool next_line( const char *&line, size_t &len );  // no copy, valid until next call
+    bool is_open() const { return opened; }
+    bool is_compressed() const { return compressed; }
+    explicit operator bool() const { return opened && !eof; }
+
+    // Random access, compressed container only
+    uint64_t nbr_lines();
+    bool seek_line( uint64_t line_nbr );
+
+private:
+    bool read_block();
+    bool read_index();
+    std::ifstream in;
+    bool opened=false;
+    bool compressed=false;
+    bool eof=false;
+    bool have_index=false;
+    uint64_t total_lines=0;
+    std::vector<uint64_t> index_offsets;
+    std::vector<uint64_t> index_first_lines;
+    std::string block;
+    size_t block_offset=0;
+};
+
+// Write lines either as a plain text file or as a compressed container
+class LineWriter
+{
+public:
+    LineWriter() {}
+    LineWriter( const std::string &fname, bool compress=false, bool append=false ) { open(fname,compress,append); }
+    ~LineWriter() { close(); }
+    bool open( const std::string &fname, bool compress=false, bool append=false );
+    void putline( const std::string &line );
+    void put_utf8_bom();
+    void close();
+    bool is_compressed() const { return compressed; }
+    explicit operator bool() const { return opened; }
+
+private:
+    void flush_block();
+    std::ofstream out_plain;
+    std::fstream out;
+    bool opened=false;
+    bool compressed=false;
+    uint64_t total_lines=0;
+    uint64_t offset=0;
+    std::vector<uint64_t> index_offsets;
+    std::vector<uint64_t> index_first_lines;
+    std::string raw;
+    std::string packed;
+    unsigned int nbr_lines_in_block=0;
+};
+
+#endif // LPGNZ_H_INCLUDED
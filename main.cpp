@@ -22,19 +22,35 @@
     games ready for immediate conversion back into PGN.
 
     Usage:
-     pgn2line [-l] [-z] [-d] [-n] [-r] [-p]
-              [-y year_before] [+y year_after] [-w whitelist | -b blacklist]
-              [-f fixuplist]  input output
+     pgn2line [-l] [-k cache_dir] [-z] [-d|-D] [-n] [-r] [-p] [-B] [-c] [-m existing.lpgn]
+              [-v] [-j] [-t seconds] [-y year_before] [+y year_after]
+              [-w whitelist | -b blacklist] [-f fixuplist]  input output
 
      -l indicates input is a text file that lists input pgn files (else input is a pgn file)
+        (input pgn files can be gzip, zip or zstd compressed, they are decoded on the fly)
+     -k specifies a conversion cache directory (-l only). Each pgn file's converted games are
+        kept there, and files that haven't changed are not converted again next time
      -z indicates don't include zero length games (BYEs are unaffected)
      -Z indicates don't include zero length games, including BYEs
      -d indicates smart game de-duplication (eliminates more dups)
+     -D indicates smart game de-duplication by position, like -d but the moves are replayed
+        so games still match if the moves are written differently (Nbd2 or Nd2, O-O or 0-0)
      -n indicates no sorting or de-duping
 	 -r specifies smart reverse sort - yields most recent games first, smart because higher
         rounds/boards are adjusted to come first both here and in the conventional sort
         order
      -p indicates create a .pgn from output (filename is ".pgn" appended to output)
+     -B indicates create a binary columnar .bpgn from output (".bpgn" appended to output)
+     -c indicates write output (and temporary files) in the compressed .lpgn container format
+     -m merge the games from input into existing.lpgn (previous output of pgn2line, not reverse
+        sorted) to make output. Only the part of existing.lpgn from six months before the
+        earliest new game onwards is re-sorted and de-duped with the new games
+     -v validate games, replaying each game's main line. Games with an illegal move or
+        without a result at the end of the moves go to output-rejects.lpgn instead, with
+        a Rejected tag giving the ply and reason
+     -j write metrics for each stage (time, lines and bytes read and written, memory and
+        temporary disk usage) and counts of games kept and dropped to output-metrics.json
+     -t print a progress line every so many seconds
      -y discard games unless they are played in year_before or earlier
      +y discard games unless they are played in year_after or later
      -w specifies a whitelist list of tournaments, discard games not from these tournaments
@@ -74,6 +90,9 @@
     in the same format as the whitelist/blacklist/fixuplist greatly simplifying preparation of
     such lists.
 
+    And lpgnstats, a program that reports tournaments, players, games per year and results
+    in one pass, looking only at the prefix and headers of each line.
+
     Games are represented on a single line as follows;
 
         Prefix@Hheader1@Hheader2...@Mmoves1@Mmoves2...
@@ -135,9 +154,17 @@
 //#define PLAYERS       // A utility for extracting player names from line file
 //#define DISKSORT      // Just for testing our disksort() 
 //#define WORDSEARCH    // A poor man's grep -w
+//#define LPGNZ         // Convert to and from the compressed .lpgn container
+//#define LPGNSTATS     // Tournaments, players, years and results in a single pass
+//#define FIXUPC        // Compile a whitelist, blacklist or fixuplist for faster loading
+//#define BENCH         // Benchmark each stage of the pipeline with synthetic pgn (link with thc.cpp)
+//#define BPGN          // Convert to and read the binary columnar .bpgn format (link with thc.cpp)
+//#define LPGNM         // Convert .lpgn moves to and from compact one byte moves (link with thc.cpp)
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <assert.h>
 #include <iostream>
@@ -148,32 +175,87 @@
 #include <map>
 #include <set>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <new>
+#include "bpgn.h"
+#include "bquery.h"
+#include "convcache.h"
 #include "disksort.h"
+#include "hashlist.h"
+#include "inflate.h"
+#include "lpgnz.h"
+#include "metrics.h"
+#include "movecode.h"
+#include "pgngen.h"
+#include "sortkey.h"
 #include "util.h"
 
-static bool pgn2line( std::string fin, std::string fout, std::string diag_fout,
+static bool pgn2line( std::string fin, std::string fout, std::string diag_fout, std::string reject_fout,
                         bool &utf8_bom,
                         bool append,
+                        bool compress,
                         bool reverse_order,
                         bool remove_zero_length,
                         bool remove_zero_length_allow_bye,
                         bool remove_unfixed_players_flag,
                         int year_before,
                         int year_after,
-                        const std::set<std::string> &whitelist,
-                        const std::set<std::string> &blacklist,
-                        const std::map<std::string,std::string> &fixups,
-                        const std::map<std::string,std::string> &name_fixups );
+                        const HashedList &whitelist,
+                        const HashedList &blacklist,
+                        const HashedList &fixups,
+                        const HashedList &name_fixups,
+                        EventSiteIds *event_site_ids );
 static void line2pgn( std::string fin, std::string fout );
 static void tournaments( std::string fin, std::string fout, bool bare=false );
 static void players( std::string fin, std::string fout, bool bare, bool dups_only );
 static bool read_tournament_list( std::string fin, std::vector<std::string> &tournaments, std::vector<std::string> *names=NULL  );
+static bool read_hashed_list( std::string fin, bool fixup, HashedList &tournaments, HashedList *names=NULL );
 static bool test_date_format( const std::string &date, char separator );
 static bool parse_date_format( const std::string &date, char separator, int &yyyy, int &mm, int &dd );
-static bool refine_sort( std::string fin, std::string fout );
+static bool refine_sort( std::string fin, std::string fout, bool compress, bool final_output, bool add_utf8_bom_to_output, std::ofstream *p_smart_uniq, bool append=false );
 static void word_search( bool case_insignificant, std::string word, std::string fin, std::string fout );
-static void remove_tie_breaker_and_dups( std::string fin, std::string fout, bool add_utf8_bom_to_output, std::ofstream *p_smart_uniq, bool no_deduping_at_all=false );
-static void postponed_dedup_filter( bool flush, const std::string &line, std::ofstream &out, std::ofstream *p_smart_uniq );
+static void remove_sort_keys_and_dups( std::string fin, std::string fout, bool add_utf8_bom_to_output, std::ofstream *p_smart_uniq, bool no_deduping_at_all=false, bool compress=false );
+static void set_game_count( uint64_t game_count );
+static bool merge_cutoff( std::string fin, std::string &cutoff );
+static bool split_existing_lpgn( std::string fin, const std::string &cutoff, std::string fout, std::string keyed_fout, bool compress, EventSiteIds &event_site_ids );
+static bool append_cached_games( std::string fin, std::string fout, bool append, bool compress, EventSiteIds &event_site_ids, uint64_t &tie_breaker, bool &utf8_bom );
+static uint64_t append_text_file( std::string fin, std::string fout );
+static void postponed_dedup_filter( bool flush, const std::string &line, const std::string &day, uint64_t fingerprint, LineWriter &out, std::ofstream *p_smart_uniq );
+static void lpgnz( bool decompress, std::string fin, std::string fout, long first_line=-1, long nbr_lines=0 );
+static void lpgnm( bool expand, bool compress, std::string fin, std::string fout );
+static void lpgnstats( std::string fin, std::string fout );
+static void bpgn_info( std::string fin );
+static void bpgn_columns( std::string columns, std::string fin, std::string fout );
+static void bpgn_query_file( std::string query, std::string fin, std::string fout );
+#ifdef BENCH
+static void bench( const PgnGenConfig &config, std::string prefix, bool keep );
+#endif
+
+// Games kept and dropped by pgn2line's filters and de-duplication (see -j), games
+//  from the conversion cache were counted when they were converted
+struct GameCounts
+{
+    uint64_t read=0;
+    uint64_t kept=0;
+    uint64_t dropped_year=0;
+    uint64_t dropped_zero_length=0;
+    uint64_t dropped_players_not_fixed=0;
+    uint64_t dropped_whitelist=0;
+    uint64_t dropped_blacklist=0;
+    uint64_t rejected=0;
+    uint64_t from_cache=0;
+    uint64_t dedup_exact=0;
+    uint64_t dedup_smart=0;
+};
+static GameCounts game_counts;
+
+// Smart dedup (-d) compares the moves of games as text, -D replays them and compares
+//  the positions reached instead
+static bool smart_uniq_by_position = false;
 
 #ifdef _DEBUG   // for debugging / testing
 #define remove(filename)    do { remove_nulled_out(filename); } while(false)
@@ -320,22 +402,298 @@ int main( int argc, const char *argv[] )
     return 0;
 #endif
 
+#ifdef LPGNZ
+    int arg_idx=1;
+    bool decompress=false;
+    long first_line=-1, nbr_lines=0;
+    bool ok = true;
+    while( ok && argc>3 )
+    {
+        if( std::string(argv[arg_idx]) == "-d" )
+            decompress = true;
+        else if( std::string(argv[arg_idx]) == "-x" && argc>5 )
+        {
+            decompress = true;
+            first_line = atol(argv[arg_idx+1]);
+            nbr_lines  = atol(argv[arg_idx+2]);
+            ok = (first_line>=1 && nbr_lines>=1);
+            argc -= 2;
+            arg_idx += 2;
+        }
+        else
+            break;
+        argc--;
+        arg_idx++;
+    }
+    if( argc != 3 )
+        ok = false;
+    if( !ok )
+    {
+        printf(
+            "lpgnz V3.04 (from Github.com/billforsternz/pgn2line)\n"
+            "Convert .lpgn files to and from the compressed .lpgn container format\n"
+            "Usage:\n"
+            " lpgnz [-d] [-x first_line nbr_lines] input output\n"
+            "\n"
+            "Without flags input is a plain .lpgn file, output is compressed\n"
+            "-d requests decompression, input is compressed, output is a plain .lpgn file\n"
+            "-x requests decompression of nbr_lines lines starting at line first_line\n"
+            "   (the first line is line 1), only the blocks needed are decompressed\n"
+            "\n"
+            "Companion programs line2pgn, wordsearch, tournaments, players and pgn2line\n"
+            "all read compressed files transparently, pgn2line -c creates them\n"
+        );
+        return -1;
+    }
+    std::string fin(argv[arg_idx]);
+    std::string fout(argv[arg_idx+1]);
+    if( fin == fout )
+    {
+        printf( "Error: input and output filenames are the same.\n" );
+        return -1;
+    }
+    lpgnz( decompress, fin, fout, first_line, nbr_lines );
+    return 0;
+#endif
+
+#ifdef LPGNM
+    int arg_idx=1;
+    bool expand=false;
+    bool compress=false;
+    while( argc>3 )
+    {
+        if( std::string(argv[arg_idx]) == "-d" )
+            expand = true;
+        else if( std::string(argv[arg_idx]) == "-c" )
+            compress = true;
+        else
+            break;
+        argc--;
+        arg_idx++;
+    }
+    if( argc != 3 )
+    {
+        printf(
+            "lpgnm V3.04 (from Github.com/billforsternz/pgn2line)\n"
+            "Convert the moves of .lpgn files to and from compact moves, one byte per move\n"
+            "Usage:\n"
+            " lpgnm [-d] [-c] input output\n"
+            "\n"
+            "Without flags the moves of each game in input are compacted. Each main line\n"
+            "move is stored as its index in the list of legal moves, comments, variations\n"
+            "and NAGs are kept. Games with moves that can't be read are left as they are\n"
+            "-d requests expansion of compacted moves back to PGN movetext, with standard\n"
+            "   SAN moves and move numbers\n"
+            "-c indicates write output in the compressed .lpgn container format\n"
+            "\n"
+            "Compacted .lpgn files are for archiving, other programs need expanded files\n"
+        );
+        return -1;
+    }
+    std::string fin(argv[arg_idx]);
+    std::string fout(argv[arg_idx+1]);
+    if( fin == fout )
+    {
+        printf( "Error: input and output filenames are the same.\n" );
+        return -1;
+    }
+    lpgnm( expand, compress, fin, fout );
+    return 0;
+#endif
+
+#ifdef LPGNSTATS
+    if( argc<2 || argc>3 )
+    {
+        printf(
+            "lpgnstats V3.04 (from Github.com/billforsternz/pgn2line)\n"
+            "Report on files created by pgn2line in a single pass\n"
+            "Usage:\n"
+            " lpgnstats input.lpgn [output.txt]\n"
+            "\n"
+            "Report comprises the tournament list (as per program tournaments), player\n"
+            "names and counts (as per program players), games per year and results\n"
+        );
+        return -1;
+    }
+    lpgnstats( argv[1], argc==2?"":argv[2] );
+    return 0;
+#endif
+
+#ifdef BPGN
+    bool ok = (argc==3 && argv[1][0]!='-') ||
+              (argc==3 && std::string(argv[1])=="-i") ||
+              ((argc==4 || argc==5) && std::string(argv[1])=="-c") ||
+              ((argc==4 || argc==5) && std::string(argv[1])=="-q");
+    if( !ok )
+    {
+        printf(
+            "bpgn V3.04 (from Github.com/billforsternz/pgn2line)\n"
+            "Convert files created by pgn2line to the binary columnar .bpgn format,\n"
+            "read columns back and run queries\n"
+            "Usage:\n"
+            " bpgn input.lpgn output.bpgn\n"
+            " bpgn -i input.bpgn\n"
+            " bpgn -c column[,column...] input.bpgn [output.txt]\n"
+            " bpgn -q query input.bpgn [output.txt]\n"
+            "\n"
+            "-i lists the columns\n"
+            "-c writes the named columns, one line per game with tab separated columns\n"
+            "   (only those columns are read). Columns are line, tournament_date, date,\n"
+            "   event, site, round, white, black, result, white_elo, black_elo,\n"
+            "   white_fide_id, black_fide_id, white_fed, black_fed, eco, flags,\n"
+            "   extra_tags and moves\n"
+            "-q runs a query, reading only the columns it needs, for example\n"
+            "   bpgn -q \"count by year,white_fed where year>=2000\" input.bpgn\n"
+            "   bpgn -q \"count,avg(white_elo) by event where event~olympiad\" input.bpgn\n"
+            "   query is aggregate[,aggregate...] [by column[,column...]] [where condition...]\n"
+            "   aggregates are count, sum(column), avg(column), min(column), max(column)\n"
+            "   conditions are column op value, op is one of = != < <= > >= ~ (contains)\n"
+            "   extra columns year, month, tournament_year and plies can be used too\n"
+            "\n"
+            "pgn2line -B also writes a .bpgn file (\".bpgn\" appended to output)\n"
+        );
+        return -1;
+    }
+    if( std::string(argv[1]) == "-i" )
+        bpgn_info( argv[2] );
+    else if( std::string(argv[1]) == "-c" )
+        bpgn_columns( argv[2], argv[3], argc==5?argv[4]:"" );
+    else if( std::string(argv[1]) == "-q" )
+        bpgn_query_file( argv[2], argv[3], argc==5?argv[4]:"" );
+    else if( !lpgn_to_bpgn( argv[1], argv[2] ) )
+        return -1;
+    return 0;
+#endif
+
+#ifdef BENCH
+    PgnGenConfig config;
+    bool keep = false;
+    bool ok = true;
+    int arg_idx=1;
+    while( ok && argc>1 )
+    {
+        std::string arg(argv[arg_idx]);
+        if( arg == "-c" )
+            config.clock_comments = true;
+        else if( arg == "-k" )
+            keep = true;
+        else if( argc>2 && arg.length()==2 && arg[0]=='-' && strchr("nsatyfdp",arg[1]) )
+        {
+            const char *value = argv[arg_idx+1];
+            switch( arg[1] )
+            {
+                case 'n': config.nbr_games = atol(value);               break;
+                case 's': config.seed = strtoull(value,NULL,10);        break;
+                case 'a': config.comment_density = atof(value);         break;
+                case 't': config.games_per_tournament = atoi(value);    break;
+                case 'y': config.nbr_years = atoi(value);               break;
+                case 'f': config.first_year = atoi(value);              break;
+                case 'd': config.duplicate_rate = atof(value);          break;
+                case 'p': config.max_plies = atoi(value);               break;
+            }
+            argc--;
+            arg_idx++;
+        }
+        else
+            break;
+        argc--;
+        arg_idx++;
+    }
+    if( argc > 2 || (argc==2 && argv[arg_idx][0]=='-') )
+        ok = false;
+    if( !ok )
+    {
+        printf(
+            "bench V3.04 (from Github.com/billforsternz/pgn2line)\n"
+            "Generate a synthetic pgn file, then time each stage of the pgn2line pipeline\n"
+            "(and utilities line2pgn, wordsearch and tournaments) in isolation\n"
+            "Usage:\n"
+            " bench [-n games] [-t games_per_tournament] [-f first_year] [-y years]\n"
+            "       [-a comment_density] [-d duplicate_rate] [-p max_plies] [-c]\n"
+            "       [-s seed] [-k] [prefix]\n"
+            "\n"
+            "-c adds lichess style clock comments after every move\n"
+            "-k keeps the generated and output files (named prefix.pgn etc.)\n"
+            "Defaults are 10000 games, 50 games per tournament, 20 years from 2000,\n"
+            "comment density 0.05 (per move), duplicate rate 0.02, 120 plies max, seed 1\n"
+            "and prefix \"bench\". Reported for each stage are wall and CPU time, MB/s\n"
+            "of input, games/s, memory allocations and process peak memory so far\n"
+        );
+        return -1;
+    }
+    bench( config, argc==2 ? argv[arg_idx] : "bench", keep );
+    return 0;
+#endif
+
+#ifdef FIXUPC
+    int arg_idx=1;
+    bool fixup=false;
+    if( argc>1 && std::string(argv[1]) == "-f" )
+    {
+        fixup = true;
+        argc--;
+        arg_idx=2;
+    }
+    if( argc != 3 )
+    {
+        printf(
+            "fixupc V3.04 (from Github.com/billforsternz/pgn2line)\n"
+            "Compile a whitelist, blacklist or fixuplist into a binary hash table file.\n"
+            "pgn2line accepts compiled files with its -w, -b and -f options and loads\n"
+            "them much faster than the original text files, which matters for big lists\n"
+            "Usage:\n"
+            " fixupc [-f] input.txt output\n"
+            "\n"
+            "-f indicates input is a fixuplist (otherwise a whitelist or blacklist)\n"
+        );
+        return -1;
+    }
+    std::string fin(argv[arg_idx]);
+    std::string fout(argv[arg_idx+1]);
+    if( fin == fout )
+    {
+        printf( "Error: input and output filenames are the same.\n" );
+        return -1;
+    }
+    HashedList tournaments;
+    HashedList names;
+    if( !read_hashed_list( fin, fixup, tournaments, &names ) )
+        return -1;
+    if( !hashlist_save( fout, tournaments, names ) )
+        return -1;
+    printf( "%u tournament%s, %u player name%s compiled\n",
+            (unsigned)tournaments.size(), tournaments.size()==1?"":"s",
+            (unsigned)names.size(), names.size()==1?"":"s" );
+    return 0;
+#endif
+
 #ifdef PGN2LINE
     // Command line processing
+    int argc_original = argc;
     bool remove_zero_length = false;
     bool remove_zero_length_allow_bye = false;
     bool list_flag = false;
     bool reverse_flag = false;
     bool pgn_create_flag = false;
+    bool bpgn_create_flag = false;
     bool remove_unfixed_players_flag = false;
     bool whitelist_flag = false;
     bool smart_uniq = false;
     bool no_sort = false;
+    bool compress = false;
     std::string whitelist_file;
     bool blacklist_flag = false;
     std::string blacklist_file;
     bool fixup_flag = false;
     std::string fixup_file;
+    bool merge_flag = false;
+    std::string merge_file;
+    bool cache_flag = false;
+    int nbr_cache_errors = 0;
+    std::string cache_dir;
+    bool metrics_flag = false;
+    bool validate_flag = false;
+    double progress_seconds = 0.0;
     bool ok = true;
 
     // Unless one or both of these are set on the command line
@@ -362,12 +720,40 @@ int main( int argc, const char *argv[] )
             remove_zero_length_allow_bye = true;
         else if( std::string(argv[arg_idx]) == "-d" )
             smart_uniq = true;
+        else if( std::string(argv[arg_idx]) == "-D" )
+        {
+            smart_uniq = true;
+            smart_uniq_by_position = true;
+        }
         else if( std::string(argv[arg_idx]) == "-n" )
             no_sort = true;
         else if( std::string(argv[arg_idx]) == "-p" )
             pgn_create_flag = true;
+        else if( std::string(argv[arg_idx]) == "-B" )
+            bpgn_create_flag = true;
+        else if( std::string(argv[arg_idx]) == "-c" )
+            compress = true;
         else if( std::string(argv[arg_idx]) == "-2" )
             remove_unfixed_players_flag = true;
+        else if( std::string(argv[arg_idx]) == "-j" )
+            metrics_flag = true;
+        else if( std::string(argv[arg_idx]) == "-v" )
+            validate_flag = true;
+        else if( util::prefix( std::string(argv[arg_idx]),"-t") )
+        {
+            if( std::string(argv[arg_idx]) == "-t" )
+            {
+                argc--;
+                arg_idx++;
+                progress_seconds = atof(argv[arg_idx]);
+            }
+            else
+            {
+                progress_seconds = atof(argv[arg_idx]+2);
+            }
+            if( progress_seconds <= 0.0 )
+                ok = false;
+        }
         else if( util::prefix( std::string(argv[arg_idx]),"-f") )
         {
             fixup_flag = true;
@@ -382,6 +768,34 @@ int main( int argc, const char *argv[] )
                 fixup_file = std::string(argv[arg_idx]).substr(2);
             }
         }
+        else if( util::prefix( std::string(argv[arg_idx]),"-k") )
+        {
+            cache_flag = true;
+            if( std::string(argv[arg_idx]) == "-k" )
+            {
+                argc--;
+                arg_idx++;
+                cache_dir = std::string(argv[arg_idx]);
+            }
+            else
+            {
+                cache_dir = std::string(argv[arg_idx]).substr(2);
+            }
+        }
+        else if( util::prefix( std::string(argv[arg_idx]),"-m") )
+        {
+            merge_flag = true;
+            if( std::string(argv[arg_idx]) == "-m" )
+            {
+                argc--;
+                arg_idx++;
+                merge_file = std::string(argv[arg_idx]);
+            }
+            else
+            {
+                merge_file = std::string(argv[arg_idx]).substr(2);
+            }
+        }
         else if( util::prefix( std::string(argv[arg_idx]),"-w") )
         {
             whitelist_flag = true;
@@ -447,22 +861,38 @@ int main( int argc, const char *argv[] )
     }
     if( argc != 3 )
         ok = false;
-    if( !ok || (whitelist_flag&&blacklist_flag) )
+    if( !ok || (whitelist_flag&&blacklist_flag) || (merge_flag&&(reverse_flag||no_sort)) || (cache_flag&&!list_flag) )
     {
 /*
-     pgn2line [-l] [-z] [-d] [-n] [-r] [-p]
-              [-y year_before] [+y year_after] [-w whitelist | -b blacklist]
-              [-f fixuplist]  input output
+     pgn2line [-l] [-k cache_dir] [-z] [-d|-D] [-n] [-r] [-p] [-B] [-c] [-m existing.lpgn]
+              [-v] [-j] [-t seconds] [-y year_before] [+y year_after]
+              [-w whitelist | -b blacklist] [-f fixuplist]  input output
 
      -l indicates input is a text file that lists input pgn files (else input is a pgn file)
+        (input pgn files can be gzip, zip or zstd compressed, they are decoded on the fly)
+     -k specifies a conversion cache directory (-l only). Each pgn file's converted games are
+        kept there, and files that haven't changed are not converted again next time
      -z indicates don't include zero length games (BYEs are unaffected)
      -Z indicates don't include zero length games, including BYEs
      -d indicates smart game de-duplication (eliminates more dups)
+     -D indicates smart game de-duplication by position, like -d but the moves are replayed
+        so games still match if the moves are written differently (Nbd2 or Nd2, O-O or 0-0)
      -n indicates no sorting or de-duping
 	 -r specifies smart reverse sort - yields most recent games first, smart because higher
         rounds/boards are adjusted to come first both here and in the conventional sort
         order
      -p indicates create a .pgn from output (filename is ".pgn" appended to output)
+     -B indicates create a binary columnar .bpgn from output (".bpgn" appended to output)
+     -c indicates write output (and temporary files) in the compressed .lpgn container format
+     -m merge the games from input into existing.lpgn (previous output of pgn2line, not reverse
+        sorted) to make output. Only the part of existing.lpgn from six months before the
+        earliest new game onwards is re-sorted and de-duped with the new games
+     -v validate games, replaying each game's main line. Games with an illegal move or
+        without a result at the end of the moves go to output-rejects.lpgn instead, with
+        a Rejected tag giving the ply and reason
+     -j write metrics for each stage (time, lines and bytes read and written, memory and
+        temporary disk usage) and counts of games kept and dropped to output-metrics.json
+     -t print a progress line every so many seconds
      -y discard games unless they are played in year_before or earlier
      +y discard games unless they are played in year_after or later
      -w specifies a whitelist list of tournaments, discard games not from these tournaments
@@ -478,21 +908,44 @@ int main( int argc, const char *argv[] )
         "Convert pgn file(s) to an intermediate format, one line per game, sorted\n"
         "\n"
         "Usage:\n"
-        " pgn2line [-l] [-z] [-d] [-n] [-r] [-p] [-y year_before] [+y year_after]\n"
-        "          [-w whitelist | -b blacklist]\n"
-        "          [-f fixuplist] input output.lpgn\n"
+        " pgn2line [-l] [-k cache_dir] [-z] [-d|-D] [-n] [-r] [-p] [-B] [-c]\n"
+        "          [-m existing.lpgn]\n"
+        "          [-v] [-j] [-t seconds] [-y year_before] [+y year_after]\n"
+        "          [-w whitelist | -b blacklist] [-f fixuplist] input output.lpgn\n"
         "\n"
         "-l indicates input is a text file that lists input pgn files\n"
         "   (otherwise input is a single pgn file)\n"
+        "   (input pgn files can be gzip (.gz), zip (.zip) or zstd (.zst) compressed)\n"
+        "-k specifies a conversion cache directory (-l only, the directory must\n"
+        "   exist). Each pgn file's converted games are kept there, and files that\n"
+        "   haven't changed are not converted again next time\n"
         "-z indicates don't include zero length games (BYEs are unaffected)\n"
         "-Z indicates don't include zero length games, including BYEs\n"
         "-d indicates smart game de-duplication (eliminates more dups)\n"
+        "-D indicates smart game de-duplication by position, like -d but the moves are\n"
+        "   replayed so games still match if the moves are written differently\n"
         "-n indicates no sorting or de-duping\n"
 		"-r specifies smart reverse sort - yields most recent games first, smart\n"
 		"   because higher rounds/boards are adjusted to come first both here and\n"
 		"   in the conventional sort order\n"
         "-p indicates create a .pgn from output (filename is \".pgn\" appended to\n"
         "   output)\n"
+        "-B indicates create a binary columnar .bpgn from output (filename is\n"
+        "   \".bpgn\" appended to output), see companion program bpgn\n"
+        "-c indicates write output (and temporary files) in the compressed .lpgn\n"
+        "   container format, see companion program lpgnz\n"
+        "-m merge the games from input into existing.lpgn (previous output of\n"
+        "   pgn2line, not reverse sorted) to make output. Only the part of\n"
+        "   existing.lpgn from six months before the earliest new game onwards is\n"
+        "   re-sorted and de-duped with the new games (not allowed with -r or -n)\n"
+        "-v validate games, replaying each game's main line. Games with an illegal\n"
+        "   move or without a result at the end of the moves go to file\n"
+        "   output.lpgn-rejects.lpgn instead, with a Rejected tag giving the ply and\n"
+        "   the reason\n"
+        "-j write metrics for each stage (wall and CPU time, lines and bytes read\n"
+        "   and written, memory and temporary disk usage) and counts of games kept\n"
+        "   and dropped by each filter and by de-duplication to output-metrics.json\n"
+        "-t print a progress line every so many seconds\n"
         "-y discard games unless they are played in year_before or earlier\n"
         "+y discard games unless they are played in year_after or later\n"
         "-w specifies a whitelist list of tournaments, discard games not from one\n"
@@ -511,6 +964,9 @@ int main( int argc, const char *argv[] )
         "Pairs of before and after player names are now allowed in the fixup file,\n"
         "player names are identified as those strings NOT in yyyy Event@Site format\n"
         "\n"
+        "Big -w -b and -f files load faster if compiled with companion program fixupc,\n"
+        "compiled files can be used in place of the text files\n"
+        "\n"
         "-2 flag removes games unless both players have been fixed up (useful for\n"
         "   cleaning online PGNs with a list of some but not all player handles)\n"
         "\n"
@@ -529,60 +985,45 @@ int main( int argc, const char *argv[] )
         printf( "Error: input and output filenames are the same.\n" );
         return -1;
     }
-
-    // Read tournament files
-    std::set<std::string> whitelist;
-    std::set<std::string> blacklist;
-    std::map<std::string,std::string> fixups;
-    std::map<std::string,std::string> name_fixups;
-    if( whitelist_flag )
+    if( merge_flag && merge_file == fout )
     {
-        std::vector<std::string> temp;
-        ok = read_tournament_list( whitelist_file, temp );
-        for( unsigned int i=0; ok && i<temp.size(); i++ )
-            whitelist.insert(temp[i]);
+        printf( "Error: existing and output filenames are the same.\n" );
+        return -1;
     }
+
+    // Metrics for each stage are always collected, they cost very little
+    PipelineMetrics metrics;
+    if( progress_seconds > 0.0 )
+        metrics.start_progress( progress_seconds );
+    metrics.begin( "read lists" );
+
+    // Read tournament files (text files, or compiled by program fixupc)
+    HashedList whitelist;
+    HashedList blacklist;
+    HashedList fixups;
+    HashedList name_fixups;
+    if( whitelist_flag )
+        ok = read_hashed_list( whitelist_file, false, whitelist );
     if( ok && blacklist_flag )
-    {
-        std::vector<std::string> temp;
-        ok = read_tournament_list( blacklist_file, temp );
-        for( unsigned int i=0; ok && i<temp.size(); i++ )
-            blacklist.insert(temp[i]);
-    }
+        ok = read_hashed_list( blacklist_file, false, blacklist );
     std::string diag_fout;
     if( ok && fixup_flag )
     {
-        std::vector<std::string> temp;
-        std::vector<std::string> names;
-        ok = read_tournament_list( fixup_file, temp, &names );
-        if( ok && temp.size()%2 != 0 )
+        ok = read_hashed_list( fixup_file, true, fixups, &name_fixups );
+        if( ok && !name_fixups.empty() )
         {
-            printf( "Error; Odd number of tournaments in fixup table, should be before and after pairs\n" );
-            ok = false;
-        }
-        else
-        {
-            for( unsigned int i=0; ok && i<temp.size(); i+=2 )
-                fixups.insert( std::pair<std::string,std::string>(temp[i],temp[i+1]) );
-        }
-        if( ok && names.size()%2 != 0 )
-        {
-            printf( "Error; Odd number of player names in fixup table, should be before and after pairs\n" );
-            ok = false;
-        }
-        else
-        {
-            if( names.size() > 0 )
-            {
-                diag_fout = fout + "-name-fixups.txt";
-                printf( "All player name fixups will be listed in file %s\n", diag_fout.c_str() );
-            }
-            for( unsigned int i=0; ok && i<names.size(); i+=2 )
-                name_fixups.insert( std::pair<std::string,std::string>(names[i],names[i+1]) );
+            diag_fout = fout + "-name-fixups.txt";
+            printf( "All player name fixups will be listed in file %s\n", diag_fout.c_str() );
         }
     }
     if( !ok )
         return -1;
+    std::string reject_fout;
+    if( validate_flag )
+    {
+        reject_fout = fout + "-rejects.lpgn";
+        printf( "Games with illegal moves will be listed in file %s\n", reject_fout.c_str() );
+    }
     unsigned int seed = static_cast<unsigned int>( time(NULL) );
     srand(seed);
     int r1=rand();
@@ -591,15 +1032,25 @@ int main( int argc, const char *argv[] )
         r2=rand();
     std::string temp1_fout = util::sprintf( "%s-temp-filename-pgn2line-presort-%05d.tmp", fout.c_str(), r1 );
     std::string temp2_fout = util::sprintf( "%s-temp-filename-pgn2line-postsort-%05d.tmp", fout.c_str(), r2 );
+    temp_disk_usage.add( temp1_fout );
+    temp_disk_usage.add( temp2_fout );
     ok = false;
     printf( "pgn2line V3.04 (from Github.com/billforsternz/pgn2line)\n" );
+    metrics.begin( "convert" );
     bool all_utf8_bom = true;
+    EventSiteIds event_site_ids;
+
+    // Sort key tie breakers for the games of an existing file start from 1, number new
+    //  games after them so existing games stay first amongst otherwise equal games
+    if( merge_flag )
+        set_game_count( 0x100000000ULL );
     if( !list_flag )
     {
         printf( "Processing 1 pgn file\n" );
-        ok = pgn2line( fin, temp1_fout, diag_fout,
+        ok = pgn2line( fin, temp1_fout, diag_fout, reject_fout,
                     all_utf8_bom,
                     false,
+                    compress,
                     reverse_flag,
                     remove_zero_length,
                     remove_zero_length_allow_bye,
@@ -609,7 +1060,8 @@ int main( int argc, const char *argv[] )
                     whitelist,
                     blacklist,
                     fixups,
-                    name_fixups
+                    name_fixups,
+                    &event_site_ids
             );
     }
     else
@@ -638,6 +1090,36 @@ int main( int argc, const char *argv[] )
                 pgn_files.push_back(line);
         }
         int nbr_files = pgn_files.size();
+
+        // The conversion cache is specific to the options that affect conversion
+        ConversionCache cache;
+        uint64_t tie_breaker = merge_flag ? 0x100000000ULL : 0;
+        int nbr_cached = 0;
+        if( cache_flag )
+        {
+            std::string options = util::sprintf( "V3.04 %d %d %d %d %d %d %d", reverse_flag, remove_zero_length,
+                        remove_zero_length_allow_bye, remove_unfixed_players_flag, year_before, year_after, validate_flag );
+            uint64_t config_hash = cache_hash( options.c_str(), options.length() );
+            const HashedList *lists[4] = { &whitelist, &blacklist, &fixups, &name_fixups };
+            for( int i=0; i<4; i++ )
+            {
+                const std::string &data = lists[i]->get_data();
+                config_hash = cache_hash( data.c_str(), data.length(), config_hash );
+                config_hash = cache_hash( "|", 1, config_hash );
+            }
+            if( !cache.open(cache_dir,config_hash) )
+                return -1;
+
+            // Cached files' reports are appended, so start the reports empty
+            if( diag_fout != "" )
+            {
+                std::ofstream truncate( diag_fout, std::ios_base::out );
+            }
+            if( reject_fout != "" )
+            {
+                std::ofstream truncate( reject_fout, std::ios_base::out|std::ios_base::binary );
+            }
+        }
         bool append=false;
         int file_number=1;
         ok = false;
@@ -645,9 +1127,62 @@ int main( int argc, const char *argv[] )
         {
             printf( "Processing %d of %d pgn file%s\r", file_number++, nbr_files, nbr_files==1?"":"s" );
             bool utf8_bom;
-            bool any = pgn2line( line, temp1_fout, diag_fout,
+            bool any;
+            std::string entry;
+            if( cache_flag && cache.find(line,entry) )
+            {
+                nbr_cached++;
+                uint64_t lines_written = io_counters.lines_written;
+                any = append_cached_games( entry, temp1_fout, append, compress, event_site_ids, tie_breaker, utf8_bom );
+                game_counts.from_cache += io_counters.lines_written - lines_written;
+                if( any && diag_fout != "" )
+                    append_text_file( entry + "-name-fixups.txt", diag_fout );
+                if( any && reject_fout != "" )
+                    game_counts.rejected += append_text_file( entry + "-rejects.lpgn", reject_fout );
+            }
+            else if( cache_flag && entry != "" )
+            {
+
+                // Convert into a new cache entry, without sort keys, then use the entry
+                std::string temp_entry = ConversionCache::temp_name(entry);
+                any = pgn2line( line, temp_entry, diag_fout=="" ? "" : entry + "-name-fixups.txt",
+                        reject_fout=="" ? "" : entry + "-rejects.lpgn",
+                        utf8_bom,
+                        false,
+                        compress,
+		                reverse_flag,
+                        remove_zero_length,
+                        remove_zero_length_allow_bye,
+                        remove_unfixed_players_flag,
+                        year_before,
+                        year_after,
+                        whitelist,
+                        blacklist,
+                        fixups,
+                        name_fixups,
+                        NULL );
+                if( any )
+                {
+
+                    // If the entry can't be committed, use the converted games anyway
+                    bool committed = cache.commit(entry);
+                    if( !committed )
+                        nbr_cache_errors++;
+                    any = append_cached_games( committed ? entry : temp_entry, temp1_fout, append, compress, event_site_ids, tie_breaker, utf8_bom );
+                    if( !committed )
+                        remove( temp_entry.c_str() );
+                    if( any && diag_fout != "" )
+                        append_text_file( entry + "-name-fixups.txt", diag_fout );
+                    if( any && reject_fout != "" )
+                        append_text_file( entry + "-rejects.lpgn", reject_fout );
+                }
+            }
+            else
+            {
+                any = pgn2line( line, temp1_fout, diag_fout, reject_fout,
                         utf8_bom,
                         append,
+                        compress,
 		                reverse_flag,
                         remove_zero_length,
                         remove_zero_length_allow_bye,
@@ -657,7 +1192,9 @@ int main( int argc, const char *argv[] )
                         whitelist,
                         blacklist,
                         fixups,
-                        name_fixups );
+                        name_fixups,
+                        &event_site_ids );
+            }
             if( any )  // don't give up unless none of the files are processed
             {
                 ok = true;
@@ -666,14 +1203,26 @@ int main( int argc, const char *argv[] )
             }
             append = true;
         }
+        printf( "\n" );    // end the progress line
+        if( cache_flag )
+        {
+            cache.save();
+            printf( "%d of %d pgn file%s found in conversion cache %s\n", nbr_cached, nbr_files, nbr_files==1?"":"s", cache_dir.c_str() );
+            if( nbr_cache_errors > 0 )
+                printf( "Error; %d pgn file%s converted but not added to conversion cache %s\n", nbr_cache_errors, nbr_cache_errors==1?"":"s", cache_dir.c_str() );
+        }
     }
     if( !ok )
         return -1;
+    if( validate_flag )
+        printf( "%llu game%s rejected, see file %s\n", static_cast<unsigned long long>(game_counts.rejected),
+                    game_counts.rejected==1?"":"s", reject_fout.c_str() );
     bool add_utf8_bom_to_output = all_utf8_bom;
     if( no_sort )
 	{
-		printf( "Removing tie breaker field\n");
-        remove_tie_breaker_and_dups( temp1_fout, fout, add_utf8_bom_to_output, NULL, true );
+		printf( "Removing sort keys\n");
+        metrics.begin( "remove sort keys" );
+        remove_sort_keys_and_dups( temp1_fout, fout, add_utf8_bom_to_output, NULL, true, compress );
 		remove( temp1_fout.c_str() );
 	}
     else
@@ -692,41 +1241,97 @@ int main( int argc, const char *argv[] )
             }
         }
         std::ofstream *p_smart_uniq = (smart_uniq && out_smart_uniq) ? &out_smart_uniq : 0;
-        printf( "%sStarting sort\n", list_flag?"\n":"" );   // list_flag = newline needed
-        disksort( temp1_fout, temp2_fout );
+        if( merge_flag )
+        {
+            metrics.begin( "merge split" );
+            std::string cutoff;
+            if( !merge_cutoff(temp1_fout,cutoff) ||
+                !split_existing_lpgn(merge_file,cutoff,fout,temp1_fout,compress,event_site_ids) )
+            {
+                remove( temp1_fout.c_str() );
+                return -1;
+            }
+        }
+        printf( "Starting sort\n" );
+        metrics.begin( "sort" );
+
+        // The first sort pass replaces event and site ids in the sort keys with their
+        //  ranks, so from here on sort keys order games as the textual prefixes do
+        event_site_ids.rank();
+        disksort( temp1_fout, temp2_fout, false, compress,
+                  [&event_site_ids]( std::string &line ) { event_site_ids.replace_id_with_rank(line); } );
 	    remove( temp1_fout.c_str() );
         printf( "Sort complete\n");
-        printf( "Starting refinement sort\n");
-		refine_sort( temp2_fout, temp1_fout );
-		printf( "Refinement sort complete\n");
-        remove( temp2_fout.c_str() );
 	    if( reverse_flag )
 	    {
+            printf( "Starting refinement sort\n");
+            metrics.begin( "refinement sort" );
+		    refine_sort( temp2_fout, temp1_fout, compress, false, false, NULL );
+		    printf( "Refinement sort complete\n");
+            remove( temp2_fout.c_str() );
 		    printf( "Starting reversal sort\n");
-		    disksort( temp1_fout, temp2_fout, true );
+            metrics.begin( "reversal sort" );
+		    disksort( temp1_fout, temp2_fout, true, compress );
 		    printf( "Reversal sort complete\n");
 		    remove( temp1_fout.c_str() );
-		    printf( "Removing tie breaker field and dups%s\n", smart_uniq_msg.c_str() );
-            remove_tie_breaker_and_dups( temp2_fout, fout, add_utf8_bom_to_output, p_smart_uniq );
+		    printf( "Removing sort keys and dups%s\n", smart_uniq_msg.c_str() );
+            metrics.begin( "remove sort keys and dups" );
+            remove_sort_keys_and_dups( temp2_fout, fout, add_utf8_bom_to_output, p_smart_uniq, false, compress );
 		    remove( temp2_fout.c_str() );
 	    }
 	    else
 	    {
-		    printf( "Removing tie breaker field and dups%s\n", smart_uniq_msg.c_str() );
-            remove_tie_breaker_and_dups( temp1_fout, fout, add_utf8_bom_to_output, p_smart_uniq );
-		    remove( temp1_fout.c_str() );
+
+            // The refinement sort writes the final output directly, removing sort keys
+            //  and dups as it goes
+            printf( "Starting refinement sort, removing dups%s\n", smart_uniq_msg.c_str() );
+            metrics.begin( "refinement sort" );
+		    refine_sort( temp2_fout, fout, compress, true, add_utf8_bom_to_output, p_smart_uniq, merge_flag );
+		    printf( "Refinement sort complete\n");
+            remove( temp2_fout.c_str() );
 	    }
     }
     if( pgn_create_flag )
+    {
+        metrics.begin( "create pgn" );
         line2pgn( fout, fout + ".pgn" );
-    return 0;
+    }
+    if( bpgn_create_flag )
+    {
+        metrics.begin( "create bpgn" );
+        lpgn_to_bpgn( fout, fout + ".bpgn" );
+    }
+    metrics.end();
+    if( metrics_flag )
+    {
+        std::string metrics_fout = fout + "-metrics.json";
+        metrics.info( "program", "pgn2line V3.04" );
+        std::string command_line;
+        for( int i=0; i<argc_original; i++ )
+            command_line += (i?" ":"") + std::string(argv[i]);
+        metrics.info( "command_line", command_line );
+        metrics.count( "read", game_counts.read );
+        metrics.count( "kept", game_counts.kept );
+        metrics.count( "dropped_year", game_counts.dropped_year );
+        metrics.count( "dropped_zero_length", game_counts.dropped_zero_length );
+        metrics.count( "dropped_players_not_fixed", game_counts.dropped_players_not_fixed );
+        metrics.count( "dropped_whitelist", game_counts.dropped_whitelist );
+        metrics.count( "dropped_blacklist", game_counts.dropped_blacklist );
+        metrics.count( "rejected", game_counts.rejected );
+        metrics.count( "from_cache", game_counts.from_cache );
+        metrics.count( "dedup_exact", game_counts.dedup_exact );
+        metrics.count( "dedup_smart", game_counts.dedup_smart );
+        if( metrics.write_json(metrics_fout) )
+            printf( "Metrics written to file %s\n", metrics_fout.c_str() );
+    }
+    return nbr_cache_errors>0 ? -1 : 0;
 #endif
 }
 
 class Game
 {
 public:
-	static unsigned int game_count;
+	static uint64_t game_count;
     Game() {clear();}
     void clear();
     void process_header_line( const std::string &line );
@@ -734,118 +1339,197 @@ public:
     bool is_game_non_zero_length();
     bool is_game_non_zero_length_or_BYE();
     bool is_both_players_fixed();
-    std::string get_game_as_line(bool reverse_order);
-    void fixup_tournament( const std::map<std::string,std::string> &fixup_list );
-    void fixup_names( const std::map<std::string,std::string> &fixup_list, std::ofstream *p_out_diag );
-    std::string get_yyyy_event_at_site();
-    std::string get_prefix(bool reverse_order);
+    void get_game_as_line( bool reverse_order, std::string &line, EventSiteIds *event_site_ids=NULL );
+    void fixup_tournament( const HashedList &fixup_list );
+    void fixup_names( const HashedList &fixup_list, std::ofstream *p_out_diag );
+    bool is_tournament_in_list( const HashedList &list, const char **value=NULL, size_t *value_len=NULL );
+    void get_prefix( bool reverse_order, std::string &s );
+    void get_sort_key( bool reverse_order, EventSiteIds &event_site_ids, std::string &s );
     std::string get_description();
     int yyyy = 2000;
 private:
-    std::string get_event_header();
-    std::string get_site_header();
-    std::string headers;
-    std::string moves;
-    std::string eventx;
-    std::string site;
-    std::string white;
-    std::string black;
-    std::string date;
+
+    // All the text of a game lives in one arena, fields are offset/length spans into
+    //  it. The arena and span lists are cleared but never freed between games, so once
+    //  they have grown to accommodate the biggest game there are no allocations per game
+    struct Span
+    {
+        uint32_t offset=0;
+        uint32_t len=0;
+    };
+    Span add( const char *text, size_t len );
+    Span add( const std::string &text ) { return add(text.c_str(),text.length()); }
+    Span add_player_header( const char *tag, const char *name, size_t name_len, const char *rest, size_t rest_len );
+    const char *ptr( Span span ) const { return arena.c_str()+span.offset; }
+    std::string str( Span span ) const { return std::string(ptr(span),span.len); }
+    void append_event_site( std::string &s );
+    void append_round( bool reverse_order, std::string &s );
+    std::string arena;
+    std::vector<Span> headers;  // excluding Event and Site, "@H" not included
+    std::vector<Span> moves;    // "@M" not included
+    Span eventx;
+    Span site;
+    Span white;
+    Span black;
+    Span round;
+    Span result;
+    std::string date;           // scratch, for parse_date_format()
+    std::string scratch;
+    std::string event_site;
     std::string year;
     std::string month;
     std::string day;
-    std::string round;
-    std::string result;
+    uint32_t yyyymmdd;
     bool both_players_fixed;
     int move_txt_len;
-	unsigned int game_idx;
+	uint64_t game_idx;
 };
 
-unsigned int Game::game_count = 0;
+uint64_t Game::game_count = 0;
+
+static void set_game_count( uint64_t game_count )
+{
+    Game::game_count = game_count;
+}
 
 void Game::clear()
 {
+    arena.clear();
     headers.clear();
     moves.clear();
-    eventx.clear();
-    site.clear();
-    white.clear();
-    black.clear();
-    date.clear();
+    eventx = site = white = black = round = result = Span();
     yyyy = 0;
     year = "0000";
     month = "00";
     day = "00";
-    round.clear();
-    result.clear();
+    yyyymmdd = 0;
     both_players_fixed = false;
     move_txt_len = 0;
 	game_idx = 0;
 }
 
-std::string Game::get_game_as_line(bool reverse_order)
+Game::Span Game::add( const char *text, size_t len )
 {
-    std::string s=get_prefix(reverse_order);
-    s += "@H";
-    s += get_event_header();
-    s += "@H";
-    s += get_site_header();
-    s += headers;
-    s += moves;
-    return s;
+    Span span;
+    span.offset = static_cast<uint32_t>(arena.length());
+    span.len    = static_cast<uint32_t>(len);
+    arena.append( text, len );
+    return span;
 }
 
-std::string Game::get_yyyy_event_at_site()
+// Add [Tag "name"] followed by rest (which is normally empty)
+Game::Span Game::add_player_header( const char *tag, const char *name, size_t name_len, const char *rest, size_t rest_len )
 {
-    std::string s = year; 
-    s += ' ';
-    s += eventx;
-    s += '@';
-    s += site;
-    return s;
+    Span span;
+    span.offset = static_cast<uint32_t>(arena.length());
+    arena += '[';
+    arena += tag;
+    arena += " \"";
+    arena.append( name, name_len );
+    arena += "\"]";
+    arena.append( rest, rest_len );
+    span.len = static_cast<uint32_t>(arena.length()-span.offset);
+    return span;
+}
+
+// The line is built with one sized allocation (none at all if line is reused and
+//  has already grown big enough). The line starts with a sort key if event_site_ids
+//  is provided
+void Game::get_game_as_line( bool reverse_order, std::string &line, EventSiteIds *event_site_ids )
+{
+    line.clear();
+    if( event_site_ids )
+        get_sort_key( reverse_order, *event_site_ids, line );
+    get_prefix( reverse_order, line );
+    size_t len = line.length() + 12 + eventx.len + 11 + site.len;   // @H[Event ""] @H[Site ""]
+    for( auto it=headers.begin(); it!=headers.end(); it++ )
+        len += 2 + it->len;
+    for( auto it=moves.begin(); it!=moves.end(); it++ )
+        len += 2 + it->len;
+    line.reserve( len );
+    line += "@H[Event \"";
+    line.append( ptr(eventx), eventx.len );
+    line += "\"]@H[Site \"";
+    line.append( ptr(site), site.len );
+    line += "\"]";
+    for( auto it=headers.begin(); it!=headers.end(); it++ )
+    {
+        line += "@H";
+        line.append( ptr(*it), it->len );
+    }
+    for( auto it=moves.begin(); it!=moves.end(); it++ )
+    {
+        line += "@M";
+        line.append( ptr(*it), it->len );
+    }
 }
 
-void Game::fixup_tournament( const std::map<std::string,std::string> &fixup_list )
+// Look up "yyyy Event@Site" without building the string
+bool Game::is_tournament_in_list( const HashedList &list, const char **value, size_t *value_len )
 {
-    std::string t = get_yyyy_event_at_site();
-    bool found=false;
-    auto it = fixup_list.find(t);
-    if( it != fixup_list.end() )
+    const char *pieces[5] = { year.c_str(), " ", ptr(eventx), "@", ptr(site) };
+    size_t lens[5] = { year.length(), 1, eventx.len, 1, site.len };
+    return list.find( pieces, lens, 5, value, value_len );
+}
+
+void Game::fixup_tournament( const HashedList &fixup_list )
+{
+    const char *value;
+    size_t value_len;
+    if( is_tournament_in_list(fixup_list,&value,&value_len) )
     {
-        std::string to = it->second;
-        auto offset = to.find('@');
-        assert( offset != std::string::npos );
-        eventx = to.substr(5,offset-5);
-        site   = to.substr(offset+1);
+        const char *at = static_cast<const char *>( memchr(value,'@',value_len) );
+        assert( at != NULL );
+        eventx = add( value+5, at-(value+5) );
+        site   = add( at+1, value+value_len-(at+1) );
     }
 }
 
-void Game::fixup_names( const std::map<std::string,std::string> &fixup_list, std::ofstream *p_out_diag )
+void Game::fixup_names( const HashedList &fixup_list, std::ofstream *p_out_diag )
 {
-    std::string t = get_yyyy_event_at_site();
     int nbr_changes=0;
-    auto it1 = fixup_list.find(white);
-    auto it2 = fixup_list.find(black);
-    if( it1 != fixup_list.end()  || it2 != fixup_list.end() )
+    const char *pieces[2];
+    size_t lens[2];
+    const char *new_name[2] = {NULL,NULL};
+    size_t new_len[2] = {0,0};
+    Span *player[2] = { &white, &black };
+    const char *tag[2] = { "White", "Black" };
+    bool found = false;
+    for( int i=0; i<2; i++ )
     {
-        std::string before = get_description();
-        if( it1 != fixup_list.end() )
-        {
-            nbr_changes++;
-            std::string new_white = it1->second;
-            std::string from = "@H[White \"" + white + "\"]";
-            std::string to   = "@H[White \"" + new_white + "\"]";
-            util::replace_once( headers, from, to );
-            white = new_white;
-        }
-        if( it2 != fixup_list.end() )
+        pieces[0] = ptr(*player[i]);
+        lens[0] = player[i]->len;
+        if( fixup_list.find(pieces,lens,1,&new_name[i],&new_len[i]) )
+            found = true;
+        else
+            new_name[i] = NULL;
+    }
+    if( found )
+    {
+        std::string before = get_description();
+        for( int i=0; i<2; i++ )
         {
+            if( !new_name[i] )
+                continue;
             nbr_changes++;
-            std::string new_black = it2->second;
-            std::string from = "@H[Black \"" + black + "\"]";
-            std::string to   = "@H[Black \"" + new_black + "\"]";
-            util::replace_once( headers, from, to );
-            black = new_black;
+
+            // Replace the first header starting with [Tag "old name"]
+            size_t tag_len = strlen(tag[i]);
+            size_t from_len = 1 + tag_len + 2 + player[i]->len + 2;
+            for( auto it=headers.begin(); it!=headers.end(); it++ )
+            {
+                const char *h = ptr(*it);
+                if( it->len >= from_len && h[0]=='[' && 0==memcmp(h+1,tag[i],tag_len)
+                    && h[1+tag_len]==' ' && h[2+tag_len]=='"'
+                    && 0==memcmp(h+3+tag_len,ptr(*player[i]),player[i]->len)
+                    && h[from_len-2]=='"' && h[from_len-1]==']' )
+                {
+                    scratch.assign( h+from_len, it->len-from_len );
+                    *it = add_player_header( tag[i], new_name[i], new_len[i], scratch.c_str(), scratch.length() );
+                    break;
+                }
+            }
+            *player[i] = add( new_name[i], new_len[i] );
         }
         std::string after = get_description();
         if( p_out_diag )
@@ -860,19 +1544,77 @@ void Game::fixup_names( const std::map<std::string,std::string> &fixup_list, std
     both_players_fixed = (nbr_changes==2);
 }
 
-std::string Game::get_prefix(bool reverse_order)
+// Sort key, see sortkey.h. The proxy tournament date is the game date (the refinement
+//  sort replaces it with the real tournament start date)
+void Game::get_sort_key( bool reverse_order, EventSiteIds &event_site_ids, std::string &s )
+{
+    event_site.clear();
+    append_event_site( event_site );
+    sort_key_append_hex( s, yyyymmdd, 8 );
+    sort_key_append_hex( s, event_site_ids.intern(event_site), 8 );
+    sort_key_append_hex( s, yyyymmdd, 8 );
+    append_round( reverse_order, s );
+    s += ' ';
+
+	// The game idx in original file is a sort tie breaker, in case round doesn't
+	//  have a board number. Eg in a tournament you might have Round 3.1, 3.2, 3.3
+	//  etc (great). But if you just have Round 3 for all these games, without this
+	//  tie breaker the games end up sorted according to White's Surname (not very
+	//  helpful). The tie breaker means that the sort order will be the same as in
+	//  the original .pgn, which is likely to be an improvement over White's surname.
+    sort_key_append_hex( s, game_idx, 16 );
+    s += '\t';
+}
+
+void Game::append_event_site( std::string &s )
+{
+    const Span event_site[2] = { eventx, site };
+    for( int i=0; i<2; i++ )
+    {
+        if( i > 0 )
+            s += ", ";
+        const char *p = ptr(event_site[i]);
+        for( uint32_t j=0; j<event_site[i].len; j++ )
+        {
+            if( p[j] == '#' )   // very important the event and/or site don't happen to contain string " # "
+                s += '#';
+            s += p[j];
+        }
+    }
+}
+
+// eg Round = "3" -> "003" or if reverse order "997"
+// eg Round = "3.1" -> "003.001" or if reverse order "997.999"
+// eg Round = "3.1.2" -> "003.001.002" or if reverse order "997.999.998"
+// The point is to make the text as usefully sortable as possible
+void Game::append_round( bool reverse_order, std::string &s )
+{
+    const char *p = ptr(round);
+    const char *end = p + round.len;
+    for(;;)
+    {
+        const char *dot = static_cast<const char *>( memchr(p,'.',end-p) );
+        scratch.assign( p, dot ? dot-p : end-p );
+		int iround = atoi(scratch.c_str());
+		if( reverse_order )
+			iround = 1000-iround;
+		util::append_fixed<3>(s,iround);
+        if( !dot )
+            break;
+		s += '.';
+        p = dot+1;
+    }
+}
+
+void Game::get_prefix( bool reverse_order, std::string &s )
 {
-    std::string event_site = eventx;
-    event_site += ", ";
-    event_site += site;
-    util::replace_all( event_site, "#", "##" ); // very important the event and/or site don't happen to contain string " # "
-    std::string s = year;
+    s += year;
     s += '-';
     s += month;
     s += '-';
     s += day;
     s += ' ';
-    s += event_site;
+    append_event_site( s );
     s += " # ";
     s += year;
     s += '-';
@@ -880,73 +1622,31 @@ std::string Game::get_prefix(bool reverse_order)
     s += '-';
     s += day;
     s += ' ';
+    append_round( reverse_order, s );
 
-	// eg Round = "3" -> "003" or if reverse order "997"
-	// eg Round = "3.1" -> "003.001" or if reverse order "997.999"
-	// eg Round = "3.1.2" -> "003.001.002" or if reverse order "997.999.998"
-	// The point is to make the text as usefully sortable as possible
-    std::string sround = round;
-    size_t offset = sround.find_first_of('.');
-    while( offset != std::string::npos )
-    {
-		std::string temp = sround.substr(0,offset);
-		int iround = atoi(temp.c_str());
-		if( reverse_order )
-			iround = 1000-iround;
-		temp = util::sprintf("%03d",iround);
-		s += temp;
-		s += '.';
-		sround = sround.substr(offset+1);
-        offset = sround.find_first_of('.');
-    }
-	int iround = atoi(sround.c_str());
-	if( reverse_order )
-		iround = 1000-iround;
-	std::string temp = util::sprintf("%03d",iround);
-	s += temp;
-
-	// New feature, append the game idx in original file as a sort tie breaker,
-	//  in case round doesn't have a board number. Eg in a tournament you might
-	//  have Round 3.1, 3.2, 3.3 etc (great). But if you just have Round 3 for
-	//  all these games, without this tie breaker the games end up sorted
-	//  according to White's Surname (not very helpful). The tie breaker means
-	//  that the sort order will be the same as in the original .pgn, which is
-	//  likely to be an improvement over White's surname.
-	s += ' ';
-	std::string sgame_idx = util::sprintf("%09u", game_idx);
-	s += sgame_idx;
-
-	// Add " White-Black"
+	// Add " White-Black", surnames only with spaces replaced by underscores
 	s += ' ';
-    offset = white.find_first_of(",");
-    std::string one_word;
-    if( offset != std::string::npos )
-        one_word = white.substr(0,offset);
-    else
-        one_word = white;
-    util::replace_all( one_word, " ", "_" );
-    s += one_word;
-    s += "-";
-    offset = black.find_first_of(",");
-    if( offset != std::string::npos )
-        one_word = black.substr(0,offset);
-    else
-        one_word = black;
-    util::replace_all( one_word, " ", "_" );
-    s += one_word;
-    return s;
+    const Span players[2] = { white, black };
+    for( int i=0; i<2; i++ )
+    {
+        if( i > 0 )
+            s += '-';
+        const char *name = ptr(players[i]);
+        for( uint32_t j=0; j<players[i].len && name[j]!=','; j++ )
+            s += (name[j]==' ' ? '_' : name[j]);
+    }
 }
 
 std::string Game::get_description()
 {
     std::string s;
-    s = white;
+    s = str(white);
     s += " - ";
-    s += black;
+    s += str(black);
     s += " - ";
-    s += eventx;
+    s += str(eventx);
     s += ", ";
-    s += site;
+    s += str(site);
     s += ", ";
     s += year;
     s += '-';
@@ -958,16 +1658,21 @@ std::string Game::get_description()
 
 bool Game::is_game_non_zero_length()
 {
-    return( move_txt_len > static_cast<int>(result.length()) );
+    return( move_txt_len > static_cast<int>(result.len) );
 }
 
 bool Game::is_game_non_zero_length_or_BYE()
 {
-    if( move_txt_len > static_cast<int>(result.length()) )
+    if( move_txt_len > static_cast<int>(result.len) )
         return true;
-    std::string w = util::toupper(white);
-    std::string b = util::toupper(black);
-    return( w=="BYE" || b=="BYE" );
+    const Span players[2] = { white, black };
+    for( int i=0; i<2; i++ )
+    {
+        const char *name = ptr(players[i]);
+        if( players[i].len==3 && (name[0]=='B'||name[0]=='b') && (name[1]=='Y'||name[1]=='y') && (name[2]=='E'||name[2]=='e') )
+            return true;
+    }
+    return false;
 }
 
 bool Game::is_both_players_fixed()
@@ -981,134 +1686,417 @@ void Game::process_header_line( const std::string &line )
 		game_idx = ++game_count;
     bool event_site=false;
     bool white_black=false;
-    std::string key, value;
-    int from = line.find_first_not_of(' ',1);
-    int to   = line.find_first_of(' ');
+    size_t from = line.find_first_not_of(' ',1);
+    size_t to   = line.find_first_of(' ');
     if( std::string::npos != from && std::string::npos != to && to>from )
     {
-        key = line.substr( from, to-from );
+        const char *key = line.c_str()+from;
+        size_t key_len = to-from;
         from = line.find_first_of('\"');
         to   = line.find_last_of('\"');
         if( std::string::npos != from && std::string::npos != to && to>from )
         {
-            value = line.substr( from+1, (to-from)-1 );
-            if( key == "Event" )
+            // Value between the quotes, and a trimmed version of the value
+            const char *value = line.c_str()+from+1;
+            size_t value_len = (to-from)-1;
+            const char *trimmed = value;
+            size_t trimmed_len = value_len;
+            while( trimmed_len>0 && strchr(" \n\r\t",*trimmed) && *trimmed )
             {
-                event_site = true;
-                util::trim(value);
-                eventx = value;
+                trimmed++;
+                trimmed_len--;
             }
-            else if( key == "Site" )
+            while( trimmed_len>0 && strchr(" \n\r\t",trimmed[trimmed_len-1]) && trimmed[trimmed_len-1] )
+                trimmed_len--;
+            bool trim_changed = (trimmed_len != value_len);
+            #define KEY_IS(k) (key_len==sizeof(k)-1 && 0==memcmp(key,k,key_len))
+            if( KEY_IS("Event") )
             {
                 event_site = true;
-                util::trim(value);
-                site = value;
+                eventx = add( trimmed, trimmed_len );
             }
-            else if( key == "White" )
+            else if( KEY_IS("Site") )
             {
-                white_black = true;
-                headers += "@H";
-                if( util::trim(value) )
-                {
-                    headers += "[White \"";
-                    headers += value;
-                    headers += "\"]";
-                }
-                else
-                    headers += line;
-                white = value;
+                event_site = true;
+                site = add( trimmed, trimmed_len );
             }
-            else if( key == "Black" )
+            else if( KEY_IS("White") || KEY_IS("Black") )
             {
                 white_black = true;
-                headers += "@H";
-                if( util::trim(value) )
-                {
-                    headers += "[Black \"";
-                    headers += value;
-                    headers += "\"]";
-                }
+                Span header;
+                if( trim_changed )
+                    header = add_player_header( key_len==5&&key[0]=='W'?"White":"Black", trimmed, trimmed_len, "", 0 );
+                else
+                    header = add( line );
+                headers.push_back( header );
+                if( key[0] == 'W' )
+                    white = add( trimmed, trimmed_len );
                 else
-                    headers += line;
-                black = value;
+                    black = add( trimmed, trimmed_len );
             }
-            else if( key == "Date" )
+            else if( KEY_IS("Date") )
             {
                 bool ok=false;
-                date = value;
+                date.assign( value, value_len );
                 int y,m,d;
                 ok = parse_date_format( date, '.', y, m, d );
                 if( ok )
                 {
                     yyyy = y;
-					year = util::sprintf( "%04d", y );
-					month = util::sprintf( "%02d", m );
-					day = util::sprintf( "%02d", d );
+					util::assign_fixed<4>( year, y );
+					util::assign_fixed<2>( month, m );
+					util::assign_fixed<2>( day, d );
+                    yyyymmdd = y*10000 + m*100 + d;
                 }
             }
-            else if( key == "Round" )
-                round = value;
-            else if( key == "Result" )
-                result = value;
+            else if( KEY_IS("Round") )
+                round = add( value, value_len );
+            else if( KEY_IS("Result") )
+                result = add( value, value_len );
+            #undef KEY_IS
         }
     }
     if( !event_site && !white_black )
-    {
-        headers += "@H";
-        headers += line;
-    }
+        headers.push_back( add(line) );
 }
 
 void Game::process_moves_line( const std::string &line )
 {
     move_txt_len += line.length();
-    moves += "@M";
-    moves += line;
+    moves.push_back( add(line) );
 }
 
-std::string Game::get_event_header()
+// The main line and starting position (blank unless there's a FEN tag) of a line of
+//  pgn2line output, with or without a sort key. Movetext lines are separated by '\n'
+static void game_line_movetext( const std::string &line, std::string &fen, std::string &movetext )
 {
-    std::string s = "[Event ";
-    s += '\"';
-    s += eventx;
-    s += '\"';
-    s += ']';
-    return s;
+    SortKey key;
+    size_t offset = sort_key_parse(line,key) ? key.text_offset : 0;
+    const char *p = line.c_str() + offset;
+    const char *end = line.c_str() + line.length();
+    fen.clear();
+    movetext.clear();
+    char kind = '\0';
+    while( p < end )
+    {
+        const char *at = static_cast<const char *>( memchr(p,'@',end-p) );
+        if( !at )
+            at = end;
+        if( kind == 'M' )
+            movetext.append( p, at );
+        if( at == end )
+            break;
+        p = at+1;
+        if( p<end && (*p=='H' || *p=='M') )
+        {
+            kind = *p++;
+            if( kind=='M' && movetext.length()>0 )
+                movetext += '\n';
+            if( kind=='H' && end-p>=7 && 0==memcmp(p,"[FEN \"",6) )
+            {
+                const char *q = static_cast<const char *>( memchr(p+6,'"',end-p-6) );
+                if( q )
+                    fen.assign( p+6, q-p-6 );
+            }
+            continue;
+        }
+        if( p<end && *p=='$' )
+            p++;        // "@$" -> "@"
+        if( kind == 'M' )
+            movetext += '@';
+    }
 }
 
-std::string Game::get_site_header()
+// Replay the main line of a game, a line of pgn2line output with or without a sort
+//  key. Returns false with a description of the problem if a move is illegal or the
+//  moves are cut short
+static bool validate_game_line( const std::string &line, std::string &reason )
 {
-    std::string s = "[Site ";
-    s += '\"';
-    s += site;
-    s += '\"';
-    s += ']';
-    return s;
+    std::string fen;
+    std::string movetext;
+    game_line_movetext( line, fen, movetext );
+    int ply;
+    if( validate_movetext(fen,movetext.c_str(),movetext.length(),ply,reason) )
+        return true;
+    reason = util::sprintf( "ply %d, %s", ply, reason.c_str() );
+    return false;
+}
+
+// Fingerprint of the positions reached by the main line of a game, for smart dedup by
+//  position (-D). 0 if a move can't be read or there are too few moves to go on
+#define DEDUP_MIN_PLY 4
+static uint64_t game_line_fingerprint( const std::string &line )
+{
+    std::string fen;
+    std::string movetext;
+    game_line_movetext( line, fen, movetext );
+    uint64_t fingerprint;
+    int ply;
+    if( !fingerprint_movetext(fen,movetext.c_str(),movetext.length(),fingerprint,ply) || ply<DEDUP_MIN_PLY )
+        return 0;
+    return fingerprint ? fingerprint : 1;
+}
+
+// Lines are processed in batches on worker threads, and each batch's result is passed
+//  to write() on a single writer thread, in the original order of the lines. For stages
+//  where the work per line would otherwise hold up the stage (pgn2line -v and -D)
+template <class Result> class OrderedBatches
+{
+public:
+    typedef std::function<void( std::string &lines, Result &result )> Work;     // lines separated by '\n'
+    typedef std::function<void( Result &result )> Write;
+    OrderedBatches( Work work, Write write );
+    ~OrderedBatches() { finish(); }
+    void putline( const std::string &line );
+    void finish();      // wait for all results to be written
+private:
+    void submit();
+    Work work;
+    Write write;
+    std::string batch;
+    uint64_t nbr_batches=0;
+    uint64_t in_flight=0;
+    uint64_t max_in_flight=0;
+    bool reading_done=false;
+    bool finished=false;
+    std::deque< std::pair<uint64_t,std::string> > queue;
+    std::map<uint64_t,Result> results;
+    std::mutex mtx;
+    std::condition_variable cv_batch, cv_result, cv_space;
+    std::vector<std::thread> workers;
+    std::thread writer;
+};
+
+template <class Result> OrderedBatches<Result>::OrderedBatches( Work work, Write write )
+    : work(work), write(write)
+{
+    unsigned int nbr_threads = std::thread::hardware_concurrency();
+    if( nbr_threads < 1 )
+        nbr_threads = 1;
+    if( nbr_threads > 8 )
+        nbr_threads = 8;
+    max_in_flight = 4*nbr_threads;      // batches submitted but not yet written
+    for( unsigned int i=0; i<nbr_threads; i++ )
+    {
+        workers.push_back( std::thread( [this]()
+        {
+            std::string lines;
+            for(;;)
+            {
+                uint64_t seq;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv_batch.wait( lock, [&]{ return !queue.empty() || reading_done; } );
+                    if( queue.empty() )
+                        break;
+                    seq = queue.front().first;
+                    lines.swap( queue.front().second );
+                    queue.pop_front();
+                }
+                Result result;
+                this->work( lines, result );
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    results[seq] = std::move(result);
+                }
+                cv_result.notify_one();
+            }
+        } ) );
+    }
+    writer = std::thread( [this]()
+    {
+        Result result;
+        for( uint64_t seq=0;; seq++ )
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_result.wait( lock, [&]{ return results.count(seq)>0 || (reading_done && seq==nbr_batches); } );
+                auto it = results.find(seq);
+                if( it == results.end() )
+                    break;
+                result = std::move( it->second );
+                results.erase( it );
+            }
+            this->write( result );
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                in_flight--;
+            }
+            cv_space.notify_one();
+        }
+    } );
+}
+
+template <class Result> void OrderedBatches<Result>::putline( const std::string &line )
+{
+    batch += line;
+    batch += '\n';
+    if( batch.length() >= 256*1024 )
+        submit();
+}
+
+template <class Result> void OrderedBatches<Result>::submit()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_space.wait( lock, [&]{ return in_flight < max_in_flight; } );
+    queue.push_back( std::make_pair(nbr_batches++,std::string()) );
+    queue.back().second.swap( batch );
+    in_flight++;
+    cv_batch.notify_one();
+}
+
+template <class Result> void OrderedBatches<Result>::finish()
+{
+    if( finished )
+        return;
+    finished = true;
+    if( batch.length() > 0 )
+        submit();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        reading_done = true;
+    }
+    cv_batch.notify_all();
+    cv_result.notify_all();
+    for( auto it=workers.begin(); it!=workers.end(); it++ )
+        it->join();
+    writer.join();
+}
+
+// Call f( line ) for each line of a batch
+template <class F> static void for_each_batch_line( const std::string &lines, std::string &line, F f )
+{
+    const char *p = lines.c_str();
+    const char *end = p + lines.length();
+    while( p < end )
+    {
+        const char *eol = static_cast<const char *>( memchr(p,'\n',end-p) );
+        if( !eol )
+            eol = end;
+        line.assign( p, eol );
+        p = eol+1;
+        f( line );
+    }
+}
+
+// pgn2line -v, games are checked on worker threads so the parser isn't held up. They
+//  are passed on to out in their original order, games that fail the check go to the
+//  reject file instead, as plain .lpgn with a Rejected tag giving the reason
+class GameValidator
+{
+public:
+    GameValidator( LineWriter &out, std::ofstream &out_reject, bool enabled );
+    void putline( const std::string &line );
+    void finish();      // wait for all games to be written
+    uint64_t nbr_rejected=0;
+private:
+    struct Checked
+    {
+        std::string kept;       // lines separated by '\n'
+        std::string rejected;
+        uint64_t nbr_rejected=0;
+    };
+    LineWriter &out;
+    std::ofstream &out_reject;
+    std::unique_ptr< OrderedBatches<Checked> > batches;
+};
+
+GameValidator::GameValidator( LineWriter &out, std::ofstream &out_reject, bool enabled )
+    : out(out), out_reject(out_reject)
+{
+    if( !enabled )
+        return;
+    auto check = []( std::string &lines, Checked &result )
+    {
+        std::string line;
+        std::string reason;
+        for_each_batch_line( lines, line, [&]( const std::string &line )
+        {
+            if( validate_game_line(line,reason) )
+            {
+                result.kept += line;
+                result.kept += '\n';
+                return;
+            }
+
+            // Plain .lpgn, with the reason as the last header
+            SortKey key;
+            size_t offset = sort_key_parse(line,key) ? key.text_offset : 0;
+            size_t moves = line.find( "@M", offset );
+            if( moves == std::string::npos )
+                moves = line.length();
+            std::string tag = "@H[Rejected \"";
+            for( char c: reason )
+            {
+                if( c=='"' || c=='\\' )
+                    tag += '\\';
+                tag += c;
+                if( c == '@' )
+                    tag += '$';
+            }
+            tag += "\"]";
+            result.rejected.append( line, offset, moves-offset );
+            result.rejected += tag;
+            result.rejected.append( line, moves, std::string::npos );
+            result.rejected += '\n';
+            result.nbr_rejected++;
+        } );
+    };
+    auto write = [this]( Checked &result )
+    {
+        std::string line;
+        for_each_batch_line( result.kept, line, [this]( const std::string &line ) { this->out.putline(line); } );
+        this->out_reject.write( result.rejected.c_str(), result.rejected.length() );
+        nbr_rejected += result.nbr_rejected;
+    };
+    batches.reset( new OrderedBatches<Checked>( check, write ) );
+}
+
+void GameValidator::putline( const std::string &line )
+{
+    if( batches )
+        batches->putline( line );
+    else
+        out.putline( line );
+}
+
+void GameValidator::finish()
+{
+    if( batches )
+        batches->finish();
 }
 
-static bool pgn2line( std::string fin, std::string fout, std::string diag_fout,
+static bool pgn2line( std::string fin, std::string fout, std::string diag_fout, std::string reject_fout,
                     bool &utf8_bom,
                     bool append,
+                    bool compress,
                     bool reverse_order,
                     bool remove_zero_length,
                     bool remove_zero_length_allow_bye,
                     bool remove_unfixed_players_flag,
                     int year_before,
                     int year_after,
-                    const std::set<std::string> &whitelist,
-                    const std::set<std::string> &blacklist,
-                    const std::map<std::string,std::string> &fixups,
-                    const std::map<std::string,std::string> &name_fixups )
+                    const HashedList &whitelist,
+                    const HashedList &blacklist,
+                    const HashedList &fixups,
+                    const HashedList &name_fixups,
+                    EventSiteIds *event_site_ids )
 {
     Game game;
     utf8_bom = false;
-    std::ifstream in(fin.c_str());
+    InputFile in(fin);
+    if( in.format()!=input_plain && !in )
+    {
+        printf( "Error; File %s is %s compressed, only gzip, zip and zstd compressed input is supported,"
+                " please decompress it first\n", fin.c_str(), input_format_name(in.format()) );
+        return false;
+    }
     if( !in )
     {
         printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
         return false;
     }
-    std::ofstream out( fout.c_str(), append ? std::ios_base::app : std::ios_base::out );
+    LineWriter out( fout, compress, append );
     if( !out )
     {
         printf( "Error; Cannot open file %s for %s\n", fout.c_str(), append?"appending":"writing" );
@@ -1122,11 +2110,23 @@ static bool pgn2line( std::string fin, std::string fout, std::string diag_fout,
             printf( "Warning; Cannot open diagnostic file %s for writing\n", diag_fout.c_str() );
     }
     std::ofstream *p_out_diag = out_diag ? &out_diag : NULL;
+    std::ofstream out_reject;
+    if( reject_fout != "" )
+    {
+        out_reject.open( reject_fout.c_str(), append ? std::ios_base::app|std::ios_base::binary : std::ios_base::out|std::ios_base::binary );
+        if( !out_reject )
+        {
+            printf( "Error; Cannot open file %s for %s\n", reject_fout.c_str(), append?"appending":"writing" );
+            return false;
+        }
+    }
+    GameValidator validator( out, out_reject, reject_fout!="" );
     int line_number=0;
     enum {search_for_header,start_header,in_header,process_header,
             search_for_moves,in_moves,process_game,
             process_game_and_exit,done} state=search_for_header;
     std::string line;
+    std::string line_out;
     bool next_line=true;
     while( state != done )
     {
@@ -1146,11 +2146,16 @@ static bool pgn2line( std::string fin, std::string fout, std::string diag_fout,
             }
             else
             {
+                io_counters.lines_read++;
+                io_counters.bytes_read += line.length()+1;
+
                 // Strip out UTF8 BOM mark (hex value: EF BB BF)
                 if( line_number==0 && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65)
                 {
                     line = line.substr(3);
                     utf8_bom = true;
+                    if( !event_site_ids )
+                        out.put_utf8_bom();     // output without sort keys is plain .lpgn
                 }
                 util::ltrim(line);
                 util::rtrim(line);
@@ -1202,10 +2207,10 @@ static bool pgn2line( std::string fin, std::string fout, std::string diag_fout,
                 else
                 {
                     // All headers are in, apply fixups
-                    if( fixups.size() > 0 )
+                    if( !fixups.empty() )
                         game.fixup_tournament(fixups);
 
-                    if( name_fixups.size() > 0 )
+                    if( !name_fixups.empty() )
                         game.fixup_names(name_fixups,p_out_diag);
 
                     // Next get moves
@@ -1257,271 +2262,650 @@ static bool pgn2line( std::string fin, std::string fout, std::string diag_fout,
             case process_game_and_exit:
             {
                 state = (state==process_game_and_exit ? done : search_for_header);
+                game_counts.read++;
                 bool ok = (game.yyyy>=year_after && game.yyyy<=year_before);
+                if( !ok )
+                    game_counts.dropped_year++;
                 if( ok && remove_zero_length_allow_bye )
+                {
                     ok = game.is_game_non_zero_length_or_BYE();
+                    if( !ok )
+                        game_counts.dropped_zero_length++;
+                }
                 if( ok && remove_zero_length )
+                {
                     ok = game.is_game_non_zero_length();
+                    if( !ok )
+                        game_counts.dropped_zero_length++;
+                }
                 if( ok && remove_unfixed_players_flag )
+                {
                     ok = game.is_both_players_fixed();
-                std::string t = game.get_yyyy_event_at_site();
-                if( ok && whitelist.size() > 0)
+                    if( !ok )
+                        game_counts.dropped_players_not_fixed++;
+                }
+                if( ok && !whitelist.empty() )
                 {
                     ok = false; // discard game unless tournament is in the white list
-                    auto it = whitelist.find(t);
-                    if( it != whitelist.end() )
+                    if( game.is_tournament_in_list(whitelist) )
                         ok = true;  // tournament is in the whitelist
+                    else
+                        game_counts.dropped_whitelist++;
                 }
-                if( ok && blacklist.size() > 0 )
+                if( ok && !blacklist.empty() )
                 {
-                    auto it = blacklist.find(t);
-                    if( it != blacklist.end() )
+                    if( game.is_tournament_in_list(blacklist) )
+                    {
                         ok = false; // tournament is in the blacklist
+                        game_counts.dropped_blacklist++;
+                    }
                 }
                 if( ok )
                 {
-                    std::string line_out = game.get_game_as_line(reverse_order);
-                    util::putline(out,line_out);
+                    game_counts.kept++;
+                    game.get_game_as_line(reverse_order,line_out,event_site_ids);
+                    validator.putline(line_out);
                 }
                 break;
             }
         }
     }
+    validator.finish();
+    game_counts.kept -= validator.nbr_rejected;
+    game_counts.rejected += validator.nbr_rejected;
     return true;
 }
 
-static void remove_tie_breaker_and_dups( std::string fin, std::string fout, bool add_utf8_bom_to_output, std::ofstream *p_smart_uniq, bool no_deduping_at_all )
+// Lines leaving the sort stages either keep their sort keys (for further sorting) or
+//  are final output, with the sort key removed and (unless no_deduping_at_all)
+//  duplicates dropped. The dedup filter groups games by the tournament and game dates
+//  plus event and site, which is exactly the front of the sort key
+class SortedLineWriter
+{
+public:
+    SortedLineWriter( LineWriter &out, bool final_output, std::ofstream *p_smart_uniq, bool no_deduping_at_all );
+    void putline( const std::string &line );
+    void flush();
+private:
+    void dedup_line( const std::string &line, uint64_t fingerprint );
+    LineWriter &out;
+    bool final_output;
+    std::ofstream *p_smart_uniq;
+    bool no_deduping_at_all;
+    std::string day;
+    std::string text;
+
+    // Smart dedup by position (-D), the games are fingerprinted on worker threads
+    struct Fingerprinted
+    {
+        std::string lines;
+        std::vector<uint64_t> fingerprints;
+    };
+    std::unique_ptr< OrderedBatches<Fingerprinted> > batches;
+};
+
+SortedLineWriter::SortedLineWriter( LineWriter &out, bool final_output, std::ofstream *p_smart_uniq, bool no_deduping_at_all )
+    : out(out), final_output(final_output), p_smart_uniq(p_smart_uniq), no_deduping_at_all(no_deduping_at_all)
+{
+    if( !final_output || no_deduping_at_all || !p_smart_uniq || !smart_uniq_by_position )
+        return;
+    auto fingerprint = []( std::string &lines, Fingerprinted &result )
+    {
+        std::string line;
+        for_each_batch_line( lines, line, [&]( const std::string &line )
+        {
+            result.fingerprints.push_back( game_line_fingerprint(line) );
+        } );
+        result.lines.swap( lines );
+    };
+    auto write = [this]( Fingerprinted &result )
+    {
+        std::string line;
+        size_t i = 0;
+        for_each_batch_line( result.lines, line, [&]( const std::string &line )
+        {
+            dedup_line( line, result.fingerprints[i++] );
+        } );
+    };
+    batches.reset( new OrderedBatches<Fingerprinted>( fingerprint, write ) );
+}
+
+void SortedLineWriter::putline( const std::string &line )
+{
+    if( !final_output )
+    {
+        out.putline( line );
+        return;
+    }
+    if( batches )
+        batches->putline( line );
+    else
+        dedup_line( line, 0 );
+}
+
+void SortedLineWriter::dedup_line( const std::string &line, uint64_t fingerprint )
+{
+    SortKey key;
+    if( sort_key_parse(line,key) )
+    {
+        day.assign( line, 0, sort_key_day_len );
+        text.assign( line, key.text_offset, std::string::npos );
+    }
+    else
+    {
+        day.clear();
+        text = line;
+    }
+    if( !no_deduping_at_all )
+        postponed_dedup_filter( false, text, day, fingerprint, out, p_smart_uniq );
+    else
+        out.putline( text );        // straight out without going through dedup filter
+}
+
+void SortedLineWriter::flush()
+{
+    if( batches )
+        batches->finish();
+    if( final_output && !no_deduping_at_all )
+        postponed_dedup_filter( true, "", "", 0, out, p_smart_uniq );
+}
+
+static void remove_sort_keys_and_dups( std::string fin, std::string fout, bool add_utf8_bom_to_output, std::ofstream *p_smart_uniq, bool no_deduping_at_all, bool compress )
 {
 
 /*
     Line by line transformation
-    In:  2001-12-28 Acme Open, Gotham # 2001-12-31 003.002.001 000000001 Smith-Jones
+    In:  013158dc00000002013158df003.002.001 0000000000000001\t2001-12-28 Acme Open, Gotham # 2001-12-31 003.002.001 Smith-Jones
     Out: 2001-12-28 Acme Open, Gotham # 2001-12-31 003.002.001 Smith-Jones
  */
 
-    std::ifstream in(fin);
+    LineReader in(fin);
     if( !in )
     {
         printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
         return;
     }
-    std::ofstream out(fout);
+    LineWriter out(fout,compress);
     if( !out )
     {
         printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
         return;
     }
     if( add_utf8_bom_to_output )
-        out.write( "\xef\xbb\xbf", 3 );
-    for(;;)
+        out.put_utf8_bom();
+    SortedLineWriter sorted_out( out, true, p_smart_uniq, no_deduping_at_all );
+    std::string line;
+    while( in.getline(line) )
+        sorted_out.putline( line );
+    sorted_out.flush();
+}
+
+// Incremental update (-m flag). New games can join tournaments that started up to six
+//  months before them (see refine_sort()), so the part of the existing file from six
+//  months before the earliest new game must be sorted again with the new games. The
+//  cutoff is the start of that month (as "yyyy-mm-00")
+static bool merge_cutoff( std::string fin, std::string &cutoff )
+{
+    LineReader in(fin);
+    if( !in )
     {
-        std::string line;
-        std::string line_out;
-        bool expected_format = false;
-        if( !std::getline(in,line) )
-            break;
-        std::string prefix_end = " # ";     // we double up earlier '#' chars to make sure
-                                            //  this doesn't occur earlier in prefix
-        size_t offset = line.find( prefix_end );
-        if( offset != std::string::npos )
-        {
-            offset += 3;
-            size_t offset2 = line.find( ' ', offset );
-            if( offset2!=std::string::npos && offset2==offset+10 )  
-            {
-                offset2++;
-                size_t offset3 = line.find( ' ', offset2 );
-                if( offset3 != std::string::npos )
-                {
-                    offset3++;
-                    size_t offset4 = line.find( ' ', offset3 );
-                    if( offset4!=std::string::npos && offset4==offset3+9 )  
-                    {
-                        offset4++;
-                        expected_format = true;
-                        for( int i=0; expected_format && i<9; i++ )
-                        {
-                            char c = line[offset3+i];
-                            expected_format = (isascii(c) && isdigit(c));
-                        }
-                        if( expected_format )
-                            line_out = line.substr(0,offset3) + line.substr(offset4);
-                    }
-                }
-            }
-        }
-        if( !expected_format )
-            line_out = line;
-        if( !no_deduping_at_all )
-            postponed_dedup_filter( false,line_out,out,p_smart_uniq );
-        else
-            util::putline( out,line_out );        // straight out without going through dedup filter
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return false;
     }
-    if( !no_deduping_at_all )
-        postponed_dedup_filter(true, "", out, p_smart_uniq );
-}                                                                     
+    uint32_t earliest = 99991231;
+    std::string line;
+    while( in.getline(line) )
+    {
+        SortKey key;
+        if( sort_key_parse(line,key) && key.game_date<earliest )
+            earliest = key.game_date;
+    }
+    int yyyy = earliest/10000;
+    int mm   = earliest/100%100;
+    if( mm == 0 )
+        mm = 1;
+    mm -= 6;
+    if( mm < 1 )
+    {
+        mm += 12;
+        yyyy--;
+    }
+    if( yyyy < 0 )
+    {
+        yyyy = 0;
+        mm = 0;
+    }
+    util::assign_fixed<4>( cutoff, yyyy );
+    cutoff += '-';
+    util::append_fixed<2>( cutoff, mm );
+    cutoff += "-00";
+    return true;
+}
 
-static void line2pgn( std::string fin, std::string fout )
+// The existing file is sorted by tournament date, so lines with a tournament date before
+//  the cutoff are a head of the file that is copied straight to the output. The tail
+//  is given sort keys and appended to the file of new games
+static bool split_existing_lpgn( std::string fin, const std::string &cutoff, std::string fout, std::string keyed_fout, bool compress, EventSiteIds &event_site_ids )
 {
-    Game game;
-    std::ifstream in(fin);
+    LineReader in(fin);
     if( !in )
     {
         printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
-        return;
+        return false;
     }
-    std::ofstream out(fout);
+    LineWriter out(fout,compress);
     if( !out )
     {
         printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
-        return;
+        return false;
     }
-    enum {in_prefix1,in_prefix2,in_header1,in_header2,in_moves1,in_moves2,finished} state=in_prefix1, old_state=in_prefix2;
-    bool first_line = true;
-    for(;;)
+    LineWriter keyed_out(keyed_fout,compress,true);
+    if( !keyed_out )
+    {
+        printf( "Error; Cannot open file %s for appending\n", keyed_fout.c_str() );
+        return false;
+    }
+    printf( "Merging with existing file %s, tournaments from %.7s onwards will be re-sorted\n",
+                fin.c_str(), cutoff.c_str() );
+    std::string line;
+    std::string keyed_line;
+    bool head = true;
+    uint64_t nbr_head=0, nbr_tail=0;
+    while( in.getline(line) )
     {
-        std::string line;
-        std::string line_out;
-        if( !std::getline(in,line) )
-            break;
 
-        // Strip out UTF8 BOM mark (hex value: EF BB BF). If it's there, put it in PGN
-        if( first_line && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65 )
+        // Keep any UTF8 BOM mark (hex value: EF BB BF)
+        if( nbr_head+nbr_tail==0 && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65 )
         {
+            out.put_utf8_bom();
             line = line.substr(3);
-            out.write( "\xef\xbb\xbf", 3 );
         }
-        first_line = false;
-        const char *p = line.c_str();
-        state=in_prefix1;
-        old_state=in_prefix2;
-        for(;;)
+        if( head && line.compare(0,10,cutoff) < 0 )
         {
-            bool finished_header = false;
-            bool finished_moves  = false;
-            char c = *p++;
-            old_state = state;
-            switch( state )
-            {
-                case in_prefix1:
-                {
-                    if( c == '\0' )
-                        state = finished;
-                    else if( c == '@' )
-                        state = in_prefix2;
-                    break;
-                }
+            out.putline( line );
+            nbr_head++;
+            continue;
+        }
+        head = false;
+        nbr_tail++;
+        if( !sort_key_from_line(line,event_site_ids,nbr_tail,keyed_line) )
+        {
+            printf( "Error; File %s line %llu is not in the expected format (not pgn2line output?)\n",
+                        fin.c_str(), static_cast<unsigned long long>(nbr_head+nbr_tail) );
+            return false;
+        }
+        keyed_out.putline( keyed_line );
+    }
+    printf( "%llu games copied, %llu games to be re-sorted with new games\n",
+                static_cast<unsigned long long>(nbr_head), static_cast<unsigned long long>(nbr_tail) );
+    return true;
+}
+
+// Append a conversion cache entry (plain .lpgn lines) to pgn2line's temporary file,
+//  giving each line a sort key (see sortkey.h). The tie breakers number games across
+//  all cache entries in the order of the list file
+static bool append_cached_games( std::string fin, std::string fout, bool append, bool compress, EventSiteIds &event_site_ids, uint64_t &tie_breaker, bool &utf8_bom )
+{
+    utf8_bom = false;
+    LineReader in(fin);
+    if( !in.is_open() )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return false;
+    }
+    LineWriter out( fout, compress, append );
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for %s\n", fout.c_str(), append?"appending":"writing" );
+        return false;
+    }
+    std::string line;
+    std::string keyed_line;
+    bool first = true;
+    while( in.getline(line) )
+    {
+
+        // Strip out UTF8 BOM mark (hex value: EF BB BF), it indicates the original pgn had one
+        if( first && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65 )
+        {
+            line = line.substr(3);
+            utf8_bom = true;
+        }
+        first = false;
+        if( sort_key_from_line(line,event_site_ids,++tie_breaker,keyed_line) )
+            out.putline( keyed_line );
+    }
+    return true;
+}
+
+// Append text file fin to fout, returns the number of lines appended
+static uint64_t append_text_file( std::string fin, std::string fout )
+{
+    std::ifstream in( fin, std::ios_base::in | std::ios_base::binary );
+    if( !in )
+        return 0;
+    std::ofstream out( fout, std::ios_base::out | std::ios_base::app | std::ios_base::binary );
+    if( !out )
+    {
+        printf( "Warning; Cannot open file %s for appending\n", fout.c_str() );
+        return 0;
+    }
+    uint64_t nbr_lines = 0;
+    std::string line;
+    while( std::getline(in,line) )
+    {
+        out << line << '\n';
+        nbr_lines++;
+    }
+    return nbr_lines;
+}
+
+// Convert one line to pgn, appended to pgn
+static void line2pgn_line( const char *p, const char *end, std::string &pgn )
+{
+    enum {in_prefix1,in_prefix2,in_header1,in_header2,in_moves1,in_moves2,finished} state=in_prefix1, old_state=in_prefix2;
+    std::string line_out;
+    for(;;)
+    {
+        bool finished_header = false;
+        bool finished_moves  = false;
+        char c = p<end ? *p++ : '\0';
+        old_state = state;
+        switch( state )
+        {
+            case in_prefix1:
+            {
+                if( c == '\0' )
+                    state = finished;
+                else if( c == '@' )
+                    state = in_prefix2;
+                break;
+            }
 
-                case in_prefix2:
+            case in_prefix2:
+            {
+                if( c == '\0' )
+                    state = finished;
+                else if( c == 'H' )
+                    state = in_header1;
+                else
+                    state = in_prefix1; //go back
+                break;
+            }
+
+            case in_header1:
+            {
+                if( c == '\0' )
                 {
-                    if( c == '\0' )
-                        state = finished;
-                    else if( c == 'H' )
-                        state = in_header1;
-                    else
-                        state = in_prefix1; //go back
-                    break;
+                    finished_header = true;
+                    state = finished;
                 }
+                else if( c == '@' )
+                    state = in_header2;
+                else
+                    line_out += c;
+                break;
+            }
 
-                case in_header1:
+            case in_header2:
+            {
+                if( c == '\0' )
                 {
-                    if( c == '\0' )
-                    {
-                        finished_header = true;
-                        state = finished;
-                    }
-                    else if( c == '@' )
-                        state = in_header2;
-                    else
-                        line_out += c;
-                    break;
+                    finished_header = true;
+                    state = finished;
                 }
-
-                case in_header2:
+                else if( c == 'H' )
                 {
-                    if( c == '\0' )
-                    {
-                        finished_header = true;
-                        state = finished;
-                    }
-                    else if( c == 'H' )
-                    {
-                        finished_header = true;
-                        state = in_header1;
-                    }
-                    else if( c == 'M' )
-                    {
-                        finished_header = true;
-                        state = in_moves1;
-                    }
-                    else
-                    {
-                        state = in_header1;  // @$ -> @ (normal @ character in data - not @H or @M),
-                        line_out += '@';     //  so we expect c == '$' but not much point checking
-                    }
-                    break;
+                    finished_header = true;
+                    state = in_header1;
+                }
+                else if( c == 'M' )
+                {
+                    finished_header = true;
+                    state = in_moves1;
+                }
+                else
+                {
+                    state = in_header1;  // @$ -> @ (normal @ character in data - not @H or @M),
+                    line_out += '@';     //  so we expect c == '$' but not much point checking
                 }
+                break;
+            }
 
-                case in_moves1:
+            case in_moves1:
+            {
+                if( c == '\0' )
                 {
-                    if( c == '\0' )
-                    {
-                        finished_moves = true;
-                        state = finished;
-                    }
-                    else if( c == '@' )
-                        state = in_moves2;
-                    else
-                        line_out += c;
-                    break;
+                    finished_moves = true;
+                    state = finished;
                 }
+                else if( c == '@' )
+                    state = in_moves2;
+                else
+                    line_out += c;
+                break;
+            }
 
-                case in_moves2:
+            case in_moves2:
+            {
+                if( c == '\0' )
                 {
-                    if( c == '\0' )
-                    {
-                        finished_moves = true;
-                        state = finished;
-                    }
-                    else if( c == 'M' )
-                    {
-                        finished_moves = true;
-                        state = in_moves1;
-                    }
-                    else
-                    {
-                        state = in_moves1;  // @$ -> @ (normal @ character in data - not @H or @M),
-                        line_out += '@';    //  so we expect c == '$' but not much point checking
-                    }
-                    break;
+                    finished_moves = true;
+                    state = finished;
                 }
+                else if( c == 'M' )
+                {
+                    finished_moves = true;
+                    state = in_moves1;
+                }
+                else
+                {
+                    state = in_moves1;  // @$ -> @ (normal @ character in data - not @H or @M),
+                    line_out += '@';    //  so we expect c == '$' but not much point checking
+                }
+                break;
             }
-            if( state != old_state )
+        }
+        if( state != old_state )
+        {
+            if( finished_header )
             {
-                if( finished_header )
+                pgn += line_out;
+                pgn += '\n';
+                line_out.clear();
+                if( state == in_moves1 )
+                    pgn += '\n';
+            }
+            if( finished_moves )
+            {
+                pgn += line_out;
+                pgn += '\n';
+                line_out.clear();
+                if( state == finished )
+                    pgn += '\n';
+            }
+        }
+        if( c == '\0' )
+            break;
+    }
+}
+
+static void line2pgn( std::string fin, std::string fout )
+{
+    LineReader in(fin);
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return;
+    }
+    std::ofstream out(fout);
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+        return;
+    }
+
+    // Lines are read in batches, worker threads convert the batches and a writer
+    //  thread writes the converted batches in their original order. Batches are
+    //  numbered as they are read, the writer waits for each number in turn
+    const size_t batch_size = 1024*1024;
+    unsigned int nbr_threads = std::thread::hardware_concurrency();
+    if( nbr_threads < 1 )
+        nbr_threads = 1;
+    if( nbr_threads > 8 )
+        nbr_threads = 8;
+    const uint64_t max_in_flight = 4*nbr_threads;   // batches read but not yet written
+    std::deque< std::pair<uint64_t,std::string> > queue;
+    std::map<uint64_t,std::string> converted;
+    uint64_t nbr_batches = 0;
+    uint64_t in_flight = 0;
+    bool reading_done = false;
+    std::mutex mtx;
+    std::condition_variable cv_batch, cv_converted, cv_space;
+    std::vector<std::thread> workers;
+    for( unsigned int i=0; i<nbr_threads; i++ )
+    {
+        workers.push_back( std::thread( [&]()
+        {
+            std::string batch;
+            std::string pgn;
+            for(;;)
+            {
+                uint64_t seq;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv_batch.wait( lock, [&]{ return !queue.empty() || reading_done; } );
+                    if( queue.empty() )
+                        break;
+                    seq = queue.front().first;
+                    batch.swap( queue.front().second );
+                    queue.pop_front();
+                }
+                pgn.clear();
+                const char *p = batch.c_str();
+                const char *end = p + batch.length();
+                while( p < end )
                 {
-                    util::putline(out,line_out);
-                    line_out.clear();
-                    if( state == in_moves1 )
-                        util::putline(out,"");
+                    const char *eol = static_cast<const char *>( memchr(p,'\n',end-p) );
+                    if( !eol )
+                        eol = end;
+                    line2pgn_line( p, eol, pgn );
+                    p = eol+1;
                 }
-                if( finished_moves )
                 {
-                    util::putline(out,line_out);
-                    line_out.clear();
-                    if( state == finished )
-                        util::putline(out,"");
+                    std::lock_guard<std::mutex> lock(mtx);
+                    converted[seq].swap( pgn );
                 }
+                cv_converted.notify_one();
             }
-            if( c == '\0' )
-                break;
+        } ) );
+    }
+    std::thread writer( [&]()
+    {
+        std::string pgn;
+        for( uint64_t seq=0;; seq++ )
+        {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_converted.wait( lock, [&]{ return converted.count(seq)>0 || (reading_done && seq==nbr_batches); } );
+                auto it = converted.find(seq);
+                if( it == converted.end() )
+                    break;
+                pgn.swap( it->second );
+                converted.erase( it );
+            }
+            out.write( pgn.c_str(), pgn.length() );
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                in_flight--;
+            }
+            cv_space.notify_one();
+        }
+    } );
+    std::string batch;
+    const char *line;
+    size_t len;
+    bool first_line = true;
+    for(;;)
+    {
+        bool more = in.next_line(line,len);
+        if( more )
+        {
+            // Strip out UTF8 BOM mark (hex value: EF BB BF). If it's there, put it in PGN
+            if( first_line && len>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65 )
+            {
+                line += 3;
+                len  -= 3;
+                out.write( "\xef\xbb\xbf", 3 );    // (nothing has been queued for the writer yet)
+            }
+            first_line = false;
+            batch.append( line, len );
+            batch += '\n';
+        }
+        if( batch.length() >= batch_size || (!more && batch.length()>0) )
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_space.wait( lock, [&]{ return in_flight < max_in_flight; } );
+            queue.push_back( std::make_pair(nbr_batches++,std::string()) );
+            queue.back().second.swap( batch );
+            in_flight++;
+            cv_batch.notify_one();
+        }
+        if( !more )
+            break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        reading_done = true;
+    }
+    cv_batch.notify_all();
+    cv_converted.notify_all();
+    for( auto it=workers.begin(); it!=workers.end(); it++ )
+        it->join();
+    writer.join();
+}
+
+// Convert to or from the compressed container, or extract a range of lines (first line is
+//  line 1) from a compressed container, decompressing only the blocks needed
+static void lpgnz( bool decompress, std::string fin, std::string fout, long first_line, long nbr_lines )
+{
+    LineReader in(fin);
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return;
+    }
+    if( decompress && !in.is_compressed() )
+    {
+        printf( "Error; File %s is not a compressed lpgn file\n", fin.c_str() );
+        return;
+    }
+    LineWriter out(fout,!decompress);
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+        return;
+    }
+    if( first_line > 0 )
+    {
+        if( !in.seek_line(first_line-1) )
+        {
+            printf( "Error; File %s has only %lu lines\n", fin.c_str(), (unsigned long)in.nbr_lines() );
+            return;
         }
     }
+    std::string line;
+    long count=0;
+    while( (first_line<=0 || count<nbr_lines) && in.getline(line) )
+    {
+        out.putline(line);
+        count++;
+    }
 }
 
 static void tournaments( std::string fin, std::string fout, bool bare )
 {
-    std::ifstream in(fin.c_str());
+    LineReader in(fin);
     if( !in )
     {
         printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
@@ -1647,7 +3031,7 @@ static void tournaments( std::string fin, std::string fout, bool bare )
         }
         if( !replay_line )
         {
-            if( !std::getline(in,line) )
+            if( !in.getline(line) )
                 state = (state==in_tournament ? print_tournament_and_finish : finished);
             else
             {
@@ -1673,10 +3057,435 @@ static void tournaments( std::string fin, std::string fout, bool bare )
     }
 }
 
-
-static void players( std::string fin, std::string fout, bool bare, bool dups_only )
+
+// Counts occurrences of names, an open addressing hash table with the names themselves
+//  interned in one big string, so there is no allocation per name
+class NameCounter
+{
+public:
+    NameCounter() : slots(1024) {}
+    void add( const char *name, size_t len, int count=1 )
+    {
+        uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+        for( size_t i=0; i<len; i++ )
+            hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ULL;
+        size_t mask = slots.size()-1;
+        size_t idx = static_cast<size_t>(hash) & mask;
+        for(;;)
+        {
+            Slot &slot = slots[idx];
+            if( slot.count == 0 )
+                break;
+            if( slot.hash==hash && slot.len==len && 0==memcmp(names.c_str()+slot.offset,name,len) )
+            {
+                slot.count += count;
+                return;
+            }
+            idx = (idx+1) & mask;
+        }
+        Slot &slot = slots[idx];
+        slot.hash   = hash;
+        slot.offset = names.length();
+        slot.len    = len;
+        slot.count  = count;
+        names.append( name, len );
+        if( ++nbr_used*2 > slots.size() )
+            grow();
+    }
+    void merge_into( NameCounter &other ) const
+    {
+        for( auto it=slots.begin(); it!=slots.end(); it++ )
+        {
+            if( it->count )
+                other.add( names.c_str()+it->offset, it->len, it->count );
+        }
+    }
+    void get_sorted( std::vector< std::pair<std::string,int> > &sorted ) const
+    {
+        sorted.clear();
+        for( auto it=slots.begin(); it!=slots.end(); it++ )
+        {
+            if( it->count )
+                sorted.push_back( std::pair<std::string,int>( names.substr(it->offset,it->len), it->count ) );
+        }
+        std::sort( sorted.begin(), sorted.end() );
+    }
+private:
+    struct Slot
+    {
+        uint64_t hash=0;
+        size_t offset=0;
+        size_t len=0;
+        int count=0;
+    };
+    void grow()
+    {
+        std::vector<Slot> old;
+        old.swap( slots );
+        slots.resize( old.size()*2 );
+        size_t mask = slots.size()-1;
+        for( auto it=old.begin(); it!=old.end(); it++ )
+        {
+            if( it->count )
+            {
+                size_t idx = static_cast<size_t>(it->hash) & mask;
+                while( slots[idx].count )
+                    idx = (idx+1) & mask;
+                slots[idx] = *it;
+            }
+        }
+    }
+    std::vector<Slot> slots;
+    size_t nbr_used=0;
+    std::string names;
+};
+
+// Equivalent of std::string::find() for a range of characters
+static const char *find_in_range( const char *p, const char *end, const char *pattern, size_t pattern_len )
+{
+    while( p+pattern_len <= end )
+    {
+        p = static_cast<const char *>( memchr(p,pattern[0],end-p-pattern_len+1) );
+        if( !p )
+            return NULL;
+        if( 0 == memcmp(p,pattern,pattern_len) )
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+// Count the player names in a batch of '\n' terminated lines
+static void players_count_batch( const std::string &batch, NameCounter &names )
+{
+    static const char prefix1[] = "[White \"";
+    static const char prefix2[] = "[Black \"";
+    const size_t prefix_len = sizeof(prefix1)-1;
+    const char *line = batch.c_str();
+    const char *batch_end = line + batch.length();
+    while( line < batch_end )
+    {
+        const char *end = static_cast<const char *>( memchr(line,'\n',batch_end-line) );
+        if( !end )
+            end = batch_end;
+        const char *prefix = prefix1;
+        for( int i=0; i<2; i++ )
+        {
+            const char *offset = find_in_range( line, end, prefix, prefix_len );
+            if( offset )
+            {
+                offset += prefix_len;
+                const char *offset2 = static_cast<const char *>( memchr(offset,'"',end-offset) );
+                if( offset2 )
+                    names.add( offset, offset2-offset );
+            }
+            prefix = prefix2;
+        }
+        line = end+1;
+    }
+}
+
+static void players( std::string fin, std::string fout, bool bare, bool dups_only )
+{
+    LineReader in(fin);
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return;
+    }
+    std::ostream* fp = &std::cout;
+    std::ofstream out;
+    if( fout != "" )
+    {
+        out.open(fout);
+        if( out )
+            fp = &out;
+        else
+        {
+            printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+            return;
+        }
+    }
+
+    // Lines are read in batches and counted by worker threads, each with its own
+    //  hash table, the tables are merged at the end
+    const size_t batch_size = 1024*1024;
+    const size_t max_queued = 16;
+    unsigned int nbr_threads = std::thread::hardware_concurrency();
+    if( nbr_threads < 1 )
+        nbr_threads = 1;
+    if( nbr_threads > 8 )
+        nbr_threads = 8;
+    std::vector<NameCounter> counters(nbr_threads);
+    std::deque<std::string> queue;
+    bool reading_done = false;
+    std::mutex mtx;
+    std::condition_variable cv_batch, cv_space;
+    std::vector<std::thread> workers;
+    for( unsigned int i=0; i<nbr_threads; i++ )
+    {
+        NameCounter *counter = &counters[i];
+        workers.push_back( std::thread( [&,counter]()
+        {
+            std::string batch;
+            for(;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv_batch.wait( lock, [&]{ return !queue.empty() || reading_done; } );
+                    if( queue.empty() )
+                        break;
+                    batch.swap( queue.front() );
+                    queue.pop_front();
+                }
+                cv_space.notify_one();
+                players_count_batch( batch, *counter );
+            }
+        } ) );
+    }
+    std::string batch;
+    const char *line;
+    size_t len;
+    int line_number = 0;
+    for(;;)
+    {
+        bool more = in.next_line(line,len);
+        if( more )
+        {
+            // Strip out UTF8 BOM mark (hex value: EF BB BF)
+            if( line_number==0 && len>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65)
+            {
+                line += 3;
+                len  -= 3;
+            }
+            line_number++;
+            batch.append( line, len );
+            batch += '\n';
+        }
+        if( batch.length() >= batch_size || (!more && batch.length()>0) )
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_space.wait( lock, [&]{ return queue.size() < max_queued; } );
+            queue.push_back( std::string() );
+            queue.back().swap( batch );
+            cv_batch.notify_one();
+        }
+        if( !more )
+            break;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        reading_done = true;
+    }
+    cv_batch.notify_all();
+    for( auto it=workers.begin(); it!=workers.end(); it++ )
+        it->join();
+    for( unsigned int i=1; i<nbr_threads; i++ )
+        counters[i].merge_into( counters[0] );
+    std::vector< std::pair<std::string,int> > names;
+    counters[0].get_sorted( names );
+
+    std::vector<std::string> recent_names;
+    std::vector<std::string> recent_surnames;
+    for( auto it=names.begin(); it!=names.end(); it++ )
+    {
+        std::string name = it->first.c_str();
+        int count  = it->second;
+        std::string surname = name;
+        size_t offset = name.find(',');
+        bool comma_present = (offset != std::string::npos);
+        if( comma_present )
+            surname = name.substr(0,offset);
+        std::string detail;
+        if( bare )
+            detail = util::sprintf( "%s%s", comma_present?"":"@ ", name.c_str() );
+        else
+            detail = util::sprintf( "%s%s: %d", comma_present?"":"@ ", name.c_str(), count );
+        if( !dups_only )
+            util::putline(*fp,detail);
+        else
+        {
+
+            // Always flush after last name
+            it++;
+            bool flush = (it == names.end());
+            it--;
+
+            // If empty, simply buffer for later
+            if( recent_surnames.size() == 0 )
+            {
+                recent_names.push_back( detail );
+                recent_surnames.push_back( surname );
+            }
+
+            // Else if not empty flush if surname changes
+            else
+            {
+                bool different = (surname != recent_surnames[recent_surnames.size()-1]);
+                if( different )
+                    flush = true;
+
+                // Else multiple matching names in a row
+                else
+                {
+                    recent_names.push_back( detail );
+                    recent_surnames.push_back( surname );
+                }
+            }
+
+            // If flush, dump multiple matching names in a row
+            if( flush )
+            {
+                if( recent_names.size() > 1 )
+                {
+                    for( auto it2=recent_names.begin(); it2!=recent_names.end(); it2++ )
+                        util::putline(*fp,*it2);
+                }
+
+                // Clear the buffer and add the latest line, possibly first of a run of matching lines
+                recent_names.clear();
+                recent_surnames.clear();
+                recent_names.push_back( detail );
+                recent_surnames.push_back( surname );
+            }
+        }
+    }
+}
+
+// Append .lpgn text, an '@' in the text is escaped as "@$"
+static void lpgn_escape_append( std::string &s, const std::string &text )
+{
+    for( char c: text )
+    {
+        s += c;
+        if( c == '@' )
+            s += '$';
+    }
+}
+
+// Replace the @M sections of a line with a single @C section of compact movetext,
+//  returns false (leaving the line as it is) if the moves can't be read
+static bool lpgnm_compact( const std::string &line, std::string &converted )
+{
+    size_t offset = line.find("@M");
+    if( offset==std::string::npos || line.find("@C")!=std::string::npos )
+        return false;
+    std::string fen;
+    std::string movetext;
+    std::string compact;
+    game_line_movetext( line, fen, movetext );
+    if( !compact_movetext(fen,movetext.c_str(),movetext.length(),compact) )
+        return false;
+    converted.assign( line, 0, offset );
+    converted += "@C";
+    lpgn_escape_append( converted, compact );
+    return true;
+}
+
+// Replace the @C section of a line with @M sections of standard PGN movetext
+static bool lpgnm_expand( const std::string &line, std::string &converted )
+{
+    size_t offset = line.find("@C");
+    if( offset == std::string::npos )
+        return false;
+    std::string fen;
+    std::string dummy;
+    game_line_movetext( line, fen, dummy );
+    std::string compact;
+    for( size_t i=offset+2; i<line.length(); i++ )
+    {
+        compact += line[i];
+        if( line[i]=='@' && i+1<line.length() && line[i+1]=='$' )
+            i++;        // "@$" -> "@"
+    }
+    std::string movetext;
+    if( !expand_movetext(fen,compact,movetext) )
+        return false;
+    converted.assign( line, 0, offset );
+    size_t start = 0;
+    for(;;)
+    {
+        size_t eol = movetext.find( '\n', start );
+        converted += "@M";
+        lpgn_escape_append( converted, movetext.substr(start,eol-start) );
+        if( eol == std::string::npos )
+            break;
+        start = eol+1;
+    }
+    return true;
+}
+
+// Convert the move sections of .lpgn files to and from compact movetext, one byte per
+//  main line move. Games whose moves can't be converted are left as they are
+static void lpgnm( bool expand, bool compress, std::string fin, std::string fout )
+{
+    LineReader in(fin);
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return;
+    }
+    LineWriter out(fout,compress);
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+        return;
+    }
+    struct Converted
+    {
+        std::string lines;
+        uint64_t nbr_games=0;
+        uint64_t nbr_converted=0;
+        uint64_t bytes_in=0;
+        uint64_t bytes_out=0;
+    };
+    Converted totals;
+    auto convert = [expand]( std::string &lines, Converted &result )
+    {
+        std::string line;
+        std::string converted;
+        for_each_batch_line( lines, line, [&]( const std::string &line )
+        {
+            bool ok = expand ? lpgnm_expand(line,converted) : lpgnm_compact(line,converted);
+            const std::string &s = ok ? converted : line;
+            result.lines += s;
+            result.lines += '\n';
+            result.nbr_games++;
+            if( ok )
+                result.nbr_converted++;
+            result.bytes_in  += line.length();
+            result.bytes_out += s.length();
+        } );
+    };
+    auto write = [&]( Converted &result )
+    {
+        std::string line;
+        for_each_batch_line( result.lines, line, [&]( const std::string &line ) { out.putline(line); } );
+        totals.nbr_games     += result.nbr_games;
+        totals.nbr_converted += result.nbr_converted;
+        totals.bytes_in      += result.bytes_in;
+        totals.bytes_out     += result.bytes_out;
+    };
+    {
+        OrderedBatches<Converted> batches( convert, write );
+        std::string line;
+        while( in.getline(line) )
+            batches.putline( line );
+    }
+    printf( "%llu of %llu games %s, %llu bytes -> %llu bytes\n",
+            static_cast<unsigned long long>(totals.nbr_converted), static_cast<unsigned long long>(totals.nbr_games),
+            expand ? "expanded" : "compacted",
+            static_cast<unsigned long long>(totals.bytes_in), static_cast<unsigned long long>(totals.bytes_out) );
+    if( !expand && totals.nbr_converted<totals.nbr_games )
+        printf( "(games with moves that can't be read are left as they are)\n" );
+}
+
+// Tournaments, players, games per year and results in a single pass. Only the prefix and
+//  headers of each line are examined, scanning stops at the first @M, so the work done
+//  is proportional to the header bytes, not the (much larger) move bytes
+static void lpgnstats( std::string fin, std::string fout )
 {
-    std::ifstream in(fin.c_str());
+    LineReader in(fin);
     if( !in )
     {
         printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
@@ -1695,108 +3504,139 @@ static void players( std::string fin, std::string fout, bool bare, bool dups_onl
             return;
         }
     }
-    std::string prefix1 = "[White \"";
-    std::string prefix2 = "[Black \"";
-    size_t prefix_len = prefix1.length();
-    assert( prefix_len == prefix2.length() );
-    std::string line;
+    std::vector< std::pair<std::string,int> > tournament_runs;  // file order, as tournaments()
+    bool run_continues = false;
     std::map<std::string,int> names;
+    std::map<std::string,int> years;
+    std::map<std::string,int> results;
+    int total_games = 0;
+    int total_results = 0;
     int line_number = 0;
-    for(;;)
+    const char *line;
+    size_t len;
+    std::string s;
+    while( in.next_line(line,len) )
     {
-        if( !std::getline(in,line) )
-            break;
         // Strip out UTF8 BOM mark (hex value: EF BB BF)
-        if( line_number==0 && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65)
-            line = line.substr(3);
+        if( line_number==0 && len>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65)
+        {
+            line += 3;
+            len  -= 3;
+        }
         line_number++;
-        std::string player_name;
-        std::string prefix = prefix1;
-        for( int i=0; i<2; i++ )
+        const char *end = line+len;
+
+        // Prefix ends at the first @H or @M (an '@' in the prefix is escaped as "@$")
+        const char *prefix_end = line;
+        while( NULL != (prefix_end = static_cast<const char *>(memchr(prefix_end,'@',end-prefix_end)))
+                && prefix_end+1<end && prefix_end[1]!='H' && prefix_end[1]!='M' )
+            prefix_end++;
+        if( prefix_end==NULL || prefix_end+1>=end )
+            prefix_end = end;
+
+        // Tournament is the prefix up to " # ", the game date follows
+        const char *hash = NULL;
+        for( const char *p=line; p+3<=prefix_end; p++ )
         {
-            size_t offset = line.find(prefix);
-            if( offset != std::string::npos )
+            if( p[0]==' ' && p[1]=='#' && p[2]==' ' )
             {
-                offset += prefix_len;
-                size_t offset2 = line.find("\"",offset);
-                if( offset2 != std::string::npos )
-                {
-                    player_name = line.substr(offset,offset2-offset);
-                    auto it = names.find(player_name);
-                    if( it == names.end() )
-                        names.insert( std::pair<std::string,int>(player_name,1) );
-                    else
-                        it->second++;
-                }
+                hash = p;
+                break;
             }
-            prefix = prefix2;
         }
-    }
-    std::vector<std::string> recent_names;
-    std::vector<std::string> recent_surnames;
-    for( auto it=names.begin(); it!=names.end(); it++ )
-    {
-        std::string name = it->first.c_str();
-        int count  = it->second;
-        std::string surname = name;
-        size_t offset = name.find(',');
-        bool comma_present = (offset != std::string::npos);
-        if( comma_present )
-            surname = name.substr(0,offset);
-        std::string detail;
-        if( bare )
-            detail = util::sprintf( "%s%s", comma_present?"":"@ ", name.c_str() );
-        else
-            detail = util::sprintf( "%s%s: %d", comma_present?"":"@ ", name.c_str(), count );
-        if( !dups_only )
-            util::putline(*fp,detail);
+        if( !hash )
+            run_continues = false;
         else
         {
-
-            // Always flush after last name
-            it++;
-            bool flush = (it == names.end());
-            it--;
-
-            // If empty, simply buffer for later
-            if( recent_surnames.size() == 0 )
-            {
-                recent_names.push_back( detail );
-                recent_surnames.push_back( surname );
-            }
-
-            // Else if not empty flush if surname changes
+            s.assign( line, hash-line );
+            if( run_continues && tournament_runs.back().first==s )
+                tournament_runs.back().second++;
             else
-            {
-                bool different = (surname != recent_surnames[recent_surnames.size()-1]);
-                if( different )
-                    flush = true;
-
-                // Else multiple matching names in a row
-                else
-                {
-                    recent_names.push_back( detail );
-                    recent_surnames.push_back( surname );
-                }
-            }
+                tournament_runs.push_back( std::pair<std::string,int>(s,1) );
+            run_continues = true;
+            total_games++;
+            const char *yyyy = hash+3;
+            bool ok = (yyyy+4 <= prefix_end);
+            for( int i=0; ok && i<4; i++ )
+                ok = isascii(yyyy[i]) && isdigit(yyyy[i]);
+            s = ok ? std::string(yyyy,4) : "????";
+            years[s]++;
+        }
 
-            // If flush, dump multiple matching names in a row
-            if( flush )
+        // Headers, each @H[Tag "Value"] up to the next @H or @M
+        const char *p = prefix_end;
+        while( p+1<end && p[1]=='H' )
+        {
+            const char *hdr = p+2;
+            const char *hdr_end = hdr;
+            while( NULL != (hdr_end = static_cast<const char *>(memchr(hdr_end,'@',end-hdr_end)))
+                    && hdr_end+1<end && hdr_end[1]!='H' && hdr_end[1]!='M' )
+                hdr_end++;
+            if( hdr_end==NULL || hdr_end+1>=end )
+                hdr_end = end;
+            size_t hdr_len = hdr_end-hdr;
+            int tag = 0;
+            size_t value_offset = 0;
+            if( hdr_len>=8 && 0==memcmp(hdr,"[White \"",8) )
+                tag = 1, value_offset = 8;
+            else if( hdr_len>=8 && 0==memcmp(hdr,"[Black \"",8) )
+                tag = 1, value_offset = 8;
+            else if( hdr_len>=9 && 0==memcmp(hdr,"[Result \"",9) )
+                tag = 2, value_offset = 9;
+            if( tag )
             {
-                if( recent_names.size() > 1 )
+                const char *value = hdr+value_offset;
+                const char *quote = static_cast<const char *>( memchr(value,'"',hdr_end-value) );
+                if( quote )
                 {
-                    for( auto it2=recent_names.begin(); it2!=recent_names.end(); it2++ )
-                        util::putline(*fp,*it2);
+                    s.assign( value, quote-value );
+                    if( tag == 1 )
+                        names[s]++;
+                    else
+                    {
+                        results[s]++;
+                        total_results++;
+                    }
                 }
-
-                // Clear the buffer and add the latest line, possibly first of a run of matching lines
-                recent_names.clear();
-                recent_surnames.clear();
-                recent_names.push_back( detail );
-                recent_surnames.push_back( surname );
             }
+            p = hdr_end;
         }
     }
+
+    util::putline(*fp,"Tournaments");
+    util::putline(*fp,"===========");
+    for( auto it=tournament_runs.begin(); it!=tournament_runs.end(); it++ )
+    {
+        s = util::sprintf( "%s (%d game%s)", it->first.c_str(), it->second, it->second==1?"":"s" );
+        util::putline(*fp,s);
+    }
+    s = util::sprintf( "%d total game%s", total_games, total_games==1?"":"s" );
+    util::putline(*fp,s);
+    util::putline(*fp,"");
+    util::putline(*fp,"Players");
+    util::putline(*fp,"=======");
+    for( auto it=names.begin(); it!=names.end(); it++ )
+    {
+        bool comma_present = (it->first.find(',') != std::string::npos);
+        s = util::sprintf( "%s%s: %d", comma_present?"":"@ ", it->first.c_str(), it->second );
+        util::putline(*fp,s);
+    }
+    util::putline(*fp,"");
+    util::putline(*fp,"Games per year");
+    util::putline(*fp,"==============");
+    for( auto it=years.begin(); it!=years.end(); it++ )
+    {
+        s = util::sprintf( "%s: %d", it->first.c_str(), it->second );
+        util::putline(*fp,s);
+    }
+    util::putline(*fp,"");
+    util::putline(*fp,"Results");
+    util::putline(*fp,"=======");
+    for( auto it=results.begin(); it!=results.end(); it++ )
+    {
+        s = util::sprintf( "%s: %d (%.1f%%)", it->first.c_str(), it->second, 100.0*it->second/total_results );
+        util::putline(*fp,s);
+    }
 }
 
 /*
@@ -1808,6 +3648,10 @@ We achieve that by replacing the proxy tournament date with the real tournament
 re-sorting. The previous sort means that the tournament date is now easily determined - it
 is simply the first date encountered for the tournament.
 
+(The example shows the line text only, each line actually starts with a sort key, see
+sortkey.h. Tournaments are identified by the event and site rank in the key, and the
+tournament date is replaced in both the key and the text).
+
 Example:
 
 2016-11-01 Brazil Champs, Brazil # 2016-11-01 Game 1...
@@ -1839,7 +3683,7 @@ modify tournament date and re - sort which yields
 
 struct Tournament
 {
-    std::string start_date;
+    uint32_t start_date;    // yyyymmdd
     bool hit=false;
 };
 
@@ -1848,31 +3692,36 @@ struct Month
     bool hit=false;
     int yyyy;
     int mm;
-    std::string yyyy_mm;
-    std::map<std::string,Tournament> tournaments;
+    std::string yyyy_mm;    // as a sort key tournament date field, yyyymm00 in hex
+    std::map<uint32_t,Tournament> tournaments;     // indexed by event and site rank
 };
 
-static bool refine_sort( std::string fin, std::string fout )
+// If final_output, sort keys are removed and duplicates dropped as lines are written
+static bool refine_sort( std::string fin, std::string fout, bool compress, bool final_output, bool add_utf8_bom_to_output, std::ofstream *p_smart_uniq, bool append )
 {
-    std::ifstream in(fin.c_str());
+    LineReader in(fin);
     if( !in )
     {
         printf( "Error, cannot open file %s for reading\n", fin.c_str() );
         return false;
     }
-    std::ofstream out(fout.c_str());
-    if( !out )
+    LineWriter out_file(fout,compress,append);
+    if( !out_file )
     {
-        printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+        printf( "Error; Cannot open file %s for %s\n", fout.c_str(), append?"appending":"writing" );
         return false;
     }
+    if( final_output && add_utf8_bom_to_output && !append )
+        out_file.put_utf8_bom();
+    SortedLineWriter out( out_file, final_output, p_smart_uniq, false );
 
     enum {first_time_thru,new_month,buffering,flush_and_exit} state=first_time_thru;
     std::string line;
     bool bad=false;
     int yyyy, mm;
-    std::string game_date;
-    std::string tournament_description;
+    SortKey key;
+    uint32_t game_date=0;
+    std::string start_date_text;
     std::deque<std::string> main_buffer;
     std::deque<Month> months;
     Month m;
@@ -1894,7 +3743,7 @@ static bool refine_sort( std::string fin, std::string fout )
             {
                 if( bad )
                 {
-                    util::putline(out,line);
+                    out.putline(line);
                 }
                 else
                 {
@@ -1902,7 +3751,8 @@ static bool refine_sort( std::string fin, std::string fout )
                     m.hit = false;
                     m.yyyy = yyyy;
                     m.mm = mm;
-                    m.yyyy_mm = util::sprintf("%04d-%02d",yyyy,mm);
+                    m.yyyy_mm.clear();
+                    sort_key_append_hex( m.yyyy_mm, yyyy*10000+mm*100, 8 );
                     m.tournaments.clear();
                     replay_line = true;
                 }
@@ -1930,11 +3780,11 @@ static bool refine_sort( std::string fin, std::string fout )
                         //  won't be retained when we're processing March, unless it scored a hit in
                         //  February
                         bool found=false;
-                        std::string tournament_start_date;
+                        uint32_t tournament_start_date;
                         for( unsigned int i=0; !found && i<months.size(); i++)
                         {
                             Month &previous_month = months[i];
-                            auto it = previous_month.tournaments.find(tournament_description);
+                            auto it = previous_month.tournaments.find(key.event_site);
                             if( it != previous_month.tournaments.end() )
                             {
                                 found = true;
@@ -1948,7 +3798,7 @@ static bool refine_sort( std::string fin, std::string fout )
                         //  if it's not there, add it
                         if( !found )
                         {
-                            auto it = m.tournaments.find(tournament_description);
+                            auto it = m.tournaments.find(key.event_site);
                             if( it != m.tournaments.end() )
                                 tournament_start_date = it->second.start_date;
                             else
@@ -1957,13 +3807,20 @@ static bool refine_sort( std::string fin, std::string fout )
                                 t.start_date = game_date;   // the initial disk sort means this will be the
                                                             //  start date of the whole tournament
                                 tournament_start_date = game_date;
-                                m.tournaments.insert(std::pair<std::string,Tournament>(tournament_description,t));
+                                m.tournaments.insert(std::pair<uint32_t,Tournament>(key.event_site,t));
                             }
                         }
 
                         // One way or another we now know the tournament start date, change the proxy
-                        //  tournament start date to the real tournament start date and buffer line
-                        line.replace(0,tournament_start_date.length(),tournament_start_date);
+                        //  tournament start date to the real tournament start date (in both the sort
+                        //  key and the text) and buffer line
+                        sort_key_set_hex( line, sort_key_tournament_date_offset, tournament_start_date );
+                        util::assign_fixed<4>( start_date_text, tournament_start_date/10000 );
+                        start_date_text += '-';
+                        util::append_fixed<2>( start_date_text, tournament_start_date/100%100 );
+                        start_date_text += '-';
+                        util::append_fixed<2>( start_date_text, tournament_start_date%100 );
+                        line.replace( key.text_offset, start_date_text.length(), start_date_text );
                         main_buffer.push_back(line);
                     }
 
@@ -2001,11 +3858,11 @@ static bool refine_sort( std::string fin, std::string fout )
                                     //  This would happen more often if you weren't using massive PGNs
                                     //  with thousands of tournaments and games, there are more likely
                                     //  to be months with games but no tournaments in that case.
-                                    if( l.substr(0,7) >= old_month.yyyy_mm )
+                                    if( l.compare(0,8,old_month.yyyy_mm) >= 0 )
                                         break;
                                     else
                                     {
-                                        util::putline(out,l);
+                                        out.putline(l);
                                         main_buffer.pop_front();
                                     }
                                 }
@@ -2072,40 +3929,37 @@ static bool refine_sort( std::string fin, std::string fout )
             {
                 std::string l = main_buffer[0];
                 main_buffer.pop_front();
-                util::putline(out,l);
+                out.putline(l);
             }
 
             // Discard old months
             months.clear();
         }
+        if( done )
+            out.flush();
 
         // Get next line and validate it
         if( !replay_line && !done )
         {
-            if( !std::getline(in,line) )
+            if( !in.getline(line) )
                 state = flush_and_exit;
             else
             {
-                // Validate line, should have format "yyyy-mm-dd Event, Site # yyyy-mm-dd etc"
-                //  First date is tournament start date, second date is game date.
-                const size_t event_offset=11;
-                bool ok = line.length()>event_offset && line[event_offset-1]==' ';
-                int dd;
-                if( ok && parse_date_format(line,'-',yyyy,mm,dd) )
+                // Validate line, should start with a sort key followed by text with format
+                //  "yyyy-mm-dd Event, Site # yyyy-mm-dd etc". First date is tournament start
+                //  date, second date is game date. As with parse_date_format(), month and day
+                //  0 are changed to 1
+                bool ok = sort_key_parse(line,key) && line.length()>=key.text_offset+10;
+                if( ok )
                 {
-                    ok = false;
-                    size_t offset = line.find(" # ");
-                    if( std::string::npos != offset )
-                    {
-                        tournament_description = line.substr(event_offset, offset-event_offset);
-                        offset += 3;
-                        int y,m,d;
-                        if( parse_date_format(line.substr(offset),'-',y,m,d) )
-                        {
-                            ok = true;
-                            game_date = util::sprintf( "%04d-%02d-%02d",y,m,d);
-                        }
-                    }
+                    yyyy = key.tournament_date/10000;
+                    mm   = key.tournament_date/100%100;
+                    if( mm == 0 )
+                        mm = 1;
+                    int y = key.game_date/10000;
+                    int m = key.game_date/100%100;
+                    int d = key.game_date%100;
+                    game_date = y*10000 + (m?m:1)*100 + (d?d:1);
                 }
 
                 // Set validation status of line
@@ -2199,6 +4053,63 @@ static bool read_tournament_list( std::string fin, std::vector<std::string> &tou
 }
 
 
+// Read a whitelist or blacklist, or a fixuplist (fixup=true) of tournament pairs and
+//  player name pairs, from either a text file or a file compiled by program fixupc
+static bool read_hashed_list( std::string fin, bool fixup, HashedList &tournaments, HashedList *names )
+{
+    HashedList temp;
+    if( hashlist_detect(fin) )
+    {
+        if( !hashlist_load( fin, tournaments, names?*names:temp ) )
+            return false;
+        if( tournaments.has_values() != fixup )
+        {
+            printf( "Error; File %s was compiled as a %s, not a %s\n", fin.c_str(),
+                        fixup ? "whitelist/blacklist" : "fixuplist",
+                        fixup ? "fixuplist" : "whitelist/blacklist" );
+            return false;
+        }
+        return true;
+    }
+    std::vector<std::string> list;
+    std::vector<std::string> list_names;
+    bool ok = read_tournament_list( fin, list, fixup ? &list_names : NULL );
+    if( !ok )
+        return false;
+    if( !fixup )
+    {
+        tournaments.build( list );
+        return true;
+    }
+    if( list.size()%2 != 0 )
+    {
+        printf( "Error; Odd number of tournaments in fixup table, should be before and after pairs\n" );
+        return false;
+    }
+    if( list_names.size()%2 != 0 )
+    {
+        printf( "Error; Odd number of player names in fixup table, should be before and after pairs\n" );
+        return false;
+    }
+    std::vector<std::string> before, after;
+    for( unsigned int i=0; i<list.size(); i+=2 )
+    {
+        before.push_back( list[i] );
+        after.push_back( list[i+1] );
+    }
+    tournaments.build( before, &after );
+    before.clear();
+    after.clear();
+    for( unsigned int i=0; i<list_names.size(); i+=2 )
+    {
+        before.push_back( list_names[i] );
+        after.push_back( list_names[i+1] );
+    }
+    if( names )
+        names->build( before, &after );
+    return true;
+}
+
 static bool test_date_format( const std::string &date, char separator )
 {
     // Test only that for yyyy.mm.dd, each of yyyy, mm, and dd are present
@@ -2271,7 +4182,7 @@ static bool parse_date_format( const std::string &date, char separator, int &yyy
 // Poor man's grep -w
 static void word_search( bool case_insignificant, std::string word, std::string fin, std::string fout )
 {
-    std::ifstream in(fin.c_str());
+    LineReader in(fin);
     if( !in )
     {
         printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
@@ -2296,7 +4207,7 @@ static void word_search( bool case_insignificant, std::string word, std::string
     for(;;)
     {
         std::string line;
-        if( !std::getline(in,line) )
+        if( !in.getline(line) )
             break;
 
         // Strip out UTF8 BOM mark (hex value: EF BB BF)
@@ -2536,6 +4447,8 @@ struct CANDIDATE
 {
     std::string line;
     bool keep;
+    uint64_t fingerprint;   // of the moves, smart dedup by position only (0 if unknown)
+    size_t prefix_len;      // smart dedup by position only
 };
 
 static std::vector<CANDIDATE> postponed_dedup;
@@ -2545,27 +4458,194 @@ static bool sort_func(const CANDIDATE* lhs, const CANDIDATE* rhs)
     return (lhs->line) < (rhs->line);
 }
 
-static void postponed_dedup_filter( bool flush, const std::string &line, std::ofstream &out, std::ofstream *p_smart_uniq )
+// Games with the same prefix and moves together, even if their headers or the way
+//  the moves are written differ
+static bool sort_func_by_position(const CANDIDATE* lhs, const CANDIDATE* rhs)
 {
-    static std::string cached_day;
-    bool have_line = !flush;
+    int cmp = lhs->line.compare( 0, lhs->prefix_len, rhs->line, 0, rhs->prefix_len );
+    if( cmp != 0 )
+        return cmp < 0;
+    if( lhs->fingerprint != rhs->fingerprint )
+        return lhs->fingerprint < rhs->fingerprint;
+    return (lhs->line) < (rhs->line);
+}
 
-    // Calculate the tournament plus date = 'day', eg
-    // line = "2001-12-28 Acme Open, Gotham # 2001-12-31 003.002.001 Smith-Jones...
-    // day  = "2001-12-28 Acme Open, Gotham # 2001-12-31"
-    std::string day;
-    if( have_line )
+// Moves match if the games reach the same positions, or failing that if the moves
+//  are written the same way
+static bool equal_smart_match_by_position( const CANDIDATE *p, const CANDIDATE *q )
+{
+    if( !equal_prefix_only(p->line,q->line) )
+        return false;
+    if( p->fingerprint && q->fingerprint )
+        return p->fingerprint == q->fingerprint;
+    return equal_moves( p->line, q->line );
+}
+
+// Summary of the columns in a .bpgn file
+static void bpgn_info( std::string fin )
+{
+    BpgnReader in;
+    if( !in.open(fin) )
+        return;
+    printf( "%s: %llu games\n", fin.c_str(), static_cast<unsigned long long>(in.nbr_games()) );
+    for( const std::string &name: in.column_names() )
+    {
+        int type = in.column_type(name);
+        std::string type_name = (type==bpgn_var ? std::string("var") : util::sprintf("u%d",8*type));
+        printf( "%-20s %-4s %14llu bytes\n", name.c_str(), type_name.c_str(),
+                static_cast<unsigned long long>(in.column_size(name)) );
+    }
+}
+
+// Write selected columns as text, one line per game with tab separated columns.
+//  Only the requested columns are read (plus flags and extra_tags to decode moves
+//  that start from a FEN position)
+static void bpgn_columns( std::string columns, std::string fin, std::string fout )
+{
+    BpgnReader in;
+    if( !in.open(fin) )
+        return;
+    std::ostream* fp = &std::cout;
+    std::ofstream out;
+    if( fout != "" )
+    {
+        out.open(fout);
+        if( out )
+            fp = &out;
+        else
+        {
+            printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+            return;
+        }
+    }
+    std::vector<std::string> names;
+    util::replace_all( columns, ",", " " );
+    util::split( columns, names );
+    size_t nbr_columns = names.size();
+    std::vector< std::vector<uint64_t> > values(nbr_columns);
+    std::vector< std::vector<std::string> > dictionaries(nbr_columns);
+    std::vector< std::vector<uint64_t> > var_offsets(nbr_columns);
+    std::vector<std::string> var_data(nbr_columns);
+    std::vector<uint8_t> flags;
+    std::vector<uint64_t> tag_offsets;
+    std::string tag_data;
+    for( size_t i=0; i<nbr_columns; i++ )
+    {
+        const std::string &name = names[i];
+        if( !in.has_column(name) )
+        {
+            printf( "Error; File %s has no column %s\n", fin.c_str(), name.c_str() );
+            return;
+        }
+        bool ok;
+        if( in.column_type(name) == bpgn_var )
+            ok = in.read_var( name, var_offsets[i], var_data[i] );
+        else
+        {
+            ok = in.read_block( name, 0, static_cast<size_t>(in.nbr_games()), values[i] );
+            if( ok && in.has_dictionary(name) )
+                ok = in.read_dictionary( name, dictionaries[i] );
+        }
+        if( ok && name=="moves" && flags.size()==0 )
+        {
+            ok = in.read_column( "flags", flags );
+            if( ok )
+                ok = in.read_var( "extra_tags", tag_offsets, tag_data );
+        }
+        if( !ok )
+            return;
+    }
+    std::string line;
+    std::vector<std::string> san;
+    for( uint64_t game=0; game<in.nbr_games(); game++ )
+    {
+        line.clear();
+        for( size_t i=0; i<nbr_columns; i++ )
+        {
+            const std::string &name = names[i];
+            if( i > 0 )
+                line += '\t';
+            if( var_offsets[i].size() > 0 )
+            {
+                size_t offset = static_cast<size_t>( var_offsets[i][game] );
+                size_t len    = static_cast<size_t>( var_offsets[i][game+1] ) - offset;
+                std::string value( var_data[i], offset, len );
+                if( name == "moves" )
+                {
+                    std::string fen;
+                    if( flags[game] & BPGN_FLAG_FEN )
+                    {
+                        std::string tags( tag_data, static_cast<size_t>(tag_offsets[game]),
+                                          static_cast<size_t>(tag_offsets[game+1]-tag_offsets[game]) );
+                        size_t pos = tags.find( std::string("FEN\0",4) );
+                        if( pos != std::string::npos )
+                            fen = tags.c_str() + pos + 4;
+                    }
+                    decode_moves( fen, value, san );
+                    for( size_t j=0; j<san.size(); j++ )
+                    {
+                        if( j > 0 )
+                            line += ' ';
+                        line += san[j];
+                    }
+                }
+                else if( name == "extra_tags" )
+                {
+                    // Tag\0Value\0... -> [Tag "Value"] ...
+                    size_t j=0;
+                    while( j < value.length() )
+                    {
+                        const char *tag = value.c_str()+j;
+                        j += strlen(tag)+1;
+                        const char *val = value.c_str()+j;
+                        j += strlen(val)+1;
+                        if( tag != value.c_str() )
+                            line += ' ';
+                        line += util::sprintf( "[%s \"%s\"]", tag, val );
+                    }
+                }
+                else
+                    line += value;
+                continue;
+            }
+            uint64_t value = values[i][game];
+            if( dictionaries[i].size() > 0 )
+                line += value<dictionaries[i].size() ? dictionaries[i][static_cast<size_t>(value)] : "";
+            else
+                line += bpgn_value_str( name, value );
+        }
+        util::putline(*fp,line);
+    }
+}
+
+// Run a query, output to a file or to stdout
+static void bpgn_query_file( std::string query, std::string fin, std::string fout )
+{
+    std::ostream* fp = &std::cout;
+    std::ofstream out;
+    if( fout != "" )
     {
-        std::string prefix_end = " # ";     // we double up earlier '#' chars to make sure
-                                            //  this doesn't occur earlier in prefix
-        size_t offset = line.find(prefix_end);
-        if( offset != std::string::npos )
+        out.open(fout);
+        if( out )
+            fp = &out;
+        else
         {
-            offset += 3;
-            size_t offset2 = line.find(' ', offset);
-            if( offset2 != std::string::npos && offset2 == offset + 10)
-                day = line.substr(0, offset2);
+            printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+            return;
         }
+    }
+    bpgn_query( fin, query, *fp );
+}
+
+// The tournament plus date = 'day' identifies games played on one day of one tournament,
+//  eg for line = "2001-12-28 Acme Open, Gotham # 2001-12-31 003.002.001 Smith-Jones...
+//  it's the part of the line's sort key equivalent to "2001-12-28 Acme Open, Gotham # 2001-12-31"
+static void postponed_dedup_filter( bool flush, const std::string &line, const std::string &day, uint64_t fingerprint, LineWriter &out, std::ofstream *p_smart_uniq )
+{
+    static std::string cached_day;
+    bool have_line = !flush;
+    if( have_line )
+    {
         if( postponed_dedup.size() >= 1 && cached_day != day)
             flush = true;  // flush buffered lines, before storing this one
     }
@@ -2573,10 +4653,12 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
     // All games in one 'day' are collected together and deduped
     if( flush )
     {
+        // A stable sort, so equal lines stay in file order and exact dedup keeps the earliest
         std::vector<CANDIDATE*> sorted;
         for( CANDIDATE &c: postponed_dedup )
             sorted.push_back( &c );
-        std::sort( sorted.begin(), sorted.end(), sort_func );
+        bool by_position = (p_smart_uniq && smart_uniq_by_position);
+        std::stable_sort( sorted.begin(), sorted.end(), by_position ? sort_func_by_position : sort_func );
 
         // Smart deduplication ?
         if( p_smart_uniq )
@@ -2591,7 +4673,8 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
                 // Monitor runs of duplicate games
                 CANDIDATE *p = sorted[i];
                 CANDIDATE *q = sorted[i-1];
-                bool match = (p->line==q->line) || equal_smart_match( p->line, q->line );
+                bool match = (p->line==q->line) ||
+                             (by_position ? equal_smart_match_by_position(p,q) : equal_smart_match(p->line,q->line));
                 if( match )
                 {
                     if( in_run )
@@ -2634,6 +4717,16 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
 
                     // Keep the selected game only
                     sorted[the_one]->keep = true;
+                    for( unsigned int j=run_idx; j<run_idx+run_len; j++ )
+                    {
+                        if( j != the_one )
+                        {
+                            if( sorted[j]->line == sorted[the_one]->line )
+                                game_counts.dedup_exact++;
+                            else
+                                game_counts.dedup_smart++;
+                        }
+                    }
 
                     // If they weren't all the same, append to diagnostics file to show what we did
                     s = "";
@@ -2653,8 +4746,9 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
                         }
                     }
 
-                    // Replace the earliest of the matching group with the line we are keeping 
-                    if( !all_the_same && earliest != sorted[the_one] )
+                    // Replace the earliest of the matching group with the line we are keeping,
+                    //  so a game's position doesn't depend on which duplicate was kept
+                    if( earliest != sorted[the_one] )
                     {
                         earliest->line = sorted[the_one]->line;
                         earliest->keep = true;
@@ -2675,7 +4769,10 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
             for( CANDIDATE *p : sorted )
             {
                 if( prev && p->line == prev->line )
+                {
                     p->keep = false;
+                    game_counts.dedup_exact++;
+                }
                 prev = p;
             }
         }
@@ -2685,7 +4782,7 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
         for( const CANDIDATE& c : postponed_dedup )
         {
             if( c.keep )
-                util::putline( out, c.line );
+                out.putline( c.line );
         }
         postponed_dedup.clear();
         cached_day.clear();
@@ -2697,6 +4794,14 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
         CANDIDATE c;
         c.line = line;
         c.keep = true;
+        c.fingerprint = fingerprint;
+        c.prefix_len = 0;
+        if( p_smart_uniq && smart_uniq_by_position )
+        {
+            c.prefix_len = line.find("@H");
+            if( c.prefix_len == std::string::npos )
+                c.prefix_len = line.length();
+        }
         postponed_dedup.push_back(c);
 
         // Don't start a collection of games in one 'day' without a cached day to compare later games to
@@ -2706,10 +4811,185 @@ static void postponed_dedup_filter( bool flush, const std::string &line, std::of
                 cached_day = day;
             else
             {
-                util::putline( out, line );    // dump the game immediately
+                out.putline( line );    // dump the game immediately
                 postponed_dedup.clear();
             }
         }
     }
 }
 
+#ifdef BENCH
+
+// Count allocations, see metrics.h
+void *operator new( size_t size )
+{
+    allocation_count++;
+    void *p = malloc( size ? size : 1 );
+    if( !p )
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete( void *p ) noexcept
+{
+    free(p);
+}
+
+void operator delete( void *p, size_t ) noexcept
+{
+    free(p);
+}
+
+struct BenchStage
+{
+    double wall;
+    double cpu;
+    uint64_t allocations;
+    void start()
+    {
+        allocations = allocation_count;
+        cpu  = cpu_time();
+        wall = wall_time();
+    }
+    void stop()
+    {
+        wall = wall_time() - wall;
+        cpu  = cpu_time() - cpu;
+        allocations = allocation_count - allocations;
+    }
+};
+
+static uint64_t bench_count_lines( const std::string &fname )
+{
+    LineReader in(fname);
+    uint64_t nbr_lines = 0;
+    const char *line;
+    size_t len;
+    while( in.next_line(line,len) )
+        nbr_lines++;
+    return nbr_lines;
+}
+
+// bytes is the size of the stage's input, games is the number of games processed
+static void bench_report( const char *stage, uint64_t bytes, uint64_t games, const BenchStage &s )
+{
+    double wall = s.wall>0.0 ? s.wall : 1e-9;
+    printf( "%-20s %8.2f %8.2f %9.1f %11.0f %12llu %9.1f\n", stage, s.wall, s.cpu,
+            bytes/(1024.0*1024.0)/wall, games/wall,
+            static_cast<unsigned long long>(s.allocations), peak_rss()/(1024.0*1024.0) );
+}
+
+// Run each stage of the pipeline in isolation on a synthetic pgn file, each stage
+//  reads the file written by the previous stage
+static void bench( const PgnGenConfig &config, std::string prefix, bool keep )
+{
+    std::string pgn           = prefix + ".pgn";
+    std::string keyed         = prefix + "-keyed.tmp";
+    std::string sorted        = prefix + "-sorted.tmp";
+    std::string refined       = prefix + "-refined.tmp";
+    std::string lpgn          = prefix + ".lpgn";
+    std::string smart_lpgn    = prefix + "-smart.lpgn";
+    std::string smart_report  = prefix + "-smart-dedup.txt";
+    std::string position_lpgn = prefix + "-position.lpgn";
+    std::string position_report = prefix + "-position-dedup.txt";
+    std::string line2pgn_out  = prefix + "-out.pgn";
+    std::string words         = prefix + "-words.lpgn";
+    std::string tournament_list = prefix + "-tournaments.txt";
+    printf( "Synthetic pgn; %lu games, %d games per tournament, %d years from %d, seed %llu\n"
+            "  comment density %.3f, duplicate rate %.3f, clock comments %s, max plies %d\n\n",
+            config.nbr_games, config.games_per_tournament, config.nbr_years, config.first_year,
+            static_cast<unsigned long long>(config.seed), config.comment_density, config.duplicate_rate,
+            config.clock_comments?"yes":"no", config.max_plies );
+    printf( "%-20s %8s %8s %9s %11s %12s %9s\n", "Stage", "Wall s", "CPU s", "MB/s", "Games/s", "Allocations", "Peak MB" );
+    BenchStage s;
+
+    // Generate
+    PgnGenResult gen;
+    s.start();
+    bool ok = pgngen( pgn, config, gen );
+    s.stop();
+    if( !ok )
+        return;
+    bench_report( "generate", gen.nbr_bytes, gen.nbr_games, s );
+
+    // Convert
+    const HashedList empty;
+    EventSiteIds event_site_ids;
+    bool utf8_bom;
+    s.start();
+    pgn2line( pgn, keyed, "", "", utf8_bom, false, false, false, false, false, false, 10000, -10000,
+              empty, empty, empty, empty, &event_site_ids );
+    s.stop();
+    uint64_t nbr_games = bench_count_lines(keyed);
+    bench_report( "pgn2line", file_size(pgn), nbr_games, s );
+
+    // Sort
+    s.start();
+    event_site_ids.rank();
+    disksort( keyed, sorted, false, false,
+              [&event_site_ids]( std::string &line ) { event_site_ids.replace_id_with_rank(line); } );
+    s.stop();
+    bench_report( "disksort", file_size(keyed), nbr_games, s );
+
+    // Refinement sort, keeping sort keys
+    s.start();
+    refine_sort( sorted, refined, false, false, false, NULL );
+    s.stop();
+    bench_report( "refine_sort", file_size(sorted), nbr_games, s );
+
+    // Dedup, exact then smart
+    s.start();
+    remove_sort_keys_and_dups( refined, lpgn, false, NULL );
+    s.stop();
+    bench_report( "dedup", file_size(refined), nbr_games, s );
+    {
+        std::ofstream out_smart_uniq( smart_report );
+        s.start();
+        remove_sort_keys_and_dups( refined, smart_lpgn, false, &out_smart_uniq );
+        s.stop();
+    }
+    bench_report( "dedup -d", file_size(refined), nbr_games, s );
+    {
+        std::ofstream out_smart_uniq( position_report );
+        smart_uniq_by_position = true;
+        s.start();
+        remove_sort_keys_and_dups( refined, position_lpgn, false, &out_smart_uniq );
+        s.stop();
+        smart_uniq_by_position = false;
+    }
+    bench_report( "dedup -D", file_size(refined), nbr_games, s );
+    nbr_games = bench_count_lines(lpgn);
+
+    // Utilities that read the finished .lpgn
+    s.start();
+    line2pgn( lpgn, line2pgn_out );
+    s.stop();
+    bench_report( "line2pgn", file_size(lpgn), nbr_games, s );
+    s.start();
+    word_search( false, "Carlsen", lpgn, words );
+    s.stop();
+    bench_report( "word_search", file_size(lpgn), nbr_games, s );
+    s.start();
+    tournaments( lpgn, tournament_list );
+    s.stop();
+    bench_report( "tournaments", file_size(lpgn), nbr_games, s );
+
+    // Clean up
+    remove( keyed.c_str() );
+    remove( sorted.c_str() );
+    remove( refined.c_str() );
+    if( !keep )
+    {
+        remove( pgn.c_str() );
+        remove( lpgn.c_str() );
+        remove( smart_lpgn.c_str() );
+        remove( smart_report.c_str() );
+        remove( position_lpgn.c_str() );
+        remove( position_report.c_str() );
+        remove( line2pgn_out.c_str() );
+        remove( words.c_str() );
+        remove( tournament_list.c_str() );
+    }
+}
+
+#endif // BENCH
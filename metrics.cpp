@@ -0,0 +1,264 @@
+/*
+
+    Timing, memory and throughput measurement
+
+*/
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <string>
+#include <fstream>
+#include "util.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+#include "metrics.h"
+
+std::atomic<uint64_t> allocation_count(0);
+IoCounters io_counters;
+TempDiskUsage temp_disk_usage;
+
+double wall_time()
+{
+    auto now = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>( now.time_since_epoch() ).count();
+}
+
+double cpu_time()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if( !GetProcessTimes( GetCurrentProcess(), &creation, &exit, &kernel, &user ) )
+        return 0.0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) * 1e-7;   // 100ns units
+#else
+    struct rusage usage;
+    if( getrusage( RUSAGE_SELF, &usage ) )
+        return 0.0;
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
+uint64_t peak_rss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof(counters) ) )
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if( getrusage( RUSAGE_SELF, &usage ) )
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss;                     // bytes on macOS
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;  // kilobytes on Linux
+#endif
+#endif
+}
+
+uint64_t file_size( const std::string &fname )
+{
+    struct stat st;
+    if( stat(fname.c_str(),&st) )
+        return 0;
+    return static_cast<uint64_t>(st.st_size);
+}
+
+void TempDiskUsage::add( const std::string &fname )
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    fnames.push_back(fname);
+}
+
+uint64_t TempDiskUsage::current()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t total = 0;
+    for( const std::string &fname: fnames )
+        total += file_size(fname);     // zero if it doesn't exist (yet, or any more)
+    return total;
+}
+
+void TempDiskUsage::sample( uint64_t extra_bytes )
+{
+    uint64_t total = current() + extra_bytes;
+    uint64_t peak = peak_bytes;
+    while( total>peak && !peak_bytes.compare_exchange_weak(peak,total) )
+        ;
+}
+
+static std::string megabytes( uint64_t bytes )
+{
+    return util::sprintf( "%.1fMB", bytes/(1024.0*1024.0) );
+}
+
+static std::string json_string( const std::string &s )
+{
+    std::string out = "\"";
+    for( char c: s )
+    {
+        if( c=='"' || c=='\\' )
+        {
+            out += '\\';
+            out += c;
+        }
+        else if( static_cast<unsigned char>(c) < ' ' )
+            out += util::sprintf( "\\u%04x", c );
+        else
+            out += c;
+    }
+    out += '"';
+    return out;
+}
+
+PipelineMetrics::PipelineMetrics()
+{
+    start_wall = wall_time();
+    start_cpu  = cpu_time();
+}
+
+PipelineMetrics::~PipelineMetrics()
+{
+    end();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    if( progress.joinable() )
+        progress.join();
+}
+
+void PipelineMetrics::start_progress( double interval_seconds )
+{
+    if( interval_seconds>0.0 && !progress.joinable() )
+        progress = std::thread( &PipelineMetrics::progress_thread, this, interval_seconds );
+}
+
+void PipelineMetrics::progress_thread( double interval_seconds )
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    for(;;)
+    {
+        cv.wait_for( lock, std::chrono::duration<double>(interval_seconds) );
+        if( stopping )
+            break;
+        if( !in_stage )
+            continue;
+        temp_disk_usage.sample();
+        printf( "Progress; %.0fs, %s %.0fs, %llu lines (%s) read, %llu lines (%s) written,"
+                " temp disk %s, peak memory %s\n",
+                wall_time()-start_wall, start.name.c_str(), wall_time()-start.wall,
+                static_cast<unsigned long long>(io_counters.lines_read-start.lines_read),
+                megabytes(io_counters.bytes_read-start.bytes_read).c_str(),
+                static_cast<unsigned long long>(io_counters.lines_written-start.lines_written),
+                megabytes(io_counters.bytes_written-start.bytes_written).c_str(),
+                megabytes(temp_disk_usage.current()).c_str(), megabytes(peak_rss()).c_str() );
+        fflush(stdout);
+    }
+}
+
+void PipelineMetrics::begin( const std::string &name )
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    close_stage();
+    in_stage = true;
+    start.name = name;
+    start.wall = wall_time();
+    start.cpu  = cpu_time();
+    start.lines_read    = io_counters.lines_read;
+    start.bytes_read    = io_counters.bytes_read;
+    start.lines_written = io_counters.lines_written;
+    start.bytes_written = io_counters.bytes_written;
+}
+
+void PipelineMetrics::end()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    close_stage();
+}
+
+// Call with mtx locked
+void PipelineMetrics::close_stage()
+{
+    if( !in_stage )
+        return;
+    in_stage = false;
+    temp_disk_usage.sample();
+    StageMetrics s;
+    s.name = start.name;
+    s.wall = wall_time() - start.wall;
+    s.cpu  = cpu_time() - start.cpu;
+    s.lines_read    = io_counters.lines_read - start.lines_read;
+    s.bytes_read    = io_counters.bytes_read - start.bytes_read;
+    s.lines_written = io_counters.lines_written - start.lines_written;
+    s.bytes_written = io_counters.bytes_written - start.bytes_written;
+    s.temp_disk = temp_disk_usage.current();
+    s.peak_rss  = peak_rss();
+    stages.push_back(s);
+}
+
+void PipelineMetrics::count( const std::string &name, uint64_t value )
+{
+    counts.push_back( std::pair<std::string,uint64_t>(name,value) );
+}
+
+void PipelineMetrics::info( const std::string &name, const std::string &value )
+{
+    infos.push_back( std::pair<std::string,std::string>(name,value) );
+}
+
+bool PipelineMetrics::write_json( const std::string &fname )
+{
+    end();
+    std::ofstream out( fname );
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fname.c_str() );
+        return false;
+    }
+    out << "{\n";
+    for( auto &i: infos )
+        out << "  " << json_string(i.first) << ": " << json_string(i.second) << ",\n";
+    out << util::sprintf( "  \"wall_seconds\": %.3f,\n", wall_time()-start_wall );
+    out << util::sprintf( "  \"cpu_seconds\": %.3f,\n", cpu_time()-start_cpu );
+    out << util::sprintf( "  \"peak_rss_bytes\": %llu,\n", static_cast<unsigned long long>(peak_rss()) );
+    out << util::sprintf( "  \"temp_disk_peak_bytes\": %llu,\n", static_cast<unsigned long long>(temp_disk_usage.peak()) );
+    out << "  \"games\": {";
+    for( size_t i=0; i<counts.size(); i++ )
+        out << (i?",":"") << "\n    " << json_string(counts[i].first)
+            << util::sprintf( ": %llu", static_cast<unsigned long long>(counts[i].second) );
+    out << "\n  },\n";
+    out << "  \"stages\": [";
+    for( size_t i=0; i<stages.size(); i++ )
+    {
+        const StageMetrics &s = stages[i];
+        out << (i?",":"") << "\n    {\n";
+        out << "      \"name\": " << json_string(s.name) << ",\n";
+        out << util::sprintf( "      \"wall_seconds\": %.3f,\n", s.wall );
+        out << util::sprintf( "      \"cpu_seconds\": %.3f,\n", s.cpu );
+        out << util::sprintf( "      \"lines_read\": %llu,\n", static_cast<unsigned long long>(s.lines_read) );
+        out << util::sprintf( "      \"bytes_read\": %llu,\n", static_cast<unsigned long long>(s.bytes_read) );
+        out << util::sprintf( "      \"lines_written\": %llu,\n", static_cast<unsigned long long>(s.lines_written) );
+        out << util::sprintf( "      \"bytes_written\": %llu,\n", static_cast<unsigned long long>(s.bytes_written) );
+        out << util::sprintf( "      \"temp_disk_bytes\": %llu,\n", static_cast<unsigned long long>(s.temp_disk) );
+        out << util::sprintf( "      \"peak_rss_bytes\": %llu\n", static_cast<unsigned long long>(s.peak_rss) );
+        out << "    }";
+    }
+    out << "\n  ]\n}\n";
+    return true;
+}
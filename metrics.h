@@ -0,0 +1,101 @@
+/*
+
+    Timing, memory and throughput measurement
+
+*/
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+double wall_time();         // seconds, from an arbitrary start
+double cpu_time();          // seconds of process CPU time (all threads)
+uint64_t peak_rss();        // bytes, peak resident set size of the process so far
+uint64_t file_size( const std::string &fname );
+
+// Counts operator new calls, only in programs that replace operator new to count
+//  them (see program bench in main.cpp), otherwise stays zero
+extern std::atomic<uint64_t> allocation_count;
+
+// Lines and bytes (uncompressed text, including line ends) read by LineReader and
+//  pgn2line's pgn input and written by LineWriter, across the whole process
+struct IoCounters
+{
+    std::atomic<uint64_t> lines_read{0};
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> lines_written{0};
+    std::atomic<uint64_t> bytes_written{0};
+};
+extern IoCounters io_counters;
+
+// Temporary disk usage is the total size of the registered temporary files, plus
+//  anything unregistered the caller knows about (disksort reports its own temporary
+//  files this way). Only samples are seen, so the peak is the largest sample
+class TempDiskUsage
+{
+public:
+    void add( const std::string &fname );
+    void sample( uint64_t extra_bytes=0 );
+    uint64_t current();
+    uint64_t peak() const { return peak_bytes; }
+private:
+    std::mutex mtx;
+    std::vector<std::string> fnames;
+    std::atomic<uint64_t> peak_bytes{0};
+};
+extern TempDiskUsage temp_disk_usage;
+
+// Per stage metrics for a pipeline of stages run one after another. Each stage is
+//  measured from begin() to the next begin() or end(), optionally a progress line is
+//  printed every so often by a background thread, and at the end everything can be
+//  written as a JSON summary
+struct StageMetrics
+{
+    std::string name;
+    double wall=0.0;
+    double cpu=0.0;
+    uint64_t lines_read=0;
+    uint64_t bytes_read=0;
+    uint64_t lines_written=0;
+    uint64_t bytes_written=0;
+    uint64_t temp_disk=0;       // at the end of the stage
+    uint64_t peak_rss=0;        // process peak so far, at the end of the stage
+};
+
+class PipelineMetrics
+{
+public:
+    PipelineMetrics();
+    ~PipelineMetrics();
+    void start_progress( double interval_seconds );
+    void begin( const std::string &name );
+    void end();
+    void count( const std::string &name, uint64_t value );  // added to "games"
+    void info( const std::string &name, const std::string &value );
+    bool write_json( const std::string &fname );
+    const std::vector<StageMetrics> &get_stages() const { return stages; }
+private:
+    void close_stage();
+    void progress_thread( double interval_seconds );
+    std::vector<StageMetrics> stages;
+    std::vector< std::pair<std::string,uint64_t> > counts;
+    std::vector< std::pair<std::string,std::string> > infos;
+    bool in_stage=false;
+    StageMetrics start;         // counters at the start of the current stage
+    double start_wall;
+    double start_cpu;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping=false;
+    std::thread progress;
+};
+
+#endif // METRICS_H_INCLUDED
@@ -0,0 +1,642 @@
+/*
+
+    Compact move encoding, see movecode.h
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include "thc.h"
+#include "movecode.h"
+
+bool MoveCoder::set_start( const std::string &fen )
+{
+    legal_valid = false;
+    if( fen == "" )
+    {
+        thc::ChessPosition::Init();
+        thc::ChessRules::Init();
+        return true;
+    }
+    return Forsyth( fen.c_str() );
+}
+
+void MoveCoder::legal_moves( std::vector<thc::Move> &legal )
+{
+    thc::MOVELIST list;
+    GenMoveList( &list );
+    legal.clear();
+
+    // Unless we are in check, only a king move, en passant or a move by a pinned
+    //  piece can expose the king, so only those need the (slow) full test
+    int king = white ? wking_square : bking_square;
+    bool in_check = AttackedSquare( static_cast<thc::Square>(king), !white );
+    bool pinned[64] = {false};
+    if( !in_check )
+    {
+        static const int dirs[8][2] = { {0,1}, {0,-1}, {1,0}, {-1,0}, {1,1}, {1,-1}, {-1,1}, {-1,-1} };
+        int king_file = king&7, king_rank = king>>3;
+        for( int d=0; d<8; d++ )
+        {
+            bool diagonal = (dirs[d][0]!=0 && dirs[d][1]!=0);
+            int file = king_file + dirs[d][0];
+            int rank = king_rank + dirs[d][1];
+            int own = -1;
+            for( ; 0<=file && file<8 && 0<=rank && rank<8; file+=dirs[d][0], rank+=dirs[d][1] )
+            {
+                char piece = squares[file + 8*rank];
+                if( piece == ' ' )
+                    continue;
+                bool ours = white ? isupper(piece) : islower(piece);
+                if( ours )
+                {
+                    if( own >= 0 )
+                        break;
+                    own = file + 8*rank;
+                    continue;
+                }
+                piece = static_cast<char>( toupper(piece) );
+                if( own>=0 && (piece=='Q' || piece==(diagonal?'B':'R')) )
+                    pinned[own] = true;
+                break;
+            }
+        }
+    }
+    for( int i=0; i<list.count; i++ )
+    {
+        thc::Move &mv = list.moves[i];
+        bool test = in_check || mv.src==king || pinned[mv.src] || mv.special==thc::SPECIAL_WEN_PASSANT || mv.special==thc::SPECIAL_BEN_PASSANT;
+        if( !test )
+        {
+            legal.push_back( mv );
+            continue;
+        }
+        PushMove( mv );
+        thc::Square king_after = static_cast<thc::Square>( white ? bking_square : wking_square );
+        if( !AttackedPiece(king_after) )
+            legal.push_back( mv );
+        PopMove( mv );
+    }
+}
+
+std::string MoveCoder::san( const std::vector<thc::Move> &legal, thc::Move mv ) const
+{
+    std::string s;
+    switch( mv.special )
+    {
+        case thc::SPECIAL_WK_CASTLING:
+        case thc::SPECIAL_BK_CASTLING:  return "O-O";
+        case thc::SPECIAL_WQ_CASTLING:
+        case thc::SPECIAL_BQ_CASTLING:  return "O-O-O";
+        default: break;
+    }
+    char piece = static_cast<char>( toupper(squares[mv.src]) );
+    char src_file = 'a' + (mv.src&7);
+    char src_rank = '8' - (mv.src>>3);
+    bool capture = mv.capture!=' ' || mv.special==thc::SPECIAL_WEN_PASSANT || mv.special==thc::SPECIAL_BEN_PASSANT;
+    if( piece == 'P' )
+    {
+        if( capture )
+        {
+            s += src_file;
+            s += 'x';
+        }
+    }
+    else
+    {
+        s += piece;
+
+        // Disambiguate if another piece of the same type can reach the same square
+        bool ambiguous=false, same_file=false, same_rank=false;
+        for( const thc::Move &other: legal )
+        {
+            if( other.dst==mv.dst && other.src!=mv.src && squares[other.src]==squares[mv.src] )
+            {
+                ambiguous = true;
+                if( (other.src&7) == (mv.src&7) )
+                    same_file = true;
+                if( (other.src>>3) == (mv.src>>3) )
+                    same_rank = true;
+            }
+        }
+        if( ambiguous )
+        {
+            if( !same_file )
+                s += src_file;
+            else if( !same_rank )
+                s += src_rank;
+            else
+            {
+                s += src_file;
+                s += src_rank;
+            }
+        }
+        if( capture )
+            s += 'x';
+    }
+    s += static_cast<char>( 'a' + (mv.dst&7) );
+    s += static_cast<char>( '8' - (mv.dst>>3) );
+    switch( mv.special )
+    {
+        case thc::SPECIAL_PROMOTION_QUEEN:  s += "=Q";    break;
+        case thc::SPECIAL_PROMOTION_ROOK:   s += "=R";    break;
+        case thc::SPECIAL_PROMOTION_BISHOP: s += "=B";    break;
+        case thc::SPECIAL_PROMOTION_KNIGHT: s += "=N";    break;
+        default: break;
+    }
+    return s;
+}
+
+bool MoveCoder::encode( const char *san, size_t len, uint8_t &code )
+{
+    // Ignore check, mate and annotation suffixes
+    while( len>0 && strchr("+#!?",san[len-1]) )
+        len--;
+    error = "unreadable";
+    if( len < 2 )
+        return false;
+    if( !legal_valid )
+        legal_moves( legal );
+    legal_valid = false;
+
+    // Castling
+    int castling = 0;
+    if( len==3 && (0==memcmp(san,"O-O",3) || 0==memcmp(san,"0-0",3)) )
+        castling = 1;
+    else if( len==5 && (0==memcmp(san,"O-O-O",5) || 0==memcmp(san,"0-0-0",5)) )
+        castling = 2;
+    int found = -1;
+    if( castling )
+    {
+        error = "illegal";
+        for( size_t i=0; i<legal.size(); i++ )
+        {
+            thc::SPECIAL special = legal[i].special;
+            if( castling==1 ? (special==thc::SPECIAL_WK_CASTLING || special==thc::SPECIAL_BK_CASTLING)
+                            : (special==thc::SPECIAL_WQ_CASTLING || special==thc::SPECIAL_BQ_CASTLING) )
+                found = static_cast<int>(i);
+        }
+    }
+    else
+    {
+
+        // [piece] [from file] [from rank] [x] to_file to_rank [[=]promotion]
+        char piece = 'P';
+        if( strchr("KQRBN",san[0]) )
+        {
+            piece = san[0];
+            san++;
+            len--;
+        }
+        thc::SPECIAL promotion = thc::NOT_SPECIAL;
+        if( piece=='P' && len>=3 && strchr("QRBNqrbn",san[len-1]) )
+        {
+            switch( toupper(san[len-1]) )
+            {
+                case 'Q': promotion = thc::SPECIAL_PROMOTION_QUEEN;     break;
+                case 'R': promotion = thc::SPECIAL_PROMOTION_ROOK;      break;
+                case 'B': promotion = thc::SPECIAL_PROMOTION_BISHOP;    break;
+                case 'N': promotion = thc::SPECIAL_PROMOTION_KNIGHT;    break;
+            }
+            len--;
+            if( san[len-1] == '=' )
+                len--;
+        }
+        char from_file=0, from_rank=0;
+        char to_file=0, to_rank=0;
+        for( size_t i=0; i<len; i++ )
+        {
+            char c = san[i];
+            if( 'a'<=c && c<='h' )
+            {
+                if( to_file )
+                    from_file = to_file;
+                to_file = c;
+            }
+            else if( '1'<=c && c<='8' )
+            {
+                if( to_rank )
+                    from_rank = to_rank;
+                to_rank = c;
+            }
+            else if( c!='x' && c!=':' && c!='-' )
+                return false;
+        }
+        if( !to_file || !to_rank )
+            return false;
+        error = "illegal";
+        int dst = (to_file-'a') + 8*('8'-to_rank);
+        if( piece=='P' && !from_file )
+            from_file = to_file;      // "e4", a pawn that doesn't capture stays on its file
+        for( size_t i=0; i<legal.size(); i++ )
+        {
+            const thc::Move &mv = legal[i];
+            if( mv.dst!=dst || toupper(squares[mv.src])!=piece )
+                continue;
+            if( from_file && (mv.src&7)!=from_file-'a' )
+                continue;
+            if( from_rank && (mv.src>>3)!='8'-from_rank )
+                continue;
+            bool is_promotion = (mv.special>=thc::SPECIAL_PROMOTION_QUEEN && mv.special<=thc::SPECIAL_PROMOTION_KNIGHT);
+            if( is_promotion ? mv.special!=promotion : promotion!=thc::NOT_SPECIAL )
+                continue;
+            if( found >= 0 )
+            {
+                error = "ambiguous";
+                return false;
+            }
+            found = static_cast<int>(i);
+        }
+    }
+    if( found < 0 )
+        return false;
+    code = static_cast<uint8_t>(found);
+    PlayMove( legal[found] );
+    return true;
+}
+
+bool MoveCoder::decode( uint8_t code, thc::Move &mv, std::string *san_out )
+{
+    if( !legal_valid )
+        legal_moves( legal );
+    legal_valid = false;
+    if( code >= legal.size() )
+        return false;
+    mv = legal[code];
+    if( !san_out )
+    {
+        PlayMove( mv );
+        return true;
+    }
+
+    // The suffix needs the legal moves after the move, keep them for the next move
+    *san_out = san( legal, mv );
+    PlayMove( mv );
+    legal_moves( legal );
+    legal_valid = true;
+    if( AttackedSquare( white ? wking_square : bking_square, !white ) )
+        *san_out += (legal.size()==0 ? '#' : '+');
+    return true;
+}
+
+// The tokens of the main line of PGN movetext, move numbers are skipped. Comments
+//  ("{...}" or ";..." to the end of the line), whole variations and NAGs are
+//  token_text. f( kind, token, token_len ) returns false to stop
+enum MovetextToken { token_move, token_result, token_unreadable, token_text };
+template <class F> static void main_line_tokens( const char *movetext, size_t len, F f )
+{
+    const char *p = movetext;
+    const char *end = movetext+len;
+    int depth = 0;          // of variations
+    const char *variation = NULL;
+    while( p < end )
+    {
+        char c = *p;
+        const char *text = p;
+        if( c=='{' )
+        {
+            const char *q = static_cast<const char *>( memchr(p,'}',end-p) );
+            p = q ? q+1 : end;
+        }
+        else if( c==';' )
+        {
+            const char *q = static_cast<const char *>( memchr(p,'\n',end-p) );
+            p = q ? q : end;
+        }
+        else if( c=='(' )
+        {
+            if( depth++ == 0 )
+                variation = p;
+            p++;
+            continue;
+        }
+        else if( c==')' )
+        {
+            p++;
+            if( depth == 0 )
+                continue;
+            if( --depth > 0 )
+                continue;
+            text = variation;
+        }
+        else if( isascii(c) && isspace(c) )
+        {
+            p++;
+            continue;
+        }
+        else
+        {
+            const char *token = p;
+            while( p<end && !(isascii(*p) && isspace(*p)) && !strchr("{};()",*p) )
+                p++;
+            if( p == token )
+                p++;        // stray '}'
+            if( depth > 0 )
+                continue;
+            size_t token_len = p-token;
+            MovetextToken kind = token_move;
+
+            // Skip move numbers
+            if( isdigit(*token) )
+            {
+                size_t i=0;
+                while( i<token_len && isdigit(token[i]) )
+                    i++;
+                while( i<token_len && token[i]=='.' )
+                    i++;
+                if( i == token_len )
+                    continue;       // "12." or "12..."
+                if( token_len>=3 && (0==memcmp(token,"1-0",3) || 0==memcmp(token,"0-1",3) || 0==memcmp(token,"1/2",3)) )
+                    kind = token_result;
+                else if( token[i-1] == '.' )
+                {
+                    token += i;     // "12.e4"
+                    token_len -= i;
+                }
+                else if( token[0] != '0' )
+                    kind = token_unreadable;   // "0-0" castling is the only move starting with a digit
+            }
+            else if( *token == '$' )
+                kind = token_text;
+            else if( *token == '*' )
+                kind = token_result;
+            if( !f(kind,token,token_len) )
+                return;
+            continue;
+        }
+        if( depth==0 && !f(token_text,text,p-text) )
+            return;
+    }
+    if( depth > 0 )
+        f( token_text, variation, end-variation );     // unterminated variation
+}
+
+bool encode_movetext( const std::string &fen, const char *movetext, size_t len, std::string &codes )
+{
+    codes.clear();
+    MoveCoder coder;
+    if( !coder.set_start(fen) )
+        return false;
+    bool ok = true;
+    main_line_tokens( movetext, len, [&]( MovetextToken kind, const char *token, size_t token_len )
+    {
+        if( kind==token_result || kind==token_text )
+            return true;
+        uint8_t code;
+        if( kind==token_unreadable || !coder.encode(token,token_len,code) )
+            ok = false;
+        else
+            codes += static_cast<char>(code);
+        return ok;
+    } );
+    return ok;
+}
+
+bool validate_movetext( const std::string &fen, const char *movetext, size_t len, int &ply, std::string &reason )
+{
+    ply = 0;
+    reason.clear();
+    MoveCoder coder;
+    if( !coder.set_start(fen) )
+    {
+        reason = "bad FEN";
+        return false;
+    }
+    bool result = false;    // last token was a result
+    main_line_tokens( movetext, len, [&]( MovetextToken kind, const char *token, size_t token_len )
+    {
+        if( kind == token_text )
+            return true;
+        result = (kind == token_result);
+        if( result )
+            return true;
+        uint8_t code;
+        if( kind==token_unreadable || !coder.encode(token,token_len,code) )
+        {
+            ply++;
+            reason = std::string( kind==token_unreadable ? "unreadable" : coder.encode_error() ) +
+                     " move " + std::string(token,token_len);
+            return false;
+        }
+        ply++;
+        return true;
+    } );
+    if( reason=="" && !result )
+        reason = "no result at end of moves (truncated?)";
+    return reason == "";
+}
+
+bool fingerprint_movetext( const std::string &fen, const char *movetext, size_t len, uint64_t &fingerprint, int &ply )
+{
+    fingerprint = 0;
+    ply = 0;
+    thc::ChessRules cr;
+    if( fen!="" && !cr.Forsyth(fen.c_str()) )
+        return false;
+    uint64_t hash = cr.Hash64Calculate();
+    fingerprint = cr.white ? hash : ~hash;
+    bool ok = true;
+    main_line_tokens( movetext, len, [&]( MovetextToken kind, const char *token, size_t token_len )
+    {
+        if( kind==token_result || kind==token_text )
+            return true;
+
+        // Check, mate and annotation suffixes and 0-0 castling are all read the same way
+        while( token_len>0 && strchr("+#!?",token[token_len-1]) )
+            token_len--;
+        char buf[16];
+        thc::Move mv;
+        ok = (kind==token_move && 0<token_len && token_len<sizeof(buf));
+        if( ok )
+        {
+            memcpy( buf, token, token_len );
+            buf[token_len] = '\0';
+            if( buf[0] == '0' )
+            {
+                for( size_t i=0; i<token_len; i++ )
+                {
+                    if( buf[i] == '0' )
+                        buf[i] = 'O';
+                }
+            }
+            ok = mv.NaturalInFast(&cr,buf) || mv.NaturalIn(&cr,buf);
+        }
+        if( !ok )
+            return false;
+        hash = cr.Hash64Update( hash, mv );
+        cr.PlayMove( mv );
+        fingerprint = (fingerprint ^ hash) * 0x9e3779b97f4a7c15ULL;
+        fingerprint ^= fingerprint >> 29;
+        ply++;
+        return true;
+    } );
+    return ok;
+}
+
+// Comment, variation, NAG or annotation glyphs as compact text. A ";" comment becomes
+//  a "{}" comment, since line breaks aren't kept
+static void compact_text( const char *text, size_t len, std::string &compact )
+{
+    compact += COMPACT_TEXT;
+    bool rest_of_line = (len>0 && *text==';');
+    if( rest_of_line )
+    {
+        compact += '{';
+        text++;
+        len--;
+    }
+    for( size_t i=0; i<len; i++ )
+    {
+        char c = text[i];
+        if( 0<=c && c<' ' )
+            c = ' ';    // including line breaks and the COMPACT_ bytes
+        else if( rest_of_line && c=='}' )
+            c = ')';
+        compact += c;
+    }
+    if( rest_of_line )
+        compact += '}';
+    compact += COMPACT_END;
+}
+
+static const char *compact_results[] = { "1-0", "0-1", "1/2-1/2", "*" };
+
+bool compact_movetext( const std::string &fen, const char *movetext, size_t len, std::string &compact )
+{
+    compact.clear();
+    MoveCoder coder;
+    if( !coder.set_start(fen) )
+        return false;
+    bool ok = true;
+    main_line_tokens( movetext, len, [&]( MovetextToken kind, const char *token, size_t token_len )
+    {
+        if( kind == token_result )
+        {
+            for( int i=0; i<4; i++ )
+            {
+                if( token_len==strlen(compact_results[i]) && 0==memcmp(token,compact_results[i],token_len) )
+                {
+                    compact += static_cast<char>( COMPACT_RESULT+i );
+                    return true;
+                }
+            }
+        }
+        if( kind==token_result || kind==token_text )
+        {
+            compact_text( token, token_len, compact );
+            return true;
+        }
+
+        // Check and mate are worked out again by expand_movetext(), glyphs are kept
+        size_t move_len = token_len;
+        while( move_len>0 && strchr("+#!?",token[move_len-1]) )
+            move_len--;
+        uint8_t code;
+        ok = (kind==token_move && coder.encode(token,move_len,code));
+        if( !ok )
+            return false;
+        compact += static_cast<char>( COMPACT_MOVE+code );
+        std::string glyphs;
+        for( size_t i=move_len; i<token_len; i++ )
+        {
+            if( token[i]=='!' || token[i]=='?' )
+                glyphs += token[i];
+        }
+        if( glyphs.length() > 0 )
+            compact_text( glyphs.c_str(), glyphs.length(), compact );
+        return true;
+    } );
+    return ok;
+}
+
+bool expand_movetext( const std::string &fen, const std::string &compact, std::string &movetext )
+{
+    movetext.clear();
+    MoveCoder coder;
+    if( !coder.set_start(fen) )
+        return false;
+
+    // One long line first
+    std::string s;
+    bool need_number = true;    // for a move by Black, at the start or after text
+    size_t i=0, len=compact.length();
+    while( i < len )
+    {
+        unsigned char b = static_cast<unsigned char>( compact[i++] );
+        if( b >= COMPACT_MOVE )
+        {
+            if( s.length() > 0 )
+                s += ' ';
+            if( coder.white )
+                s += std::to_string(coder.full_move_count) + ". ";
+            else if( need_number )
+                s += std::to_string(coder.full_move_count) + "... ";
+            need_number = false;
+            thc::Move mv;
+            std::string san;
+            if( !coder.decode( static_cast<uint8_t>(b-COMPACT_MOVE), mv, &san ) )
+                return false;
+            s += san;
+        }
+        else if( b == COMPACT_TEXT )
+        {
+            size_t end = compact.find( COMPACT_END, i );
+            if( end == std::string::npos )
+                return false;
+            bool glyphs = (end>i && (compact[i]=='!' || compact[i]=='?'));
+            if( !glyphs )
+            {
+                if( s.length() > 0 )
+                    s += ' ';
+                need_number = true;
+            }
+            s.append( compact, i, end-i );
+            i = end+1;
+        }
+        else if( COMPACT_RESULT<=b && b<COMPACT_RESULT+4 )
+        {
+            if( s.length() > 0 )
+                s += ' ';
+            s += compact_results[b-COMPACT_RESULT];
+        }
+        else
+            return false;
+    }
+
+    // Then lines of at most 79 characters, broken at spaces
+    size_t start = 0;
+    len = s.length();
+    while( len-start > 79 )
+    {
+        size_t brk = s.rfind( ' ', start+79 );
+        if( brk==std::string::npos || brk<=start )
+            brk = s.find( ' ', start+79 );
+        if( brk == std::string::npos )
+            break;
+        movetext.append( s, start, brk-start );
+        movetext += '\n';
+        start = brk+1;
+    }
+    movetext.append( s, start, std::string::npos );
+    return true;
+}
+
+bool decode_moves( const std::string &fen, const std::string &codes, std::vector<std::string> &san )
+{
+    san.clear();
+    MoveCoder coder;
+    if( !coder.set_start(fen) )
+        return false;
+    for( char c: codes )
+    {
+        thc::Move mv;
+        std::string s;
+        if( !coder.decode( static_cast<uint8_t>(c), mv, &s ) )
+            return false;
+        san.push_back(s);
+    }
+    return true;
+}
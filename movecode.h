@@ -0,0 +1,90 @@
+/*
+
+    Compact move encoding
+
+    A move is encoded as its index in the list of legal moves in the position (in
+    thc's move generation order), so one byte per move is always enough (there are
+    never more than 218 legal moves in a chess position). Decoding needs the same
+    list, so moves can only be decoded in order from the start position.
+
+*/
+
+#ifndef MOVECODE_H_INCLUDED
+#define MOVECODE_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "thc.h"
+
+class MoveCoder : public thc::ChessRules
+{
+public:
+
+    // Standard starting position, or a FEN position (returns false if the FEN is bad)
+    bool set_start( const std::string &fen="" );
+
+    // Legal moves in the current position. Unlike ChessRules::GenLegalMoveList() this
+    //  doesn't evaluate every move for mate and stalemate, which makes it several times
+    //  faster, the moves are in the same order
+    void legal_moves( std::vector<thc::Move> &legal );
+
+    // SAN for a move in the current position, without a check or mate suffix, legal
+    //  is the current legal move list
+    std::string san( const std::vector<thc::Move> &legal, thc::Move mv ) const;
+
+    // Encode a SAN move (annotations like '+', '!?' are ignored) in the current position
+    //  and play it, returns false if the move isn't legal (or is ambiguous)
+    bool encode( const char *san, size_t len, uint8_t &code );
+
+    // Why encode() last returned false, "unreadable", "illegal" or "ambiguous"
+    const char *encode_error() const { return error; }
+
+    // Decode a move in the current position and play it, returns false if the code is
+    //  out of range. Optionally get the move's SAN (with a check or mate suffix)
+    bool decode( uint8_t code, thc::Move &mv, std::string *san=NULL );
+
+private:
+    std::vector<thc::Move> legal;
+    bool legal_valid=false;     // legal is the legal move list for the current position
+    const char *error="";
+};
+
+// Encode the main line of PGN movetext (comments, variations, NAGs, move numbers
+//  and results are skipped), one byte per move. Returns false if a move can't be
+//  encoded, codes then holds the moves before it
+bool encode_movetext( const std::string &fen, const char *movetext, size_t len, std::string &codes );
+
+// Check the main line of PGN movetext is legal and ends with a result. Returns false
+//  with the reason if not, ply is then the half move with the problem (0 if the FEN
+//  is bad, the number of moves if there's no result)
+bool validate_movetext( const std::string &fen, const char *movetext, size_t len, int &ply, std::string &reason );
+
+// Fingerprint of the main line of PGN movetext, from the positions (thc's Hash64) the
+//  moves reach, so games with the same moves have the same fingerprint however the
+//  moves are written (Nbd2 or Nd2, O-O or 0-0, with or without + and #). Returns
+//  false if a move can't be read, ply is the number of moves
+bool fingerprint_movetext( const std::string &fen, const char *movetext, size_t len, uint64_t &fingerprint, int &ply );
+
+// Compact movetext, the moves of the main line one byte each for archival .lpgn files
+//  (see program lpgnm). A move is COMPACT_MOVE plus its code. Comments, variations,
+//  NAGs and annotation glyphs (!, ?) are kept as text between COMPACT_TEXT and
+//  COMPACT_END, a result is COMPACT_RESULT plus 0 to 3 for 1-0, 0-1, 1/2-1/2 and *
+#define COMPACT_TEXT    0x01
+#define COMPACT_END     0x02
+#define COMPACT_RESULT  0x03
+#define COMPACT_MOVE    0x20
+
+// PGN movetext (lines separated by '\n') to compact movetext, returns false if a main
+//  line move can't be encoded
+bool compact_movetext( const std::string &fen, const char *movetext, size_t len, std::string &compact );
+
+// Compact movetext back to PGN movetext with standard SAN moves (with check and mate
+//  suffixes) and move numbers, in lines of at most 79 characters separated by '\n'.
+//  Returns false if the compact movetext is bad
+bool expand_movetext( const std::string &fen, const std::string &compact, std::string &movetext );
+
+// Decode to SAN moves, returns false if a code is bad (san then holds the moves before it)
+bool decode_moves( const std::string &fen, const std::string &codes, std::vector<std::string> &san );
+
+#endif // MOVECODE_H_INCLUDED
@@ -0,0 +1,191 @@
+/*
+
+    Synthetic PGN generator, for benchmarks
+
+    Timing the pgn2line suite on private collections isn't repeatable, so the
+    bench program generates its own input. Everything is driven by a simple
+    private random number generator (not std::rand() or the std distributions,
+    which vary between platforms) so a given seed and configuration always
+    produces exactly the same file.
+
+*/
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "thc.h"
+#include "movecode.h"
+#include "util.h"
+#include "pgngen.h"
+
+// SplitMix64
+class GenRandom
+{
+public:
+    GenRandom( uint64_t seed ) : state(seed) {}
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+        return z ^ (z>>31);
+    }
+    int range( int n )  { return n<=1 ? 0 : static_cast<int>(next() % static_cast<uint64_t>(n)); }
+    bool chance( double probability ) { return (next()>>11) * (1.0/9007199254740992.0) < probability; }
+private:
+    uint64_t state;
+};
+
+static const char *surnames[] =
+{
+    "Smith", "Jones", "Nakamura", "Carlsen", "Ivanchuk", "Forster", "Garcia", "Muller",
+    "Kowalski", "Nguyen", "Singh", "Rossi", "Petrov", "Larsen", "Dubois", "Silva",
+    "Cohen", "Ozturk", "Andersson", "Tanaka", "Fischer", "Novak", "Horvath", "Popescu"
+};
+static const char *sites[] =
+{
+    "Wellington NZL", "Auckland NZL", "Berlin GER", "Reykjavik ISL", "Gibraltar",
+    "Wijk aan Zee NED", "Hastings ENG", "Moscow RUS", "St Louis USA", "Chennai IND"
+};
+static const char *events[] =
+{
+    "Open", "Championship", "Masters", "Rapid", "Invitational", "Congress", "Memorial", "Cup"
+};
+static const char *comments[] =
+{
+    "A natural move", "The main line", "Interesting, but White has better",
+    "Black is fine here", "The critical moment of the game", "Dubious",
+    "Missing a tactical shot", "Time trouble was approaching"
+};
+#define NBR(array) (sizeof(array)/sizeof(array[0]))
+
+static std::string player_name( GenRandom &rnd )
+{
+    return util::sprintf( "%s%d, %c.", surnames[rnd.range(NBR(surnames))], rnd.range(100), 'A'+rnd.range(26) );
+}
+
+static void add_token( std::string &moves, std::string &current_line, const std::string &token )
+{
+    if( current_line.length()>0 && current_line.length()+1+token.length() > 79 )
+    {
+        moves += current_line;
+        moves += '\n';
+        current_line.clear();
+    }
+    if( current_line.length() > 0 )
+        current_line += ' ';
+    current_line += token;
+}
+
+// Random legal game, as the move text of a PGN game (with result)
+static void random_game( GenRandom &rnd, const PgnGenConfig &config, std::string &moves, std::string &result )
+{
+    MoveCoder cr;
+    std::vector<thc::Move> legal;
+    std::string current_line;
+    moves.clear();
+    int nbr_plies = 10 + rnd.range( config.max_plies>10 ? config.max_plies-10 : 1 );
+    int clock_white = 180, clock_black = 180;
+    result = "*";
+    cr.legal_moves( legal );
+    for( int ply=0; ply<nbr_plies && legal.size()>0; ply++ )
+    {
+        thc::Move mv = legal[ rnd.range(static_cast<int>(legal.size())) ];
+        std::string move = cr.san( legal, mv );
+        if( cr.white )
+            add_token( moves, current_line, util::sprintf("%d.",cr.full_move_count) );
+        int &clock = cr.white ? clock_white : clock_black;
+        cr.PlayMove( mv );
+        cr.legal_moves( legal );
+        bool check = cr.AttackedSquare( cr.white ? cr.wking_square : cr.bking_square, !cr.white );
+        if( legal.size() == 0 )
+        {
+            if( check )
+            {
+                move += '#';
+                result = cr.white ? "0-1" : "1-0";
+            }
+            else
+                result = "1/2-1/2";
+        }
+        else if( check )
+            move += '+';
+        add_token( moves, current_line, move );
+        if( config.clock_comments )
+        {
+            clock -= rnd.range(8);
+            if( clock < 1 )
+                clock = 1;
+            add_token( moves, current_line, util::sprintf("{ [%%clk 0:%02d:%02d] }", clock/60, clock%60) );
+        }
+        if( config.comment_density>0.0 && rnd.chance(config.comment_density) )
+            add_token( moves, current_line, util::sprintf("{%s}", comments[rnd.range(NBR(comments))]) );
+    }
+    if( result == "*" )
+    {
+        static const char *results[] = { "1-0", "0-1", "1/2-1/2" };
+        result = results[ rnd.range(3) ];
+    }
+    add_token( moves, current_line, result );
+    moves += current_line;
+    moves += '\n';
+}
+
+bool pgngen( const std::string &fout, const PgnGenConfig &config, PgnGenResult &result )
+{
+    result = PgnGenResult();
+    std::ofstream out( fout, std::ios_base::out | std::ios_base::binary );
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+        return false;
+    }
+    GenRandom rnd( config.seed );
+    int games_per_tournament = config.games_per_tournament>0 ? config.games_per_tournament : 1;
+    int nbr_rounds = games_per_tournament<9 ? games_per_tournament : 9;
+    int nbr_boards = (games_per_tournament+nbr_rounds-1) / nbr_rounds;
+    int nbr_years  = config.nbr_years>0 ? config.nbr_years : 1;
+    std::string game;
+    std::string moves;
+    std::string game_result;
+    unsigned long tournament_nbr = 0;
+    while( result.nbr_games < config.nbr_games )
+    {
+
+        // A new tournament, games are written round by round, a day per round
+        tournament_nbr++;
+        std::string event = util::sprintf( "%s %s %lu", surnames[rnd.range(NBR(surnames))],
+                                           events[rnd.range(NBR(events))], tournament_nbr );
+        const char *site = sites[ rnd.range(NBR(sites)) ];
+        int year  = config.first_year + rnd.range(nbr_years);
+        int month = 1 + rnd.range(12);
+        int day   = 1 + rnd.range(20);
+        for( int i=0; i<games_per_tournament && result.nbr_games<config.nbr_games; i++ )
+        {
+            int round = 1 + i/nbr_boards;
+            int board = 1 + i%nbr_boards;
+            if( result.nbr_games>0 && rnd.chance(config.duplicate_rate) )
+            {
+                out.write( game.c_str(), game.length() );   // an exact duplicate of the previous game
+                result.nbr_bytes += game.length();
+                result.nbr_games++;
+            }
+            random_game( rnd, config, moves, game_result );
+            game  = util::sprintf( "[Event \"%s\"]\n", event.c_str() );
+            game += util::sprintf( "[Site \"%s\"]\n", site );
+            game += util::sprintf( "[Date \"%04d.%02d.%02d\"]\n", year, month, day+round-1 );
+            game += util::sprintf( "[Round \"%d.%d\"]\n", round, board );
+            game += util::sprintf( "[White \"%s\"]\n", player_name(rnd).c_str() );
+            game += util::sprintf( "[Black \"%s\"]\n", player_name(rnd).c_str() );
+            game += util::sprintf( "[Result \"%s\"]\n", game_result.c_str() );
+            game += '\n';
+            game += moves;
+            game += '\n';
+            out.write( game.c_str(), game.length() );
+            result.nbr_bytes += game.length();
+            result.nbr_games++;
+        }
+    }
+    return true;
+}
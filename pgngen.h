@@ -0,0 +1,36 @@
+/*
+
+    Synthetic PGN generator, for benchmarks
+
+*/
+
+#ifndef PGNGEN_H_INCLUDED
+#define PGNGEN_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+
+struct PgnGenConfig
+{
+    unsigned long nbr_games = 10000;
+    uint64_t seed = 1;                  // same seed, same config -> same pgn
+    int games_per_tournament = 50;
+    int first_year = 2000;
+    int nbr_years = 20;                 // tournament dates are spread over this many years
+    double comment_density = 0.05;      // fraction of moves followed by a text comment
+    double duplicate_rate = 0.02;       // fraction of games that repeat the previous game
+    bool clock_comments = false;        // lichess style { [%clk 0:02:59] } after every move
+    int max_plies = 120;
+};
+
+struct PgnGenResult
+{
+    unsigned long nbr_games = 0;        // including duplicates
+    uint64_t nbr_bytes = 0;
+};
+
+// Games are random but legal (generated with thc), grouped into tournaments played
+//  round by round. Returns false if fout can't be written
+bool pgngen( const std::string &fout, const PgnGenConfig &config, PgnGenResult &result );
+
+#endif // PGNGEN_H_INCLUDED
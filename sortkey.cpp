@@ -0,0 +1,157 @@
+/*
+
+    Sort keys carried by the lines of pgn2line's temporary files
+
+    Previously the temporary files were sorted on the textual line prefix, with a
+    9 digit tie breaker embedded in the prefix that had to be cut out again at the
+    end. Now a sort key precedes the line proper (see sortkey.h). The key orders
+    lines exactly as the old prefix did, but the sort stages compare short fixed
+    width fields, the refinement sort patches fields in place, and the key is
+    simply dropped from the front of each line on final output.
+
+*/
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "sortkey.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+void sort_key_append_hex( std::string &s, uint64_t value, int nbr_digits )
+{
+    for( int shift=(nbr_digits-1)*4; shift>=0; shift-=4 )
+        s += hex_digits[ (value>>shift) & 0x0f ];
+}
+
+void sort_key_set_hex( std::string &line, size_t offset, uint32_t value )
+{
+    for( int i=7; i>=0; i-- )
+    {
+        line[offset+i] = hex_digits[ value & 0x0f ];
+        value >>= 4;
+    }
+}
+
+static bool parse_hex( const char *p, int nbr_digits, uint64_t &value )
+{
+    value = 0;
+    for( int i=0; i<nbr_digits; i++ )
+    {
+        char c = p[i];
+        int digit;
+        if( '0'<=c && c<='9' )
+            digit = c-'0';
+        else if( 'a'<=c && c<='f' )
+            digit = c-'a'+10;
+        else
+            return false;
+        value = (value<<4) | digit;
+    }
+    return true;
+}
+
+bool sort_key_parse( const std::string &line, SortKey &key )
+{
+    const char *p = line.c_str();
+    size_t len = line.length();
+    if( len < sort_key_round_offset+1 )
+        return false;
+    uint64_t t, e, g;
+    if( !parse_hex(p+sort_key_tournament_date_offset,8,t) ||
+        !parse_hex(p+sort_key_event_site_offset,8,e) ||
+        !parse_hex(p+sort_key_game_date_offset,8,g) )
+        return false;
+    const char *space = static_cast<const char *>( memchr(p+sort_key_round_offset,' ',len-sort_key_round_offset) );
+    if( !space )
+        return false;
+    size_t offset = (space-p) + 1;
+    if( len < offset+16+1 || !parse_hex(p+offset,16,key.tie_breaker) || p[offset+16]!='\t' )
+        return false;
+    key.tournament_date = static_cast<uint32_t>(t);
+    key.event_site      = static_cast<uint32_t>(e);
+    key.game_date       = static_cast<uint32_t>(g);
+    key.text_offset     = offset+16+1;
+    return true;
+}
+
+// Date "yyyy-mm-dd" as yyyymmdd
+static bool parse_date( const char *p, uint32_t &yyyymmdd )
+{
+    yyyymmdd = 0;
+    for( int i=0; i<10; i++ )
+    {
+        if( i==4 || i==7 )
+        {
+            if( p[i] != '-' )
+                return false;
+        }
+        else if( '0'<=p[i] && p[i]<='9' )
+            yyyymmdd = yyyymmdd*10 + (p[i]-'0');
+        else
+            return false;
+    }
+    return true;
+}
+
+// Line format "yyyy-mm-dd Event, Site # yyyy-mm-dd Round White-Black@H..."
+bool sort_key_from_line( const std::string &line, EventSiteIds &event_site_ids, uint64_t tie_breaker, std::string &keyed_line )
+{
+    uint32_t tournament_date, game_date;
+    if( line.length()<11 || line[10]!=' ' || !parse_date(line.c_str(),tournament_date) )
+        return false;
+    size_t offset = line.find(" # ",11);
+    if( offset==std::string::npos || line.length()<offset+3+11 || line[offset+3+10]!=' ' ||
+        !parse_date(line.c_str()+offset+3,game_date) )
+        return false;
+    size_t round_offset = offset+3+11;
+    size_t round_end = line.find(' ',round_offset);
+    if( round_end == std::string::npos )
+        return false;
+    keyed_line.clear();
+    sort_key_append_hex( keyed_line, game_date, 8 );
+    sort_key_append_hex( keyed_line, event_site_ids.intern(line.substr(11,offset-11)), 8 );
+    sort_key_append_hex( keyed_line, game_date, 8 );
+    keyed_line.append( line, round_offset, round_end-round_offset );
+    keyed_line += ' ';
+    sort_key_append_hex( keyed_line, tie_breaker, 16 );
+    keyed_line += '\t';
+    keyed_line += line;
+    return true;
+}
+
+uint32_t EventSiteIds::intern( const std::string &event_site )
+{
+    auto it = ids.find(event_site);
+    if( it != ids.end() )
+        return it->second;
+    uint32_t id = static_cast<uint32_t>(strings.size());
+    it = ids.insert( std::pair<std::string,uint32_t>(event_site,id) ).first;
+    strings.push_back( &it->first );
+    return id;
+}
+
+// In the textual prefix event and site are followed by " # " and the comparison
+//  of two prefixes is always decided within "Event, Site # " (this is why '#' is
+//  doubled), so that's the text we rank
+void EventSiteIds::rank()
+{
+    std::vector< std::pair<std::string,uint32_t> > sorted;
+    sorted.reserve( strings.size() );
+    for( uint32_t id=0; id<strings.size(); id++ )
+        sorted.push_back( std::pair<std::string,uint32_t>(*strings[id]+" # ",id) );
+    std::sort( sorted.begin(), sorted.end() );
+    ranks.resize( sorted.size() );
+    for( uint32_t i=0; i<sorted.size(); i++ )
+        ranks[ sorted[i].second ] = i;
+}
+
+void EventSiteIds::replace_id_with_rank( std::string &line ) const
+{
+    uint64_t id;
+    if( line.length() >= sort_key_event_site_offset+8 &&
+        parse_hex(line.c_str()+sort_key_event_site_offset,8,id) && id<ranks.size() )
+        sort_key_set_hex( line, sort_key_event_site_offset, ranks[id] );
+}
@@ -0,0 +1,67 @@
+/*
+
+    Sort keys carried by the lines of pgn2line's temporary files
+
+*/
+
+#ifndef SORTKEY_H_INCLUDED
+#define SORTKEY_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Each line of pgn2line's temporary files starts with a sort key, then a tab, then
+//  the line proper. The key is made of fixed width hex fields so a simple string
+//  comparison of two lines is a comparison of their keys (temporary files remain
+//  text files so they can be disksorted and optionally compressed);
+//
+//      tttttttt eeeeeeee gggggggg round iiiiiiiiiiiiiiii \t
+//      (without the spaces, except for the one terminating round)
+//
+//  t = tournament date as yyyymmdd, e = event and site id, g = game date as yyyymmdd,
+//  round = rendered round text, eg "003.001" (kept as text, it orders exactly as
+//  before that way), i = 64 bit tie breaker (the game index)
+struct SortKey
+{
+    uint32_t tournament_date=0;
+    uint32_t event_site=0;
+    uint32_t game_date=0;
+    uint64_t tie_breaker=0;
+    size_t text_offset=0;       // where the line proper starts
+};
+
+const size_t sort_key_tournament_date_offset = 0;
+const size_t sort_key_event_site_offset = 8;
+const size_t sort_key_game_date_offset = 16;
+const size_t sort_key_day_len = 24;     // tournament date, event and site, game date
+const size_t sort_key_round_offset = 24;
+
+void sort_key_append_hex( std::string &s, uint64_t value, int nbr_digits );
+void sort_key_set_hex( std::string &line, size_t offset, uint32_t value );
+bool sort_key_parse( const std::string &line, SortKey &key );
+
+class EventSiteIds;
+
+// Give a line of finished (sorted, forward order) pgn2line output a sort key, so it
+//  can be sorted again alongside new games. The tournament date in the key is the
+//  game date, as it is for a newly converted game
+bool sort_key_from_line( const std::string &line, EventSiteIds &event_site_ids, uint64_t tie_breaker, std::string &keyed_line );
+
+// Event and site (as they appear in the prefix, with '#' doubled) are given ids as
+//  they are met. Once all games are converted the ids are ranked in the order of the
+//  textual prefix, and the first sort pass swaps each id for its rank
+class EventSiteIds
+{
+public:
+    uint32_t intern( const std::string &event_site );
+    void rank();
+    void replace_id_with_rank( std::string &line ) const;
+private:
+    std::unordered_map<std::string,uint32_t> ids;
+    std::vector<const std::string *> strings;
+    std::vector<uint32_t> ranks;
+};
+
+#endif // SORTKEY_H_INCLUDED
@@ -9,11 +9,16 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
+#include <chrono>
 #include "..\util.h"
 #include "..\thc.h"
 #include "key.h"
 #include "lichess_utils.h"
+#include "movedecode.h"
+#include "replay.h"
 #include "cmd.h"
 
 struct MicroGame
@@ -27,6 +32,7 @@ struct GAME
 {
     int line_nbr;
     bool replaced;
+    std::string prefix;
     std::string moves_txt;
     std::vector<thc::Move> moves;
 };
@@ -432,11 +438,55 @@ struct GAME2
     std::string header;
     std::string moves;
 };
-    
+
+// Lowercased names, and for each trigram (three consecutive chars) the ascending
+//  indexes of the names it appears in. Any name containing a string s of three or
+//  more chars is in the list of every trigram of s, so the shortest of those lists
+//  is all that needs to be checked
+struct NameIndex
+{
+    std::vector<std::string> names;
+    std::unordered_map<uint32_t,std::vector<uint32_t>> trigrams;
+
+    static uint32_t trigram( const std::string &s, size_t i )
+    {
+        return (static_cast<uint8_t>(s[i])<<16) | (static_cast<uint8_t>(s[i+1])<<8) | static_cast<uint8_t>(s[i+2]);
+    }
+
+    void add( const std::string &lower_case_name )
+    {
+        uint32_t idx = static_cast<uint32_t>(names.size());
+        names.push_back(lower_case_name);
+        for( size_t i=0; i+3<=lower_case_name.length(); i++ )
+        {
+            std::vector<uint32_t> &v = trigrams[ trigram(lower_case_name,i) ];
+            if( v.size()==0 || v.back()!=idx )
+                v.push_back(idx);
+        }
+    }
+
+    // NULL if s is too short to narrow the search
+    const std::vector<uint32_t> *candidates( const std::string &s ) const
+    {
+        static const std::vector<uint32_t> none;
+        const std::vector<uint32_t> *best = NULL;
+        for( size_t i=0; i+3<=s.length(); i++ )
+        {
+            auto it = trigrams.find( trigram(s,i) );
+            if( it == trigrams.end() )
+                return &none;
+            if( !best || it->second.size()<best->size() )
+                best = &it->second;
+        }
+        return best;
+    }
+};
+
 
  int cmd_bulk_out_skeleton( std::ifstream &in_bulk, std::ifstream &in_skeleton, std::ofstream &out )
 {
-    std::vector<GAME2> bulk_v;
+    std::vector<std::string> bulk_moves;
+    NameIndex white_index, black_index;
     std::vector<GAME2> skeleton_v;
     std::vector<std::string> skeleton_headers;
     unsigned long line_nbr=0;
@@ -455,13 +505,17 @@ struct GAME2
             line = line.substr(3);
         }
 
+        // Index the bulk games by lowercased player names, keep only their moves
         auto offset = line.find( "@M" );
         if( offset != std::string::npos )
         {
-            GAME2 g;
-            g.header = line.substr(0,offset);
-            g.moves  = line.substr(offset);
-            bulk_v.push_back(g);
+            std::string header = line.substr(0,offset);
+            std::string bulk_white, bulk_black;
+            key_find(header,"White",bulk_white);
+            key_find(header,"Black",bulk_black);
+            white_index.add( util::tolower(bulk_white) );
+            black_index.add( util::tolower(bulk_black) );
+            bulk_moves.push_back( line.substr(offset) );
         }
     }
 
@@ -490,11 +544,12 @@ struct GAME2
         }
     }
 
-    // Clunky O(N^2) algo
+    // Each skeleton game's surnames must be found in exactly one bulk game's
+    //  names, look only at the bulk games the name indexes can't rule out
     int successes = 0;
     for( GAME2 &skeleton: skeleton_v )
     {
-        std::string white, black, bulk_white, bulk_black;
+        std::string white, black;
         key_find(skeleton.header,"White",white);
         std::string white_orig = white;
         white = util::tolower(white);
@@ -509,25 +564,33 @@ struct GAME2
         if( offset != std::string::npos )
             black = black.substr(0,offset);
         util::rtrim(black);
-        int idx=0, count=0, found_idx;
-
-        // Look through bulk games
-        for( GAME2 &bulk: bulk_v )
-        {
-            key_find(bulk.header,"White",bulk_white);
-            bulk_white = util::tolower(bulk_white);
-            key_find(bulk.header,"Black",bulk_black);
-            bulk_black = util::tolower(bulk_black);
-            auto offset = bulk_white.find(white);
-            bool found1 = (offset != std::string::npos);
-            offset = bulk_black.find(black);
-            bool found2 = (offset != std::string::npos);
+        int count=0;
+        uint32_t found_idx=0;
+        auto check = [&]( uint32_t idx )
+        {
+            bool found1 = (white_index.names[idx].find(white) != std::string::npos);
+            bool found2 = (black_index.names[idx].find(black) != std::string::npos);
             if( found1 && found2 )
             {
                 count++;
                 found_idx = idx;
             }
-            idx++;
+        };
+        const std::vector<uint32_t> *candidates = white_index.candidates(white);
+        const std::vector<uint32_t> *black_candidates = black_index.candidates(black);
+        if( !candidates || (black_candidates && black_candidates->size()<candidates->size()) )
+            candidates = black_candidates;
+        if( candidates )
+        {
+            for( uint32_t idx: *candidates )
+                check(idx);
+        }
+        else
+        {
+            // Both names too short for the indexes to help
+            uint32_t nbr_bulk = static_cast<uint32_t>(bulk_moves.size());
+            for( uint32_t idx=0; idx<nbr_bulk; idx++ )
+                check(idx);
         }
         std::string round;
         key_find(skeleton.header,"Round",round);
@@ -541,11 +604,7 @@ struct GAME2
         if( count == 1 )
         {
             successes++;
-            GAME2 &bulk = bulk_v[found_idx];
-            key_find(bulk.header,"White",bulk_white);
-            key_find(bulk.header,"Black",bulk_black);
-            // printf( " found as %s-%s\n", bulk_white.c_str(), bulk_black.c_str() );
-            util::putline( out, skeleton.header+bulk.moves );
+            util::putline( out, skeleton.header+bulk_moves[found_idx] );
         }
     }
     printf( "%u successes from %zu attempts\n", successes, skeleton_v.size() );
@@ -716,11 +775,34 @@ struct GAME2
 }
 
 //#define TRIGGER "2014-06-29 9th Wroclaw Open 2014, Wroclaw POL # 2014-06-29 001.026 Dzikowski-Dadello"
- int cmd_pluck( std::ifstream &in_aux, std::ifstream &in, std::ofstream &out, bool reorder )
+// A game's key and moves, hashed to find the games a bulk line can replace
+static uint64_t pluck_fingerprint( const std::string &prefix, const std::vector<thc::Move> &moves )
 {
+    uint64_t h = std::hash<std::string>()(prefix) ^ moves.size();
+    for( thc::Move mv: moves )
+    {
+        uint32_t m = mv.src | (mv.dst<<8) | (mv.special<<16) | ((mv.capture&0xff)<<24);
+        h = (h^m) * 0x100000001b3ULL;
+    }
+    return h;
+}
 
-    // Read the input
-    std::map<std::string,std::vector<GAME>> input;
+// A bulk line that might replace an input line
+struct PluckCandidate
+{
+    bool candidate=false;
+    uint64_t fingerprint=0;
+    std::vector<thc::Move> moves;
+    std::string line;
+};
+
+ int cmd_pluck( const std::string &fin_aux, std::ifstream &in, std::ofstream &out, bool reorder )
+{
+
+    // Read the input, index its games by prefix and moves
+    std::vector<GAME> games;
+    std::unordered_set<std::string> prefixes;
+    std::unordered_map<uint64_t,std::vector<size_t>> index;     // fingerprint -> games
     std::vector<std::string> vin;
     std::vector< std::pair<double,std::string> > vout;  // bulk line_nbr and line
     unsigned long line_nbr=0;
@@ -745,94 +827,87 @@ struct GAME2
         size_t offset = line.find("@H");
         if( offset != std::string::npos )
         {
-            std::string prefix = line.substr(0,offset);
             GAME g;
             g.replaced = false;
             g.line_nbr = line_nbr;
+            g.prefix = line.substr(0,offset);
             std::vector<std::string> main_line;
             std::vector<int> clk_times;
             int nbr_comments;
             get_main_line( line, main_line, clk_times, g.moves_txt, nbr_comments );
             convert_moves( main_line, g.moves );
-            auto it = input.find(prefix);
             bool trigger = false;
 #ifdef TRIGGER
-            trigger = (prefix==TRIGGER);
+            trigger = (g.prefix==TRIGGER);
 #endif
             if( trigger )
-                printf( "Triggered %lu: (%s) reading input: %s\n", line_nbr+1, it==input.end()?"not found":"found", g.moves_txt.c_str() );
-            if( it != input.end() )
-                it->second.push_back(g);
-            else
-            {
-                std::vector<GAME> v;
-                v.push_back(g);
-                input[prefix] = v;
-            }
+                printf( "Triggered %lu: (%s) reading input: %s\n", line_nbr+1, prefixes.count(g.prefix)?"found":"not found", g.moves_txt.c_str() );
+            prefixes.insert( g.prefix );
+            index[ pluck_fingerprint(g.prefix,g.moves) ].push_back( games.size() );
+            games.push_back(g);
         }
         line_nbr++;
     }
 
-    // Read the bulk file searching for lines to be plucked
+    // Read the bulk file searching for lines to be plucked. Bulk lines with a
+    //  prefix from the input are decoded on worker threads, then each in turn
+    //  replaces the first unreplaced input game with the same prefix and moves
     printf( "Reading bulk input seeking matches to %lu lines\n", line_nbr );
-    line_nbr=0;
     int nbr_plucked = 0;
-    for(;;)
-    {
-        std::string line;
-        if( !std::getline(in_aux, line) )
-            break;
-
-        // Strip out UTF8 BOM mark (hex value: EF BB BF)
-        if( line_nbr==0 && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65)
-            line = line.substr(3);
-
-        size_t offset = line.find("@H");
-        if( offset != std::string::npos )
+    ReplayOptions options;
+    options.decode = false;
+    ReplayEngine<PluckCandidate> engine( options );
+    engine.run( fin_aux,
+        [&]( ReplayGame &game, PluckCandidate &c )
+        {
+            size_t offset = game.line.find("@H");
+            if( offset == std::string::npos )
+                return true;
+            std::string prefix = game.line.substr(0,offset);
+            if( prefixes.count(prefix) == 0 )
+                return true;
+            game.read(0);
+
+            // Unreadable moves can't match
+            if( game.fen || game.moves.size()!=game.main_line.size() )
+                return true;
+            c.candidate = true;
+            c.fingerprint = pluck_fingerprint( prefix, game.moves );
+            c.moves.swap( game.moves );
+            c.line.swap( game.line );
+            return true;
+        },
+        [&]( uint64_t bulk_line_nbr, uint64_t, PluckCandidate &c )
         {
-            std::string prefix = line.substr(0,offset);
-            auto it = input.find(prefix);
-            bool trigger = false;
-#ifdef TRIGGER
-            trigger = (prefix==TRIGGER);
-#endif
-            if( trigger )
-                printf( "Triggered (%s) reading bulk\n", it==input.end()?"not found":"found" );
-            if( it != input.end() )
+            if( c.candidate )
             {
-                std::vector<std::string> main_line;
-                std::vector<int> clk_times;
-                std::string moves_txt;
-                int nbr_comments;
-                get_main_line( line, main_line, clk_times, moves_txt, nbr_comments );
-                if( trigger )
-                    printf( "moves : %s\n", moves_txt.c_str() );
-                for( GAME &g: it->second )
+                auto it = index.find(c.fingerprint);
+                if( it != index.end() )
                 {
-                    if( trigger )
-                        printf( "%s: %s\n", g.replaced?"true":"false", g.moves_txt.c_str() );
-                    if( !g.replaced && g.moves.size()==main_line.size() )
+                    for( size_t idx: it->second )
                     {
-                        std::vector<thc::Move> moves;
-                        convert_moves( main_line, moves );
-                        if( g.moves == moves )
+                        GAME &g = games[idx];
+                        if( !g.replaced && g.moves==c.moves && 0==c.line.compare(0,g.prefix.length(),g.prefix)
+                            && c.line.compare(g.prefix.length(),2,"@H")==0 )
                         {
-                            std::pair<double,std::string> pr(line_nbr,line);
-                            vout[g.line_nbr] = pr;
+                            vout[g.line_nbr] = std::pair<double,std::string>(static_cast<double>(bulk_line_nbr),c.line);
                             g.replaced = true;
                             nbr_plucked++;
+                            bool trigger = false;
+#ifdef TRIGGER
+                            trigger = (g.prefix==TRIGGER);
+#endif
                             if( trigger )
-                                printf( "Woo hoo: %lu\n", g.line_nbr+1 );
+                                printf( "Woo hoo: %d\n", g.line_nbr+1 );
+                            break;
                         }
-                        break;
                     }
                 }
             }
+            if( ((bulk_line_nbr+1) % 100000) == 0 )
+                printf( "%lu lines read, %d lines plucked\n", static_cast<unsigned long>(bulk_line_nbr+1), nbr_plucked );
         }
-        line_nbr++;
-        if( (line_nbr % 100000) == 0 )
-            printf( "%lu lines read, %d lines plucked\n", line_nbr, nbr_plucked );
-    }
+    );
 
     // Find and report on unreplaced lines
     line_nbr=0;
@@ -2142,92 +2217,74 @@ int cmd_temp( std::ofstream &out )
     return 0;
 }
 
-// Adapted (just a little) from http://www.talkativeman.com/levenshtein-distance-algorithm-string-comparison/
-static int lev_distance( const std::string source, const std::string target )
+// Restricted Damerau-Levenshtein distance, with transpositions counted only
+//  after the first two chars of each string (as the original matrix version).
+//  Hyyro's bit-vector variant of Myers' algorithm, one 64 bit word per column
+//  of the shorter string, or a three row matrix if both are longer than 64
+static int lev_distance( const std::string &source, const std::string &target )
 {
-    // Step 1
-    const int n = (int)source.length();
-    const int m = (int)target.length();
-    if( n == 0 )
-    {
-        return m;
-    }
+    if( source == target )
+        return 0;
+    const std::string &p = source.length()<=target.length() ? source : target;   // pattern, bit per char
+    const std::string &t = source.length()<=target.length() ? target : source;
+    const int m = (int)p.length();
+    const int n = (int)t.length();
     if( m == 0 )
-    {
         return n;
-    }
-
-    // Good form to declare a TYPEDEF
-    typedef std::vector< std::vector<int> > matrix_t;
-    matrix_t matrix(n+1);
-
-    // Size the vectors in the 2nd dimension. Unfortunately C++ doesn't
-    // allow for allocation on declaration of 2nd dimension of vec of vec
-    for( int i=0; i<=n; i++ )
-    {
-        matrix[i].resize(m+1);
-    }
-
-    // Step 2
-    for( int i=0; i<=n; i++ )
-    {
-        matrix[i][0]=i;
-    }
-    for( int j=0; j<=m; j++)
-    {
-        matrix[0][j]=j;
-    }
-
-    // Step 3
-    for( int i=1; i<=n; i++ )
-    {
-        const char s_i = source[i-1];
-
-        // Step 4
-        for( int j=1; j<=m; j++ )
-        {
-            const char t_j = target[j-1];
-
-            // Step 5
-            int cost;
-            if( s_i == t_j )
-            {
-                cost = 0;
-            }
-            else
-            {
-                cost = 1;
-            }
-
-            // Step 6
-            const int above = matrix[i-1][j];
-            const int left = matrix[i][j-1];
-            const int diag = matrix[i-1][j-1];
-            #define MIN(a,b) ((a)<=(b) ? (a) : (b))
-            int temp = MIN( left+1, diag+cost );
-            int cell = MIN( above+1, temp );
-
-            // Step 6A: Cover transposition, in addition to deletion,
-            // insertion and substitution. This step is taken from:
-            // Berghel, Hal ; Roach, David : "An Extension of Ukkonen's
-            // Enhanced Dynamic Programming ASM Algorithm"
-            // (http://www.acm.org/~hlb/publications/asm/asm.html)
-            if( i>2 && j>2 )
-            {
-                int trans = matrix[i-2][j-2]+1;
-                if( source[i-2] != t_j )
-                    trans++;
-                if( s_i != target[j-2] )
-                    trans++;
-                if( cell>trans )
-                    cell=trans;
-            }
-            matrix[i][j]=cell;
-        }
-    }
-
-    // Step 7
-    return matrix[n][m];
+    if( m <= 64 )
+    {
+        uint64_t peq[256];
+        for( int i=0; i<m; i++ )
+            peq[(uint8_t)p[i]] = 0;
+        for( int j=0; j<n; j++ )
+            peq[(uint8_t)t[j]] = 0;
+        for( int i=0; i<m; i++ )
+            peq[(uint8_t)p[i]] |= (1ULL<<i);
+        const uint64_t last = 1ULL<<(m-1);
+        const uint64_t no_trans = 3;    // transpositions not counted in first two rows
+        uint64_t vp = ~0ULL, vn = 0, d0 = 0, pm_prev = 0;
+        int score = m;
+        for( int j=0; j<n; j++ )
+        {
+            uint64_t pm = peq[(uint8_t)t[j]];
+            uint64_t tr = j<2 ? 0 : (((~d0) & pm) << 1) & pm_prev & ~no_trans;
+            d0 = (((pm & vp) + vp) ^ vp) | pm | vn | tr;
+            uint64_t hp = vn | ~(d0 | vp);
+            uint64_t hn = d0 & vp;
+            if( hp & last )
+                score++;
+            else if( hn & last )
+                score--;
+            hp = (hp<<1) | 1;
+            hn = hn<<1;
+            vp = hn | ~(d0 | hp);
+            vn = hp & d0;
+            pm_prev = pm;
+        }
+        return score;
+    }
+
+    // Long strings, keep just three rows of the matrix
+    static std::vector<int> rows;
+    rows.resize( 3*(n+1) );
+    int *prev2 = &rows[0], *prev = &rows[n+1], *row = &rows[2*(n+1)];
+    for( int j=0; j<=n; j++ )
+        prev[j] = j;
+    for( int i=1; i<=m; i++ )
+    {
+        row[0] = i;
+        for( int j=1; j<=n; j++ )
+        {
+            int cost = (p[i-1]==t[j-1] ? 0 : 1);
+            int cell = std::min( std::min(prev[j]+1,row[j-1]+1), prev[j-1]+cost );
+            if( i>2 && j>2 && p[i-2]==t[j-1] && p[i-1]==t[j-2] )
+                cell = std::min( cell, prev2[j-2]+1 );
+            row[j] = cell;
+        }
+        std::swap( prev2, prev );
+        std::swap( prev, row );
+    }
+    return prev[n];
 }
 
 int cmd_fide_id_to_name( std::ifstream &in_aux_fide, std::ifstream &in_aux_keep, std::ifstream &in_aux_custom,
@@ -2487,3 +2544,85 @@ int cmd_normalise( std::ifstream &in, std::ofstream &out )
     }
     return 0;
 }
+
+// The original convert_moves(), as a baseline for the benchmark
+static void convert_moves_baseline( const std::vector<std::string> &in, std::vector<thc::Move> &out )
+{
+    thc::ChessRules cr;
+    out.clear();
+    for( const std::string &s: in )
+    {
+        thc::Move m;
+        if( !m.NaturalInFast( &cr, s.c_str() ) && !m.NaturalIn( &cr, s.c_str() ) )
+            break;
+        out.push_back(m);
+        cr.PlayMove(m);
+    }
+}
+
+// Benchmark game replay, the moves of every game converted the original way, then
+//  with convert_moves()'s fast path for piece moves, then with its opening plies cache
+//  as well
+int cmd_replay_bench( std::ifstream &in, std::ofstream &out )
+{
+    std::vector<std::vector<std::string>> games;
+    std::string line;
+    std::vector<int> clk_times;
+    std::string moves_txt;
+    int nbr_comments;
+    printf( "Reading games\n" );
+    while( std::getline(in,line) )
+    {
+        util::rtrim(line);
+        games.push_back( std::vector<std::string>() );
+        get_main_line( line, games.back(), clk_times, moves_txt, nbr_comments );
+    }
+    std::vector<std::vector<thc::Move>> replayed(games.size());
+    std::vector<thc::Move> moves;
+    int nbr_different = 0;
+    static const char *names[] = { "baseline", "fast path", "fast path + cache" };
+    for( int pass=0; pass<3; pass++ )
+    {
+        MoveDecoder::fast_path_enable( pass>=1 );
+        MoveDecoder::cache_enable( pass>=2 );
+        uint64_t hits   = MoveDecoder::nbr_cache_hits();
+        uint64_t misses = MoveDecoder::nbr_cache_misses();
+        uint64_t nbr_plies = 0;
+        auto start = std::chrono::steady_clock::now();
+        for( size_t i=0; i<games.size(); i++ )
+        {
+            if( pass == 0 )
+            {
+                convert_moves_baseline( games[i], moves );
+                replayed[i] = moves;
+            }
+            else
+            {
+                convert_moves( games[i], moves );
+                if( moves != replayed[i] )
+                    nbr_different++;
+            }
+            nbr_plies += moves.size();
+        }
+        double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+        if( elapsed <= 0.0 )
+            elapsed = 1e-9;
+        hits   = MoveDecoder::nbr_cache_hits() - hits;
+        misses = MoveDecoder::nbr_cache_misses() - misses;
+        std::string s = util::sprintf( "%-18s %zu games, %llu plies in %.3f seconds, %.0f games/s, %.1f ns/ply",
+            names[pass], games.size(), static_cast<unsigned long long>(nbr_plies), elapsed,
+            games.size()/elapsed, elapsed*1e9/(nbr_plies?nbr_plies:1) );
+        if( hits+misses > 0 )
+            s += util::sprintf( ", cache hits %.1f%%", 100.0*hits/(hits+misses) );
+        printf( "%s\n", s.c_str() );
+        util::putline( out, s );
+    }
+    MoveDecoder::fast_path_enable( true );
+    MoveDecoder::cache_enable( true );
+    if( nbr_different > 0 )
+    {
+        printf( "Error; %d games replayed differently\n", nbr_different );
+        return -1;
+    }
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#include <string>
 
 // Basic form: fin, fout
 int cmd_fide_id_report( std::ifstream &in, std::ofstream &out );
@@ -19,13 +20,15 @@ int cmd_get_name_fide_id( std::ifstream &in, std::ofstream &out );
 int cmd_lichess_broadcast_improve( std::ifstream &in, std::ofstream &out );
 int cmd_hardwired( std::ifstream &in, std::ofstream &out );
 int cmd_time( std::ifstream &in, std::ofstream &out );
+int cmd_replay_bench( std::ifstream &in, std::ofstream &out );
 
 // Complete applications
 int cmd_golden( std::ifstream &in, std::ofstream &out );
-int cmd_tabiya( std::ifstream &in, std::ofstream &out );
+#define TABIYA_PLY 16
+int cmd_tabiya( const std::string &fin, std::ofstream &out, int first_ply, int last_ply );
 
 // Aux input file: fin_aux, fin, fout
-int cmd_pluck( std::ifstream &in_aux, std::ifstream &in, std::ofstream &out, bool reorder );
+int cmd_pluck( const std::string &fin_aux, std::ifstream &in, std::ofstream &out, bool reorder );
 int cmd_bulk_out_skeleton( std::ifstream &in_aux, std::ifstream &in, std::ofstream &out );
 int cmd_improve( std::ifstream &in_aux, std::ifstream &in, std::ofstream &out );
 int cmd_add_ratings( std::ifstream &in_aux, std::ifstream &in, std::ofstream &out );
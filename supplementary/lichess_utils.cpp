@@ -6,6 +6,7 @@
 #include "key.h"
 #include "baby.h"
 #include "lichess_utils.h"
+#include "movedecode.h"
 
 // Do some baby_clk stuff
 static int baby_nbr_tests_passed;
@@ -342,14 +343,15 @@ int get_main_line( const std::string &s, std::vector<std::string> &main_line, st
 // Simplest possible txt -> chess moves conversion
 void convert_moves( const std::vector<std::string> &in, std::vector<thc::Move> &out )
 {
-    thc::ChessRules cr;
+    MoveDecoder md;
     out.clear();
-    for( std::string s: in )
+    for( const std::string &s: in )
     {
         thc::Move m;
-        m.NaturalInFast( &cr, s.c_str() );
+        if( !md.decode( s, m ) )
+            break;      // stop at an illegal or unreadable move
         out.push_back(m);
-        cr.PlayMove(m);
+        md.play(m);
     }
 }
 
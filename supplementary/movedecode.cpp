@@ -0,0 +1,305 @@
+// supplementary.cpp : Do something special to LPGN file
+//  movedecode.cpp, fast SAN move reading for replaying games
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include "..\thc.h"
+#include "movedecode.h"
+
+#define DECODE_CACHE_PLY    12      // cache the moves of the first 12 half moves only
+#define DECODE_CACHE_BITS   12      // 4096 entries, small enough to stay in cache
+
+struct DecodeCacheEntry
+{
+    uint64_t position;
+    uint64_t txt;           // move text packed into 8 bytes, 0 = unused
+    thc::Move mv;
+};
+
+static thread_local std::vector<DecodeCacheEntry> decode_cache;
+static thread_local uint64_t decode_cache_hits;
+static thread_local uint64_t decode_cache_misses;
+static bool decode_cache_enabled = true;
+static bool decode_fast_path_enabled = true;
+
+void MoveDecoder::cache_enable( bool enable )
+{
+    decode_cache_enabled = enable;
+}
+
+void MoveDecoder::fast_path_enable( bool enable )
+{
+    decode_fast_path_enabled = enable;
+}
+
+uint64_t MoveDecoder::nbr_cache_hits()
+{
+    return decode_cache_hits;
+}
+
+uint64_t MoveDecoder::nbr_cache_misses()
+{
+    return decode_cache_misses;
+}
+
+// Squares a piece on an empty board can reach, and the squares between two squares
+//  on the same line
+struct DecodeTables
+{
+    uint64_t knight[64];
+    uint64_t bishop[64];
+    uint64_t rook[64];
+    uint64_t between[64][64];
+    DecodeTables()
+    {
+        memset( this, 0, sizeof(*this) );
+        static const int knight_deltas[8][2] = { {1,2}, {2,1}, {2,-1}, {1,-2}, {-1,-2}, {-2,-1}, {-2,1}, {-1,2} };
+        static const int ray_deltas[8][2]    = { {1,0}, {-1,0}, {0,1}, {0,-1}, {1,1}, {1,-1}, {-1,1}, {-1,-1} };
+        for( int sq=0; sq<64; sq++ )
+        {
+            int file = sq&7, row = sq>>3;
+            for( int i=0; i<8; i++ )
+            {
+                int f = file+knight_deltas[i][0], r = row+knight_deltas[i][1];
+                if( 0<=f && f<8 && 0<=r && r<8 )
+                    knight[sq] |= 1ULL << (r*8+f);
+            }
+            for( int i=0; i<8; i++ )
+            {
+                uint64_t path = 0;
+                int f = file+ray_deltas[i][0], r = row+ray_deltas[i][1];
+                while( 0<=f && f<8 && 0<=r && r<8 )
+                {
+                    int dst = r*8+f;
+                    if( i < 4 )
+                        rook[sq] |= 1ULL << dst;
+                    else
+                        bishop[sq] |= 1ULL << dst;
+                    between[sq][dst] = path;
+                    path |= 1ULL << dst;
+                    f += ray_deltas[i][0];
+                    r += ray_deltas[i][1];
+                }
+            }
+        }
+    }
+};
+
+static const DecodeTables &decode_tables()
+{
+    static DecodeTables tables;
+    return tables;
+}
+
+// Index of the only set bit
+static int bit_index( uint64_t bit )
+{
+    static const int de_bruijn_index[64] =
+    {
+         0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+        62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+        63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+        46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6
+    };
+    return de_bruijn_index[ (bit*0x03f79d71b4cb0a89ULL) >> 58 ];
+}
+
+MoveDecoder::MoveDecoder()
+{
+    memset( pieces, 0, sizeof(pieces) );
+    occupied = 0;
+    for( int sq=0; sq<64; sq++ )
+    {
+        char piece = squares[sq];
+        if( piece != ' ' )
+        {
+            pieces[piece&0x7f] |= 1ULL << sq;
+            occupied |= 1ULL << sq;
+        }
+    }
+    hash = Hash64Calculate();
+    ply = 0;
+}
+
+bool MoveDecoder::decode( const std::string &san, thc::Move &mv )
+{
+    // The move NaturalInFast() finds depends on the pieces, side to move and en passant
+    //  target only, so that's what identifies the position
+    DecodeCacheEntry *entry = NULL;
+    uint64_t position=0, txt=0;
+    if( decode_cache_enabled && ply<DECODE_CACHE_PLY && san.length()>0 && san.length()<=sizeof(txt) )
+    {
+        if( decode_cache.size() == 0 )
+            decode_cache.resize( 1<<DECODE_CACHE_BITS );
+        memcpy( &txt, san.c_str(), san.length() );
+        position = hash ^ (static_cast<uint64_t>(enpassant_target+1) * 0xff51afd7ed558ccdULL);
+        if( !white )
+            position ^= 0x9e3779b97f4a7c15ULL;
+        uint64_t idx = ((position^txt) * 0x9e3779b97f4a7c15ULL) >> (64-DECODE_CACHE_BITS);
+        entry = &decode_cache[idx];
+        if( entry->position==position && entry->txt==txt )
+        {
+            decode_cache_hits++;
+            mv = entry->mv;
+            return true;
+        }
+        decode_cache_misses++;
+    }
+    const char *s = san.c_str();
+    bool ok = (decode_fast_path_enabled && decode_piece_move(s,mv)) || mv.NaturalInFast(this,s);
+    if( ok )
+    {
+        if( entry )
+        {
+            entry->position = position;
+            entry->txt = txt;
+            entry->mv = mv;
+        }
+        return true;
+    }
+
+    // NaturalIn() also depends on castling rights, so isn't cached
+    return mv.NaturalIn(this,s);
+}
+
+// Knight, bishop, rook or queen move with only one candidate piece, in the forms
+//  NaturalInFast() reads (eg Nf3, Nxf3, Nef3, Nexf3, N2f3, N2xf3), otherwise leave it
+//  to NaturalInFast()
+bool MoveDecoder::decode_piece_move( const char *san, thc::Move &mv )
+{
+    const DecodeTables &tables = decode_tables();
+    char piece = *san++;
+    const uint64_t *reach;
+    switch( piece )
+    {
+        case 'N':   reach = tables.knight;   break;
+        case 'B':   reach = tables.bishop;   break;
+        case 'R':   reach = tables.rook;     break;
+        case 'Q':   reach = NULL;            break;
+        default:    return false;
+    }
+    bool capture = false;
+    char src_file='\0', src_rank='\0';
+    char c = *san++;
+    if( c == 'x' )
+    {
+        capture = true;
+        c = *san++;
+    }
+    if( '1'<=c && c<='8' )
+        src_rank = c;
+    else if( 'a'<=c && c<='h' )
+        src_file = c;
+    else
+        return false;
+    c = *san++;
+    if( c == 'x' )
+    {
+        if( capture )
+            return false;
+        capture = true;
+        c = *san++;
+    }
+    int dst;
+    if( '1'<=c && c<='8' )
+    {
+        if( !src_file )
+            return false;
+        dst = thc::make_square( src_file, c );
+        src_file = '\0';
+    }
+    else if( 'a'<=c && c<='h' )
+    {
+        char r = *san++;
+        if( r<'1' || '8'<r )
+            return false;
+        dst = thc::make_square( c, r );
+    }
+    else
+        return false;
+    c = *san;
+    if( isascii(c) && isalnum(c) )
+        return false;
+    char target = squares[dst];
+    if( capture ? (target==' ' || (isupper(target)!=0)==white) : target!=' ' )
+        return false;
+
+    // Candidates, those pieces that could reach the destination on an empty board
+    if( !white )
+        piece = static_cast<char>( tolower(piece) );
+    uint64_t candidates = pieces[static_cast<int>(piece)];
+    candidates &= reach ? reach[dst] : (tables.bishop[dst]|tables.rook[dst]);
+    if( src_file )
+        candidates &= 0x0101010101010101ULL << (src_file-'a');
+    if( src_rank )
+        candidates &= 0xffULL << (('8'-src_rank)*8);
+    uint64_t found = 0;
+    while( candidates )
+    {
+        uint64_t bit = candidates & (0-candidates);
+        candidates ^= bit;
+        if( piece!='N' && piece!='n' && (tables.between[bit_index(bit)][dst] & occupied) )
+            continue;
+        if( found )
+            return false;   // ambiguous, NaturalInFast() checks legality
+        found = bit;
+    }
+    if( !found )
+        return false;
+    mv.src = static_cast<thc::Square>( bit_index(found) );
+    mv.dst = static_cast<thc::Square>( dst );
+    mv.special = thc::NOT_SPECIAL;
+    mv.capture = target;
+    return true;
+}
+
+void MoveDecoder::play( thc::Move mv )
+{
+    int src = mv.src, dst = mv.dst;
+    char piece = squares[src];
+    pieces[piece&0x7f] &= ~(1ULL<<src);
+    occupied &= ~(1ULL<<src);
+    if( mv.capture != ' ' )
+    {
+        int captured = dst;
+        if( mv.special == thc::SPECIAL_WEN_PASSANT )
+            captured = dst+8;
+        else if( mv.special == thc::SPECIAL_BEN_PASSANT )
+            captured = dst-8;
+        pieces[mv.capture&0x7f] &= ~(1ULL<<captured);
+        occupied &= ~(1ULL<<captured);
+    }
+    switch( mv.special )
+    {
+        case thc::SPECIAL_PROMOTION_QUEEN:  piece = white ? 'Q' : 'q';    break;
+        case thc::SPECIAL_PROMOTION_ROOK:   piece = white ? 'R' : 'r';    break;
+        case thc::SPECIAL_PROMOTION_BISHOP: piece = white ? 'B' : 'b';    break;
+        case thc::SPECIAL_PROMOTION_KNIGHT: piece = white ? 'N' : 'n';    break;
+        case thc::SPECIAL_WK_CASTLING:
+            pieces['R'] = (pieces['R'] & ~(1ULL<<thc::h1)) | (1ULL<<thc::f1);
+            occupied = (occupied & ~(1ULL<<thc::h1)) | (1ULL<<thc::f1);
+            break;
+        case thc::SPECIAL_WQ_CASTLING:
+            pieces['R'] = (pieces['R'] & ~(1ULL<<thc::a1)) | (1ULL<<thc::d1);
+            occupied = (occupied & ~(1ULL<<thc::a1)) | (1ULL<<thc::d1);
+            break;
+        case thc::SPECIAL_BK_CASTLING:
+            pieces['r'] = (pieces['r'] & ~(1ULL<<thc::h8)) | (1ULL<<thc::f8);
+            occupied = (occupied & ~(1ULL<<thc::h8)) | (1ULL<<thc::f8);
+            break;
+        case thc::SPECIAL_BQ_CASTLING:
+            pieces['r'] = (pieces['r'] & ~(1ULL<<thc::a8)) | (1ULL<<thc::d8);
+            occupied = (occupied & ~(1ULL<<thc::a8)) | (1ULL<<thc::d8);
+            break;
+        default:
+            break;
+    }
+    pieces[piece&0x7f] |= 1ULL<<dst;
+    occupied |= 1ULL<<dst;
+    if( ++ply <= DECODE_CACHE_PLY )
+        hash = Hash64Update( hash, mv );
+    PlayMove( mv );
+}
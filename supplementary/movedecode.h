@@ -0,0 +1,43 @@
+// supplementary.cpp : Do something special to LPGN file
+//  movedecode.cpp, fast SAN move reading for replaying games
+
+#ifndef MOVEDECODE_H_INCLUDED
+#define MOVEDECODE_H_INCLUDED
+#include <stdint.h>
+#include <string>
+#include "..\thc.h"
+
+// Replays a game from the standard starting position. decode() gives exactly the
+//  same move as Move::NaturalInFast() (or Move::NaturalIn() for the unusual moves
+//  that can't read), but faster;
+//   - The opening plies, where the same positions come up over and over again, are
+//     looked up in a per thread cache of (position, move text) -> move
+//   - Knight, bishop, rook and queen moves find their source square with bitboards
+//     of the pieces, rather than by searching out from the destination square,
+//     when there's only one candidate
+class MoveDecoder : public thc::ChessRules
+{
+public:
+    MoveDecoder();
+
+    // Read a move in the current position, returns false if it's illegal or unreadable
+    bool decode( const std::string &san, thc::Move &mv );
+
+    // Play a move returned by decode()
+    void play( thc::Move mv );
+
+    // For benchmarking
+    static void cache_enable( bool enable );
+    static void fast_path_enable( bool enable );
+    static uint64_t nbr_cache_hits();       // this thread's counts
+    static uint64_t nbr_cache_misses();
+
+private:
+    bool decode_piece_move( const char *san, thc::Move &mv );
+    uint64_t pieces[128];       // bitboard for each piece, indexed by 'N', 'b' etc.
+    uint64_t occupied;
+    uint64_t hash;              // thc's Hash64 while the cache is in use
+    int ply;
+};
+
+#endif //MOVEDECODE_H_INCLUDED
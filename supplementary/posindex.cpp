@@ -0,0 +1,336 @@
+// supplementary.cpp : Do something special to LPGN file
+//  posindex.cpp, the position index commands
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <chrono>
+#include "..\util.h"
+#include "..\thc.h"
+#include "replay.h"
+#include "posindex.h"
+
+//
+// Index of the starting position and the positions reached in the first
+//  POSITION_INDEX_PLY half moves of each game's main line, so all games that
+//  reach a position, by any move order, can be found without replaying every game
+//
+//  Index file layout (host byte order, ie little endian);
+//      "PIDX", uint32 version, uint32 nbr_ply, uint32 reserved, uint64 size of
+//      the .lpgn file, uint64 nbr_entries, then nbr_entries entries of uint64
+//      position hash, uint64 offset of the game's line in the .lpgn file, sorted
+//      by hash then offset
+//
+//  The position hash is thc's Hash64Calculate() (pieces only, kept up to date with
+//  Hash64Update() as the moves are played) with a constant mixed in when Black is
+//  to move. Castling and en passant rights are ignored. Games with a FEN tag
+//  aren't indexed
+//
+
+#define POSITION_INDEX_PLY      30
+#define POSITION_INDEX_VERSION  2     // 1 didn't index the starting position
+#define POSITION_INDEX_HDR_LEN  32
+#define POSITION_INDEX_RUN      (16*1024*1024)      // entries sorted in memory at a time
+#define BLACK_TO_MOVE           0x9e3779b97f4a7c15ULL
+
+struct PositionEntry
+{
+    uint64_t hash;
+    uint64_t offset;
+    bool operator<( const PositionEntry &other ) const
+    {
+        return hash<other.hash || (hash==other.hash && offset<other.offset);
+    }
+};
+
+static uint64_t position_hash( uint64_t hash, bool white )
+{
+    return white ? hash : hash^BLACK_TO_MOVE;
+}
+
+static bool write_entries( std::ofstream &out, const std::vector<PositionEntry> &entries )
+{
+    out.write( reinterpret_cast<const char *>(entries.data()), entries.size()*sizeof(PositionEntry) );
+    return !out.fail();
+}
+
+// Sort the entries in memory, and write them to a temporary run file
+static bool write_run( const std::string &fout, std::vector<PositionEntry> &run, std::vector<std::string> &run_files )
+{
+    std::sort( run.begin(), run.end() );
+    std::string fname = util::sprintf( "%s-run%d.tmp", fout.c_str(), static_cast<int>(run_files.size()) );
+    run_files.push_back(fname);
+    std::ofstream out( fname, std::ios_base::out | std::ios_base::binary );
+    bool ok = out && write_entries(out,run);
+    if( !ok )
+        printf( "Error; Cannot write file %s\n", fname.c_str() );
+    run.clear();
+    return ok;
+}
+
+// Buffered reading of one run file during the merge
+struct RunReader
+{
+    std::ifstream in;
+    std::vector<PositionEntry> buf;
+    size_t idx=0;
+    bool next( PositionEntry &e )
+    {
+        if( idx >= buf.size() )
+        {
+            buf.resize( 64*1024 );
+            in.read( reinterpret_cast<char *>(buf.data()), buf.size()*sizeof(PositionEntry) );
+            buf.resize( static_cast<size_t>(in.gcount()) / sizeof(PositionEntry) );
+            idx = 0;
+            if( buf.size() == 0 )
+                return false;
+        }
+        e = buf[idx++];
+        return true;
+    }
+};
+
+// Merge the sorted run files into out
+static bool merge_runs( std::ofstream &out, const std::vector<std::string> &run_files )
+{
+    std::vector<RunReader> readers( run_files.size() );
+    typedef std::pair<PositionEntry,size_t> Head;   // next entry from each run
+    auto greater = []( const Head &lhs, const Head &rhs ) { return rhs.first < lhs.first; };
+    std::priority_queue< Head, std::vector<Head>, decltype(greater) > heads(greater);
+    for( size_t i=0; i<run_files.size(); i++ )
+    {
+        readers[i].in.open( run_files[i], std::ios_base::in | std::ios_base::binary );
+        if( !readers[i].in )
+        {
+            printf( "Error; Cannot open file %s for reading\n", run_files[i].c_str() );
+            return false;
+        }
+        PositionEntry e;
+        if( readers[i].next(e) )
+            heads.push( Head(e,i) );
+    }
+    std::vector<PositionEntry> buf;
+    while( !heads.empty() )
+    {
+        Head head = heads.top();
+        heads.pop();
+        buf.push_back( head.first );
+        if( buf.size() >= 64*1024 )
+        {
+            if( !write_entries(out,buf) )
+                return false;
+            buf.clear();
+        }
+        PositionEntry e;
+        if( readers[head.second].next(e) )
+            heads.push( Head(e,head.second) );
+    }
+    return write_entries(out,buf);
+}
+
+static void put_u32( std::string &s, uint32_t value )
+{
+    s.append( reinterpret_cast<const char *>(&value), sizeof(value) );
+}
+
+static void put_u64( std::string &s, uint64_t value )
+{
+    s.append( reinterpret_cast<const char *>(&value), sizeof(value) );
+}
+
+int cmd_position_index( const std::string &fin, const std::string &fout )
+{
+    std::ifstream in( fin, std::ios_base::in | std::ios_base::binary | std::ios_base::ate );
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return -1;
+    }
+    uint64_t offset = static_cast<uint64_t>( in.tellg() );
+    in.close();
+
+    // Games are replayed on worker threads, their positions are collected in order
+    std::vector<PositionEntry> run;
+    std::vector<std::string> run_files;
+    uint64_t nbr_games = 0;
+    uint64_t nbr_entries = 0;
+    bool ok = true;
+    ReplayOptions options;
+    options.max_ply = POSITION_INDEX_PLY;
+    ReplayEngine<std::vector<uint64_t>> engine( options );
+    thc::ChessRules start;
+    uint64_t start_hash = position_hash( start.Hash64Calculate(), true );
+    ok = engine.run( fin,
+        [start_hash]( ReplayGame &game, std::vector<uint64_t> &game_hashes )
+        {
+            if( game.fen )
+                return false;
+
+            // Each position once per game, even if it's reached more than once
+            game_hashes.push_back( start_hash );
+            game.replay( [&]( uint64_t hash, int )
+            {
+                game_hashes.push_back( position_hash(hash,game.cr.white) );
+                return true;
+            } );
+            std::sort( game_hashes.begin(), game_hashes.end() );
+            game_hashes.erase( std::unique(game_hashes.begin(),game_hashes.end()), game_hashes.end() );
+            return true;
+        },
+        [&]( uint64_t, uint64_t line_offset, std::vector<uint64_t> &game_hashes )
+        {
+            for( uint64_t hash: game_hashes )
+            {
+                PositionEntry e;
+                e.hash = hash;
+                e.offset = line_offset;
+                run.push_back(e);
+                nbr_entries++;
+            }
+            nbr_games++;
+            if( nbr_games%100000 == 0 )
+                printf( "%llu games indexed\n", static_cast<unsigned long long>(nbr_games) );
+            if( ok && run.size() >= POSITION_INDEX_RUN )
+                ok = write_run( fout, run, run_files );
+        }
+    ) && ok;
+    std::ofstream out( fout, std::ios_base::out | std::ios_base::binary );
+    if( !out )
+    {
+        printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+        ok = false;
+    }
+    if( ok )
+    {
+        std::string hdr = "PIDX";
+        put_u32( hdr, POSITION_INDEX_VERSION );
+        put_u32( hdr, POSITION_INDEX_PLY );
+        put_u32( hdr, 0 );
+        put_u64( hdr, offset );
+        put_u64( hdr, nbr_entries );
+        out.write( hdr.c_str(), hdr.length() );
+
+        // Usually everything fits in memory, otherwise merge sorted runs
+        if( run_files.size() == 0 )
+        {
+            std::sort( run.begin(), run.end() );
+            ok = write_entries( out, run );
+        }
+        else
+        {
+            if( run.size() > 0 )
+                ok = write_run( fout, run, run_files );
+            ok = ok && merge_runs( out, run_files );
+        }
+        if( !ok )
+            printf( "Error; Cannot write file %s\n", fout.c_str() );
+    }
+    for( const std::string &fname: run_files )
+        remove( fname.c_str() );
+    if( !ok )
+        return -1;
+    printf( "%llu games indexed, %llu positions (first %d ply)\n", static_cast<unsigned long long>(nbr_games),
+                static_cast<unsigned long long>(nbr_entries), POSITION_INDEX_PLY );
+    return 0;
+}
+
+static bool read_entry( std::ifstream &in, uint64_t idx, PositionEntry &e )
+{
+    in.seekg( POSITION_INDEX_HDR_LEN + idx*sizeof(PositionEntry) );
+    return !in.read( reinterpret_cast<char *>(&e), sizeof(e) ).fail();
+}
+
+int cmd_position_query( const std::string &fin_index, const std::string &fen, const std::string &fin, std::ofstream &out )
+{
+    auto start = std::chrono::steady_clock::now();
+    thc::ChessRules cr;
+    if( !cr.Forsyth( fen.c_str() ) )
+    {
+        printf( "Error; Bad FEN %s\n", fen.c_str() );
+        return -1;
+    }
+    uint64_t hash = position_hash( cr.Hash64Calculate(), cr.white );
+    std::ifstream idx( fin_index, std::ios_base::in | std::ios_base::binary );
+    if( !idx )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin_index.c_str() );
+        return -1;
+    }
+    std::ifstream in( fin, std::ios_base::in | std::ios_base::binary );
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return -1;
+    }
+    char hdr[POSITION_INDEX_HDR_LEN];
+    uint32_t version=0, nbr_ply=0;
+    uint64_t lpgn_size=0, nbr_entries=0;
+    if( idx.read(hdr,sizeof(hdr)) && 0==memcmp(hdr,"PIDX",4) )
+    {
+        memcpy( &version,     hdr+4,  sizeof(version) );
+        memcpy( &nbr_ply,     hdr+8,  sizeof(nbr_ply) );
+        memcpy( &lpgn_size,   hdr+16, sizeof(lpgn_size) );
+        memcpy( &nbr_entries, hdr+24, sizeof(nbr_entries) );
+    }
+    if( version != POSITION_INDEX_VERSION )
+    {
+        printf( "Error; File %s is not a version %d position index\n", fin_index.c_str(), POSITION_INDEX_VERSION );
+        return -1;
+    }
+    in.seekg( 0, std::ios_base::end );
+    if( static_cast<uint64_t>(in.tellg()) != lpgn_size )
+    {
+        printf( "Error; Index %s was not built from this version of %s\n", fin_index.c_str(), fin.c_str() );
+        return -1;
+    }
+
+    // Binary search for the first entry with the position's hash
+    uint64_t lo=0, hi=nbr_entries;
+    while( lo < hi )
+    {
+        uint64_t mid = lo + (hi-lo)/2;
+        PositionEntry e;
+        if( !read_entry(idx,mid,e) )
+        {
+            printf( "Error; File %s is truncated\n", fin_index.c_str() );
+            return -1;
+        }
+        if( e.hash < hash )
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+
+    // The matching entries are together, in .lpgn file order
+    std::vector<uint64_t> offsets;
+    idx.clear();
+    idx.seekg( POSITION_INDEX_HDR_LEN + lo*sizeof(PositionEntry) );
+    PositionEntry e;
+    while( lo<nbr_entries && idx.read(reinterpret_cast<char *>(&e),sizeof(e)) && e.hash==hash )
+    {
+        offsets.push_back( e.offset );
+        lo++;
+    }
+    std::string line;
+    for( uint64_t offset: offsets )
+    {
+        in.clear();
+        in.seekg( offset );
+        if( !std::getline(in,line) )
+            break;
+        if( line.length()>0 && line[line.length()-1]=='\r' )
+            line.pop_back();
+        util::putline(out,line);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start );
+    printf( "%d games reach the position (in the first %u ply), %.1f milliseconds\n", static_cast<int>(offsets.size()),
+                nbr_ply, elapsed.count()/1000.0 );
+    return 0;
+}
@@ -0,0 +1,18 @@
+// supplementary.cpp : Do something special to LPGN file
+//  posindex.cpp, the position index commands
+
+#ifndef POSINDEX_H_INCLUDED
+#define POSINDEX_H_INCLUDED
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+
+// Build an index of the positions reached in the first few ply of each game
+int cmd_position_index( const std::string &fin, const std::string &fout );
+
+// Find all games that reach a position, using the index
+int cmd_position_query( const std::string &fin_index, const std::string &fen, const std::string &fin, std::ofstream &out );
+
+#endif //POSINDEX_H_INCLUDED
@@ -0,0 +1,52 @@
+// supplementary.cpp : Do something special to LPGN file
+//  replay.cpp, replay the games of a .lpgn file on worker threads
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "..\util.h"
+#include "..\thc.h"
+#include "lichess_utils.h"
+#include "replay.h"
+
+//
+// The commands that replay every game (or every game of a player) share this, so
+//  the reading, decoding and threading are written once. See ReplayEngine in
+//  replay.h
+//
+
+void replay_tidy_line( std::string &line, uint64_t offset )
+{
+    // Strip out UTF8 BOM mark (hex value: EF BB BF)
+    if( offset==0 && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65)
+        line.erase( 0, 3 );
+    util::rtrim(line);
+}
+
+bool replay_read_line( std::ifstream &in, uint64_t offset, std::string &line )
+{
+    in.clear();
+    in.seekg( offset );
+    if( !std::getline(in, line) )
+        return false;
+    replay_tidy_line( line, offset );
+    return true;
+}
+
+void ReplayGame::read( int max_ply )
+{
+    fen = (line.find("@H[FEN \"") != std::string::npos);
+    if( fen )
+    {
+        main_line.clear();
+        moves.clear();
+        return;
+    }
+    int nbr_comments;
+    get_main_line( line, main_line, clk_times, moves_txt, nbr_comments );
+    if( max_ply>0 && main_line.size()>static_cast<size_t>(max_ply) )
+        main_line.resize( max_ply );
+    convert_moves( main_line, moves );
+}
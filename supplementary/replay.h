@@ -0,0 +1,280 @@
+// supplementary.cpp : Do something special to LPGN file
+//  replay.cpp, replay the games of a .lpgn file on worker threads
+
+#ifndef REPLAY_H_INCLUDED
+#define REPLAY_H_INCLUDED
+#include <stdio.h>
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "..\thc.h"
+
+// One game, as the callbacks see it. Each worker thread has its own ReplayGame, and
+//  its buffers are reused from game to game
+struct ReplayGame
+{
+    uint64_t game_nbr=0;        // in the input (or the list of offsets), from 0
+    uint64_t offset=0;          // of the game's line in the input file
+    int worker=0;               // 0 to nbr_workers()-1, for results kept per worker
+    bool fen=false;             // the game starts from a FEN position, moves is empty
+    std::string line;           // without a UTF8 BOM or trailing white space
+    std::vector<std::string> main_line;     // SAN moves, at most max_ply of them
+    std::vector<thc::Move> moves;           // stops at an illegal or unreadable move
+    thc::ChessRules cr;         // after replay(), the position reached
+
+    // Read the main line from line, at most max_ply (0 for all) moves
+    void read( int max_ply );
+
+    // Play the moves from the starting position, calling on_ply( hash, ply ) after
+    //  each (hash is thc's Hash64 of the position, ply counts from 1), on_ply returns
+    //  false to stop early
+    template <class F> void replay( F on_ply );
+    void replay() { replay( []( uint64_t, int ) { return true; } ); }
+
+private:
+    std::vector<int> clk_times;
+    std::string moves_txt;
+};
+
+template <class F> void ReplayGame::replay( F on_ply )
+{
+    cr = thc::ChessRules();
+    uint64_t hash = cr.Hash64Calculate();
+    int ply = 0;
+    for( thc::Move mv: moves )
+    {
+        hash = cr.Hash64Update( hash, mv );
+        cr.PlayMove( mv );
+        if( !on_ply(hash,++ply) )
+            break;
+    }
+}
+
+// Strip a UTF8 BOM (at offset 0 only) and trailing white space from a line
+void replay_tidy_line( std::string &line, uint64_t offset );
+
+// Read and tidy the line at offset
+bool replay_read_line( std::ifstream &in, uint64_t offset, std::string &line );
+
+struct ReplayOptions
+{
+    int max_ply=0;          // moves read per game, 0 for all
+    bool decode=true;       // read() each game before visit(), false for the line only
+    bool ordered=true;      // collect() results in input order, else as they are ready
+};
+
+// Games are read on the calling thread and shared out in batches to worker threads.
+//  visit( game, result ) is called on a worker thread for each game, and returns true
+//  if there's a result. collect( game_nbr, offset, result ) is called for each result
+//  on a single collecting thread, so it needs no locking
+template <class Result> class ReplayEngine
+{
+public:
+    typedef std::function<bool( ReplayGame &game, Result &result )> Visit;
+    typedef std::function<void( uint64_t game_nbr, uint64_t offset, Result &result )> Collect;
+    ReplayEngine( const ReplayOptions &options=ReplayOptions() );
+    int nbr_workers() const { return nbr_threads; }
+
+    // Every line of the file
+    bool run( const std::string &fin, Visit visit, Collect collect )
+        { return run( fin, NULL, visit, collect ); }
+
+    // The lines at offsets, in the order given
+    bool run( const std::string &fin, const std::vector<uint64_t> &offsets, Visit visit, Collect collect )
+        { return run( fin, &offsets, visit, collect ); }
+
+private:
+    struct Input
+    {
+        uint64_t offset;
+        std::string line;
+    };
+    struct Batch
+    {
+        uint64_t first_game_nbr=0;
+        std::vector<Input> games;
+    };
+    struct Output
+    {
+        std::vector<uint64_t> game_nbrs;
+        std::vector<uint64_t> offsets;
+        std::vector<Result> results;
+    };
+    bool run( const std::string &fin, const std::vector<uint64_t> *offsets, Visit visit, Collect collect );
+    void submit( Batch &batch );
+    ReplayOptions options;
+    int nbr_threads;
+    uint64_t nbr_batches=0;
+    uint64_t in_flight=0;
+    bool reading_done=false;
+    std::deque< std::pair<uint64_t,Batch> > queue;
+    std::map<uint64_t,Output> outputs;
+    std::mutex mtx;
+    std::condition_variable cv_batch, cv_output, cv_space;
+};
+
+template <class Result> ReplayEngine<Result>::ReplayEngine( const ReplayOptions &options )
+    : options(options)
+{
+    nbr_threads = static_cast<int>( std::thread::hardware_concurrency() );
+    if( nbr_threads < 1 )
+        nbr_threads = 1;
+    if( nbr_threads > 8 )
+        nbr_threads = 8;
+}
+
+template <class Result> void ReplayEngine<Result>::submit( Batch &batch )
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_space.wait( lock, [&]{ return in_flight < static_cast<uint64_t>(4*nbr_threads); } );
+    queue.push_back( std::make_pair(nbr_batches++,Batch()) );
+    std::swap( queue.back().second, batch );
+    in_flight++;
+    cv_batch.notify_one();
+}
+
+template <class Result> bool ReplayEngine<Result>::run( const std::string &fin, const std::vector<uint64_t> *offsets,
+                                                      Visit visit, Collect collect )
+{
+    std::ifstream in( fin, std::ios_base::in | std::ios_base::binary );
+    if( !in )
+    {
+        printf( "Error; Cannot open file %s for reading\n", fin.c_str() );
+        return false;
+    }
+    nbr_batches = 0;
+    in_flight = 0;
+    reading_done = false;
+    std::vector<std::thread> workers;
+    for( int i=0; i<nbr_threads; i++ )
+    {
+        workers.push_back( std::thread( [this,i,&visit]()
+        {
+            ReplayGame game;
+            game.worker = i;
+            Batch batch;
+            for(;;)
+            {
+                uint64_t seq;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv_batch.wait( lock, [&]{ return !queue.empty() || reading_done; } );
+                    if( queue.empty() )
+                        break;
+                    seq = queue.front().first;
+                    std::swap( batch, queue.front().second );
+                    queue.pop_front();
+                }
+                Output output;
+                for( size_t j=0; j<batch.games.size(); j++ )
+                {
+                    Input &input = batch.games[j];
+                    game.game_nbr = batch.first_game_nbr + j;
+                    game.offset = input.offset;
+                    game.line.swap( input.line );
+                    replay_tidy_line( game.line, game.offset );
+                    if( options.decode )
+                        game.read( options.max_ply );
+                    Result result;
+                    if( visit(game,result) )
+                    {
+                        output.game_nbrs.push_back( game.game_nbr );
+                        output.offsets.push_back( game.offset );
+                        output.results.push_back( std::move(result) );
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    outputs[seq] = std::move(output);
+                }
+                cv_output.notify_one();
+            }
+        } ) );
+    }
+    std::thread collector( [this,&collect]()
+    {
+        for( uint64_t seq=0;; seq++ )
+        {
+            Output output;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                if( options.ordered )
+                    cv_output.wait( lock, [&]{ return outputs.count(seq)>0 || (reading_done && seq==nbr_batches); } );
+                else
+                    cv_output.wait( lock, [&]{ return outputs.size()>0 || (reading_done && seq==nbr_batches); } );
+                auto it = options.ordered ? outputs.find(seq) : outputs.begin();
+                if( it == outputs.end() )
+                    break;
+                output = std::move( it->second );
+                outputs.erase( it );
+            }
+            for( size_t j=0; j<output.results.size(); j++ )
+                collect( output.game_nbrs[j], output.offsets[j], output.results[j] );
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                in_flight--;
+            }
+            cv_space.notify_one();
+        }
+    } );
+
+    // Read the games in batches
+    Batch batch;
+    size_t batch_len = 0;
+    uint64_t game_nbr = 0;
+    uint64_t offset = 0;
+    std::string line;
+    for(;;)
+    {
+        uint64_t line_offset = offset;
+        if( offsets )
+        {
+            if( game_nbr >= offsets->size() )
+                break;
+            line_offset = (*offsets)[game_nbr];
+            in.clear();
+            in.seekg( line_offset );
+        }
+        if( !std::getline(in,line) )
+        {
+            if( !offsets )
+                break;
+            line.clear();
+        }
+        offset = line_offset + line.length() + 1;
+        batch_len += line.length();
+        Input input;
+        input.offset = line_offset;
+        input.line.swap( line );
+        batch.games.push_back( std::move(input) );
+        game_nbr++;
+        if( batch_len>=256*1024 || batch.games.size()>=1024 )
+        {
+            submit( batch );
+            batch = Batch();
+            batch.first_game_nbr = game_nbr;
+            batch_len = 0;
+        }
+    }
+    if( batch.games.size() > 0 )
+        submit( batch );
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        reading_done = true;
+    }
+    cv_batch.notify_all();
+    cv_output.notify_all();
+    for( auto it=workers.begin(); it!=workers.end(); it++ )
+        it->join();
+    collector.join();
+    return true;
+}
+
+#endif //REPLAY_H_INCLUDED
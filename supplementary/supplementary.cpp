@@ -4,6 +4,28 @@
 /*
 
 Some recent stuff
+    rb = replay_bench
+        fin, fout
+        fin = input .lpgn
+        fout = report, games replayed per second with the original move reading, then with
+               convert_moves()' fast path, then with its cache as well
+    y = tabiya
+        fin, fout
+        fin = input .lpgn
+        fout = output .lpgn games reaching each player's most frequent position after 16 ply
+    yw = tabiya_window
+        fin, fout, first_ply, last_ply
+        Same as y but for each ply from first_ply to last_ply (one pass over the games)
+    pi = position_index
+        fin, fout
+        fin = input .lpgn
+        fout = index of positions in the first 30 ply of each game, sorted by position hash
+    pq = position_query
+        fin_index, fen, fin, fout
+        fin_index = index from pi
+        fen = position to find (move order doesn't matter, castling and en passant rights ignored)
+        fin = input .lpgn the index was built from
+        fout = output .lpgn games that reach the position
     z = collect_fide_id
         fin_aux, fin, fout
         fin_aux = list of nzl fide ids
@@ -47,6 +69,7 @@ Some recent stuff
 #include <algorithm>
 #include "key.h"
 #include "cmd.h"
+#include "posindex.h"
 #include "..\util.h"
 #include "..\thc.h"
 
@@ -57,6 +80,7 @@ typedef enum
     get_known_fide_id_games_plus,
     add_ratings,        
     tabiya,             
+    tabiya_window,
     get_name_fide_id,
     propogate,
     fide_id_report,
@@ -77,7 +101,10 @@ typedef enum
     pluck_games_reorder,
     remove_exact_pairs, 
     temp,
-    normalise
+    normalise,
+    position_index,
+    position_query,
+    replay_bench
 } CMD_ENUM;
 
 struct COMMAND
@@ -95,6 +122,7 @@ static COMMAND table[] =
                          5,  "zz nz-fide-ids.txt in.lpgn out.lpgn    ;Collect games with NZ players and NZ tournaments"},
     {add_ratings,        5,  "r ratings.txt in.lpgn out.lpgn         ;Fix Lichess names and add ratings"},
     {tabiya,             4,  "y in.lpgn out.lpgn                     ;Find Tabiyas in file"},
+    {tabiya_window,      6,  "yw in.lpgn out.lpgn first_ply last_ply ;Find Tabiyas after each ply in window"},
     {get_name_fide_id,   4,  "gf in.lpgn id-players.txt              ;Get Player names from FIDE-ids from file"},
     {propogate,          8,  "propogate manual-fide-ids.txt nat-fide-ids.txt fide-ids.txt in.lpgn out.lpgn report.txt"},
     {fide_id_report,     4,  "fir in.lpgn report.txt                 ;Report on fide-id name pairs\n" },
@@ -115,7 +143,10 @@ static COMMAND table[] =
     {pluck_games_reorder,5,  "7 bulk.lpgn in.lpgn out.lpgn           ;like 6, but assume pairs and re-order based on bulk location"},
     {remove_exact_pairs, 4,  "8 in.lpgn out.lpgn                     ;remove exact dup pairs"},
     {temp,               3,  "temp out.txt                           ;temp miscellaneous utility sorry!"},
-    {normalise,          4,  "normalise in.txt out.txt               ;normalise a fide id file"}
+    {normalise,          4,  "normalise in.txt out.txt               ;normalise a fide id file"},
+    {position_index,     4,  "pi in.lpgn index.pidx                  ;index positions in first 30 ply of games"},
+    {position_query,     6,  "pq index.pidx fen in.lpgn out.lpgn     ;find games reaching a position with index"},
+    {replay_bench,       4,  "rb in.lpgn report.txt                  ;benchmark replaying games, with and without move cache"}
 };
 
 int main( int argc, const char **argv )
@@ -217,6 +248,21 @@ int main( int argc, const char **argv )
         return cmd_temp( out );
     }
 
+    // Position index commands use binary files, so open their own files
+    if( purpose == position_index )
+        return cmd_position_index( argv[2], argv[3] );
+    if( purpose == position_query )
+    {
+        std::string fout(argv[5]);
+        std::ofstream out( fout.c_str() );
+        if( !out )
+        {
+            printf( "Error; Cannot open file %s for writing\n", fout.c_str() );
+            return -1;
+        }
+        return cmd_position_query( argv[2], argv[3], argv[4], out );
+    }
+
     // Find arg index of main input and output files
     int argi_input_file = 2;
     switch( purpose )
@@ -281,7 +327,7 @@ int main( int argc, const char **argv )
                 case pluck_games:
                 case pluck_games_reorder:
                 {
-                    return cmd_pluck( in_aux, in, out, purpose==pluck_games_reorder );
+                    return cmd_pluck( fin_aux, in, out, purpose==pluck_games_reorder );
                     break;
                 }
                 case bulk_out_skeleton:
@@ -402,7 +448,17 @@ int main( int argc, const char **argv )
         }
         case tabiya:
         {
-            return cmd_tabiya( in, out );
+            return cmd_tabiya( fin, out, TABIYA_PLY, TABIYA_PLY );
+            break;
+        }
+        case replay_bench:
+        {
+            return cmd_replay_bench( in, out );
+            break;
+        }
+        case tabiya_window:
+        {
+            return cmd_tabiya( fin, out, atoi(argv[4]), atoi(argv[5]) );
             break;
         }
         case hardwired:
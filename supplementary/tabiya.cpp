@@ -3,24 +3,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
+#include <array>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <algorithm>
 #include "..\util.h"
 #include "..\thc.h"
 #include "key.h"
-#include "lichess_utils.h"
+#include "replay.h"
 #include "tabiya.h"
 
 //
 // Find some interesting Tabiyas
-//  
+//
 
-#define TABIYA_PLY 16
 #define CUTOFF 10
 #define PLAYER_MIN_GAMES 20
 
@@ -38,49 +41,90 @@ struct Tabiya
     double proportion_hits;
 };
 
+// Each player's games are remembered as offsets of lines in the input file
+typedef std::map<std::string,std::vector<uint64_t>> PlayerGames;
+
+// One player's most frequent position at one ply
+struct PlayerBest
+{
+    int nbr_hits=0;
+    std::string squares;
+};
+
+// A position counted while replaying one player's games
+struct PositionCount
+{
+    int nbr_hits=0;
+    std::array<char,64> squares;
+};
+
 static void func_tabiya_make_maps
 (
-    std::ifstream &in, 
-    std::map<std::string,std::vector<std::string>> &white_games,
-    std::map<std::string,std::vector<std::string>> &black_games
+    const std::string &fin,
+    PlayerGames &white_games,
+    PlayerGames &black_games
+);
+static void func_tabiya_replay
+(
+    const std::string &fin,
+    PlayerGames &games,
+    int first_ply, int last_ply,
+    std::vector<std::vector<PlayerBest>> &best
 );
 static void func_tabiya_body
 (
+    const std::string &fin,
     std::ofstream &out,
-    std::map<std::string,std::vector<std::string>> &games,
-    bool white, int nbr_ply
+    PlayerGames &games,
+    const std::vector<std::vector<PlayerBest>> &best,
+    bool white, int first_ply, int nbr_ply
 );
 
-int cmd_tabiya( std::ifstream &in, std::ofstream &out )
+int cmd_tabiya( const std::string &fin, std::ofstream &out, int first_ply, int last_ply )
 {
-    std::map<std::string,std::vector<std::string>> white_games;
-    std::map<std::string,std::vector<std::string>> black_games;
-    func_tabiya_make_maps(in,white_games,black_games);
-    func_tabiya_body(out,white_games,true,TABIYA_PLY);
-    func_tabiya_body(out,black_games,false,TABIYA_PLY);
+    if( first_ply<1 || last_ply<first_ply )
+    {
+        printf( "Error; Bad ply window %d to %d\n", first_ply, last_ply );
+        return -1;
+    }
+    PlayerGames white_games;
+    PlayerGames black_games;
+    func_tabiya_make_maps(fin,white_games,black_games);
+
+    // Every ply in the window is looked at in a single replay of each game
+    std::vector<std::vector<PlayerBest>> white_best;
+    std::vector<std::vector<PlayerBest>> black_best;
+    func_tabiya_replay(fin,white_games,first_ply,last_ply,white_best);
+    func_tabiya_replay(fin,black_games,first_ply,last_ply,black_best);
+    for( int nbr_ply=first_ply; nbr_ply<=last_ply; nbr_ply++ )
+    {
+        func_tabiya_body(fin,out,white_games,white_best,true,first_ply,nbr_ply);
+        func_tabiya_body(fin,out,black_games,black_best,false,first_ply,nbr_ply);
+    }
     return 0;
 }
 
 static void func_tabiya_make_maps
 (
-    std::ifstream &in, 
-    std::map<std::string,std::vector<std::string>> &white_games,
-    std::map<std::string,std::vector<std::string>> &black_games
+    const std::string &fin,
+    PlayerGames &white_games,
+    PlayerGames &black_games
 )
 {
-    std::vector<Tabiya> best_tabiyas_nbr;
-    std::vector<Tabiya> best_tabiyas_proportion;
+    std::ifstream in( fin, std::ios_base::in | std::ios_base::binary );
     std::string line;
+    std::string header;
+    uint64_t line_offset = 0;
     int line_nbr=0;
-    int nbr_white_players=0, nbr_black_players=0;
 
-    // Build maps of (vector of games) for each player
+    // Build maps of (vector of game offsets) for each player
     printf( "Begin reading input file, make White and Black maps of games for each player\n");
-    line_nbr=0;
     for(;;)
     {
+        uint64_t offset = line_offset;
         if( !std::getline(in, line) )
             break;
+        line_offset += line.length() + 1;
 
         // Strip out UTF8 BOM mark (hex value: EF BB BF)
         if( line_nbr==0 && line.length()>=3 && line[0]==-17 && line[1]==-69 && line[2]==-65)
@@ -89,10 +133,10 @@ static void func_tabiya_make_maps
         if( line_nbr%10000 == 0 )
             printf( "%d lines\n", line_nbr );
         util::rtrim(line);
-        auto offset = line.find("@M");
-        if( offset == std::string::npos )
+        auto offset_moves = line.find("@M");
+        if( offset_moves == std::string::npos )
             continue;
-        std::string header = line.substr(0,offset);
+        header.assign( line, 0, offset_moves );
         std::string white_fide_id;
 
 #ifdef TEMP_DONT_HAVE_FIDE_ID
@@ -101,21 +145,7 @@ static void func_tabiya_make_maps
         bool ok  = key_find( header, "WhiteFideId", white_fide_id );
 #endif
         if( ok )
-        {
-            auto it = white_games.find(white_fide_id);
-            if( it != white_games.end() )
-            {
-                std::vector<std::string> &games = it->second;
-                games.push_back(line);
-            }
-            else
-            {
-                std::vector<std::string> games;
-                games.push_back(line);
-                white_games[white_fide_id] = games;
-                nbr_white_players++;
-            }
-        }
+            white_games[white_fide_id].push_back(offset);
         std::string black_fide_id;
 #ifdef TEMP_DONT_HAVE_FIDE_ID
         ok = key_find( header, "Black", black_fide_id );
@@ -123,23 +153,110 @@ static void func_tabiya_make_maps
         ok = key_find( header, "BlackFideId", black_fide_id );
 #endif
         if( ok )
+            black_games[black_fide_id].push_back(offset);
+    }
+    printf( "End reading input file %d white players, %d black players, %d lines\n",
+        static_cast<int>(white_games.size()), static_cast<int>(black_games.size()), line_nbr );
+}
+
+// Replay each player's games once, counting the positions at each ply in the window
+//  by hash. All the games, player by player, go through a ReplayEngine, so the
+//  replaying is shared out between threads, and the counts are collected in order
+//  one player at a time. best[i][ply-first_ply] is player i's (in map order) most
+//  frequent position, ties go to the greatest squares string
+struct WindowPosition
+{
+    uint64_t hash;
+    std::array<char,64> squares;
+};
+
+static void func_tabiya_replay
+(
+    const std::string &fin,
+    PlayerGames &games,
+    int first_ply, int last_ply,
+    std::vector<std::vector<PlayerBest>> &best
+)
+{
+    int nbr_window = last_ply-first_ply+1;
+    best.clear();
+    best.resize( games.size(), std::vector<PlayerBest>(nbr_window) );
+    std::vector<uint64_t> offsets;
+    std::vector<size_t> player_idx;     // for each of offsets
+    size_t idx = 0;
+    for( const std::pair<const std::string,std::vector<uint64_t>> &player: games )
+    {
+        if( player.second.size() >= PLAYER_MIN_GAMES )
+        {
+            offsets.insert( offsets.end(), player.second.begin(), player.second.end() );
+            player_idx.insert( player_idx.end(), player.second.size(), idx );
+        }
+        idx++;
+    }
+
+    // The most frequent position at each ply
+    std::vector<std::unordered_map<uint64_t,PositionCount>> counts(nbr_window);
+    auto player_done = [&]( size_t idx )
+    {
+        for( int i=0; i<nbr_window; i++ )
         {
-            auto it = black_games.find(black_fide_id);
-            if( it != black_games.end() )
+            const PositionCount *pc_best = NULL;
+            for( const std::pair<const uint64_t,PositionCount> &pr: counts[i] )
             {
-                std::vector<std::string> &games = it->second;
-                games.push_back(line);
+                const PositionCount &pc = pr.second;
+                if( !pc_best || pc.nbr_hits>pc_best->nbr_hits ||
+                    (pc.nbr_hits==pc_best->nbr_hits && memcmp(pc.squares.data(),pc_best->squares.data(),64)>0) )
+                    pc_best = &pc;
             }
-            else
+            if( pc_best )
             {
-                std::vector<std::string> games;
-                games.push_back(line);
-                black_games[black_fide_id] = games;
-                nbr_black_players++;
+                best[idx][i].nbr_hits = pc_best->nbr_hits;
+                best[idx][i].squares.assign( pc_best->squares.data(), 64 );
             }
+            counts[i].clear();
         }
-    }
-    printf( "End reading input file %d white players, %d black players, %d lines\n", nbr_white_players, nbr_black_players, line_nbr );
+        if( idx>0 && idx%100 == 0 )
+            printf( "%d players\n", static_cast<int>(idx) );
+    };
+    ReplayOptions options;
+    options.max_ply = last_ply;
+    ReplayEngine<std::vector<WindowPosition>> engine( options );
+    size_t current = games.size();
+    engine.run( fin, offsets,
+        [&]( ReplayGame &game, std::vector<WindowPosition> &window )
+        {
+            game.replay( [&]( uint64_t hash, int ply )
+            {
+                if( ply >= first_ply )
+                {
+                    WindowPosition wp;
+                    wp.hash = hash;
+                    memcpy( wp.squares.data(), game.cr.squares, 64 );
+                    window.push_back( wp );
+                }
+                return true;
+            } );
+            return true;
+        },
+        [&]( uint64_t game_nbr, uint64_t, std::vector<WindowPosition> &window )
+        {
+            size_t idx = player_idx[game_nbr];
+            if( idx != current )
+            {
+                if( current < games.size() )
+                    player_done( current );
+                current = idx;
+            }
+            for( size_t i=0; i<window.size(); i++ )
+            {
+                PositionCount &pc = counts[i][window[i].hash];
+                if( pc.nbr_hits++ == 0 )
+                    pc.squares = window[i].squares;
+            }
+        }
+    );
+    if( current < games.size() )
+        player_done( current );
 }
 
 static bool lt_nbr_hits( const Tabiya &left, const Tabiya &right )
@@ -154,80 +271,25 @@ static bool lt_proportion_hits( const Tabiya &left, const Tabiya &right )
 
 static void func_tabiya_body
 (
+    const std::string &fin,
     std::ofstream &out,
-    std::map<std::string,std::vector<std::string>> &games,
-    bool white, int nbr_ply
+    PlayerGames &games,
+    const std::vector<std::vector<PlayerBest>> &best,
+    bool white, int first_ply, int nbr_ply
 )
 {
     printf( "Look for %s Tabiyas after %d ply\n", white?"White":"Black", nbr_ply );
     std::vector<Tabiya> best_tabiyas_nbr;
     std::vector<Tabiya> best_tabiyas_proportion;
-    int nbr_players = 0;
 
     // For each player in turn
-    for( const std::pair<std::string,std::vector<std::string>> &player: games )
+    size_t idx = 0;
+    for( const std::pair<const std::string,std::vector<uint64_t>> &player: games )
     {
+        const PlayerBest &player_best = best[idx++][nbr_ply-first_ply];
         size_t nbr_of_games = player.second.size();
-        nbr_players++;
-        if( nbr_players%100 == 0)
-            printf( "%d players\n", nbr_players );
-        if( nbr_of_games < PLAYER_MIN_GAMES )
-            continue;
-
-        // Build a vector of positions after nbr_ply half moves
-        std::vector<std::string> positions;
-        for( const std::string &line: player.second )
-        {
-            std::vector<std::string> main_line;
-            std::vector<int> clk_times;
-            int nbr_comments;
-            std::string moves_txt;
-            get_main_line( line, main_line, clk_times, moves_txt, nbr_comments );
-            std::vector<thc::Move> moves;
-            convert_moves( main_line, moves );
-            thc::ChessRules cr;
-            int count = 0;
-            for( thc::Move mv: moves )
-            {
-                cr.PlayMove( mv );
-                if( ++count == nbr_ply )
-                {
-                    positions.push_back(cr.squares);
-                    break;
-                }
-            }
-        }
-
-        // Look for multiple instances of one position
-        std::sort( positions.begin(), positions.end() );
-        int in_a_row = 0;
-        int max_so_far = 0;
-        std::string best_so_far;
-        std::string previous;
-        for( const std::string &pos: positions )
-        {
-            if( in_a_row == 0 )
-            {
-                previous = pos;
-                in_a_row = 1;
-            }
-            else
-            {
-                if( previous == pos )
-                    in_a_row++;
-                else
-                {
-                    if( in_a_row >= max_so_far )
-                    {
-                        max_so_far = in_a_row;
-                        best_so_far = previous;
-                    }
-                    previous = pos;
-                    in_a_row = 1;
-                }
-            }
-        }
-        if( max_so_far < 2 )
+        int max_so_far = player_best.nbr_hits;
+        if( nbr_of_games<PLAYER_MIN_GAMES || max_so_far<2 )
             continue;
 
         // We now have the "best" (most frequent) position for this player
@@ -238,7 +300,8 @@ static void func_tabiya_body
         tabiya.nbr_hits = max_so_far;
         tabiya.proportion_hits = proportion;
         tabiya.nbr_player_games = (int)nbr_of_games;
-        tabiya.squares = best_so_far;
+        tabiya.nbr_ply = nbr_ply;
+        tabiya.squares = player_best.squares;
         tabiya.white = white;
         if( best_tabiyas_nbr.size() < CUTOFF )
             best_tabiyas_nbr.push_back(tabiya);
@@ -257,7 +320,7 @@ static void func_tabiya_body
                 best_tabiyas_proportion[0] = tabiya;
         }
     }
-    printf( "%d players\n", nbr_players );
+    printf( "%d players\n", static_cast<int>(games.size()) );
 
     // Merge the two sets of Tabiyas
     std::vector<Tabiya> merged;
@@ -286,10 +349,12 @@ static void func_tabiya_body
     }
 
     // For each Tabiya
+    std::ifstream in( fin, std::ios_base::in | std::ios_base::binary );
     for( const Tabiya &tabiya: merged )
     {
-
-        const std::string first_game = games[tabiya.fide_id][0];
+        const std::vector<uint64_t> &offsets = games[tabiya.fide_id];
+        std::string first_game;
+        replay_read_line( in, offsets[0], first_game );
         std::string name("?");
         key_find( first_game, tabiya.white?"White":"Black", name );
         std::string desc = util::sprintf( "Player %s, fide_id=%s, %s, %d games = %.2f%% percent of total=%d",
@@ -318,36 +383,30 @@ static void func_tabiya_body
             *dst++ = '\n';
         }
         *dst++ = '\0';
-        desc += buf; 
+        desc += buf;
         printf( "%s\n", desc.c_str() );
 
-        // For each of the players games, see if it reaches the Tabiya
-        for( const std::string game: games[tabiya.fide_id] )
-        {
-            
-            std::vector<std::string> main_line;
-            std::vector<int> clk_times;
-            int nbr_comments;
-            std::string moves_txt;
-            get_main_line( game, main_line, clk_times, moves_txt, nbr_comments );
-            std::vector<thc::Move> moves;
-            convert_moves( main_line, moves );
-            thc::ChessRules cr;
-            int count = 0;
-            for( thc::Move mv: moves )
+        // For each of the players games, see if it reaches the Tabiya, if it does
+        //  add it to output
+        ReplayOptions options;
+        options.max_ply = nbr_ply;
+        ReplayEngine<std::string> engine( options );
+        engine.run( fin, offsets,
+            [&]( ReplayGame &game, std::string &line )
             {
-                cr.PlayMove( mv );
-                if( ++count == nbr_ply )
-                {
-                    if( cr.squares == tabiya.squares )
-                    {
-                        // If it does, add it to output
-                        util::putline(out,game);
-                    }
-                    break;
-                }
+                if( game.moves.size() < static_cast<size_t>(nbr_ply) )
+                    return false;
+                game.replay();
+                if( 0 != memcmp(game.cr.squares,tabiya.squares.c_str(),64) )
+                    return false;
+                line.swap( game.line );
+                return true;
+            },
+            [&]( uint64_t, uint64_t, std::string &line )
+            {
+                util::putline(out,line);
             }
-        }
+        );
 
     }
 }
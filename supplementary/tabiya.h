@@ -7,8 +7,13 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#include <string>
 
-// Find tabiya command (actually a mini application)
-int cmd_tabiya( std::ifstream &in, std::ofstream &out );
+// Default number of half moves to the tabiya
+#define TABIYA_PLY 16
+
+// Find tabiya command (actually a mini application), look for tabiyas after each
+//  ply from first_ply to last_ply inclusive
+int cmd_tabiya( const std::string &fin, std::ofstream &out, int first_ply, int last_ply );
 
 #endif //TABIYA_H_INCLUDED
@@ -72,7 +72,7 @@ void ltrim( std::string &s )
     if( first_char_offset == std::string::npos )
         s.clear();
     else
-        s = s.substr(first_char_offset);
+        s.erase(0,first_char_offset);
 }
 
 void rtrim( std::string &s )
@@ -146,6 +146,19 @@ void tests()
     s = "hello";
     changed = trim(s);
     test_expect( "1.4", changed, false, s, "hello" );
+    s.clear();
+    append_fixed<3>(s,7);
+    test_expect( "2.0", true, true, s, "007" );
+    assign_fixed<3>(s,-12);
+    test_expect( "2.1", true, true, s, "-12" );
+    assign_fixed<3>(s,-5);
+    test_expect( "2.2", true, true, s, "-05" );
+    assign_fixed<3>(s,-998999);
+    test_expect( "2.3", true, true, s, "-998999" );
+    assign_fixed<9>(s,4294967295U);
+    test_expect( "2.4", true, true, s, "4294967295" );
+    assign_fixed<4>(s,0);
+    test_expect( "2.5", true, true, s, "0000" );
 }
 
 void replace_all( std::string &s, const std::string from, const std::string to )
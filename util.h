@@ -27,6 +27,39 @@ void replace_once( std::string &s, const std::string from, const std::string to
 void split( std::string &s, std::vector<std::string> &fields );
 std::string toupper( const std::string &s );
 std::string tolower( const std::string &s );
+
+// Append value formatted exactly as sprintf "%0WIDTHd" would format it (eg
+//  append_fixed<3>(s,7) appends "007"), but without parsing a format string,
+//  guessing buffer sizes or allocating (beyond growing s)
+template <int WIDTH>
+inline void append_fixed( std::string &s, long long value )
+{
+    static_assert( WIDTH>=1 && WIDTH<=20, "unsupported width" );
+    char buf[24];
+    char *end = buf+sizeof(buf);
+    char *p = end;
+    bool negative = (value < 0);
+    unsigned long long u = negative ? 0ULL-static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value);
+    do
+    {
+        *--p = static_cast<char>( '0' + u%10 );
+        u /= 10;
+    } while( u );
+    const int min_digits = negative ? WIDTH-1 : WIDTH;  // as with sprintf, the '-' counts towards the width
+    while( end-p < min_digits )
+        *--p = '0';
+    if( negative )
+        *--p = '-';
+    s.append( p, end-p );
+}
+
+// Replace s with value formatted as sprintf "%0WIDTHd" would format it
+template <int WIDTH>
+inline void assign_fixed( std::string &s, long long value )
+{
+    s.clear();
+    append_fixed<WIDTH>( s, value );
+}
 }
 
 #endif // UTIL_H_INCLUDED